@@ -0,0 +1,63 @@
+#ifndef __LIBBITC_ADDRSET_H__
+#define __LIBBITC_ADDRSET_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint64_t, uint32_t, uint8_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Static set of 20-byte hash160s (P2PKH/P2SH address hashes), built
+ * once in bulk, for watch lists too large for a bitc_hashtab.
+ *
+ * The hashes are kept sorted, with a prefix table narrowing each search
+ * to a handful of entries.  In front of that, a blocked bloom filter,
+ * one 64-byte cache line per probe, turns away nearly all misses.  The
+ * in-memory form is also the file format: a built set can be written
+ * out and later mapped straight back in.
+ *
+ * Lookups never modify the set, and may run on any number of threads.
+ */
+
+enum {
+	ADDRSET_HASH_LEN	= 20,
+	ADDRSET_BLOOM_BITS	= 10,		/* per entry */
+	ADDRSET_BUCKET_FILL	= 4,		/* entries per prefix, at most */
+};
+
+struct bitc_addrset {
+	uint64_t	n;			/* unique hashes */
+	unsigned int	bucket_bits;		/* prefix table size, log2 */
+	uint64_t	bloom_blocks;		/* of 512 bits */
+
+	const uint8_t	*bloom;
+	const uint32_t	*buckets;		/* little endian */
+	const uint8_t	*hashes;		/* sorted */
+
+	void		*mem;			/* all of the above */
+	size_t		mem_len;
+	bool		mapped;			/* mmap'd from a file? */
+};
+
+extern void bitc_addrset_init(struct bitc_addrset *set);
+extern bool bitc_addrset_build(struct bitc_addrset *set,
+			       const void *hashes, size_t n);
+extern bool bitc_addrset_write(const struct bitc_addrset *set,
+			       const char *filename);
+extern bool bitc_addrset_open(struct bitc_addrset *set, const char *filename);
+extern bool bitc_addrset_lookup(const struct bitc_addrset *set,
+				const void *hash);
+extern void bitc_addrset_free(struct bitc_addrset *set);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_ADDRSET_H__ */
@@ -6,12 +6,22 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <bitc/cstr.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum {
+	BASE58_MAX_DATA		= 128,	/* longest payload, in bytes */
+	BASE58_ADDR_LEN		= 21,	/* addrtype + hash160 */
+	BASE58_ADDR_STR_SZ	= 36,	/* base58check of one, with NUL */
+};
+
+/* buffer size for the encoding of n bytes, with NUL */
+#define BASE58_ENCODE_SIZE(n)	((n) * 138 / 100 + 2)
+
 extern cstring *base58_encode(const void *data_, size_t data_len);
 extern cstring *base58_encode_check(unsigned char addrtype, bool have_addrtype,
 			     const void *data, size_t data_len);
@@ -19,6 +29,41 @@ extern cstring *base58_encode_check(unsigned char addrtype, bool have_addrtype,
 extern cstring *base58_decode(const char *s_in);
 extern cstring *base58_decode_check(unsigned char *addrtype, const char *s_in);
 
+/*
+ * The same, into caller buffers, without allocating.  Strings are NUL
+ * terminated; payloads are limited to BASE58_MAX_DATA bytes, checksum
+ * and addrtype included.  False if too long, or if out is too small.
+ */
+extern bool base58_encode_buf(char *out, size_t out_sz,
+			      const void *data, size_t data_len);
+extern bool base58_encode_check_buf(char *out, size_t out_sz,
+				    unsigned char addrtype, bool have_addrtype,
+				    const void *data, size_t data_len);
+extern bool base58_decode_buf(void *out, size_t out_sz, size_t *out_len,
+			      const char *s_in);
+extern bool base58_decode_check_buf(unsigned char *addrtype,
+				    void *out, size_t out_sz, size_t *out_len,
+				    const char *s_in);
+
+/*
+ * Batches of n payloads of data_len bytes each, as for addresses
+ * (BASE58_ADDR_LEN, or 25 with the checksum): payload i is at
+ * data + i * data_len, its string at out + i * out_stride.  Encoding
+ * works on several payloads at once.  Decoding wants each string to
+ * come to exactly data_len bytes; ok[i] says which did, and the count
+ * of those is returned.
+ */
+extern bool base58_encode_batch(char *out, size_t out_stride,
+				const void *data, size_t data_len, size_t n);
+extern bool base58_encode_check_batch(char *out, size_t out_stride,
+				      const void *data, size_t data_len,
+				      size_t n);
+extern size_t base58_decode_batch(void *out, size_t data_len,
+				  const char *const *s_in, size_t n, bool *ok);
+extern size_t base58_decode_check_batch(void *out, size_t data_len,
+					const char *const *s_in, size_t n,
+					bool *ok);
+
 #ifdef __cplusplus
 }
 #endif
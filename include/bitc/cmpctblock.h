@@ -0,0 +1,77 @@
+#ifndef __LIBBITC_CMPCTBLOCK_H__
+#define __LIBBITC_CMPCTBLOCK_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_block, bitc_tx
+#include <bitc/coredefs.h>              // for MAX_BLOCK_WEIGHT, etc
+#include <bitc/mempool.h>               // for bitc_mempool
+#include <bitc/message.h>               // for msg_cmpctblock, etc
+#include <bitc/txcache.h>               // for bitc_txcache
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	/* smallest serializable transaction is 10 bytes */
+	CMPCT_MAX_TXS	= MAX_BLOCK_WEIGHT / (WITNESS_SCALE_FACTOR * 10),
+};
+
+/* per-block SipHash keys, from SHA256(header || nonce) */
+struct cmpct_keys {
+	uint64_t	k0;
+	uint64_t	k1;
+};
+
+extern void cmpct_keys_init(struct cmpct_keys *keys,
+			    const struct bitc_block *hdr, uint64_t nonce);
+extern uint64_t cmpct_short_id(const struct cmpct_keys *keys,
+			       const bu256_t *txid);
+extern void cmpct_short_ids(const struct cmpct_keys *keys,
+			    const bu256_t *txids, size_t n, uint64_t *out);
+
+extern void cmpct_block_build(struct msg_cmpctblock *mcb,
+			      struct bitc_block *block, uint64_t nonce);
+
+/*
+ * A compact block being reassembled.  Slots are filled from the
+ * prefilled list, the tx cache and the mempool (either may be NULL);
+ * any left NULL are requested with "getblocktxn".
+ */
+struct cmpct_partial {
+	struct bitc_block	hdr;
+	bu256_t			hash;
+
+	unsigned int		n_tx;
+	struct bitc_tx		**vtx;
+
+	unsigned int		n_prefilled;
+	unsigned int		n_cached;
+	unsigned int		n_missing;
+};
+
+extern bool cmpct_partial_init(struct cmpct_partial *pb,
+			       struct msg_cmpctblock *mcb,
+			       struct bitc_txcache *tc,
+			       const struct bitc_mempool *mp);
+extern void cmpct_partial_missing(const struct cmpct_partial *pb,
+				  struct msg_getblocktxn *mgt);
+extern bool cmpct_partial_fill(struct cmpct_partial *pb,
+			       struct msg_blocktxn *mbt);
+extern void cmpct_partial_block(struct cmpct_partial *pb,
+				struct bitc_block *block);
+extern void cmpct_partial_free(struct cmpct_partial *pb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_CMPCTBLOCK_H__ */
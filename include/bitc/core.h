@@ -241,7 +241,9 @@ struct bitc_block {
 };
 
 extern void bitc_block_init(struct bitc_block *block);
+extern bool deser_bitc_block_hdr(struct bitc_block *block, struct const_buffer *buf);
 extern bool deser_bitc_block(struct bitc_block *block, struct const_buffer *buf);
+extern void ser_bitc_block_hdr(cstring *s, const struct bitc_block *block);
 extern void ser_bitc_block(cstring *s, const struct bitc_block *block);
 extern void bitc_block_free(struct bitc_block *block);
 extern void bitc_block_freep(void *bitc_block_p);
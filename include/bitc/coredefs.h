@@ -20,6 +20,9 @@ enum {
     //! initial proto version, to be increased after version/verack negotiation
 	INIT_PROTO_VERSION 	= 209,
 
+    //! short-id-based block download (BIP 152) is enabled for all versions from this one
+	SHORT_IDS_BLOCKS_VERSION	= 70014,
+
     /** The maximum allowed weight for a block, see BIP 141 (network rule) */
     MAX_BLOCK_WEIGHT	= 4000000,
 
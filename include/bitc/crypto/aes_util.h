@@ -5,6 +5,8 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.
  */
 
+#include <bitc/crypto/aesni.h>         // for AESNI256_ctx
+#include <bitc/crypto/ctaes.h>          // for AES256_ctx
 #include <bitc/cstr.h>                 // for cstring
 
 #include <stdbool.h>                    // for bool
@@ -22,6 +24,35 @@ extern "C" {
 #define MEMSET_BZERO(p,l)     memset((p), 0, (l))
 #define MEMCPY_BCOPY(d,s,l)   memcpy((d), (s), (l))
 
+/*
+ * AES-256, on AES-NI where the CPU has it, else on ctaes.  Both give the
+ * same results; aes_set_impl() picks one, for all contexts set up after.
+ */
+enum aes_impl {
+	AES_IMPL_AUTO,
+	AES_IMPL_CTAES,
+	AES_IMPL_AESNI,
+};
+
+struct aes256_ctx {
+	bool		aesni;
+	union {
+		AES256_ctx	ctaes;
+		AESNI256_ctx	aesni;
+	} u;
+};
+
+extern bool aes_set_impl(enum aes_impl impl);
+extern enum aes_impl aes_get_impl(void);
+extern void aes256_init(struct aes256_ctx *ctx, const unsigned char *key32);
+extern void aes256_encrypt(const struct aes256_ctx *ctx, size_t blocks,
+			   unsigned char *out, const unsigned char *in);
+extern void aes256_decrypt(const struct aes256_ctx *ctx, size_t blocks,
+			   unsigned char *out, const unsigned char *in);
+extern void aes256_ctr(const struct aes256_ctx *ctx, const unsigned char *iv,
+		       unsigned char *data, size_t len);
+extern void aes256_free(struct aes256_ctx *ctx);
+
 extern cstring *read_aes_file(const char *filename, void *key, size_t key_len,
 			      size_t max_file_len);
 extern bool write_aes_file(const char *filename, void *key, size_t key_len,
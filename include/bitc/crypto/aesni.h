@@ -0,0 +1,38 @@
+#ifndef __LIBBITC_CRYPTO_AESNI_H__
+#define __LIBBITC_CRYPTO_AESNI_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * AES-256 on the x86 AES-NI instructions, with the interface of ctaes.
+ * Constant time, like ctaes, and some ten times faster; several blocks
+ * are kept in flight at once.  Use only if aesni_available() says so.
+ */
+
+typedef struct {
+	unsigned char	rk[15][16];	/* encryption round keys */
+	unsigned char	dk[15][16];	/* decryption round keys */
+} AESNI256_ctx;
+
+bool aesni_available(void);
+
+void AESNI256_init(AESNI256_ctx *ctx, const unsigned char *key32);
+void AESNI256_encrypt(const AESNI256_ctx *ctx, size_t blocks,
+		      unsigned char *cipher16, const unsigned char *plain16);
+void AESNI256_decrypt(const AESNI256_ctx *ctx, size_t blocks,
+		      unsigned char *plain16, const unsigned char *cipher16);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_CRYPTO_AESNI_H__ */
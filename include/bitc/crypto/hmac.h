@@ -25,8 +25,17 @@
 #define __HMAC_H__
 
 #include <stdint.h>
+#include <bitc/crypto/sha2.h>
+
+/* pad blocks already absorbed, for many messages under one key */
+typedef struct _HMAC_SHA512_CTX {
+	SHA512_CTX inner;
+	SHA512_CTX outer;
+} HMAC_SHA512_CTX;
 
 void hmac_sha256(const void *key, const uint32_t keylen, const void *msg, const uint32_t msglen, uint8_t *hmac);
 void hmac_sha512(const void *key, const uint32_t keylen, const void *msg, const uint32_t msglen, uint8_t *hmac);
+void hmac_sha512_Init(HMAC_SHA512_CTX *hctx, const void *key, const uint32_t keylen);
+void hmac_sha512_Raw(const HMAC_SHA512_CTX *hctx, const void *msg, const uint32_t msglen, uint8_t *hmac);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef __LIBBITC_CRYPTO_SIPHASH_H__
+#define __LIBBITC_CRYPTO_SIPHASH_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* SipHash-2-4, keyed with two little endian 64-bit halves */
+extern uint64_t siphash24(uint64_t k0, uint64_t k1,
+			  const void *data, size_t len);
+
+/* SipHash-2-4 specialized for 32-byte (uint256) input */
+extern uint64_t siphash24_u256(uint64_t k0, uint64_t k1, const void *data32);
+
+/* hash n consecutive 32-byte inputs with one key */
+extern void siphash24_u256_batch(uint64_t k0, uint64_t k1,
+				 const void *data32, size_t n,
+				 uint64_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_CRYPTO_SIPHASH_H__ */
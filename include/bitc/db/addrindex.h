@@ -0,0 +1,99 @@
+#ifndef __LIBBITC_ADDRINDEX_H__
+#define __LIBBITC_ADDRINDEX_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_block, bitc_outpt
+#include <bitc/coredefs.h>              // for chain_info
+
+#include <lmdb.h>                       // for MDB_dbi, MDB_env, MDB_txn
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint32_t, int64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent script history, in its own LMDB file: for every output
+ * script, keyed by the SHA-256 of the scriptPubKey, the outputs that
+ * paid to it and the inputs that spent them, in height order.
+ *
+ * Blocks go in strictly by height, from 0, with no reorg support.  A
+ * side table of unspent outputs maps each spent outpoint back to its
+ * script.  next_height, stored alongside, is where the next run picks
+ * up; writes are batched, one LMDB transaction per ADDRINDEX_BATCH
+ * blocks.
+ *
+ * A builder indexes a run of blocks, typically the whole stored chain
+ * on first enable, decoding and hashing them on worker threads while
+ * the caller's thread writes the index in order.
+ */
+
+enum {
+	ADDRINDEX_BATCH		= 1000,		/* blocks per commit */
+	ADDRINDEX_BUILD_BATCH	= 64,		/* blocks per work unit */
+};
+
+enum addrindex_kind {
+	ADDRINDEX_FUND,
+	ADDRINDEX_SPEND,
+};
+
+struct addrindex_entry {
+	uint32_t		height;
+	enum addrindex_kind	kind;
+	bu256_t			txid;		/* funding or spending tx */
+	uint32_t		n;		/* its vout, or vin */
+	int64_t			value;		/* of the output */
+	struct bitc_outpt	prevout;	/* spend: the output spent */
+};
+
+struct addrindex {
+	MDB_env		*env;
+	MDB_dbi		dbi_hist;
+	MDB_dbi		dbi_utxo;
+	MDB_dbi		dbi_meta;
+	MDB_txn		*txn;		/* open write batch, or NULL */
+	unsigned int	n_batch;	/* blocks in it */
+
+	bool		readonly;
+	uint32_t	next_height;	/* below this, already indexed */
+	uint32_t	sync_height;	/* ditto, as committed */
+};
+
+struct addrindex_builder;
+
+extern bool addrindex_open(struct addrindex *ai, const char *filename,
+			   bool readonly);
+extern bool addrindex_sync(struct addrindex *ai);
+extern void addrindex_close(struct addrindex *ai);
+
+extern bool addrindex_add_block(struct addrindex *ai, uint32_t height,
+				const struct bitc_block *block);
+
+extern struct addrindex_builder *addrindex_build_new(struct addrindex *ai,
+						     unsigned int n_threads);
+extern bool addrindex_build_push(struct addrindex_builder *b,
+				 uint32_t height,
+				 const struct const_buffer *blk);
+extern bool addrindex_build_finish(struct addrindex_builder *b);
+
+extern void addrindex_script_hash(bu256_t *hash, const void *script,
+				  size_t script_len);
+extern bool addrindex_addr_hash(bu256_t *hash, const struct chain_info *chain,
+				const char *address);
+extern bool addrindex_get(struct addrindex *ai, const bu256_t *script_hash,
+			  struct addrindex_entry **entries, size_t *n_entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_ADDRINDEX_H__ */
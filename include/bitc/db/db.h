@@ -57,6 +57,7 @@ extern bool blockdb_add(bu256_t *hash, struct const_buffer *buf);
 extern bool blockheightdb_init(void);
 extern bool blockheightdb_add(int height, bu256_t *hash);
 extern bool blockheightdb_getall(bool (*read_block)(void *p, size_t len));
+extern bool blockheightdb_getall_height(bool (*read_block)(int height, void *p, size_t len));
 
 extern void db_close(void);
 
@@ -0,0 +1,94 @@
+#ifndef __LIBBITC_TXINDEX_H__
+#define __LIBBITC_TXINDEX_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_block, bitc_tx
+
+#include <lmdb.h>                       // for MDB_dbi, MDB_env, MDB_txn
+
+#include <stdbool.h>                    // for bool
+#include <stdint.h>                     // for uint64_t, uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Persistent txid -> (block, offset, length) map, in its own LMDB file.
+ *
+ * A block is named by a caller-chosen 64-bit position: a record offset
+ * in a blocks.dat-style file for the scanning tools, the height for brd.
+ * Positions are indexed in increasing order; next_pos, stored alongside,
+ * is where the next run picks up.  Writes are batched, one LMDB write
+ * transaction per TXINDEX_BATCH blocks.
+ *
+ * Positions mean nothing without the blocks they point into, so the
+ * index also keeps an identity of its source, as the caller defines it
+ * (blkscan: the first block's hash, the file size, and a hash of the
+ * file's tail).  txindex_set_ident() stores a new one, emptying the
+ * index first when the source changed.
+ *
+ * txindex_open_temp() opens a fresh index in TMPDIR, already unlinked,
+ * for a single run.
+ */
+
+enum {
+	TXINDEX_BATCH		= 1000,		/* blocks per commit */
+	TXINDEX_IDENT_MAX	= 128,
+};
+
+struct txindex_pos {
+	uint64_t	block_pos;
+	uint32_t	offset;		/* of the tx, from the block start */
+	uint32_t	len;
+};
+
+struct txindex {
+	MDB_env		*env;
+	MDB_dbi		dbi_tx;
+	MDB_dbi		dbi_meta;
+	MDB_txn		*txn;		/* open write batch, or NULL */
+	unsigned int	n_batch;	/* blocks in it */
+
+	bool		readonly;
+	uint64_t	next_pos;	/* below this, already indexed */
+	uint64_t	sync_pos;	/* ditto, as committed */
+
+	uint8_t		ident[TXINDEX_IDENT_MAX];
+	size_t		ident_len;	/* 0 if none stored */
+};
+
+extern bool txindex_open(struct txindex *ti, const char *filename,
+			 bool readonly);
+extern bool txindex_open_temp(struct txindex *ti);
+extern bool txindex_set_ident(struct txindex *ti, const void *id,
+			      size_t id_len, bool reset);
+extern bool txindex_sync(struct txindex *ti);
+extern void txindex_close(struct txindex *ti);
+
+extern bool txindex_add(struct txindex *ti, const bu256_t *txids,
+			const struct txindex_pos *pos, unsigned int n,
+			uint64_t next_pos);
+extern bool txindex_add_block(struct txindex *ti, uint64_t block_pos,
+			      uint64_t next_pos,
+			      const struct const_buffer *blk);
+extern bool txindex_get(struct txindex *ti, const bu256_t *txid,
+			struct txindex_pos *pos);
+
+extern bool txindex_deser_block(struct bitc_block *block,
+				const struct const_buffer *blk,
+				uint64_t block_pos, struct txindex_pos **pos);
+extern bool txindex_fetch(struct bitc_tx *tx, const bu256_t *txid,
+			  const struct const_buffer *blk,
+			  const struct txindex_pos *pos);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_TXINDEX_H__ */
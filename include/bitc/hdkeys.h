@@ -53,6 +53,10 @@ extern bool hd_derive(struct hd_extended_key *out_child,
 		       const struct hd_path_seg *hdpath,
 		       size_t hdpath_len);
 
+extern bool hd_derive_range(struct hd_extended_key *out_children,
+			    const struct hd_extended_key *parent,
+			    uint32_t first, unsigned int n);
+
 #ifdef __cplusplus
 }
 #endif
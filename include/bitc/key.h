@@ -9,6 +9,7 @@
 
 #include <secp256k1.h>
 
+#include <bitc/addrset.h>
 #include <bitc/buint.h>
 #include <bitc/hashtab.h>
 #include <bitc/cstr.h>
@@ -33,6 +34,7 @@ extern bool bitc_pubkey_set(struct bitc_key *key, const void *pubkey, size_t pk_
 extern bool bitc_key_secret_set(struct bitc_key *key, const void *privkey_, size_t pk_len);
 extern bool bitc_privkey_get(const struct bitc_key *key, void **privkey, size_t *pk_len);
 extern bool bitc_pubkey_get(const struct bitc_key *key, void **pubkey, size_t *pk_len);
+extern bool bitc_pubkey_ser(const struct bitc_key *key, uint8_t pubkey[33]);
 extern bool bitc_key_secret_get(void *p, size_t len, const struct bitc_key *key);
 extern bool bitc_sign(const struct bitc_key *key, const void *data, size_t data_len,
 	     void **sig_, size_t *sig_len_);
@@ -48,10 +50,15 @@ bool pubkey_checklowS(const void *sig, size_t sig_len);
 struct bitc_keyset {
 	struct bitc_hashtab	*pub;
 	struct bitc_hashtab	*pubhash;
+	struct bitc_addrset	pubhash_set;	/* bulk-loaded pubkey hashes */
 };
 
 extern void bitc_keyset_init(struct bitc_keyset *ks);
 extern bool bitc_keyset_add(struct bitc_keyset *ks, struct bitc_key *key);
+extern bool bitc_keyset_add_hashes(struct bitc_keyset *ks, const void *hashes,
+				   size_t n);
+extern bool bitc_keyset_open_hashes(struct bitc_keyset *ks,
+				    const char *filename);
 extern bool bitc_keyset_lookup(const struct bitc_keyset *ks, const void *data, size_t data_len,
 		 bool is_pubkeyhash);
 extern void bitc_keyset_free(struct bitc_keyset *ks);
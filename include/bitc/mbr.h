@@ -6,6 +6,8 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <bitc/buffer.h>
 #include <bitc/message.h>
 
@@ -27,6 +29,36 @@ static inline void mbr_free(struct mbuf_reader *mbr) {}
 extern bool fread_message(int fd, struct p2p_message *msg, bool *read_ok);
 extern bool fread_block(int fd, struct p2p_message *msg, bool *read_ok);
 
+/*
+ * A blocks.dat-style file (netmagic, length, block; repeated), mapped
+ * read-only.  Blocks are returned as slices of the mapping, valid
+ * until blkfile_close().  Sequential scans advise the kernel to read
+ * ahead, and to drop what has been passed, so files larger than RAM
+ * scan with bounded memory.  Any block is also reachable directly by
+ * the file offset of its record, as returned by blkfile_next().
+ * Readers that go out of order replace the sequential advice with
+ * blkfile_advise_random(): random for sparse reads, such as a walk
+ * over record headers, or normal for runs of blocks.
+ */
+struct blkfile {
+	int			fd;
+	const unsigned char	*base;
+	size_t			len;
+
+	size_t			pos;		/* next record */
+	size_t			ahead;		/* read-ahead requested to here */
+	size_t			dropped;	/* released up to here */
+	bool			error;		/* malformed record */
+};
+
+extern bool blkfile_open(struct blkfile *bf, const char *filename);
+extern void blkfile_close(struct blkfile *bf);
+extern bool blkfile_next(struct blkfile *bf, struct const_buffer *block,
+			 uint64_t *fpos);
+extern bool blkfile_at(const struct blkfile *bf, uint64_t fpos,
+		       struct const_buffer *block);
+extern void blkfile_advise_random(struct blkfile *bf, bool random);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,156 @@
+#ifndef __LIBBITC_MEMPOOL_H__
+#define __LIBBITC_MEMPOOL_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_tx, bitc_outpt, etc
+#include <bitc/hashtab.h>               // for bitc_hashtab
+#include <bitc/parr.h>                  // for parr
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for int64_t
+#include <time.h>                       // for time_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	MEMPOOL_DEF_MAX_BYTES	= 64 * 1024 * 1024,
+	MEMPOOL_MAX_ANCESTORS	= 25,		/* package size, including the tx */
+	MEMPOOL_MAX_DESCENDANTS	= 25,		/* the same, for each ancestor */
+	MEMPOOL_MAX_DESC_BYTES	= 101 * 1000,	/* and its bytes */
+};
+
+enum mempool_result {
+	MP_OK,
+	MP_DUPLICATE,			/* already in pool */
+	MP_INVALID,			/* failed bitc_tx_valid, or coinbase */
+	MP_MISSING_INPUTS,		/* input not in UTXO set or pool */
+	MP_CONFLICT,			/* input already spent in pool */
+	MP_IMMATURE,			/* spends immature coinbase */
+	MP_BAD_SCRIPT,			/* script verification failed */
+	MP_BAD_FEE,			/* outputs exceed inputs */
+	MP_TOO_LONG,			/* too many unconfirmed relatives */
+	MP_FULL,			/* fee rate too low for a full pool */
+	MP_NON_FINAL,			/* lock time or sequence lock not met */
+};
+
+/* fee rate min-heaps: for selection, and for eviction */
+enum {
+	MEMPOOL_HEAP_ANC,		/* by ancestor fee rate */
+	MEMPOOL_HEAP_DESC,		/* by descendant score */
+	MEMPOOL_HEAPS,
+};
+
+struct mempool_heap {
+	struct mempool_entry	**ent;
+	size_t			len;
+	size_t			alloc;
+};
+
+struct mempool_entry {
+	struct bitc_tx	*tx;
+	size_t		size;		/* serialized bytes */
+	int64_t		fee;
+	time_t		time;
+
+	/* in-pool relatives (of mempool_entry) */
+	parr		*parents;
+	parr		*children;
+
+	/* ancestor package, including this tx */
+	unsigned int	n_anc;
+	size_t		anc_size;
+	int64_t		anc_fee;
+	int64_t		anc_feerate;	/* satoshis per 1000 bytes */
+
+	/* descendant package, including this tx */
+	unsigned int	n_desc;
+	size_t		desc_size;
+	int64_t		desc_fee;
+	int64_t		desc_score;	/* best of own and package fee rate */
+
+	size_t		heap_idx[MEMPOOL_HEAPS];	/* position in each heap */
+	unsigned long	walk;		/* last walk that visited this entry */
+};
+
+struct bitc_mempool {
+	struct bitc_hashtab	*map;		/* of txid -> mempool_entry */
+	struct bitc_hashtab	*spends;	/* of bitc_outpt -> mempool_entry */
+
+	/* every entry, in each heap */
+	struct mempool_heap	heap[MEMPOOL_HEAPS];
+
+	size_t			bytes;
+	size_t			max_bytes;
+
+	unsigned long		walk;		/* current walk, for set membership */
+
+	/*
+	 * Median time past of the best chain block at height, for lock
+	 * times.  NULL: time locks are checked against the clock, and
+	 * relative time locks are never met.
+	 */
+	int64_t (*median_time)(unsigned int height);
+
+	unsigned long		n_evicted;
+	unsigned long		n_confirmed;
+};
+
+extern bool bitc_mempool_init(struct bitc_mempool *mp, size_t max_bytes);
+extern void bitc_mempool_free(struct bitc_mempool *mp);
+extern enum mempool_result bitc_mempool_add(struct bitc_mempool *mp,
+				struct bitc_utxo_set *uset,
+				const struct bitc_tx *tx,
+				unsigned int height, unsigned int script_flags);
+extern bool bitc_mempool_remove(struct bitc_mempool *mp, const bu256_t *txid);
+extern void bitc_mempool_remove_block(struct bitc_mempool *mp,
+				      const struct bitc_block *block);
+extern void bitc_mempool_txids(const struct bitc_mempool *mp, bu256_t *txids,
+			       struct bitc_tx **txs);
+extern const char *mempool_result_str(enum mempool_result res);
+
+static inline struct mempool_entry *bitc_mempool_lookup(struct bitc_mempool *mp,
+						const bu256_t *txid)
+{
+	return (struct mempool_entry *) bitc_hashtab_get(mp->map, txid);
+}
+
+/* in-pool spender of an outpoint, if any */
+static inline struct mempool_entry *bitc_mempool_spender(struct bitc_mempool *mp,
+					const struct bitc_outpt *outpt)
+{
+	return (struct mempool_entry *) bitc_hashtab_get(mp->spends, outpt);
+}
+
+static inline size_t bitc_mempool_size(const struct bitc_mempool *mp)
+{
+	return mp->heap[MEMPOOL_HEAP_ANC].len;
+}
+
+/* entry with the lowest ancestor fee rate */
+static inline struct mempool_entry *bitc_mempool_min(const struct bitc_mempool *mp)
+{
+	const struct mempool_heap *h = &mp->heap[MEMPOOL_HEAP_ANC];
+
+	return h->len ? h->ent[0] : NULL;
+}
+
+/* entry evicted first: the lowest descendant score */
+static inline struct mempool_entry *bitc_mempool_worst(const struct bitc_mempool *mp)
+{
+	const struct mempool_heap *h = &mp->heap[MEMPOOL_HEAP_DESC];
+
+	return h->len ? h->ent[0] : NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_MEMPOOL_H__ */
@@ -37,6 +37,8 @@ struct p2p_message {
 enum {
 	MSG_TX = 1,
 	MSG_BLOCK,
+	MSG_FILTERED_BLOCK,
+	MSG_CMPCT_BLOCK,
 };
 
 extern void parse_message_hdr(struct p2p_message_hdr *hdr, const unsigned char *data);
@@ -154,6 +156,85 @@ extern void msg_vinv_free(struct msg_vinv *mv);
 extern void msg_vinv_push(struct msg_vinv *mv, uint32_t msg_type,
 		   const bu256_t *hash_in);
 
+/*
+ * BIP 152 compact block relay: "sendcmpct", "cmpctblock",
+ * "getblocktxn", "blocktxn"
+ */
+
+enum {
+	CMPCT_VERSION		= 1,
+	CMPCT_SHORTID_BYTES	= 6,
+	CMPCT_SHORTID_MASK	= 0xffffffffffffULL,
+};
+
+struct msg_sendcmpct {
+	bool		announce;
+	uint64_t	version;
+};
+
+static inline void msg_sendcmpct_init(struct msg_sendcmpct *msc)
+{
+	memset(msc, 0, sizeof(*msc));
+}
+
+extern bool deser_msg_sendcmpct(struct msg_sendcmpct *msc, struct const_buffer *buf);
+extern cstring *ser_msg_sendcmpct(const struct msg_sendcmpct *msc);
+static inline void msg_sendcmpct_free(struct msg_sendcmpct *msc) {}
+
+struct bitc_prefilled_tx {
+	uint32_t	index;		/* absolute index within block */
+	struct bitc_tx	tx;
+};
+
+extern void bitc_prefilled_tx_freep(void *p);
+
+struct msg_cmpctblock {
+	struct bitc_block	hdr;		/* header only */
+	uint64_t		nonce;
+	uint32_t		n_short_ids;
+	uint64_t		*short_ids;
+	parr			*prefilled;	/* of bitc_prefilled_tx */
+};
+
+static inline void msg_cmpctblock_init(struct msg_cmpctblock *mcb)
+{
+	memset(mcb, 0, sizeof(*mcb));
+	bitc_block_init(&mcb->hdr);
+}
+
+extern bool deser_msg_cmpctblock(struct msg_cmpctblock *mcb, struct const_buffer *buf);
+extern cstring *ser_msg_cmpctblock(const struct msg_cmpctblock *mcb);
+extern void msg_cmpctblock_free(struct msg_cmpctblock *mcb);
+
+struct msg_getblocktxn {
+	bu256_t		blockhash;
+	uint32_t	n_indexes;
+	uint32_t	*indexes;	/* absolute, ascending */
+};
+
+static inline void msg_getblocktxn_init(struct msg_getblocktxn *mgt)
+{
+	memset(mgt, 0, sizeof(*mgt));
+}
+
+extern bool deser_msg_getblocktxn(struct msg_getblocktxn *mgt, struct const_buffer *buf);
+extern cstring *ser_msg_getblocktxn(const struct msg_getblocktxn *mgt);
+extern void msg_getblocktxn_free(struct msg_getblocktxn *mgt);
+
+struct msg_blocktxn {
+	bu256_t		blockhash;
+	parr		*txs;		/* of bitc_tx */
+};
+
+static inline void msg_blocktxn_init(struct msg_blocktxn *mbt)
+{
+	memset(mbt, 0, sizeof(*mbt));
+}
+
+extern bool deser_msg_blocktxn(struct msg_blocktxn *mbt, struct const_buffer *buf);
+extern cstring *ser_msg_blocktxn(const struct msg_blocktxn *mbt);
+extern void msg_blocktxn_free(struct msg_blocktxn *mbt);
+
 #ifdef __cplusplus
 }
 #endif
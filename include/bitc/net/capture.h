@@ -0,0 +1,110 @@
+#ifndef __LIBBITC_NET_CAPTURE_H__
+#define __LIBBITC_NET_CAPTURE_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/message.h>              // for P2P_HDR_SZ
+
+#include <pthread.h>                    // for pthread_mutex_t, pthread_t
+#include <stdbool.h>                    // for bool
+#include <stdint.h>                     // for uint32_t, int64_t
+#include <stdio.h>                      // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Capture file: inbound P2P messages, as received, with arrival times.
+ * After an 8-byte magic, each record is
+ *
+ *	u64	microseconds since capture start
+ *	u32	connection id
+ *	16	peer IP address
+ *	u16	peer port
+ *	24	P2P message header
+ *	...	payload, as many bytes as the header says
+ *
+ * in little-endian byte order.
+ */
+
+#define NC_CAPTURE_MAGIC	"bitccap1"
+
+enum {
+	NC_CAPTURE_REC_SZ	= 8 + 4 + 16 + 2,	/* before P2P header */
+};
+
+struct nc_capture {
+	FILE			*f;
+	pthread_mutex_t		lock;		/* written by I/O threads */
+	int64_t			t0_us;
+};
+
+struct nc_capture_rec {
+	int64_t			t_us;
+	uint32_t		conn_id;
+	unsigned char		ip[16];
+	uint16_t		port;
+
+	unsigned char		hdr[P2P_HDR_SZ];
+	uint32_t		data_len;
+	void			*data;
+};
+
+extern struct nc_capture *nc_capture_open(const char *filename);
+extern bool nc_capture_write(struct nc_capture *cap, uint32_t conn_id,
+			     const unsigned char *ip, uint16_t port,
+			     const unsigned char *hdr,
+			     const void *data, uint32_t data_len);
+extern void nc_capture_close(struct nc_capture *cap);
+
+extern bool nc_capture_read_magic(FILE *f);
+extern bool nc_capture_read(FILE *f, struct nc_capture_rec *rec,
+			    bool want_data);
+extern void nc_capture_rec_free(struct nc_capture_rec *rec);
+
+/*
+ * Replay: each captured connection is re-created as a socketpair,
+ * adopted by the net engine as if freshly connected.  A driver thread
+ * writes the peer's side of the capture into them, in file order,
+ * either as fast as they are read (speed 0) or at the recorded pace
+ * scaled by speed.  Whatever we send back is read and discarded.
+ * When the file is exhausted the sockets are closed, and the
+ * connections drop.
+ */
+struct net_child_info;
+
+struct nc_replay_conn {
+	uint32_t		id;
+	int			fd;		/* driver's end */
+	unsigned char		ip[16];
+	uint16_t		port;
+};
+
+struct nc_replay {
+	FILE			*f;
+	double			speed;
+	pthread_t		thread;
+	bool			started;
+
+	struct nc_replay_conn	*conns;
+	unsigned int		n_conns;
+
+	/* written by the driver thread; read when done */
+	bool			done;
+	uint64_t		n_msgs;
+	uint64_t		n_bytes;
+};
+
+extern bool nc_replay_start(struct nc_replay *rp, struct net_child_info *nci,
+			    const char *filename, double speed);
+extern bool nc_replay_done(const struct nc_replay *rp);
+extern void nc_replay_free(struct nc_replay *rp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_NET_CAPTURE_H__ */
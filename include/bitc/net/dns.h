@@ -7,13 +7,41 @@
 
 #include <bitc/clist.h>                // for clist, clist_append
 
+#include <stdbool.h>                    // for bool
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum {
+	BU_DNS_MAX_THREADS	= 8,
+};
+
+typedef clist *(*bu_dns_lookup_fn)(clist *l, const char *seedname,
+				   unsigned int def_port);
+
 extern clist *bu_dns_lookup(clist *l, const char *seedname, unsigned int def_port);
 extern clist *bu_dns_seed_addrs(void);
 
+/*
+ * Concurrent seed resolution.  Names are looked up on helper threads;
+ * addresses (struct bitc_address, caller frees) are collected as each
+ * lookup finishes and picked up with bu_dns_seeder_take() whenever
+ * bu_dns_seeder_fd() turns readable.  Helper threads are detached, so
+ * a lookup stuck in the system resolver never holds up
+ * bu_dns_seeder_free().  lookup may be NULL, for bu_dns_lookup().
+ */
+struct bu_dns_seeder;
+
+extern struct bu_dns_seeder *bu_dns_seeder_new(const char **names,
+					       unsigned int n_names,
+					       unsigned int def_port,
+					       bu_dns_lookup_fn lookup);
+extern struct bu_dns_seeder *bu_dns_seeder_start(void);
+extern clist *bu_dns_seeder_take(struct bu_dns_seeder *ds, bool *done);
+extern int bu_dns_seeder_fd(const struct bu_dns_seeder *ds);
+extern void bu_dns_seeder_free(struct bu_dns_seeder *ds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,65 @@
+#ifndef __LIBBITC_NET_MSGBUF_H__
+#define __LIBBITC_NET_MSGBUF_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A complete wire message (header, checksum, payload), built once and
+ * never modified after.  Any number of write queues, on any thread,
+ * may hold a reference; the last unref returns it to a pool of
+ * buffers sorted by size class.  Each class keeps at most
+ * NC_MSGBUF_POOL_MAX spares and NC_MSGBUF_POOL_BYTES of memory, so
+ * only a few 1M buffers sit idle.
+ */
+
+enum {
+	NC_MSGBUF_CLASSES	= 4,		/* 256, 4K, 64K, 1M */
+	NC_MSGBUF_POOL_MAX	= 64,		/* spare buffers kept per class */
+	NC_MSGBUF_POOL_BYTES	= 4 * 1024 * 1024, /* and spare bytes */
+};
+
+struct nc_msgbuf {
+	struct nc_msgbuf	*next;		/* pool free list */
+	unsigned int		refs;
+	unsigned int		size_class;	/* NC_MSGBUF_CLASSES: unpooled */
+	size_t			len;
+	unsigned char		data[];
+};
+
+struct nc_msgbuf_stats {
+	uint64_t		n_new;		/* buffers malloc'd */
+	uint64_t		n_reused;	/* taken from the pool */
+	uint64_t		n_unpooled;	/* too big for any class */
+	unsigned int		n_free[NC_MSGBUF_CLASSES];
+};
+
+extern struct nc_msgbuf *nc_msgbuf_new(const unsigned char netmagic[4],
+				       const char *command,
+				       const void *data, uint32_t data_len);
+extern struct nc_msgbuf *nc_msgbuf_ref(struct nc_msgbuf *mb);
+extern void nc_msgbuf_unref(struct nc_msgbuf *mb);
+extern void nc_msgbuf_freep(void *mb);
+
+static inline const char *nc_msgbuf_command(const struct nc_msgbuf *mb)
+{
+	return (const char *) mb->data + 4;
+}
+
+extern void nc_msgbuf_pool_stats(struct nc_msgbuf_stats *st);
+extern void nc_msgbuf_pool_trim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_NET_MSGBUF_H__ */
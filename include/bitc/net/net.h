@@ -7,11 +7,18 @@
 
 #include <bitc/buint.h>                // for bu256_t
 #include <bitc/clist.h>                // for clist
+#include <bitc/cmpctblock.h>           // for cmpct_partial
+#include <bitc/crypto/sha2.h>           // for SHA256_CTX
+#include <bitc/mempool.h>              // for bitc_mempool
 #include <bitc/message.h>              // for P2P_HDR_SZ, p2p_message
 #include <bitc/parr.h>                 // for parr
 #include <bitc/net/peerman.h>          // for peer
+#include <bitc/net/shmring.h>          // for shmring
+#include <bitc/txcache.h>              // for bitc_txcache
 
+#include <pthread.h>                    // for pthread_mutex_t
 #include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
 #include <stdint.h>                     // for uint32_t, uint64_t
 #include <stdio.h>                      // for FILE
 #include <time.h>                       // for pid_t, time_t
@@ -28,11 +35,73 @@ extern "C" {
 #endif
 
 enum {
-	PROTO_VERSION	= 60002,
+	PROTO_VERSION	= 70014,
 };
 
 enum {
-	NC_MAX_CONN	= 8,
+	NC_MAX_CONN	= 8,			/* default connection limit */
+	NC_MAX_CONN_LIMIT = 1024,
+	NC_MAX_SHARDS	= 64,
+	NC_NEAR_TIP_SECS = 24 * 60 * 60,	/* relay txs once tip is this fresh */
+
+	NC_TICK_SECS	= 10,			/* housekeeping interval */
+	NC_PING_SECS	= 2 * 60,		/* RTT sample interval */
+	NC_STALL_SECS	= 60,			/* max wait for a requested block */
+	NC_STALL_FORGIVE = 50,			/* good blocks that cancel a stall */
+
+	NC_MAX_DIALS	= 16,			/* default connects in flight */
+	NC_SPARE_CONN	= 2,			/* default handshaked reserve */
+	NC_DIAL_RTT_MULT = 4,			/* connect timeout, in RTTs */
+	NC_DIAL_MIN_MS	= 1500,
+	NC_HANDSHAKE_SECS = 30,			/* connect to verack */
+
+	NC_SENDQ_MAX	= 4 * 1024 * 1024,	/* default send queue high water */
+};
+
+/* message commands counted separately in traffic stats */
+enum nc_msgtype {
+	NC_MSG_VERSION,
+	NC_MSG_VERACK,
+	NC_MSG_ADDR,
+	NC_MSG_GETADDR,
+	NC_MSG_INV,
+	NC_MSG_GETDATA,
+	NC_MSG_NOTFOUND,
+	NC_MSG_GETBLOCKS,
+	NC_MSG_GETHEADERS,
+	NC_MSG_HEADERS,
+	NC_MSG_BLOCK,
+	NC_MSG_TX,
+	NC_MSG_PING,
+	NC_MSG_PONG,
+	NC_MSG_SENDCMPCT,
+	NC_MSG_CMPCTBLOCK,
+	NC_MSG_GETBLOCKTXN,
+	NC_MSG_BLOCKTXN,
+	NC_MSG_OTHER,
+
+	NC_MSG_MAX
+};
+
+/* messages and bytes (header included) per command, each way */
+struct nc_traffic {
+	uint64_t		rx_msgs[NC_MSG_MAX];
+	uint64_t		rx_bytes[NC_MSG_MAX];
+	uint64_t		tx_msgs[NC_MSG_MAX];
+	uint64_t		tx_bytes[NC_MSG_MAX];
+};
+
+/*
+ * Token bucket, shared by all I/O threads.  Holds up to one second
+ * of rate; writers take what they are about to write, and give back
+ * whatever the socket did not accept.
+ */
+struct nc_ratelimit {
+	pthread_mutex_t		lock;
+	uint64_t		rate;		/* bytes/sec */
+	uint64_t		tokens;
+	int64_t			t_fill_us;	/* monotonic */
+	uint64_t		n_throttled;	/* writes deferred for want of tokens */
 };
 
 enum netcmds {
@@ -45,6 +114,12 @@ enum netcmds {
 
 struct net_settings *net_settings;
 
+struct nc_shard;
+struct nc_queue;
+struct bu_dns_seeder;
+struct nc_capture;
+struct nc_msgbuf;
+
 struct net_child_info {
 	int			read_fd;
 	int			write_fd;
@@ -60,42 +135,130 @@ struct net_child_info {
 	const struct		chain_info *chain;
 	uint64_t		*instance_nonce;
 
+	/* recently relayed txs; NULL disables compact blocks */
+	struct bitc_txcache	*txcache;
+
+	/* unconfirmed txs; NULL disables tx relay into the pool */
+	struct bitc_mempool	*mempool;
+
 	bool			running;
 
+	unsigned int		max_conns;	/* 0 means NC_MAX_CONN */
+
+	/*
+	 * Connects run in parallel, more than are needed, each timing
+	 * out after a few handshake RTTs.  Handshaked peers beyond
+	 * max_conns are kept idle as spares, up to max_spare, and
+	 * replace active peers that drop.
+	 */
+	unsigned int		max_dials;	/* 0 means NC_MAX_DIALS */
+	unsigned int		max_spare;
+	uint32_t		handshake_ms;	/* EWMA over all peers */
+
+	/*
+	 * I/O threads, each running its own event loop over a share of
+	 * the connections.  Decoded messages are handed to the thread
+	 * running eb via inbox; all callbacks below run there.
+	 * With no shards, everything runs on eb.
+	 */
+	unsigned int		n_shards;
+	struct nc_shard		*shards;
+	struct nc_queue		*inbox;
+	struct event		*inbox_ev;
+
+	struct event		*tick_ev;	/* pings, stall checks */
+
+	bool			no_dial;	/* adopted connections only */
+
+	/* inbound traffic is recorded here, if set */
+	struct nc_capture	*capture;
+	uint32_t		next_conn_id;
+
+	/* seed lookups still running; addresses are added as they come */
+	struct bu_dns_seeder	*dns;
+	struct event		*dns_ev;
+
+	/*
+	 * Outbound flow control.  A peer whose send queue grows past
+	 * sendq_max is not read from until it drains to half that.
+	 * Upload is capped by the shared bucket, if set.
+	 */
+	size_t			sendq_max;	/* 0 means NC_SENDQ_MAX */
+	struct nc_ratelimit	*upload;	/* NULL means unlimited */
+
+	struct nc_traffic	traffic;	/* all conns, main thread only */
+
 	bool (*inv_block_process)(bu256_t *hash);
 	bool (*block_process)(struct bitc_block *block,
                           struct const_buffer *buf);
+	bool (*tx_process)(const struct bitc_tx *tx);
 };
 
 struct nc_conn {
-	bool			dead;
+	bool			dead;		/* __atomic: read across threads */
 
 	int			fd;
+	uint32_t		id;		/* unique within nci */
 
 	struct peer		peer;
 	char			addr_str[64];
 
 	bool			ipv4;
-	bool			connected;
+	bool			connected;	/* __atomic, like dead */
 	struct event		*ev;
 	struct net_child_info	*nci;
 
 	struct event		*write_ev;
-	clist			*write_q;	/* of struct buffer */
+	clist			*write_q;	/* of struct nc_msgbuf */
 	unsigned int		write_partial;
 
+	/* send queue state; owned by the I/O thread */
+	size_t			write_q_bytes;	/* queued, not yet written */
+	bool			read_paused;	/* write_q_bytes past high water */
+	struct event		*throttle_ev;	/* waiting for upload tokens */
+
+	struct nc_traffic	traffic;	/* main thread only */
+
+	/* message being handled; owned by the nci->eb thread */
 	struct p2p_message	msg;
+	struct bitc_block	*msg_block;	/* "block", pre-decoded */
 
+	/* read state; owned by the I/O thread */
+	struct p2p_message	rd_msg;
 	void			*msg_p;
 	unsigned int		expected;
 	bool			reading_hdr;
 	unsigned char		hdrbuf[P2P_HDR_SZ];
+	SHA256_CTX		rd_sha;		/* payload received so far */
 
 	bool			seen_version;
 	bool			seen_verack;
 	uint32_t		protover;
+	bool			spare;		/* handshaked, held in reserve */
+	bool			syncing;	/* our getblocks went here */
+
+	bool			cmpct_ok;	/* peer sent sendcmpct v1 */
+	struct cmpct_partial	*cmpct_pend;	/* awaiting "blocktxn" */
+
+	struct nc_shard		*shard;		/* NULL if unsharded */
+	struct nc_msgbuf	*version_buf;	/* sent by shard on connect */
+	bool			closed;		/* shard released it */
+
+	/* measurements for peer scoring, in monotonic ms */
+	int64_t			t_open_ms;	/* connect started */
+	unsigned int		dial_ms;	/* connect timeout */
+	int64_t			t_ping_ms;	/* ping outstanding since, or 0 */
+	int64_t			t_last_ping_ms;
+	uint64_t		ping_nonce;
+	int64_t			t_blk_ms;	/* last block request progress */
+	unsigned int		n_blk_pending;	/* requested, not delivered */
+	unsigned int		n_blk_ok;
 };
 
+/*
+ * Network child process.  The pipes carry control commands only;
+ * received blocks are passed to the parent through ring, if set.
+ */
 struct net_engine {
 	bool	running;
 	int	rx_pipefd[2];
@@ -103,15 +266,38 @@ struct net_engine {
 	int	par_read;
 	int	par_write;
 	pid_t	child;
-	void (*network_child_process)(int read_fd, int write_fd);
 
+	size_t		ring_size;	/* 0 disables the ring */
+	struct shmring	*ring;
+
+	void (*network_child_process)(int read_fd, int write_fd,
+				      struct shmring *ring);
 };
 
-struct net_engine *neteng_new_start(void (*network_child)(int read_fd, int write_fd));
+struct net_engine *neteng_new_start(void (*network_child)(int read_fd,
+				    int write_fd, struct shmring *ring),
+				    size_t ring_size);
 
+extern bool nc_shards_start(struct net_child_info *nci, unsigned int n_shards);
+extern void nc_shards_stop(struct net_child_info *nci);
 extern void nc_conns_process(struct net_child_info *nci);
+extern bool nc_conns_adopt(struct net_child_info *nci, int fd,
+			   const struct peer *peer);
 extern void nc_conns_gc(struct net_child_info *nci, bool free_all);
+extern unsigned int nc_conns_broadcast(struct net_child_info *nci,
+				       const char *command,
+				       const void *data, size_t data_len);
 extern void nc_pipe_evt(int fd, short events, void *priv);
+extern void nc_stats_log(const struct net_child_info *nci);
+
+extern enum nc_msgtype nc_msgtype_find(const char *command);
+extern const char *nc_msgtype_str(enum nc_msgtype type);
+
+extern struct nc_ratelimit *nc_ratelimit_new(uint64_t rate);
+extern void nc_ratelimit_free(struct nc_ratelimit *rl);
+extern size_t nc_ratelimit_take(struct nc_ratelimit *rl, size_t want,
+				unsigned int *wait_ms);
+extern void nc_ratelimit_give(struct nc_ratelimit *rl, size_t n);
 extern void neteng_free(struct net_engine *neteng);
 
 #ifdef __cplusplus
@@ -8,11 +8,29 @@
 #include <bitc/clist.h>                // for clist
 #include <bitc/core.h>                 // for bitc_addr_free, bitc_addr_init, etc
 #include <bitc/cstr.h>                 // for cstring
+#include <bitc/parr.h>                 // for parr
 
 #include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
 #include <stdint.h>                     // for int64_t, uint32_t
 #include <string.h>                     // for memcpy, memset
 
+enum {
+	PEER_FRESH_SECS		= 7 * 24 * 60 * 60,	/* last_ok still counts */
+	PEER_DEF_PING_MS	= 500,		/* assumed, until measured */
+	PEER_DEF_HANDSHAKE_MS	= 1000,
+	PEER_STALL_COST_MS	= 2000,		/* per recorded stall */
+
+	PEERMAN_POP_WINDOW	= 8,		/* candidates per pop */
+
+	/* address tables: fixed buckets of fixed size */
+	PEERMAN_NEW_BUCKETS	= 1024,
+	PEERMAN_TRIED_BUCKETS	= 256,
+	PEERMAN_BUCKET_SIZE	= 64,
+	PEERMAN_NEW_PER_GROUP	= 4,		/* buckets one group may use */
+	PEERMAN_TRIED_PER_GROUP	= 8,
+};
+
 struct peer {
 	/* serialized */
 	struct bitc_address	addr;
@@ -23,9 +41,20 @@ struct peer {
 	int64_t			last_fail;
 	uint32_t		n_fail;
 
+	/* measured performance, smoothed; 0 if unknown */
+	uint32_t		ping_ms;	/* ping/pong round trip */
+	uint32_t		handshake_ms;	/* connect to verack */
+	uint32_t		rx_rate;	/* block bytes/sec */
+	uint32_t		n_stalls;	/* block requests timed out */
+
 	/* calculated at runtime */
 	unsigned char		group[20];
 	unsigned int		group_len;
+
+	/* position in peer manager */
+	bool			tried;
+	unsigned int		slot;		/* bucket * size + entry */
+	unsigned int		id;		/* index in table ids */
 };
 
 static inline void peer_init(struct peer *peer)
@@ -44,25 +73,60 @@ static inline void peer_copy(struct peer *dest, const struct peer *src)
 	memcpy(dest, src, sizeof(*dest));
 }
 
+/* fold a new sample into a smoothed measurement */
+static inline uint32_t peer_ewma(uint32_t avg, uint32_t sample)
+{
+	if (!avg)
+		return sample ? sample : 1;
+	return (uint32_t) (((uint64_t) avg * 3 + sample) / 4);
+}
+
+extern int64_t peer_cost(const struct peer *peer);
+
 extern bool deser_peer(unsigned int protover,
 		       struct peer *peer, struct const_buffer *buf);
 extern void ser_peer(cstring *s, unsigned int protover, const struct peer *peer);
 
+/*
+ * Addresses live in one of two tables.  "new" holds gossiped,
+ * untested addresses; "tried" holds peers we connected to.  An
+ * address hashes to one slot, in a bucket chosen by its network
+ * group, so no group can crowd out the rest and table size is
+ * bounded.  ids lists the occupied slots, for O(1) random picks.
+ */
+struct peer_table {
+	struct peer		**slots;
+	unsigned int		n_buckets;
+	parr			*ids;		/* of struct peer */
+};
+
 struct peer_manager {
-	struct bitc_hashtab *map_addr;	/* binary IP addr -> struct peer */
-	clist		*addrlist;	/* of struct bitc_address */
+	struct bitc_hashtab	*map_addr;	/* binary IP addr -> struct peer */
+
+	struct peer_table	new_tab;
+	struct peer_table	tried_tab;
+
+	uint64_t		key[2];		/* bucket hash key */
+	uint64_t		rng;		/* selection state */
 };
 
+static inline size_t peerman_size(const struct peer_manager *peers)
+{
+	return peers->new_tab.ids->len + peers->tried_tab.ids->len;
+}
+
 extern void peerman_free(struct peer_manager *peers);
 extern struct peer_manager *peerman_read(void *peer_file);
 extern struct peer_manager *peerman_seed(bool use_dns);
 extern bool peerman_write(struct peer_manager *peers, void *peer_file, const struct chain_info *chain);
 extern struct peer *peerman_pop(struct peer_manager *peers);
-extern void peerman_sort(struct peer_manager *peers);
+extern struct peer *peerman_lookup(struct peer_manager *peers,
+				   const unsigned char *ip);
 extern void peerman_add(struct peer_manager *peers,
 		 const struct peer *peer_in, bool known_working);
 extern void peerman_add_addr(struct peer_manager *peers,
 		 const struct bitc_address *addr_in, bool known_working);
 extern void peerman_addstr(struct peer_manager *peers, const char *addr_str);
+extern void peerman_add_seeds(struct peer_manager *peers, clist *seedlist);
 
 #endif /* __LIBBITC_NET_PEERMAN_H__ */
@@ -0,0 +1,83 @@
+#ifndef __LIBBITC_NET_SHMRING_H__
+#define __LIBBITC_NET_SHMRING_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Single-producer, single-consumer record ring in shared memory.
+ * Created before fork(); the producer (net child) appends records,
+ * the consumer (parent) reads them in place and releases them.
+ * Each side sleeps on its own notification fd.
+ */
+
+enum {
+	SHMRING_DEF_SIZE	= 32 * 1024 * 1024,
+	SHMRING_ALIGN		= 8,
+};
+
+enum shmring_type {
+	SHMR_PAD,			/* skip to start of ring */
+	SHMR_BLOCK,			/* serialized block */
+	SHMR_HEADER,			/* serialized 80-byte block header */
+};
+
+struct shmring_rec {
+	uint32_t	type;
+	uint32_t	len;		/* payload bytes */
+	unsigned char	data[];
+};
+
+struct shmring_ctl;
+
+struct shmring {
+	struct shmring_ctl	*ctl;		/* shared head/tail */
+	unsigned char		*base;		/* shared record area */
+	size_t			size;		/* power of 2 */
+	size_t			map_len;
+
+	int			mem_fd;		/* memfd, or -1 */
+	int			data_fd[2];	/* producer -> consumer */
+	int			space_fd[2];	/* consumer -> producer */
+};
+
+extern bool shmring_init(struct shmring *ring, size_t size);
+extern void shmring_free(struct shmring *ring);
+
+/* producer side */
+extern bool shmring_put(struct shmring *ring, enum shmring_type type,
+			const void *data, size_t len);
+extern bool shmring_put_wait(struct shmring *ring, enum shmring_type type,
+			     const void *data, size_t len, int timeout_ms);
+
+/* consumer side */
+extern const struct shmring_rec *shmring_peek(struct shmring *ring);
+extern void shmring_release(struct shmring *ring);
+extern bool shmring_wait(struct shmring *ring, int timeout_ms);
+
+/* largest payload that can ever be stored */
+static inline size_t shmring_max_len(const struct shmring *ring)
+{
+	return ring->size / 2 - sizeof(struct shmring_rec);
+}
+
+/* readable when records are pending (for poll/event loops) */
+static inline int shmring_fd(const struct shmring *ring)
+{
+	return ring->data_fd[0];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_NET_SHMRING_H__ */
@@ -142,6 +142,9 @@ enum txnouttype
 	TX_PUBKEYHASH,
 	TX_SCRIPTHASH,
 	TX_MULTISIG,
+	TX_WITNESS_V0_KEYHASH,
+	TX_WITNESS_V0_SCRIPTHASH,
+	TX_WITNESS_UNKNOWN,
 };
 
 /** Script opcodes */
@@ -308,6 +311,19 @@ struct bscript_addr {
 	clist			*pubhash;	/* of struct buffer */
 };
 
+enum {
+	BSP_TMPL_MAX_DATA	= 16,		/* multisig keys */
+};
+
+/* a matched output template; data points into the script itself */
+struct bscript_tmpl {
+	enum txnouttype		txtype;
+	int			version;	/* witness program version */
+	unsigned int		n_req;		/* multisig signatures needed */
+	unsigned int		n_data;
+	struct const_buffer	data[BSP_TMPL_MAX_DATA]; /* keys or hashes */
+};
+
 extern const char *GetOpName(enum opcodetype opcode);
 extern enum opcodetype GetOpType(const char *opname);
 
@@ -319,6 +335,8 @@ extern bool bsp_getop(struct bscript_op *op, struct bscript_parser *bp);
 extern unsigned int bsp_get_sigopcount(struct const_buffer* buf, bool fAccurate);
 extern parr *bsp_parse_all(const void *data_, size_t data_len);
 extern enum txnouttype bsp_classify(parr *ops);
+extern bool bsp_tmpl_match(struct bscript_tmpl *tmpl,
+			   const void *data, size_t data_len);
 extern bool bsp_addr_parse(struct bscript_addr *addr,
 		    const void *data, size_t data_len);
 extern void bsp_addr_free(struct bscript_addr *addr);
@@ -0,0 +1,77 @@
+#ifndef __LIBBITC_TXCACHE_H__
+#define __LIBBITC_TXCACHE_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_tx
+#include <bitc/hashtab.h>               // for bitc_hashtab
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded FIFO of recently relayed transactions, used to
+ * reconstruct compact blocks.  Oldest entries are evicted once
+ * either the entry or the byte limit is exceeded.  A successful
+ * bitc_txcache_add() transfers ownership of the tx to the cache.
+ */
+
+enum {
+	TXCACHE_DEF_MAX_TXS	= 20000,
+	TXCACHE_DEF_MAX_BYTES	= 16 * 1024 * 1024,
+};
+
+struct bitc_txcache_ent {
+	struct bitc_tx	*tx;
+	size_t		size;
+};
+
+struct bitc_txcache {
+	struct bitc_hashtab	*map;		/* of bu256_t -> bitc_tx */
+
+	struct bitc_txcache_ent	*ring;
+	size_t			head;		/* oldest entry */
+	size_t			count;
+	size_t			max_txs;
+
+	size_t			bytes;
+	size_t			max_bytes;
+};
+
+extern bool bitc_txcache_init(struct bitc_txcache *tc, size_t max_txs,
+			      size_t max_bytes);
+extern void bitc_txcache_free(struct bitc_txcache *tc);
+extern bool bitc_txcache_add(struct bitc_txcache *tc, struct bitc_tx *tx,
+			     size_t ser_size);
+extern void bitc_txcache_txids(const struct bitc_txcache *tc, bu256_t *txids);
+
+static inline struct bitc_tx *bitc_txcache_lookup(struct bitc_txcache *tc,
+						  const bu256_t *txid)
+{
+	return (struct bitc_tx *) bitc_hashtab_get(tc->map, txid);
+}
+
+static inline size_t bitc_txcache_size(const struct bitc_txcache *tc)
+{
+	return tc->count;
+}
+
+/* i'th entry, oldest first */
+static inline struct bitc_tx *bitc_txcache_idx(const struct bitc_txcache *tc,
+					       size_t i)
+{
+	return tc->ring[(tc->head + i) % tc->max_txs].tx;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_TXCACHE_H__ */
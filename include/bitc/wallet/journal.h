@@ -0,0 +1,76 @@
+#ifndef __LIBBITC_WALLET_JOURNAL_H__
+#define __LIBBITC_WALLET_JOURNAL_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <stdbool.h>                    // for bool
+#include <stddef.h>                     // for size_t
+#include <stdint.h>                     // for uint8_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Wallet journal: an append-only file of encrypted records.
+ *
+ * A 64-byte header holds the key derivation parameters: a random salt,
+ * and a PBKDF2-HMAC-SHA512 round count.  The derived key is split in an
+ * AES-256 key and an HMAC-SHA256 key; the header ends with a MAC over
+ * the rest of it, so a wrong passphrase is told from a damaged file.
+ *
+ * Each record is
+ *	le32 len | iv[16] | AES-256-CTR(data)[len] | tag[32]
+ * where tag is the HMAC of the record's number in the file (le64), then
+ * everything before it.  Records cannot be altered, reordered, or taken
+ * from elsewhere in the file, or from another file, without notice.
+ *
+ * Appends are synced, one record at a time.  A record cut short at the
+ * end of the file, as by a crash while appending, ends the journal, and
+ * is overwritten by the next append; a bad record anywhere else fails
+ * the open.  New journals, as when compacting one, are written beside
+ * the file, and replace it only when committed.
+ */
+
+enum {
+	WJOURNAL_VERSION	= 1,
+	WJOURNAL_KDF_ROUNDS	= 25000,
+	WJOURNAL_MAX_RECORD	= 16 * 1024 * 1024,
+};
+
+struct wallet_journal {
+	int		fd;
+	char		*filename;
+	char		*tmpname;	/* if not yet committed */
+
+	uint8_t		enc_key[32];
+	uint8_t		mac_key[32];
+
+	uint64_t	n_records;
+	uint64_t	size;		/* up to the end of the last record */
+	bool		torn;		/* junk follows the last record */
+};
+
+typedef bool (*wallet_journal_func)(void *priv, const void *data, size_t len);
+
+extern void wallet_journal_init(struct wallet_journal *wj);
+extern bool wallet_journal_detect(const char *filename);
+extern bool wallet_journal_open(struct wallet_journal *wj,
+				const char *filename,
+				const void *pass, size_t pass_len,
+				wallet_journal_func f, void *priv);
+extern bool wallet_journal_create(struct wallet_journal *wj,
+				  const char *filename,
+				  const void *pass, size_t pass_len);
+extern bool wallet_journal_append(struct wallet_journal *wj,
+				  const void *data, size_t len);
+extern bool wallet_journal_commit(struct wallet_journal *wj);
+extern void wallet_journal_free(struct wallet_journal *wj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_WALLET_JOURNAL_H__ */
@@ -0,0 +1,67 @@
+#ifndef __LIBBITC_WALLET_RESCAN_H__
+#define __LIBBITC_WALLET_RESCAN_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/wallet/wallet.h>         // for wallet, wallet_coin
+
+#include <stdbool.h>                    // for bool
+#include <stdint.h>                     // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rescan: find a wallet's coins, and what spent them, in stored blocks.
+ *
+ * Each account's receive and change chains are watched from key 0 to
+ * gap_limit keys past the last one seen used; a payment to a key near
+ * the end of that window moves the window on, and a payment to a
+ * receive key moves the account's next_key_idx past it.
+ *
+ * Blocks are pushed with their heights, which must increase (gaps are
+ * allowed), from wherever they are kept (the block database, a
+ * blocks.dat file).  They are decoded and matched on worker threads, a
+ * batch at a time, against a snapshot of the watched keys and unspent
+ * coins; the caller's thread applies the matches in order.  Keys are
+ * derived RESCAN_LOOKAHEAD past each window, so a hit rarely adds keys
+ * the snapshot lacks.  A tx a worker passed over is checked again on
+ * the caller's thread only against keys and coins added since its
+ * snapshot, so the result is that of one sequential pass.
+ *
+ * Coins already in the wallet are kept, and not added twice.  Coins
+ * found, or found spent, are marked dirty, for the caller to store.
+ */
+
+enum {
+	RESCAN_GAP_LIMIT	= 20,		/* BIP 44 */
+	RESCAN_BATCH		= 64,		/* blocks per work unit */
+	RESCAN_LOOKAHEAD	= 100,		/* keys derived past a window */
+};
+
+struct wallet_rescan_stats {
+	uint32_t	n_blocks;
+	uint64_t	n_txs;
+	unsigned int	n_coins;	/* newly found */
+	unsigned int	n_spends;	/* coins newly found spent */
+};
+
+struct wallet_rescan;
+
+extern struct wallet_rescan *wallet_rescan_new(struct wallet *wlt,
+					       unsigned int gap_limit,
+					       unsigned int n_threads);
+extern bool wallet_rescan_push(struct wallet_rescan *rs, uint32_t height,
+			       const struct const_buffer *blk);
+extern bool wallet_rescan_finish(struct wallet_rescan *rs,
+				 struct wallet_rescan_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBBITC_WALLET_RESCAN_H__ */
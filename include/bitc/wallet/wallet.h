@@ -7,23 +7,48 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.
  */
 
+#include <bitc/buint.h>                 // for bu256_t
+#include <bitc/core.h>                  // for bitc_outpt
 #include <bitc/cstr.h>                  // for cstring
 #include <bitc/parr.h>                  // for parr_idx, parr
 
 #include <stdbool.h>                    // for bool
 #include <stddef.h>                     // for size_t
-#include <stdint.h>                     // for uint32_t
+#include <stdint.h>                     // for uint32_t, int64_t
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct bitc_hashtab;
 struct chain_info;
+struct hd_extended_key;
 
 struct wallet_account {
 	cstring			*name;
 	uint32_t		acct_idx;
 	uint32_t		next_key_idx;
+
+	/* m/44'/0'/acct'/{0,1}, derived on first use */
+	struct hd_extended_key	*chain_keys[2];
+};
+
+/* an output paying to an account key, as found by a rescan */
+struct wallet_coin {
+	struct bitc_outpt	outpt;
+	int64_t			value;
+	uint32_t		height;		/* of the funding block */
+
+	/* paid to m/44'/0'/acct'/change/key_idx */
+	uint32_t		acct_idx;
+	uint32_t		change;
+	uint32_t		key_idx;
+
+	bool			spent;
+	bu256_t			spent_txid;	/* if spent: by this tx, */
+	uint32_t		spent_height;	/* in this block */
+
+	bool			dirty;		/* changed since stored */
 };
 
 struct wallet {
@@ -35,18 +60,42 @@ struct wallet {
 	parr			*keys;
 	parr			*hdmaster;
 	parr			*accounts;
+	parr			*coins;		/* wallet_coin, in chain order */
+	struct bitc_hashtab	*coin_map;	/* outpoint -> wallet_coin */
 };
 
 struct const_buffer;
 
+/*
+ * A serialized wallet is a run of p2p_message-framed records.  They are
+ * applied in order, and a later root record, account record (matched by
+ * acct_idx) or coin record (matched by outpoint) replaces an earlier one:
+ * a wallet may be stored as a snapshot followed by its changes.
+ */
+typedef bool (*wallet_record_func)(void *priv, const cstring *rec);
+
 extern bool wallet_init(struct wallet *wlt, const struct chain_info *chain);
 extern void wallet_free(struct wallet *wlt);
 extern cstring *wallet_new_address(struct wallet *wlt);
 extern cstring *ser_wallet(const struct wallet *wlt);
 extern bool deser_wallet(struct wallet *wlt, struct const_buffer *buf);
+extern bool wallet_records(const struct wallet *wlt, wallet_record_func f,
+			   void *priv);
+extern cstring *wallet_record_root(const struct wallet *wlt);
+extern cstring *wallet_record_account(const struct wallet *wlt,
+				      const struct wallet_account *acct);
+extern cstring *wallet_record_coin(const struct wallet *wlt,
+				   const struct wallet_coin *coin);
+extern bool wallet_add_coin(struct wallet *wlt, struct wallet_coin *coin);
+extern struct wallet_coin *wallet_coin_find(struct wallet *wlt,
+					    const struct bitc_outpt *outpt);
 extern bool wallet_create(struct wallet *wlt, const void *seed, size_t seed_len);
 extern bool wallet_createAccount(struct wallet *wlt, const char *name);
 extern struct wallet_account *account_byname(struct wallet *wlt, const char *name);
+extern bool wallet_account_keys(struct wallet *wlt,
+				struct wallet_account *acct, bool change,
+				uint32_t first, unsigned int n,
+				struct hd_extended_key *keys);
 extern bool wallet_valid_name(const char *name);
 
 #define wallet_for_each_key_numbered(_wlt, _key, _num)			\
@@ -7,7 +7,6 @@
 #include <bitc/core.h>
 #include <bitc/script.h>
 #include <bitc/key.h>
-#include <bitc/clist.h>
 #include <bitc/addr_match.h>
 #include <bitc/compat.h>		/* for parr_new */
 
@@ -17,41 +16,21 @@ bool bitc_txout_match(const struct bitc_txout *txout,
 	if (!txout || !txout->scriptPubKey || !ks)
 		return false;
 
-	bool rc = false;
-
-	struct bscript_addr addrs;
-	if (!bsp_addr_parse(&addrs, txout->scriptPubKey->str,
+	struct bscript_tmpl tmpl;
+	if (!bsp_tmpl_match(&tmpl, txout->scriptPubKey->str,
 			    txout->scriptPubKey->len))
 		return false;
 
-	struct const_buffer *buf;
-	clist *tmp = addrs.pub;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
-
-		if (bitc_keyset_lookup(ks, buf->p, buf->len, false)) {
-			rc = true;
-			goto out;
-		}
-	}
-
-	tmp = addrs.pubhash;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
-
-		if (bitc_keyset_lookup(ks, buf->p, buf->len, true)) {
-			rc = true;
-			goto out;
-		}
+	switch (tmpl.txtype) {
+	case TX_PUBKEY:
+		return bitc_keyset_lookup(ks, tmpl.data[0].p, tmpl.data[0].len,
+					  false);
+	case TX_PUBKEYHASH:
+		return bitc_keyset_lookup(ks, tmpl.data[0].p, tmpl.data[0].len,
+					  true);
+	default:
+		return false;
 	}
-
-out:
-	clist_free_ext(addrs.pub, buffer_freep);
-	clist_free_ext(addrs.pubhash, buffer_freep);
-
-	return rc;
 }
 
 bool bitc_tx_match(const struct bitc_tx *tx, const struct bitc_keyset *ks)
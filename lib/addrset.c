@@ -0,0 +1,334 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/addrset.h>               // for bitc_addrset, etc
+#include <bitc/endian.h>                // for le32toh, htole32, etc
+#include <bitc/util.h>                  // for bu_write_file
+
+#include <fcntl.h>                      // for open, O_RDONLY
+#include <stdlib.h>                     // for free, malloc, qsort, etc
+#include <string.h>                     // for memcmp, memcpy, memset
+#include <sys/mman.h>                   // for mmap, munmap, etc
+#include <sys/stat.h>                   // for fstat, stat
+#include <unistd.h>                     // for close
+
+enum {
+	ADDRSET_VERSION		= 1,
+	ADDRSET_BLOOM_K		= 6,		/* probes, 9 bits each */
+	ADDRSET_BLOCK_BYTES	= 64,
+	ADDRSET_MAX_BUCKET_BITS	= 24,
+};
+
+static const char addrset_magic[8] = "bitcadrs";
+
+/* file header; the rest follows, each part a multiple of 4 bytes long */
+struct addrset_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	bucket_bits;
+	uint64_t	n;
+	uint64_t	bloom_blocks;
+	uint8_t		reserved[32];
+};
+
+void bitc_addrset_init(struct bitc_addrset *set)
+{
+	memset(set, 0, sizeof(*set));
+}
+
+static uint32_t hash_bucket(const struct bitc_addrset *set, const uint8_t *h)
+{
+	uint32_t v;
+
+	if (!set->bucket_bits)
+		return 0;
+
+	memcpy(&v, h, sizeof(v));
+	return be32toh(v) >> (32 - set->bucket_bits);
+}
+
+/* hash160s are uniform already: their bytes are the bloom hashes */
+static const uint8_t *bloom_block(const struct bitc_addrset *set,
+				  const uint8_t *h)
+{
+	uint32_t v;
+
+	memcpy(&v, h + 4, sizeof(v));
+	uint64_t idx = ((uint64_t) le32toh(v) * set->bloom_blocks) >> 32;
+
+	return set->bloom + idx * ADDRSET_BLOCK_BYTES;
+}
+
+static uint64_t bloom_bits(const uint8_t *h)
+{
+	uint64_t v;
+
+	memcpy(&v, h + 8, sizeof(v));
+	return le64toh(v);
+}
+
+static bool bloom_check(const struct bitc_addrset *set, const uint8_t *h)
+{
+	const uint8_t *block = bloom_block(set, h);
+	uint64_t bits = bloom_bits(h);
+	unsigned int i;
+
+	for (i = 0; i < ADDRSET_BLOOM_K; i++) {
+		unsigned int bit = bits & 511;
+		if (!(block[bit >> 3] & (1U << (bit & 7))))
+			return false;
+		bits >>= 9;
+	}
+
+	return true;
+}
+
+static void bloom_set(const struct bitc_addrset *set, const uint8_t *h)
+{
+	uint8_t *block = (uint8_t *) bloom_block(set, h);
+	uint64_t bits = bloom_bits(h);
+	unsigned int i;
+
+	for (i = 0; i < ADDRSET_BLOOM_K; i++) {
+		unsigned int bit = bits & 511;
+		block[bit >> 3] |= (1U << (bit & 7));
+		bits >>= 9;
+	}
+}
+
+/* point set at a header-prefixed image, checking it holds together */
+static bool addrset_attach(struct bitc_addrset *set, void *mem, size_t len,
+			   bool mapped)
+{
+	struct addrset_hdr hdr;
+
+	if (len < sizeof(hdr))
+		return false;
+	memcpy(&hdr, mem, sizeof(hdr));
+
+	uint32_t bucket_bits = le32toh(hdr.bucket_bits);
+	uint64_t n = le64toh(hdr.n);
+	uint64_t bloom_blocks = le64toh(hdr.bloom_blocks);
+
+	if (memcmp(hdr.magic, addrset_magic, sizeof(hdr.magic)) ||
+	    (le32toh(hdr.version) != ADDRSET_VERSION) ||
+	    (bucket_bits > ADDRSET_MAX_BUCKET_BITS) ||
+	    (n > UINT32_MAX) ||
+	    (bloom_blocks == 0) ||
+	    (bloom_blocks > (len / ADDRSET_BLOCK_BYTES)))
+		return false;
+
+	size_t n_buckets = ((size_t) 1 << bucket_bits) + 1;
+	size_t bloom_len = bloom_blocks * ADDRSET_BLOCK_BYTES;
+	size_t buckets_len = n_buckets * sizeof(uint32_t);
+	if (len != sizeof(hdr) + bloom_len + buckets_len +
+		   n * ADDRSET_HASH_LEN)
+		return false;
+
+	const uint8_t *p = mem;
+	const uint32_t *buckets = (const uint32_t *) (p + sizeof(hdr) +
+						      bloom_len);
+
+	/* searches stay within the hashes */
+	size_t i;
+	uint32_t last = 0;
+	for (i = 0; i < n_buckets; i++) {
+		uint32_t v = le32toh(buckets[i]);
+		if (v < last || v > n)
+			return false;
+		last = v;
+	}
+	if (le32toh(buckets[0]) != 0 || last != n)
+		return false;
+
+	set->n = n;
+	set->bucket_bits = bucket_bits;
+	set->bloom_blocks = bloom_blocks;
+	set->bloom = p + sizeof(hdr);
+	set->buckets = buckets;
+	set->hashes = p + sizeof(hdr) + bloom_len + buckets_len;
+	set->mem = mem;
+	set->mem_len = len;
+	set->mapped = mapped;
+
+	return true;
+}
+
+static int hash_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, ADDRSET_HASH_LEN);
+}
+
+bool bitc_addrset_build(struct bitc_addrset *set, const void *hashes,
+			size_t n)
+{
+	bitc_addrset_init(set);
+
+	if (n > UINT32_MAX)
+		return false;
+
+	/* sorted, without duplicates */
+	uint8_t *sorted = malloc(n ? n * ADDRSET_HASH_LEN : 1);
+	if (!sorted)
+		return false;
+	if (n)
+		memcpy(sorted, hashes, n * ADDRSET_HASH_LEN);
+	qsort(sorted, n, ADDRSET_HASH_LEN, hash_cmp);
+
+	size_t i, n_uniq = 0;
+	for (i = 0; i < n; i++) {
+		const uint8_t *h = sorted + i * ADDRSET_HASH_LEN;
+		if (n_uniq &&
+		    !memcmp(h, sorted + (n_uniq - 1) * ADDRSET_HASH_LEN,
+			    ADDRSET_HASH_LEN))
+			continue;
+		memmove(sorted + n_uniq * ADDRSET_HASH_LEN, h,
+			ADDRSET_HASH_LEN);
+		n_uniq++;
+	}
+
+	unsigned int bucket_bits = 0;
+	while ((bucket_bits < ADDRSET_MAX_BUCKET_BITS) &&
+	       ((n_uniq >> bucket_bits) > ADDRSET_BUCKET_FILL))
+		bucket_bits++;
+
+	uint64_t bloom_blocks = (n_uniq * ADDRSET_BLOOM_BITS +
+				 ADDRSET_BLOCK_BYTES * 8 - 1) /
+				(ADDRSET_BLOCK_BYTES * 8);
+	if (!bloom_blocks)
+		bloom_blocks = 1;
+
+	size_t n_buckets = ((size_t) 1 << bucket_bits) + 1;
+	size_t bloom_len = bloom_blocks * ADDRSET_BLOCK_BYTES;
+	size_t len = sizeof(struct addrset_hdr) + bloom_len +
+		     n_buckets * sizeof(uint32_t) + n_uniq * ADDRSET_HASH_LEN;
+
+	/* bloom blocks on cache line boundaries, as when mapped */
+	void *mem;
+	if (posix_memalign(&mem, ADDRSET_BLOCK_BYTES, len))
+		goto err_out;
+	memset(mem, 0, len);
+
+	struct addrset_hdr *hdr = mem;
+	memcpy(hdr->magic, addrset_magic, sizeof(hdr->magic));
+	hdr->version = htole32(ADDRSET_VERSION);
+	hdr->bucket_bits = htole32(bucket_bits);
+	hdr->n = htole64(n_uniq);
+	hdr->bloom_blocks = htole64(bloom_blocks);
+
+	uint8_t *p = mem;
+	uint32_t *buckets = (uint32_t *) (p + sizeof(*hdr) + bloom_len);
+	uint8_t *set_hashes = (uint8_t *) (buckets + n_buckets);
+	memcpy(set_hashes, sorted, n_uniq * ADDRSET_HASH_LEN);
+
+	set->bucket_bits = bucket_bits;
+	set->bloom_blocks = bloom_blocks;
+	set->bloom = p + sizeof(*hdr);
+
+	/* buckets[b]: first hash with prefix >= b */
+	size_t b, j = 0;
+	for (b = 0; b < n_buckets; b++) {
+		while ((j < n_uniq) &&
+		       (hash_bucket(set, set_hashes + j * ADDRSET_HASH_LEN) < b))
+			j++;
+		buckets[b] = htole32(j);
+	}
+
+	for (i = 0; i < n_uniq; i++)
+		bloom_set(set, set_hashes + i * ADDRSET_HASH_LEN);
+
+	free(sorted);
+
+	if (!addrset_attach(set, mem, len, false)) {
+		free(mem);
+		bitc_addrset_init(set);
+		return false;
+	}
+
+	return true;
+
+err_out:
+	free(sorted);
+	bitc_addrset_init(set);
+	return false;
+}
+
+bool bitc_addrset_write(const struct bitc_addrset *set, const char *filename)
+{
+	if (!set->mem)
+		return false;
+
+	return bu_write_file(filename, set->mem, set->mem_len);
+}
+
+bool bitc_addrset_open(struct bitc_addrset *set, const char *filename)
+{
+	bitc_addrset_init(set);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < (off_t) sizeof(struct addrset_hdr)) ||
+	    ((uint64_t) st.st_size > SIZE_MAX))
+		goto err_out;
+
+	size_t len = st.st_size;
+	void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto err_out;
+	close(fd);
+
+	if (!addrset_attach(set, p, len, true)) {
+		munmap(p, len);
+		bitc_addrset_init(set);
+		return false;
+	}
+
+	return true;
+
+err_out:
+	close(fd);
+	return false;
+}
+
+bool bitc_addrset_lookup(const struct bitc_addrset *set, const void *hash)
+{
+	const uint8_t *h = hash;
+
+	if (!set->n || !bloom_check(set, h))
+		return false;
+
+	uint32_t bucket = hash_bucket(set, h);
+	size_t lo = le32toh(set->buckets[bucket]);
+	size_t hi = le32toh(set->buckets[bucket + 1]);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(h, set->hashes + mid * ADDRSET_HASH_LEN,
+				 ADDRSET_HASH_LEN);
+		if (cmp == 0)
+			return true;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return false;
+}
+
+void bitc_addrset_free(struct bitc_addrset *set)
+{
+	if (set->mapped)
+		munmap(set->mem, set->mem_len);
+	else
+		free(set->mem);
+
+	bitc_addrset_init(set);
+}
@@ -5,145 +5,405 @@
 #include "libbitc-config.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
-#include <gmp.h>
+#include <bitc/base58.h>
 #include <bitc/util.h>
 #include <bitc/cstr.h>
 
+/*
+ * Numbers are held in 32-bit limbs, on the stack.  Encoding divides
+ * by 58^5, for five digits per pass over the limbs; decoding multiplies
+ * in five digits at a time.
+ */
+
+enum {
+	B58_POW5	= 656356768,	/* 58^5 */
+	B58_LIMBS	= BASE58_MAX_DATA / 4,
+	B58_DIGITS	= BASE58_ENCODE_SIZE(BASE58_MAX_DATA) + 4,
+	B58_LANES	= 4,		/* batch payloads encoded at once */
+};
+
 static const char base58_chars[] =
 	"123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
-cstring *base58_encode(const void *data_, size_t data_len)
+static const int8_t base58_map[128] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8, -1, -1, -1, -1, -1, -1,
+	-1,  9, 10, 11, 12, 13, 14, 15, 16, -1, 17, 18, 19, 20, 21, -1,
+	22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, -1, -1, -1, -1, -1,
+	-1, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, -1, 44, 45, 46,
+	47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, -1, -1, -1, -1, -1,
+};
+
+static int base58_digit(char c)
 {
-	const unsigned char *data = data_;
-	mpz_t bn;
-
-	mpz_init(bn);
+	unsigned char uc = c;
 
-	mpz_import(bn, data_len, 1, 1, 1, 0, data);
+	return (uc < 128) ? base58_map[uc] : -1;
+}
 
-	cstring *rs = cstr_new_sz(data_len * 138 / 100 + 1);
+/* big-endian limbs, most significant first */
+static void b58_load(uint32_t *num, const unsigned char *data, size_t len)
+{
+	unsigned int n = (len + 3) / 4, i;
+	size_t j = 0;
 
-	while (mpz_sgn(bn) > 0) {
-		unsigned int c = mpz_tdiv_q_ui(bn, bn, 58);
+	for (i = 0; i < n; i++) {
+		uint32_t v = 0;
+		size_t end = len - (n - 1 - i) * 4;
 
-		cstr_append_c(rs, base58_chars[c]);
+		for (; j < end; j++)
+			v = (v << 8) | data[j];
+		num[i] = v;
 	}
+}
 
-	unsigned int i;
-	for (i = 0; i < data_len; i++) {
-		if (data[i] == 0)
-			cstr_append_c(rs, base58_chars[0]);
-		else
-			break;
+/*
+ * The digits of lanes payloads of len bytes each, divided in lockstep,
+ * written to the end of their digits[] row; where they start is
+ * returned.  Shorter numbers get leading zero digits ('1').
+ */
+static size_t b58_digits(char digits[][B58_DIGITS],
+			 const unsigned char *data, size_t len,
+			 unsigned int lanes)
+{
+	uint32_t num[B58_LANES][B58_LIMBS];
+	unsigned int n = (len + 3) / 4, top = 0, i, l;
+	size_t pos = B58_DIGITS;
+	int j;
+
+	for (l = 0; l < lanes; l++)
+		b58_load(num[l], data + l * len, len);
+
+	while (top < n) {
+		uint64_t rem[B58_LANES] = { 0 };
+		bool done = true;
+
+		for (i = top; i < n; i++)
+			for (l = 0; l < lanes; l++) {
+				uint64_t cur = (rem[l] << 32) | num[l][i];
+				num[l][i] = cur / B58_POW5;
+				rem[l] = cur % B58_POW5;
+			}
+
+		for (l = 0; l < lanes; l++)
+			if (num[l][top])
+				done = false;
+		if (done)
+			top++;
+
+		pos -= 5;
+		for (l = 0; l < lanes; l++)
+			for (j = 4; j >= 0; j--) {
+				digits[l][pos + j] = base58_chars[rem[l] % 58];
+				rem[l] /= 58;
+			}
 	}
 
-	cstring *rs_swap = cstr_new_sz(rs->len);
-	cstr_resize(rs_swap, rs->len);
-	bu_reverse_copy((unsigned char *) rs_swap->str,
-		     (unsigned char *) rs->str, rs->len);
+	return pos;
+}
+
+/* one per leading zero byte, then the digits without leading zeros */
+static bool b58_emit(char *out, size_t out_sz,
+		     const unsigned char *data, size_t len,
+		     const char *p, const char *end)
+{
+	size_t zeros = 0, n;
 
-	cstr_free(rs, true);
-	rs = rs_swap;
+	while (zeros < len && data[zeros] == 0)
+		zeros++;
+	while (p < end && *p == base58_chars[0])
+		p++;
 
-	mpz_clear(bn);
+	n = end - p;
+	if (zeros + n >= out_sz)
+		return false;
 
-	return rs;
+	memset(out, base58_chars[0], zeros);
+	memcpy(out + zeros, p, n);
+	out[zeros + n] = 0;
+	return true;
 }
 
-cstring *base58_encode_check(unsigned char addrtype, bool have_addrtype,
+static bool b58_encode_lanes(char *out, size_t out_stride,
+			     const unsigned char *data, size_t len,
+			     unsigned int lanes)
+{
+	char digits[B58_LANES][B58_DIGITS];
+	size_t pos = b58_digits(digits, data, len, lanes);
+	unsigned int l;
+
+	for (l = 0; l < lanes; l++)
+		if (!b58_emit(out + l * out_stride, out_stride,
+			      data + l * len, len,
+			      &digits[l][pos], &digits[l][B58_DIGITS]))
+			return false;
+
+	return true;
+}
+
+bool base58_encode_buf(char *out, size_t out_sz,
+		       const void *data, size_t data_len)
+{
+	if (data_len > BASE58_MAX_DATA)
+		return false;
+
+	return b58_encode_lanes(out, out_sz, data, data_len, 1);
+}
+
+/* data, then the first four bytes of its double-SHA256 */
+static void b58_add_check(unsigned char *p, size_t len)
+{
+	bu_Hash4(p + len, p, len);
+}
+
+bool base58_encode_check_buf(char *out, size_t out_sz,
+			     unsigned char addrtype, bool have_addrtype,
 			     const void *data, size_t data_len)
 {
-	cstring *s = cstr_new_sz(data_len + 1 + 4);
+	unsigned char buf[BASE58_MAX_DATA];
+	size_t len = 0;
+
+	if (data_len + 1 + 4 > BASE58_MAX_DATA)
+		return false;
 
 	if (have_addrtype)
-		cstr_append_c(s, addrtype);
-	cstr_append_buf(s, data, data_len);
+		buf[len++] = addrtype;
+	memcpy(buf + len, data, data_len);
+	len += data_len;
 
-	unsigned char md32[4];
-	bu_Hash4(md32, s->str, s->len);
+	b58_add_check(buf, len);
 
-	cstr_append_buf(s, md32, 4);
+	return base58_encode_buf(out, out_sz, buf, len + 4);
+}
 
-	cstring *s_enc = base58_encode(s->str, s->len);
+bool base58_decode_buf(void *out, size_t out_sz, size_t *out_len,
+		       const char *s_in)
+{
+	uint32_t num[B58_LIMBS];	/* least significant first */
+	unsigned int n = 0, i;
+	size_t zeros = 0, n_bytes;
+	const char *p = s_in;
+
+	while (isspace((unsigned char) *p))
+		p++;
+	for (; *p == base58_chars[0]; p++)
+		zeros++;
+
+	for (;;) {
+		uint32_t val = 0, mul = 1;
+		int k, d;
+
+		for (k = 0; k < 5 && (d = base58_digit(*p)) >= 0; k++, p++) {
+			val = val * 58 + d;
+			mul *= 58;
+		}
+		if (k == 0)
+			break;
 
-	cstr_free(s, true);
+		uint64_t carry = val;
+		for (i = 0; i < n; i++) {
+			carry += (uint64_t) num[i] * mul;
+			num[i] = (uint32_t) carry;
+			carry >>= 32;
+		}
+		if (carry) {
+			if (n == B58_LIMBS)
+				return false;
+			num[n++] = (uint32_t) carry;
+		}
 
-	return s_enc;
+		if (k < 5)
+			break;
+	}
+
+	while (isspace((unsigned char) *p))
+		p++;
+	if (*p != '\0')
+		return false;
+
+	n_bytes = n * 4;
+	if (n > 0)
+		for (i = 24; i > 0 && !(num[n - 1] >> i); i -= 8)
+			n_bytes--;
+
+	if (zeros + n_bytes > out_sz)
+		return false;
+
+	unsigned char *o = out;
+	memset(o, 0, zeros);
+	o += zeros;
+	for (i = 0; i < n_bytes; i++) {
+		size_t bit = (n_bytes - 1 - i) * 8;
+		o[i] = num[bit / 32] >> (bit % 32);
+	}
+
+	*out_len = zeros + n_bytes;
+	return true;
 }
 
-cstring *base58_decode(const char *s_in)
+bool base58_decode_check_buf(unsigned char *addrtype,
+			     void *out, size_t out_sz, size_t *out_len,
+			     const char *s_in)
 {
-	mpz_t bn;
-	cstring *ret = NULL;
+	unsigned char buf[BASE58_MAX_DATA], md32[4];
+	size_t len;
 
-	mpz_init(bn);
+	/* decode base58 string */
+	if (!base58_decode_buf(buf, sizeof(buf), &len, s_in) || (len < 4))
+		return false;
 
-	while (isspace(*s_in))
-		s_in++;
+	/* validate with trailing hash, then remove hash */
+	len -= 4;
+	bu_Hash4(md32, buf, len);
+	if (memcmp(md32, buf + len, 4))
+		return false;
 
-	const char *p;
-	for (p = s_in; *p; p++) {
-		const char *p1 = strchr(base58_chars, *p);
-		if (!p1) {
-			while (isspace(*p))
-				p++;
-			if (*p != '\0')
-				goto out;
-			break;
-		}
-		mpz_mul_ui(bn, bn, 58);
-		mpz_add_ui(bn, bn, p1 - base58_chars);
+	/* if addrtype requested, remove from front of data string */
+	const unsigned char *p = buf;
+	if (addrtype) {
+		if (len == 0)
+			return false;
+		*addrtype = *p++;
+		len--;
 	}
 
-	size_t buf_sz;
-	char *buf = mpz_export(NULL, &buf_sz, 1, 1, 1, 0, bn);
-	cstring *tmp = cstr_new_buf(buf,buf_sz);
-	free(buf);
+	if (len > out_sz)
+		return false;
 
-	if ((tmp->len >= 2) &&
-	    (tmp->str[tmp->len - 1] == 0) &&
-	    ((unsigned char)tmp->str[tmp->len - 2] >= 0x80))
-		cstr_resize(tmp, tmp->len - 1);
+	memcpy(out, p, len);
+	*out_len = len;
+	return true;
+}
 
-	for (p = s_in; *p == base58_chars[0]; p++)
-		cstr_prepend_c(tmp, '\0');
+cstring *base58_encode(const void *data_, size_t data_len)
+{
+	char s[BASE58_ENCODE_SIZE(BASE58_MAX_DATA)];
+
+	if (!base58_encode_buf(s, sizeof(s), data_, data_len))
+		return NULL;
+
+	return cstr_new(s);
+}
 
-	ret = tmp;
+cstring *base58_encode_check(unsigned char addrtype, bool have_addrtype,
+			     const void *data, size_t data_len)
+{
+	char s[BASE58_ENCODE_SIZE(BASE58_MAX_DATA)];
 
-out:
-	mpz_clear(bn);
-	return ret;
+	if (!base58_encode_check_buf(s, sizeof(s), addrtype, have_addrtype,
+				     data, data_len))
+		return NULL;
+
+	return cstr_new(s);
+}
+
+cstring *base58_decode(const char *s_in)
+{
+	unsigned char buf[BASE58_MAX_DATA];
+	size_t len;
+
+	if (!base58_decode_buf(buf, sizeof(buf), &len, s_in))
+		return NULL;
+
+	return cstr_new_buf(buf, len);
 }
 
 cstring *base58_decode_check(unsigned char *addrtype, const char *s_in)
 {
-	/* decode base58 string */
-	cstring *s = base58_decode(s_in);
-	if (!s)
+	unsigned char buf[BASE58_MAX_DATA];
+	size_t len;
+
+	if (!base58_decode_check_buf(addrtype, buf, sizeof(buf), &len, s_in))
 		return NULL;
-	if (s->len < 4)
-		goto err_out;
 
-	/* validate with trailing hash, then remove hash */
-	unsigned char md32[4];
-	bu_Hash4(md32, s->str, s->len - 4);
+	return cstr_new_buf(buf, len);
+}
+
+bool base58_encode_batch(char *out, size_t out_stride,
+			 const void *data, size_t data_len, size_t n)
+{
+	const unsigned char *p = data;
 
-	if (memcmp(md32, &s->str[s->len - 4], 4))
-		goto err_out;
+	if (data_len > BASE58_MAX_DATA)
+		return false;
 
-	cstr_resize(s, s->len - 4);
+	while (n > 0) {
+		unsigned int lanes = MIN(n, B58_LANES);
 
-	/* if addrtype requested, remove from front of data string */
-	if (addrtype) {
-		*addrtype = (unsigned char) s->str[0];
-		cstr_erase(s, 0, 1);
+		if (!b58_encode_lanes(out, out_stride, p, data_len, lanes))
+			return false;
+
+		out += lanes * out_stride;
+		p += lanes * data_len;
+		n -= lanes;
 	}
 
-	return s;
+	return true;
+}
+
+bool base58_encode_check_batch(char *out, size_t out_stride,
+			       const void *data, size_t data_len, size_t n)
+{
+	unsigned char buf[B58_LANES * BASE58_MAX_DATA];
+	const unsigned char *p = data;
+	size_t len = data_len + 4;
+	unsigned int l;
+
+	if (len > BASE58_MAX_DATA)
+		return false;
+
+	while (n > 0) {
+		unsigned int lanes = MIN(n, B58_LANES);
+
+		for (l = 0; l < lanes; l++) {
+			memcpy(buf + l * len, p + l * data_len, data_len);
+			b58_add_check(buf + l * len, data_len);
+		}
+
+		if (!b58_encode_lanes(out, out_stride, buf, len, lanes))
+			return false;
 
-err_out:
-	cstr_free(s, true);
-	return NULL;
+		out += lanes * out_stride;
+		p += lanes * data_len;
+		n -= lanes;
+	}
+
+	return true;
 }
 
+size_t base58_decode_batch(void *out, size_t data_len,
+			   const char *const *s_in, size_t n, bool *ok)
+{
+	unsigned char *o = out;
+	size_t i, len, n_ok = 0;
+
+	for (i = 0; i < n; i++, o += data_len) {
+		ok[i] = base58_decode_buf(o, data_len, &len, s_in[i]) &&
+			(len == data_len);
+		if (ok[i])
+			n_ok++;
+	}
+
+	return n_ok;
+}
+
+size_t base58_decode_check_batch(void *out, size_t data_len,
+				 const char *const *s_in, size_t n, bool *ok)
+{
+	unsigned char *o = out;
+	size_t i, len, n_ok = 0;
+
+	for (i = 0; i < n; i++, o += data_len) {
+		ok[i] = base58_decode_check_buf(NULL, o, data_len, &len,
+						s_in[i]) &&
+			(len == data_len);
+		if (ok[i])
+			n_ok++;
+	}
+
+	return n_ok;
+}
@@ -7,9 +7,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <bitc/mbr.h>
 #include <bitc/message.h>
 #include <bitc/endian.h>
+#include <bitc/util.h>
+
+enum {
+	BLKFILE_MAX_BLOCK	= 100 * 1024 * 1024,
+	BLKFILE_AHEAD		= 16 * 1024 * 1024,	/* read-ahead window */
+	BLKFILE_DROP		= 64 * 1024 * 1024,	/* release in chunks */
+};
 
 
 bool fread_block(int fd, struct p2p_message *msg, bool *read_ok)
@@ -38,7 +48,7 @@ bool fread_block(int fd, struct p2p_message *msg, bool *read_ok)
 	memset(&msg->hdr.hash, 0, sizeof(msg->hdr.hash));
 
 	unsigned int data_len = msg->hdr.data_len;
-	if (data_len > (100 * 1024 * 1024))
+	if (data_len > BLKFILE_MAX_BLOCK)
 		return false;
 
 	/* read block data */
@@ -58,3 +68,133 @@ err_out_data:
 	return false;
 }
 
+
+bool blkfile_open(struct blkfile *bf, const char *filename)
+{
+	memset(bf, 0, sizeof(*bf));
+
+	bf->fd = file_seq_open(filename);
+	if (bf->fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(bf->fd, &st) < 0)
+		goto err_out;
+
+	if ((uint64_t) st.st_size > SIZE_MAX)
+		goto err_out;
+	bf->len = st.st_size;
+
+	/* nothing to map */
+	if (bf->len == 0)
+		return true;
+
+	void *p = mmap(NULL, bf->len, PROT_READ, MAP_SHARED, bf->fd, 0);
+	if (p == MAP_FAILED)
+		goto err_out;
+	bf->base = p;
+
+#ifdef MADV_SEQUENTIAL
+	madvise(p, bf->len, MADV_SEQUENTIAL);
+#endif
+
+	return true;
+
+err_out:
+	close(bf->fd);
+	bf->fd = -1;
+	return false;
+}
+
+void blkfile_close(struct blkfile *bf)
+{
+	if (bf->base)
+		munmap((void *) bf->base, bf->len);
+	if (bf->fd >= 0)
+		close(bf->fd);
+
+	memset(bf, 0, sizeof(*bf));
+	bf->fd = -1;
+}
+
+bool blkfile_at(const struct blkfile *bf, uint64_t fpos,
+		struct const_buffer *block)
+{
+	struct p2p_blockfile_hdr hdr;
+
+	if ((fpos > bf->len) || (bf->len - fpos < sizeof(hdr)))
+		return false;
+
+	memcpy(&hdr, bf->base + fpos, sizeof(hdr));
+
+	uint32_t data_len = le32toh(hdr.data_len);
+	if ((data_len > BLKFILE_MAX_BLOCK) ||
+	    (bf->len - fpos - sizeof(hdr) < data_len))
+		return false;
+
+	block->p = bf->base + fpos + sizeof(hdr);
+	block->len = data_len;
+
+	return true;
+}
+
+void blkfile_advise_random(struct blkfile *bf, bool random)
+{
+	if (!bf->base)
+		return;
+
+#if defined(MADV_RANDOM) && defined(MADV_NORMAL)
+	madvise((void *) bf->base, bf->len, random ? MADV_RANDOM : MADV_NORMAL);
+#endif
+}
+
+/* keep the kernel reading ahead of pos, and forget what is behind it */
+static void blkfile_advise(struct blkfile *bf)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+#ifdef MADV_WILLNEED
+	if (bf->pos + BLKFILE_AHEAD / 2 > bf->ahead) {
+		size_t start = bf->ahead & ~(page - 1);
+		size_t end = MIN(bf->pos + BLKFILE_AHEAD, bf->len);
+
+		if (end > start)
+			madvise((void *) (bf->base + start), end - start,
+				MADV_WILLNEED);
+		bf->ahead = end;
+	}
+#endif
+
+#ifdef MADV_DONTNEED
+	size_t done = bf->pos & ~(page - 1);
+	if (done - bf->dropped >= BLKFILE_DROP) {
+		madvise((void *) (bf->base + bf->dropped), done - bf->dropped,
+			MADV_DONTNEED);
+		bf->dropped = done;
+	}
+#endif
+}
+
+/*
+ * Next block, and the file offset of its record.  Returns false at
+ * end of file, or on a malformed record, which sets bf->error.
+ */
+bool blkfile_next(struct blkfile *bf, struct const_buffer *block,
+		  uint64_t *fpos)
+{
+	if (bf->pos == bf->len)
+		return false;
+
+	if (!blkfile_at(bf, bf->pos, block)) {
+		bf->error = true;
+		return false;
+	}
+
+	if (fpos)
+		*fpos = bf->pos;
+
+	bf->pos += sizeof(struct p2p_blockfile_hdr) + block->len;
+	blkfile_advise(bf);
+
+	return true;
+}
@@ -0,0 +1,336 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/cmpctblock.h>            // for cmpct_partial, etc
+#include <bitc/crypto/sha2.h>           // for sha256_Raw, etc
+#include <bitc/crypto/siphash.h>        // for siphash24_u256, etc
+#include <bitc/cstr.h>                  // for cstring, cstr_free
+#include <bitc/mempool.h>               // for bitc_mempool_txids, etc
+#include <bitc/parr.h>                  // for parr, parr_idx, etc
+#include <bitc/serialize.h>             // for ser_u64
+
+#include <stdlib.h>                     // for calloc, free, qsort, etc
+#include <string.h>                     // for memset
+
+static inline uint64_t le64_from_bytes(const unsigned char *p)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		v |= ((uint64_t) p[i]) << (i * 8);
+
+	return v;
+}
+
+void cmpct_keys_init(struct cmpct_keys *keys, const struct bitc_block *hdr,
+		     uint64_t nonce)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	cstring *s = cstr_new_sz(80 + 8);
+	ser_bitc_block_hdr(s, hdr);
+	ser_u64(s, nonce);
+
+	sha256_Raw(s->str, s->len, md);
+
+	cstr_free(s, true);
+
+	keys->k0 = le64_from_bytes(&md[0]);
+	keys->k1 = le64_from_bytes(&md[8]);
+}
+
+uint64_t cmpct_short_id(const struct cmpct_keys *keys, const bu256_t *txid)
+{
+	return siphash24_u256(keys->k0, keys->k1, txid) & CMPCT_SHORTID_MASK;
+}
+
+void cmpct_short_ids(const struct cmpct_keys *keys, const bu256_t *txids,
+		     size_t n, uint64_t *out)
+{
+	size_t i;
+
+	siphash24_u256_batch(keys->k0, keys->k1, txids, n, out);
+
+	for (i = 0; i < n; i++)
+		out[i] &= CMPCT_SHORTID_MASK;
+}
+
+/* build a compact block, prefilling only the coinbase */
+void cmpct_block_build(struct msg_cmpctblock *mcb, struct bitc_block *block,
+		       uint64_t nonce)
+{
+	struct cmpct_keys keys;
+	unsigned int i, n_tx = block->vtx ? block->vtx->len : 0;
+
+	msg_cmpctblock_free(mcb);
+	msg_cmpctblock_init(mcb);
+
+	bitc_block_copy_hdr(&mcb->hdr, block);
+	mcb->nonce = nonce;
+	mcb->prefilled = parr_new(1, bitc_prefilled_tx_freep);
+
+	if (!n_tx)
+		return;
+
+	struct bitc_prefilled_tx *ptx = calloc(1, sizeof(*ptx));
+	bitc_tx_init(&ptx->tx);
+	bitc_tx_copy(&ptx->tx, parr_idx(block->vtx, 0));
+	ptx->index = 0;
+	parr_add(mcb->prefilled, ptx);
+
+	mcb->n_short_ids = n_tx - 1;
+	mcb->short_ids = calloc(n_tx, sizeof(uint64_t));
+
+	bu256_t *txids = calloc(n_tx, sizeof(bu256_t));
+	for (i = 1; i < n_tx; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+
+		bitc_tx_calc_sha256(tx);
+		bu256_copy(&txids[i - 1], &tx->sha256);
+	}
+
+	cmpct_keys_init(&keys, &mcb->hdr, nonce);
+	cmpct_short_ids(&keys, txids, mcb->n_short_ids, mcb->short_ids);
+
+	free(txids);
+}
+
+struct cmpct_slot {
+	uint64_t	short_id;
+	uint32_t	idx;		/* block position */
+	uint32_t	n_match;	/* cache hits */
+};
+
+static int cmpct_slot_cmp(const void *a_, const void *b_)
+{
+	const struct cmpct_slot *a = a_;
+	const struct cmpct_slot *b = b_;
+
+	if (a->short_id < b->short_id)
+		return -1;
+	if (a->short_id > b->short_id)
+		return 1;
+	return 0;
+}
+
+static struct bitc_tx *cmpct_tx_dup(const struct bitc_tx *src)
+{
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+
+	bitc_tx_init(tx);
+	bitc_tx_copy(tx, src);
+
+	return tx;
+}
+
+/*
+ * Returns false if the compact block is malformed or its short IDs
+ * collide, in which case the caller should fetch the full block.
+ */
+bool cmpct_partial_init(struct cmpct_partial *pb, struct msg_cmpctblock *mcb,
+			struct bitc_txcache *tc, const struct bitc_mempool *mp)
+{
+	struct cmpct_slot *slots = NULL;
+	struct bitc_tx **txs = NULL;
+	bu256_t *txids = NULL;
+	uint64_t *ids = NULL;
+	unsigned int i, n_prefilled;
+
+	memset(pb, 0, sizeof(*pb));
+
+	n_prefilled = mcb->prefilled ? mcb->prefilled->len : 0;
+	pb->n_tx = mcb->n_short_ids + n_prefilled;
+	if (!pb->n_tx || (pb->n_tx > CMPCT_MAX_TXS))
+		return false;
+
+	bitc_block_copy_hdr(&pb->hdr, &mcb->hdr);
+	bitc_block_calc_sha256(&pb->hdr);
+	bu256_copy(&pb->hash, &pb->hdr.sha256);
+
+	pb->vtx = calloc(pb->n_tx, sizeof(struct bitc_tx *));
+	if (!pb->vtx)
+		return false;
+
+	/* take ownership of prefilled transactions */
+	for (i = 0; i < n_prefilled; i++) {
+		struct bitc_prefilled_tx *ptx = parr_idx(mcb->prefilled, i);
+
+		if ((ptx->index >= pb->n_tx) || pb->vtx[ptx->index])
+			goto err_out;
+
+		struct bitc_tx *tx = malloc(sizeof(*tx));
+		memcpy(tx, &ptx->tx, sizeof(*tx));
+		bitc_tx_init(&ptx->tx);
+
+		pb->vtx[ptx->index] = tx;
+	}
+	pb->n_prefilled = n_prefilled;
+
+	/* short IDs fill the remaining slots, in order */
+	slots = calloc(mcb->n_short_ids ? mcb->n_short_ids : 1,
+		       sizeof(struct cmpct_slot));
+	unsigned int j = 0;
+	for (i = 0; i < pb->n_tx; i++) {
+		if (pb->vtx[i])
+			continue;
+		if (j == mcb->n_short_ids)
+			goto err_out;
+
+		slots[j].short_id = mcb->short_ids[j];
+		slots[j].idx = i;
+		j++;
+	}
+
+	qsort(slots, mcb->n_short_ids, sizeof(struct cmpct_slot),
+	      cmpct_slot_cmp);
+
+	for (i = 1; i < mcb->n_short_ids; i++)
+		if (slots[i].short_id == slots[i - 1].short_id)
+			goto err_out;
+
+	/* hash every cached and pooled txid, then match against the block */
+	size_t n_cache = tc ? bitc_txcache_size(tc) : 0;
+	size_t n_pool = mp ? bitc_mempool_size(mp) : 0;
+	size_t n_cand = n_cache + n_pool;
+	if (n_cand && mcb->n_short_ids) {
+		struct cmpct_keys keys;
+
+		txids = calloc(n_cand, sizeof(bu256_t));
+		txs = calloc(n_cand, sizeof(struct bitc_tx *));
+		ids = calloc(n_cand, sizeof(uint64_t));
+		if (!txids || !txs || !ids)
+			goto err_out;
+
+		size_t k;
+		if (n_cache) {
+			bitc_txcache_txids(tc, txids);
+			for (k = 0; k < n_cache; k++)
+				txs[k] = bitc_txcache_idx(tc, k);
+		}
+		if (n_pool)
+			bitc_mempool_txids(mp, &txids[n_cache], &txs[n_cache]);
+
+		cmpct_keys_init(&keys, &pb->hdr, mcb->nonce);
+		cmpct_short_ids(&keys, txids, n_cand, ids);
+
+		for (k = 0; k < n_cand; k++) {
+			struct cmpct_slot key = { ids[k], };
+			struct cmpct_slot *slot;
+
+			slot = bsearch(&key, slots, mcb->n_short_ids,
+				       sizeof(struct cmpct_slot),
+				       cmpct_slot_cmp);
+			if (!slot)
+				continue;
+
+			/* the same tx may be both cached and pooled */
+			struct bitc_tx *cur = pb->vtx[slot->idx];
+			if (cur && bu256_equal(&cur->sha256, &txids[k]))
+				continue;
+
+			/* two distinct txs share a short ID; ask the peer */
+			if (++slot->n_match > 1) {
+				if (cur) {
+					bitc_tx_freep(cur);
+					pb->vtx[slot->idx] = NULL;
+					pb->n_cached--;
+				}
+				continue;
+			}
+
+			pb->vtx[slot->idx] = cmpct_tx_dup(txs[k]);
+			pb->n_cached++;
+		}
+	}
+
+	pb->n_missing = mcb->n_short_ids - pb->n_cached;
+
+	free(slots);
+	free(txids);
+	free(txs);
+	free(ids);
+	return true;
+
+err_out:
+	free(slots);
+	free(txids);
+	free(txs);
+	free(ids);
+	cmpct_partial_free(pb);
+	return false;
+}
+
+void cmpct_partial_missing(const struct cmpct_partial *pb,
+			   struct msg_getblocktxn *mgt)
+{
+	msg_getblocktxn_free(mgt);
+	msg_getblocktxn_init(mgt);
+
+	bu256_copy(&mgt->blockhash, &pb->hash);
+
+	mgt->indexes = calloc(pb->n_missing ? pb->n_missing : 1,
+			      sizeof(uint32_t));
+
+	unsigned int i;
+	for (i = 0; i < pb->n_tx; i++)
+		if (!pb->vtx[i])
+			mgt->indexes[mgt->n_indexes++] = i;
+}
+
+/* fill missing slots, in order, from a "blocktxn" response */
+bool cmpct_partial_fill(struct cmpct_partial *pb, struct msg_blocktxn *mbt)
+{
+	if (!bu256_equal(&mbt->blockhash, &pb->hash))
+		return false;
+	if (!mbt->txs || (mbt->txs->len != pb->n_missing))
+		return false;
+
+	unsigned int i, j = 0;
+	for (i = 0; i < pb->n_tx; i++) {
+		if (pb->vtx[i])
+			continue;
+
+		pb->vtx[i] = parr_idx(mbt->txs, j);
+		parr_idx(mbt->txs, j) = NULL;
+		j++;
+	}
+
+	pb->n_missing = 0;
+
+	return true;
+}
+
+/* move a complete block's transactions into block */
+void cmpct_partial_block(struct cmpct_partial *pb, struct bitc_block *block)
+{
+	bitc_block_free(block);
+	bitc_block_copy_hdr(block, &pb->hdr);
+
+	block->vtx = parr_new(pb->n_tx, bitc_tx_freep);
+
+	unsigned int i;
+	for (i = 0; i < pb->n_tx; i++) {
+		parr_add(block->vtx, pb->vtx[i]);
+		pb->vtx[i] = NULL;
+	}
+}
+
+void cmpct_partial_free(struct cmpct_partial *pb)
+{
+	if (!pb)
+		return;
+
+	if (pb->vtx) {
+		unsigned int i;
+		for (i = 0; i < pb->n_tx; i++)
+			bitc_tx_freep(pb->vtx[i]);
+
+		free(pb->vtx);
+	}
+
+	memset(pb, 0, sizeof(*pb));
+}
@@ -526,16 +526,22 @@ void bitc_block_init(struct bitc_block *block)
 	memset(block, 0, sizeof(*block));
 }
 
-bool deser_bitc_block(struct bitc_block *block, struct const_buffer *buf)
+bool deser_bitc_block_hdr(struct bitc_block *block, struct const_buffer *buf)
 {
-	bitc_block_free(block);
-
 	if (!deser_u32(&block->nVersion, buf)) return false;
 	if (!deser_u256(&block->hashPrevBlock, buf)) return false;
 	if (!deser_u256(&block->hashMerkleRoot, buf)) return false;
 	if (!deser_u32(&block->nTime, buf)) return false;
 	if (!deser_u32(&block->nBits, buf)) return false;
 	if (!deser_u32(&block->nNonce, buf)) return false;
+	return true;
+}
+
+bool deser_bitc_block(struct bitc_block *block, struct const_buffer *buf)
+{
+	bitc_block_free(block);
+
+	if (!deser_bitc_block_hdr(block, buf)) return false;
 
 	/* permit header-only blocks */
 	if (buf->len == 0)
@@ -567,7 +573,7 @@ err_out:
 	return false;
 }
 
-static void ser_bitc_block_hdr(cstring *s, const struct bitc_block *block)
+void ser_bitc_block_hdr(cstring *s, const struct bitc_block *block)
 {
 	ser_u32(s, block->nVersion);
 	ser_u256(s, &block->hashPrevBlock);
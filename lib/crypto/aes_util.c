@@ -5,10 +5,97 @@
 
 #include <bitc/crypto/aes_util.h>
 #include <bitc/crypto/ctaes.h>          // for AES256_ctx, AES256_encrypt, etc
+#include <bitc/crypto/aesni.h>          // for AESNI256_ctx, aesni_available
 #include <bitc/crypto/sha2.h>           // for sha512_Update, sha512_Final, etc
 #include <bitc/util.h>                  // for bu_read_file, bu_write_file
 
-#include <stdlib.h>                     // for free
+#include <stdlib.h>                     // for free, malloc
+
+
+/* resolved on first use, unless set */
+static enum aes_impl aes_impl = AES_IMPL_AUTO;
+
+bool aes_set_impl(enum aes_impl impl)
+{
+    if (impl == AES_IMPL_AESNI && !aesni_available())
+        return false;
+
+    aes_impl = impl;
+    return true;
+}
+
+enum aes_impl aes_get_impl(void)
+{
+    if (aes_impl == AES_IMPL_AUTO)
+        aes_impl = aesni_available() ? AES_IMPL_AESNI : AES_IMPL_CTAES;
+
+    return aes_impl;
+}
+
+void aes256_init(struct aes256_ctx *ctx, const unsigned char *key32)
+{
+    ctx->aesni = (aes_get_impl() == AES_IMPL_AESNI);
+    if (ctx->aesni)
+        AESNI256_init(&ctx->u.aesni, key32);
+    else
+        AES256_init(&ctx->u.ctaes, key32);
+}
+
+void aes256_encrypt(const struct aes256_ctx *ctx, size_t blocks,
+                    unsigned char *out, const unsigned char *in)
+{
+    if (ctx->aesni)
+        AESNI256_encrypt(&ctx->u.aesni, blocks, out, in);
+    else
+        AES256_encrypt(&ctx->u.ctaes, blocks, out, in);
+}
+
+void aes256_decrypt(const struct aes256_ctx *ctx, size_t blocks,
+                    unsigned char *out, const unsigned char *in)
+{
+    if (ctx->aesni)
+        AESNI256_decrypt(&ctx->u.aesni, blocks, out, in);
+    else
+        AES256_decrypt(&ctx->u.ctaes, blocks, out, in);
+}
+
+// CTR mode, with iv as the initial big-endian counter block: keystream
+// is made a few blocks at a time, so AES-NI can work on them together
+void aes256_ctr(const struct aes256_ctx *ctx, const unsigned char *iv,
+                unsigned char *data, size_t len)
+{
+    unsigned char ctr[8 * AES256_BLOCK_LENGTH];
+    unsigned char ks[8 * AES256_BLOCK_LENGTH];
+    unsigned char next[AES256_BLOCK_LENGTH];
+    size_t off, i;
+    int k;
+
+    MEMCPY_BCOPY(next, iv, AES256_BLOCK_LENGTH);
+
+    for (off = 0; off < len; off += sizeof(ks)) {
+        size_t n = len - off < sizeof(ks) ? len - off : sizeof(ks);
+        size_t blocks = (n + AES256_BLOCK_LENGTH - 1) / AES256_BLOCK_LENGTH;
+
+        for (i = 0; i < blocks; i++) {
+            MEMCPY_BCOPY(ctr + i * AES256_BLOCK_LENGTH, next,
+                         AES256_BLOCK_LENGTH);
+            for (k = AES256_BLOCK_LENGTH - 1; k >= 0; k--)
+                if (++next[k])
+                    break;
+        }
+
+        aes256_encrypt(ctx, blocks, ks, ctr);
+        for (i = 0; i < n; i++)
+            data[off + i] ^= ks[i];
+    }
+
+    MEMSET_BZERO(ks, sizeof(ks));
+}
+
+void aes256_free(struct aes256_ctx *ctx)
+{
+    MEMSET_BZERO(ctx, sizeof(*ctx));
+}
 
 
 int BytesToKeySHA512AES(unsigned char *salt, unsigned char *key_data, size_t key_data_len, int count, unsigned char *key, unsigned char *iv)
@@ -65,12 +152,12 @@ static int AES256CBCEncrypt(const unsigned char* key, const unsigned char* iv, c
 
     // Write all but the last block
     int i;
-    AES256_ctx ctx;
-    AES256_init(&ctx, key);
+    struct aes256_ctx ctx;
+    aes256_init(&ctx, key);
     while (written + AES256_BLOCK_LENGTH <= size) {
         for (i = 0; i != AES256_BLOCK_LENGTH; i++)
             mixed[i] ^= *data++;
-        AES256_encrypt(&ctx, 1, out + written, mixed);
+        aes256_encrypt(&ctx, 1, out + written, mixed);
         MEMCPY_BCOPY(mixed, out + written, AES256_BLOCK_LENGTH);
         written += AES256_BLOCK_LENGTH;
     }
@@ -81,9 +168,11 @@ static int AES256CBCEncrypt(const unsigned char* key, const unsigned char* iv, c
             mixed[i] ^= *data++;
         for (i = padsize; i != AES256_BLOCK_LENGTH; i++)
             mixed[i] ^= AES256_BLOCK_LENGTH - padsize;
-        AES256_encrypt(&ctx, 1, out + written, mixed);
+        aes256_encrypt(&ctx, 1, out + written, mixed);
         written += AES256_BLOCK_LENGTH;
     }
+    aes256_free(&ctx);
+    MEMSET_BZERO(mixed, sizeof(mixed));
     return written;
 }
 
@@ -101,11 +190,13 @@ static int AES256CBCDecrypt(const unsigned char* key, const unsigned char* iv, c
     if (size % AES256_BLOCK_LENGTH != 0)
         return 0;
 
-    // Decrypt all data. Padding will be checked in the output.
-    AES256_ctx ctx;
-    AES256_init(&ctx, key);
+    // Decrypt all data, in one go: unlike encryption, blocks do not
+    // depend on each other.  Padding will be checked in the output.
+    struct aes256_ctx ctx;
+    aes256_init(&ctx, key);
+    aes256_decrypt(&ctx, size / AES256_BLOCK_LENGTH, out, data);
+    aes256_free(&ctx);
     while (written != size) {
-        AES256_decrypt(&ctx, 1, out, data + written);
         for (i = 0; i != AES256_BLOCK_LENGTH; i++)
             *out++ ^= prev[i];
         prev = data + written;
@@ -141,7 +232,11 @@ cstring *read_aes_file(const char *filename, void *key_data, size_t key_data_len
 
     if (bu_read_file(filename, &ciphertext, &ct_len, max_file_len)) {
         size_t pt_len = ct_len;
-        unsigned char plaintext[pt_len];
+        unsigned char *plaintext = malloc(pt_len ? pt_len : 1);
+        if (!plaintext) {
+            free(ciphertext);
+            return NULL;
+        }
 
         // 25000 rounds is just under 0.1 seconds on a 1.86 GHz Pentium M
         // ie slightly lower than the lowest hardware we need bother supporting
@@ -166,6 +261,7 @@ cstring *read_aes_file(const char *filename, void *key_data, size_t key_data_len
         MEMSET_BZERO(key, AES256_KEY_LENGTH);
         MEMSET_BZERO(iv, AES256_BLOCK_LENGTH);
         MEMSET_BZERO(plaintext, ct_len);
+        free(plaintext);
     }
     free(ciphertext);
 
@@ -177,10 +273,16 @@ bool write_aes_file(const char *filename_, void *key_data, size_t key_data_len,
 {
     char *filename = malloc(strlen(filename_) + 1);
     size_t ct_len = pt_len;
-    unsigned char ciphertext[ct_len];
+    unsigned char *ciphertext = malloc(ct_len + AES256_BLOCK_LENGTH);	// + padding
     bool pad = true;
     bool rc = false;
 
+    if (!filename || !ciphertext) {
+        free(filename);
+        free(ciphertext);
+        return false;
+    }
+
     // 25000 rounds is just under 0.1 seconds on a 1.86 GHz Pentium M
     // ie slightly lower than the lowest hardware we need bother supporting
     int nrounds = 1721;
@@ -198,11 +300,12 @@ bool write_aes_file(const char *filename_, void *key_data, size_t key_data_len,
             key_data_len, nrounds, key, iv) == AES256_KEY_LENGTH)
         if ((ct_len = AES256CBCEncrypt(key, iv, plaintext, pt_len, pad,
                 ciphertext)) > 0 )
-            rc = bu_write_file(filename, &ciphertext, ct_len);
+            rc = bu_write_file(filename, ciphertext, ct_len);
 
     MEMSET_BZERO(key, AES256_KEY_LENGTH);
     MEMSET_BZERO(iv, AES256_BLOCK_LENGTH);
 
+    free(ciphertext);
     free(filename);
 
     return rc;
@@ -0,0 +1,177 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/crypto/aesni.h>          // for AESNI256_ctx, etc
+
+#include <stdlib.h>                     // for abort
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>                      // for __get_cpuid, bit_AES
+#include <wmmintrin.h>                  // for _mm_aesenc_si128, etc
+
+/* built for any x86; these functions only run where the CPU has AES-NI */
+#define AESNI_FN __attribute__((target("aes,sse2")))
+
+enum {
+	AESNI_ROUNDS		= 14,
+	AESNI_WAYS		= 4,		/* blocks in flight */
+};
+
+bool aesni_available(void)
+{
+	static int have = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (have < 0)
+		have = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		       (ecx & bit_AES);
+
+	return (have != 0);
+}
+
+static AESNI_FN __m128i expand_even(__m128i k, __m128i t)
+{
+	t = _mm_shuffle_epi32(t, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+static AESNI_FN __m128i expand_odd(__m128i k, __m128i t)
+{
+	t = _mm_shuffle_epi32(t, 0xaa);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+/* the round constant must be an immediate */
+#define EXPAND_PAIR(i, rcon)						\
+	do {								\
+		rk[2 * (i)] = expand_even(rk[2 * (i) - 2],		\
+			_mm_aeskeygenassist_si128(rk[2 * (i) - 1], rcon)); \
+		if (i < 7)						\
+			rk[2 * (i) + 1] = expand_odd(rk[2 * (i) - 1],	\
+			  _mm_aeskeygenassist_si128(rk[2 * (i)], 0));	\
+	} while (0)
+
+AESNI_FN void AESNI256_init(AESNI256_ctx *ctx, const unsigned char *key32)
+{
+	__m128i rk[AESNI_ROUNDS + 1];
+	int i;
+
+	rk[0] = _mm_loadu_si128((const __m128i *) key32);
+	rk[1] = _mm_loadu_si128((const __m128i *) (key32 + 16));
+	EXPAND_PAIR(1, 0x01);
+	EXPAND_PAIR(2, 0x02);
+	EXPAND_PAIR(3, 0x04);
+	EXPAND_PAIR(4, 0x08);
+	EXPAND_PAIR(5, 0x10);
+	EXPAND_PAIR(6, 0x20);
+	EXPAND_PAIR(7, 0x40);
+
+	/* the equivalent inverse cipher's, in the order used */
+	for (i = 0; i <= AESNI_ROUNDS; i++) {
+		__m128i dk = rk[AESNI_ROUNDS - i];
+		if (i > 0 && i < AESNI_ROUNDS)
+			dk = _mm_aesimc_si128(dk);
+
+		_mm_storeu_si128((__m128i *) ctx->rk[i], rk[i]);
+		_mm_storeu_si128((__m128i *) ctx->dk[i], dk);
+	}
+
+	for (i = 0; i <= AESNI_ROUNDS; i++)
+		rk[i] = _mm_setzero_si128();
+}
+
+AESNI_FN void AESNI256_encrypt(const AESNI256_ctx *ctx, size_t blocks,
+			       unsigned char *cipher16,
+			       const unsigned char *plain16)
+{
+	__m128i rk[AESNI_ROUNDS + 1];
+	int r, j;
+
+	for (r = 0; r <= AESNI_ROUNDS; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *) ctx->rk[r]);
+
+	while (blocks > 0) {
+		__m128i b[AESNI_WAYS];
+		int n = (blocks < AESNI_WAYS) ? blocks : AESNI_WAYS;
+
+		for (j = 0; j < n; j++)
+			b[j] = _mm_xor_si128(rk[0], _mm_loadu_si128(
+				(const __m128i *) (plain16 + 16 * j)));
+		for (r = 1; r < AESNI_ROUNDS; r++)
+			for (j = 0; j < n; j++)
+				b[j] = _mm_aesenc_si128(b[j], rk[r]);
+		for (j = 0; j < n; j++)
+			_mm_storeu_si128((__m128i *) (cipher16 + 16 * j),
+				_mm_aesenclast_si128(b[j], rk[AESNI_ROUNDS]));
+
+		plain16 += 16 * n;
+		cipher16 += 16 * n;
+		blocks -= n;
+	}
+}
+
+AESNI_FN void AESNI256_decrypt(const AESNI256_ctx *ctx, size_t blocks,
+			       unsigned char *plain16,
+			       const unsigned char *cipher16)
+{
+	__m128i dk[AESNI_ROUNDS + 1];
+	int r, j;
+
+	for (r = 0; r <= AESNI_ROUNDS; r++)
+		dk[r] = _mm_loadu_si128((const __m128i *) ctx->dk[r]);
+
+	while (blocks > 0) {
+		__m128i b[AESNI_WAYS];
+		int n = (blocks < AESNI_WAYS) ? blocks : AESNI_WAYS;
+
+		for (j = 0; j < n; j++)
+			b[j] = _mm_xor_si128(dk[0], _mm_loadu_si128(
+				(const __m128i *) (cipher16 + 16 * j)));
+		for (r = 1; r < AESNI_ROUNDS; r++)
+			for (j = 0; j < n; j++)
+				b[j] = _mm_aesdec_si128(b[j], dk[r]);
+		for (j = 0; j < n; j++)
+			_mm_storeu_si128((__m128i *) (plain16 + 16 * j),
+				_mm_aesdeclast_si128(b[j], dk[AESNI_ROUNDS]));
+
+		cipher16 += 16 * n;
+		plain16 += 16 * n;
+		blocks -= n;
+	}
+}
+
+#else /* no AES-NI */
+
+bool aesni_available(void)
+{
+	return false;
+}
+
+void AESNI256_init(AESNI256_ctx *ctx, const unsigned char *key32)
+{
+	abort();
+}
+
+void AESNI256_encrypt(const AESNI256_ctx *ctx, size_t blocks,
+		      unsigned char *cipher16, const unsigned char *plain16)
+{
+	abort();
+}
+
+void AESNI256_decrypt(const AESNI256_ctx *ctx, size_t blocks,
+		      unsigned char *plain16, const unsigned char *cipher16)
+{
+	abort();
+}
+
+#endif
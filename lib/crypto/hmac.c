@@ -61,13 +61,11 @@ void hmac_sha256(const void *key_p, const uint32_t keylen, const void *msg_p, co
 	MEMSET_BZERO(i_key_pad, sizeof(i_key_pad));
 }
 
-void hmac_sha512(const void *key_p, const uint32_t keylen, const void *msg_p, const uint32_t msglen, uint8_t *hmac)
+void hmac_sha512_Init(HMAC_SHA512_CTX *hctx, const void *key_p, const uint32_t keylen)
 {
 	const uint8_t *key = key_p;
-	const uint8_t *msg = msg_p;
 	int i;
 	uint8_t buf[SHA512_BLOCK_LENGTH], o_key_pad[SHA512_BLOCK_LENGTH], i_key_pad[SHA512_BLOCK_LENGTH];
-	SHA512_CTX ctx;
 
 	memset(buf, 0, SHA512_BLOCK_LENGTH);
 	if (keylen > SHA512_BLOCK_LENGTH) {
@@ -81,17 +79,38 @@ void hmac_sha512(const void *key_p, const uint32_t keylen, const void *msg_p, co
 		i_key_pad[i] = buf[i] ^ 0x36;
 	}
 
-	sha512_Init(&ctx);
-	sha512_Update(&ctx, i_key_pad, SHA512_BLOCK_LENGTH);
+	sha512_Init(&hctx->inner);
+	sha512_Update(&hctx->inner, i_key_pad, SHA512_BLOCK_LENGTH);
+	sha512_Init(&hctx->outer);
+	sha512_Update(&hctx->outer, o_key_pad, SHA512_BLOCK_LENGTH);
+
+	MEMSET_BZERO(buf, sizeof(buf));
+	MEMSET_BZERO(o_key_pad, sizeof(o_key_pad));
+	MEMSET_BZERO(i_key_pad, sizeof(i_key_pad));
+}
+
+void hmac_sha512_Raw(const HMAC_SHA512_CTX *hctx, const void *msg, const uint32_t msglen, uint8_t *hmac)
+{
+	uint8_t buf[SHA512_DIGEST_LENGTH];
+	SHA512_CTX ctx;
+
+	memcpy(&ctx, &hctx->inner, sizeof(ctx));
 	sha512_Update(&ctx, msg, msglen);
 	sha512_Final(buf, &ctx);
 
-	sha512_Init(&ctx);
-	sha512_Update(&ctx, o_key_pad, SHA512_BLOCK_LENGTH);
+	memcpy(&ctx, &hctx->outer, sizeof(ctx));
 	sha512_Update(&ctx, buf, SHA512_DIGEST_LENGTH);
 	sha512_Final(hmac, &ctx);
 
 	MEMSET_BZERO(buf, sizeof(buf));
-	MEMSET_BZERO(o_key_pad, sizeof(o_key_pad));
-	MEMSET_BZERO(i_key_pad, sizeof(i_key_pad));
+}
+
+void hmac_sha512(const void *key, const uint32_t keylen, const void *msg, const uint32_t msglen, uint8_t *hmac)
+{
+	HMAC_SHA512_CTX hctx;
+
+	hmac_sha512_Init(&hctx, key, keylen);
+	hmac_sha512_Raw(&hctx, msg, msglen, hmac);
+
+	MEMSET_BZERO(&hctx, sizeof(hctx));
 }
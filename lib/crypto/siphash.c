@@ -0,0 +1,143 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/crypto/siphash.h>
+
+#include <string.h>                     // for memcpy
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do {			\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;	\
+	v0 = ROTL64(v0, 32);				\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;	\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;	\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;	\
+	v2 = ROTL64(v2, 32);				\
+} while (0)
+
+static inline uint64_t read_le64(const unsigned char *p)
+{
+	return ((uint64_t) p[0]) |
+	       ((uint64_t) p[1] << 8) |
+	       ((uint64_t) p[2] << 16) |
+	       ((uint64_t) p[3] << 24) |
+	       ((uint64_t) p[4] << 32) |
+	       ((uint64_t) p[5] << 40) |
+	       ((uint64_t) p[6] << 48) |
+	       ((uint64_t) p[7] << 56);
+}
+
+uint64_t siphash24(uint64_t k0, uint64_t k1, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t m;
+
+	size_t left = len;
+	while (left >= 8) {
+		m = read_le64(p);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+
+		p += 8;
+		left -= 8;
+	}
+
+	/* final block: trailing bytes, with length in the top byte */
+	m = ((uint64_t) len) << 56;
+	switch (left) {
+	case 7: m |= ((uint64_t) p[6]) << 48;
+	case 6: m |= ((uint64_t) p[5]) << 40;
+	case 5: m |= ((uint64_t) p[4]) << 32;
+	case 4: m |= ((uint64_t) p[3]) << 24;
+	case 3: m |= ((uint64_t) p[2]) << 16;
+	case 2: m |= ((uint64_t) p[1]) << 8;
+	case 1: m |= ((uint64_t) p[0]);
+	case 0: break;
+	}
+
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Fixed-length variant: four message words plus the length-only
+ * final block, with the keyed initial state supplied by the caller
+ * so batch callers compute it once.
+ */
+static inline uint64_t siphash24_u256_state(const uint64_t iv[4],
+					    const unsigned char *p)
+{
+	uint64_t v0 = iv[0], v1 = iv[1], v2 = iv[2], v3 = iv[3];
+	uint64_t m;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		m = read_le64(p + (i * 8));
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	m = ((uint64_t) 32) << 56;
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static inline void siphash24_iv(uint64_t iv[4], uint64_t k0, uint64_t k1)
+{
+	iv[0] = 0x736f6d6570736575ULL ^ k0;
+	iv[1] = 0x646f72616e646f6dULL ^ k1;
+	iv[2] = 0x6c7967656e657261ULL ^ k0;
+	iv[3] = 0x7465646279746573ULL ^ k1;
+}
+
+uint64_t siphash24_u256(uint64_t k0, uint64_t k1, const void *data32)
+{
+	uint64_t iv[4];
+
+	siphash24_iv(iv, k0, k1);
+	return siphash24_u256_state(iv, data32);
+}
+
+void siphash24_u256_batch(uint64_t k0, uint64_t k1,
+			  const void *data32, size_t n, uint64_t *out)
+{
+	const unsigned char *p = data32;
+	uint64_t iv[4];
+	size_t i;
+
+	siphash24_iv(iv, k0, k1);
+
+	for (i = 0; i < n; i++)
+		out[i] = siphash24_u256_state(iv, p + (i * 32));
+}
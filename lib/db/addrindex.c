@@ -0,0 +1,639 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/db/addrindex.h>          // for addrindex, addrindex_entry, etc
+
+#include <bitc/base58.h>                // for base58_decode_check
+#include <bitc/crypto/ripemd160.h>      // for RIPEMD160_DIGEST_LENGTH
+#include <bitc/crypto/sha2.h>           // for sha256_Raw
+#include <bitc/cstr.h>                  // for cstring, cstr_free, etc
+#include <bitc/db/db.h>                 // for MAX_DB_SIZE
+#include <bitc/endian.h>                // for htobe32, htole32, etc
+#include <bitc/log.h>                   // for log_error, log_debug
+#include <bitc/parr.h>                  // for parr_idx
+#include <bitc/script.h>                // for bsp_make_pubkeyhash, etc
+#include <bitc/util.h>                  // for bu_Hash
+
+#include <errno.h>                      // for ENOMEM
+#include <pthread.h>                    // for pthread_create, etc
+#include <stdlib.h>                     // for calloc, malloc, free
+#include <string.h>                     // for memcpy, memset
+
+enum {
+	ADDRINDEX_NUM_DBS	= 3,
+
+	/* packed: height (big-endian, so duplicates sort by it), kind,
+	 * txid, n, value, prevout
+	 */
+	ADDRINDEX_ENTRY_SZ	= 4 + 1 + 32 + 4 + 8 + 32 + 4,
+	ADDRINDEX_OUTPT_SZ	= 32 + 4,
+	ADDRINDEX_UTXO_SZ	= 32 + 8,	/* script hash, value */
+};
+
+static const char addrindex_next_key[] = "next_height";
+
+bool addrindex_open(struct addrindex *ai, const char *filename, bool readonly)
+{
+	int mdb_rc;
+	MDB_txn *txn;
+	MDB_val key_next, data_next;
+	unsigned int dbi_flags = readonly ? 0 : MDB_CREATE;
+
+	memset(ai, 0, sizeof(*ai));
+	ai->readonly = readonly;
+
+	key_next.mv_size = sizeof(addrindex_next_key) - 1;
+	key_next.mv_data = (void *) addrindex_next_key;
+
+	if ((mdb_rc = mdb_env_create(&ai->env)) != MDB_SUCCESS) goto err_out;
+	if ((mdb_rc = mdb_env_set_mapsize(ai->env, (size_t) MAX_DB_SIZE)) != MDB_SUCCESS) goto err_close;
+	if ((mdb_rc = mdb_env_set_maxdbs(ai->env, (MDB_dbi) ADDRINDEX_NUM_DBS)) != MDB_SUCCESS) goto err_close;
+	log_debug("addrindex: Opening database file '%s'", filename);
+	if ((mdb_rc = mdb_env_open(ai->env, filename, MDB_NOSUBDIR | (readonly ? MDB_RDONLY : 0), 0664)) != MDB_SUCCESS) goto err_close;
+	if ((mdb_rc = mdb_txn_begin(ai->env, NULL, readonly ? MDB_RDONLY : 0, &txn)) != MDB_SUCCESS) goto err_close;
+
+	if ((mdb_rc = mdb_dbi_open(txn, "addrhist", dbi_flags | MDB_DUPSORT | MDB_DUPFIXED, &ai->dbi_hist)) != MDB_SUCCESS) goto err_abort;
+	if ((mdb_rc = mdb_dbi_open(txn, "addrutxo", dbi_flags, &ai->dbi_utxo)) != MDB_SUCCESS) goto err_abort;
+	if ((mdb_rc = mdb_dbi_open(txn, "addrmeta", dbi_flags, &ai->dbi_meta)) != MDB_SUCCESS) goto err_abort;
+
+	mdb_rc = mdb_get(txn, ai->dbi_meta, &key_next, &data_next);
+	if ((mdb_rc == MDB_SUCCESS) && (data_next.mv_size == sizeof(uint32_t)))
+		memcpy(&ai->next_height, data_next.mv_data, sizeof(uint32_t));
+	else if (mdb_rc != MDB_NOTFOUND)
+		goto err_abort;
+
+	if ((mdb_rc = mdb_txn_commit(txn)) != MDB_SUCCESS) goto err_close;
+
+	ai->sync_height = ai->next_height;
+	log_debug("addrindex: %s indexed below height %u", filename,
+		  ai->next_height);
+
+	return true;
+
+err_abort:
+	mdb_txn_abort(txn);
+err_close:
+	mdb_env_close(ai->env);
+	ai->env = NULL;
+err_out:
+	log_error("addrindex: %s: %s", filename, mdb_strerror(mdb_rc));
+	return false;
+}
+
+/* the open batch, and everything since the last commit, is dropped */
+static void addrindex_abort(struct addrindex *ai, int mdb_rc)
+{
+	if (ai->txn)
+		mdb_txn_abort(ai->txn);
+	ai->txn = NULL;
+	ai->n_batch = 0;
+	ai->next_height = ai->sync_height;
+
+	log_error("addrindex: %s", mdb_strerror(mdb_rc));
+}
+
+bool addrindex_sync(struct addrindex *ai)
+{
+	int mdb_rc;
+
+	if (!ai->txn)
+		return true;
+
+	mdb_rc = mdb_txn_commit(ai->txn);
+	ai->txn = NULL;
+	ai->n_batch = 0;
+
+	if (mdb_rc != MDB_SUCCESS) {
+		addrindex_abort(ai, mdb_rc);
+		return false;
+	}
+
+	ai->sync_height = ai->next_height;
+	return true;
+}
+
+void addrindex_close(struct addrindex *ai)
+{
+	if (!ai->env)
+		return;
+
+	addrindex_sync(ai);
+	mdb_env_close(ai->env);
+	ai->env = NULL;
+}
+
+void addrindex_script_hash(bu256_t *hash, const void *script,
+			   size_t script_len)
+{
+	sha256_Raw(script, script_len, (uint8_t *) hash);
+}
+
+/* P2PKH or P2SH address, for the given chain */
+bool addrindex_addr_hash(bu256_t *hash, const struct chain_info *chain,
+			 const char *address)
+{
+	unsigned char addrtype;
+	cstring *script = NULL;
+
+	cstring *s = base58_decode_check(&addrtype, address);
+	if (!s || (s->len != RIPEMD160_DIGEST_LENGTH))
+		goto out;
+
+	if (addrtype == chain->addr_pubkey)
+		script = bsp_make_pubkeyhash(s);
+	else if (addrtype == chain->addr_script)
+		script = bsp_make_scripthash(s);
+	if (!script)
+		goto out;
+
+	addrindex_script_hash(hash, script->str, script->len);
+
+out:
+	if (s)
+		cstr_free(s, true);
+	if (!script)
+		return false;
+	cstr_free(script, true);
+	return true;
+}
+
+static void pack_outpt(unsigned char *p, const bu256_t *hash, uint32_t n)
+{
+	uint32_t n_le = htole32(n);
+
+	memcpy(p, hash, 32);
+	memcpy(p + 32, &n_le, 4);
+}
+
+static void pack_entry(unsigned char *p, const struct addrindex_entry *ent)
+{
+	uint32_t height_be = htobe32(ent->height);
+	uint32_t n_le = htole32(ent->n);
+	uint64_t value_le = htole64((uint64_t) ent->value);
+
+	memcpy(p, &height_be, 4);
+	p[4] = (unsigned char) ent->kind;
+	memcpy(p + 5, &ent->txid, 32);
+	memcpy(p + 37, &n_le, 4);
+	memcpy(p + 41, &value_le, 8);
+	pack_outpt(p + 49, &ent->prevout.hash, ent->prevout.n);
+}
+
+static void unpack_entry(struct addrindex_entry *ent, const unsigned char *p)
+{
+	uint32_t u32;
+	uint64_t u64;
+
+	memcpy(&u32, p, 4);
+	ent->height = be32toh(u32);
+	ent->kind = p[4];
+	memcpy(&ent->txid, p + 5, 32);
+	memcpy(&u32, p + 37, 4);
+	ent->n = le32toh(u32);
+	memcpy(&u64, p + 41, 8);
+	ent->value = (int64_t) le64toh(u64);
+	memcpy(&ent->prevout.hash, p + 49, 32);
+	memcpy(&u32, p + 81, 4);
+	ent->prevout.n = le32toh(u32);
+}
+
+/*
+ * A block, decoded and hashed: the part of indexing that needs no
+ * database, so can run off the writer's thread.
+ */
+struct addrindex_prep {
+	uint32_t		height;
+	struct buffer		*raw;		/* builder only */
+	struct bitc_block	block;
+	bu256_t			*txids;		/* per tx */
+	bu256_t			*out_hash;	/* per output, all txs */
+	bool			ok;
+};
+
+static void prep_free(struct addrindex_prep *p)
+{
+	if (p->raw)
+		buffer_freep(p->raw);
+	bitc_block_free(&p->block);
+	free(p->txids);
+	free(p->out_hash);
+	memset(p, 0, sizeof(*p));
+}
+
+static void tx_hash(bu256_t *txid, const struct bitc_tx *tx)
+{
+	if (tx->sha256_valid) {
+		bu256_copy(txid, &tx->sha256);
+		return;
+	}
+
+	cstring *s = cstr_new_sz(512);
+	ser_bitc_tx(s, tx);
+	bu_Hash((unsigned char *) txid, s->str, s->len);
+	cstr_free(s, true);
+}
+
+static bool prep_hash(struct addrindex_prep *p, const struct bitc_block *block)
+{
+	unsigned int i, j, n_outs = 0;
+
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+		n_outs += tx->vout->len;
+	}
+
+	p->txids = malloc((block->vtx->len + 1) * sizeof(bu256_t));
+	p->out_hash = malloc((n_outs + 1) * sizeof(bu256_t));
+	if (!p->txids || !p->out_hash)
+		return false;
+
+	n_outs = 0;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+
+		tx_hash(&p->txids[i], tx);
+
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bitc_txout *txout = parr_idx(tx->vout, j);
+			addrindex_script_hash(&p->out_hash[n_outs++],
+					      txout->scriptPubKey->str,
+					      txout->scriptPubKey->len);
+		}
+	}
+
+	return true;
+}
+
+static void prep_raw(struct addrindex_prep *p)
+{
+	struct const_buffer buf = { p->raw->p, p->raw->len };
+
+	p->ok = deser_bitc_block(&p->block, &buf) && p->block.vtx &&
+		prep_hash(p, &p->block);
+}
+
+static bool apply_block(struct addrindex *ai, uint32_t height,
+			const struct bitc_block *block,
+			const struct addrindex_prep *p)
+{
+	int mdb_rc;
+	MDB_val key, data;
+	unsigned char ent_buf[ADDRINDEX_ENTRY_SZ];
+	unsigned char outpt_buf[ADDRINDEX_OUTPT_SZ];
+	unsigned char utxo_buf[ADDRINDEX_UTXO_SZ];
+	unsigned int i, j, o = 0;
+
+	if (ai->readonly)
+		return false;
+	if (height < ai->next_height)
+		return true;
+	if (height > ai->next_height) {
+		log_error("addrindex: height %u, expected %u",
+			  height, ai->next_height);
+		return false;
+	}
+
+	if (!ai->txn &&
+	    ((mdb_rc = mdb_txn_begin(ai->env, NULL, 0, &ai->txn)) != MDB_SUCCESS))
+		goto err_abort;
+
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+		struct addrindex_entry ent;
+
+		memset(&ent, 0, sizeof(ent));
+		ent.height = height;
+		bu256_copy(&ent.txid, &p->txids[i]);
+
+		/* spends of indexed outputs; coinbase finds nothing */
+		ent.kind = ADDRINDEX_SPEND;
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bitc_txin *txin = parr_idx(tx->vin, j);
+			bu256_t script_hash;
+			uint64_t value_le;
+
+			pack_outpt(outpt_buf, &txin->prevout.hash,
+				   txin->prevout.n);
+			key.mv_size = sizeof(outpt_buf);
+			key.mv_data = outpt_buf;
+
+			mdb_rc = mdb_get(ai->txn, ai->dbi_utxo, &key, &data);
+			if (mdb_rc == MDB_NOTFOUND)
+				continue;
+			if ((mdb_rc != MDB_SUCCESS) ||
+			    (data.mv_size != ADDRINDEX_UTXO_SZ))
+				goto err_abort;
+
+			memcpy(&script_hash, data.mv_data, 32);
+			memcpy(&value_le, (unsigned char *) data.mv_data + 32, 8);
+
+			ent.n = j;
+			ent.value = (int64_t) le64toh(value_le);
+			bitc_outpt_copy(&ent.prevout, &txin->prevout);
+			pack_entry(ent_buf, &ent);
+
+			key.mv_size = sizeof(bu256_t);
+			key.mv_data = &script_hash;
+			data.mv_size = sizeof(ent_buf);
+			data.mv_data = ent_buf;
+			if ((mdb_rc = mdb_put(ai->txn, ai->dbi_hist, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+
+			key.mv_size = sizeof(outpt_buf);
+			key.mv_data = outpt_buf;
+			if ((mdb_rc = mdb_del(ai->txn, ai->dbi_utxo, &key, NULL)) != MDB_SUCCESS) goto err_abort;
+		}
+
+		ent.kind = ADDRINDEX_FUND;
+		bitc_outpt_init(&ent.prevout);
+		for (j = 0; j < tx->vout->len; j++) {
+			struct bitc_txout *txout = parr_idx(tx->vout, j);
+			const bu256_t *script_hash = &p->out_hash[o++];
+			uint64_t value_le = htole64((uint64_t) txout->nValue);
+
+			ent.n = j;
+			ent.value = txout->nValue;
+			pack_entry(ent_buf, &ent);
+
+			key.mv_size = sizeof(bu256_t);
+			key.mv_data = (void *) script_hash;
+			data.mv_size = sizeof(ent_buf);
+			data.mv_data = ent_buf;
+			if ((mdb_rc = mdb_put(ai->txn, ai->dbi_hist, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+
+			/* provably unspendable: never looked up */
+			if ((txout->scriptPubKey->len > 0) &&
+			    ((unsigned char) txout->scriptPubKey->str[0] == OP_RETURN))
+				continue;
+
+			pack_outpt(outpt_buf, &p->txids[i], j);
+			memcpy(utxo_buf, script_hash, 32);
+			memcpy(utxo_buf + 32, &value_le, 8);
+
+			key.mv_size = sizeof(outpt_buf);
+			key.mv_data = outpt_buf;
+			data.mv_size = sizeof(utxo_buf);
+			data.mv_data = utxo_buf;
+			if ((mdb_rc = mdb_put(ai->txn, ai->dbi_utxo, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+		}
+	}
+
+	uint32_t next_height = height + 1;
+	key.mv_size = sizeof(addrindex_next_key) - 1;
+	key.mv_data = (void *) addrindex_next_key;
+	data.mv_size = sizeof(uint32_t);
+	data.mv_data = &next_height;
+
+	if ((mdb_rc = mdb_put(ai->txn, ai->dbi_meta, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+
+	ai->next_height = next_height;
+
+	if (++ai->n_batch >= ADDRINDEX_BATCH)
+		return addrindex_sync(ai);
+
+	return true;
+
+err_abort:
+	addrindex_abort(ai, mdb_rc);
+	return false;
+}
+
+bool addrindex_add_block(struct addrindex *ai, uint32_t height,
+			 const struct bitc_block *block)
+{
+	struct addrindex_prep p;
+	bool rc = false;
+
+	if (height < ai->next_height)
+		return true;
+
+	memset(&p, 0, sizeof(p));
+	bitc_block_init(&p.block);
+
+	if (block->vtx && prep_hash(&p, block))
+		rc = apply_block(ai, height, block, &p);
+
+	prep_free(&p);
+	return rc;
+}
+
+bool addrindex_get(struct addrindex *ai, const bu256_t *script_hash,
+		   struct addrindex_entry **entries, size_t *n_entries)
+{
+	int mdb_rc;
+	MDB_txn *txn = ai->txn;
+	MDB_cursor *cursor = NULL;
+	MDB_val key, data;
+	MDB_cursor_op op = MDB_SET_KEY;
+	struct addrindex_entry *ents = NULL;
+	size_t n = 0, alloc = 0;
+
+	*entries = NULL;
+	*n_entries = 0;
+
+	key.mv_size = sizeof(bu256_t);
+	key.mv_data = (void *) script_hash;
+
+	/* the open batch, if any, sees its own writes */
+	if (!txn &&
+	    ((mdb_rc = mdb_txn_begin(ai->env, NULL, MDB_RDONLY, &txn)) != MDB_SUCCESS))
+		goto err_out;
+	if ((mdb_rc = mdb_cursor_open(txn, ai->dbi_hist, &cursor)) != MDB_SUCCESS)
+		goto err_abort;
+
+	while ((mdb_rc = mdb_cursor_get(cursor, &key, &data, op)) == MDB_SUCCESS) {
+		op = MDB_NEXT_DUP;
+		if (data.mv_size != ADDRINDEX_ENTRY_SZ)
+			continue;
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			struct addrindex_entry *tmp;
+			tmp = realloc(ents, alloc * sizeof(*ents));
+			if (!tmp) {
+				mdb_rc = ENOMEM;
+				goto err_abort;
+			}
+			ents = tmp;
+		}
+
+		unpack_entry(&ents[n++], data.mv_data);
+	}
+
+	mdb_cursor_close(cursor);
+	if (txn != ai->txn)
+		mdb_txn_abort(txn);
+
+	if (mdb_rc != MDB_NOTFOUND) {
+		free(ents);
+		goto err_out;
+	}
+
+	*entries = ents;
+	*n_entries = n;
+	return true;
+
+err_abort:
+	if (cursor)
+		mdb_cursor_close(cursor);
+	if (txn != ai->txn)
+		mdb_txn_abort(txn);
+	free(ents);
+err_out:
+	log_error("addrindex: %s", mdb_strerror(mdb_rc));
+	return false;
+}
+
+/*
+ * Builder.  Blocks are copied into batches as they are pushed; a full
+ * batch is decoded and hashed by worker threads while the previous
+ * one is written, in order, on the caller's thread.
+ */
+
+struct addrindex_batch {
+	struct addrindex_prep	prep[ADDRINDEX_BUILD_BATCH];
+	unsigned int		n;
+	unsigned int		next_claim;
+
+	pthread_t		*threads;
+	unsigned int		n_threads;	/* running */
+};
+
+struct addrindex_builder {
+	struct addrindex	*ai;
+	unsigned int		max_threads;
+	struct addrindex_batch	batch[2];
+	unsigned int		cur;		/* being filled */
+	bool			ok;
+};
+
+static void *build_worker(void *priv)
+{
+	struct addrindex_batch *batch = priv;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&batch->next_claim, 1,
+				       __ATOMIC_RELAXED)) < batch->n)
+		prep_raw(&batch->prep[i]);
+
+	return NULL;
+}
+
+static void batch_start(struct addrindex_builder *b,
+			struct addrindex_batch *batch)
+{
+	unsigned int i, n_threads = MIN(b->max_threads, batch->n);
+
+	batch->next_claim = 0;
+	batch->n_threads = 0;
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&batch->threads[i], NULL, build_worker,
+				   batch))
+			break;
+		batch->n_threads++;
+	}
+
+	/* no threads to be had: do it here */
+	if (!batch->n_threads)
+		build_worker(batch);
+}
+
+static void batch_finish(struct addrindex_builder *b,
+			 struct addrindex_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->n_threads; i++)
+		pthread_join(batch->threads[i], NULL);
+	batch->n_threads = 0;
+
+	for (i = 0; i < batch->n; i++) {
+		struct addrindex_prep *p = &batch->prep[i];
+
+		if (b->ok && !p->ok) {
+			log_error("addrindex: block decode failed at height %u",
+				  p->height);
+			b->ok = false;
+		}
+		if (b->ok && !apply_block(b->ai, p->height, &p->block, p))
+			b->ok = false;
+
+		prep_free(p);
+	}
+
+	batch->n = 0;
+}
+
+struct addrindex_builder *addrindex_build_new(struct addrindex *ai,
+					      unsigned int n_threads)
+{
+	struct addrindex_builder *b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+
+	b->ai = ai;
+	b->max_threads = n_threads ? n_threads : 1;
+	b->ok = true;
+
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		b->batch[i].threads = calloc(b->max_threads, sizeof(pthread_t));
+		if (!b->batch[i].threads)
+			goto err_out;
+	}
+
+	return b;
+
+err_out:
+	free(b->batch[0].threads);
+	free(b);
+	return NULL;
+}
+
+/* blocks must come in height order; those already indexed are skipped */
+bool addrindex_build_push(struct addrindex_builder *b, uint32_t height,
+			  const struct const_buffer *blk)
+{
+	if (!b->ok)
+		return false;
+	if (height < b->ai->next_height)
+		return true;
+
+	struct addrindex_batch *batch = &b->batch[b->cur];
+	struct addrindex_prep *p = &batch->prep[batch->n];
+
+	memset(p, 0, sizeof(*p));
+	bitc_block_init(&p->block);
+	p->height = height;
+	p->raw = buffer_copy(blk->p, blk->len);
+	batch->n++;
+
+	if (batch->n < ADDRINDEX_BUILD_BATCH)
+		return true;
+
+	/* decode this one while writing out the last */
+	batch_start(b, batch);
+	b->cur ^= 1;
+	batch_finish(b, &b->batch[b->cur]);
+
+	return b->ok;
+}
+
+bool addrindex_build_finish(struct addrindex_builder *b)
+{
+	struct addrindex_batch *last = &b->batch[b->cur];
+
+	if (last->n)
+		batch_start(b, last);
+	batch_finish(b, &b->batch[b->cur ^ 1]);
+	batch_finish(b, last);
+
+	bool ok = b->ok && addrindex_sync(b->ai);
+
+	free(b->batch[0].threads);
+	free(b->batch[1].threads);
+	free(b);
+	return ok;
+}
@@ -193,6 +193,11 @@ bool blockheightdb_add(int height, bu256_t *hash)
 	MDB_txn *txn;
 	MDB_val key_height, data_hash;
 	char hexstr[BU256_STRSZ];
+
+	/* chaindb may be used in memory only, with no database open */
+	if (!dbinfo.env)
+		return false;
+
 	bu256_hex(hexstr, hash);
 
 	key_height.mv_size = sizeof(int);
@@ -218,27 +223,33 @@ err_out:
 	return false;
 }
 
-bool blockheightdb_getall(bool (*read_block)(void *p, size_t len))
+/* walk the blocks in height order; read_height, if given, may stop it */
+static bool blockheightdb_walk(bool (*read_block)(void *p, size_t len),
+			       bool (*read_height)(int height, void *p, size_t len))
 {
 	int mdb_rc;
 	MDB_txn *txn;
 	MDB_cursor *cursorheight;
 	MDB_cursor_op op = MDB_FIRST;
 	MDB_val key_height, data_hash, data_block;
+	bool rc = true;
 
 	if ((mdb_rc = mdb_txn_begin(dbinfo.env, NULL, MDB_RDONLY, &txn)) != MDB_SUCCESS) goto err_out;
 	if ((mdb_rc = mdb_cursor_open(txn, dbinfo.handle[BLOCKHEIGHTDB].dbi, &cursorheight)) != MDB_SUCCESS) goto err_abort;
 
 	log_info("db: Reading %s database", dbinfo.handle[BLOCKHEIGHTDB].name);
-	while ((mdb_rc = mdb_cursor_get(cursorheight, &key_height, &data_hash, op)) == MDB_SUCCESS) {
+	while (rc && (mdb_rc = mdb_cursor_get(cursorheight, &key_height, &data_hash, op)) == MDB_SUCCESS) {
 		if ((mdb_rc = mdb_get(txn, dbinfo.handle[BLOCKDB].dbi, &data_hash, &data_block)) != MDB_SUCCESS) goto err_abort;
-		read_block(data_block.mv_data, data_block.mv_size);
+		if (read_height)
+			rc = read_height(*(int *)key_height.mv_data, data_block.mv_data, data_block.mv_size);
+		else
+			read_block(data_block.mv_data, data_block.mv_size);
 		if (op != MDB_NEXT) op = MDB_NEXT;
 	}
 
 	mdb_cursor_close(cursorheight);
 	mdb_txn_abort(txn);
-	return true;
+	return rc;
 
 err_abort:
 	mdb_txn_abort(txn);
@@ -247,6 +258,17 @@ err_out:
 	return false;
 }
 
+bool blockheightdb_getall(bool (*read_block)(void *p, size_t len))
+{
+	return blockheightdb_walk(read_block, NULL);
+}
+
+/* as blockheightdb_getall, with each block's height; stops on false */
+bool blockheightdb_getall_height(bool (*read_block)(int height, void *p, size_t len))
+{
+	return blockheightdb_walk(NULL, read_block);
+}
+
 void db_close(void) {
 
 	uint8_t i;
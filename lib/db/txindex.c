@@ -0,0 +1,388 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/db/txindex.h>            // for txindex, txindex_pos, etc
+
+#include <bitc/db/db.h>                 // for MAX_DB_SIZE
+#include <bitc/log.h>                   // for log_error, log_debug
+#include <bitc/parr.h>                  // for parr_new, parr_add, etc
+#include <bitc/serialize.h>             // for deser_varlen
+
+#include <stdio.h>                      // for snprintf
+#include <stdlib.h>                     // for calloc, malloc, free, etc
+#include <string.h>                     // for memcpy, memset
+#include <unistd.h>                     // for unlink
+
+enum {
+	TXINDEX_NUM_DBS		= 2,
+};
+
+static const char txindex_next_key[] = "next_pos";
+static const char txindex_ident_key[] = "ident";
+
+bool txindex_open(struct txindex *ti, const char *filename, bool readonly)
+{
+	int mdb_rc;
+	MDB_txn *txn;
+	MDB_val key_next, data_next, key_ident, data_ident;
+	unsigned int dbi_flags = readonly ? 0 : MDB_CREATE;
+
+	memset(ti, 0, sizeof(*ti));
+	ti->readonly = readonly;
+
+	key_next.mv_size = sizeof(txindex_next_key) - 1;
+	key_next.mv_data = (void *) txindex_next_key;
+	key_ident.mv_size = sizeof(txindex_ident_key) - 1;
+	key_ident.mv_data = (void *) txindex_ident_key;
+
+	if ((mdb_rc = mdb_env_create(&ti->env)) != MDB_SUCCESS) goto err_out;
+	if ((mdb_rc = mdb_env_set_mapsize(ti->env, (size_t) MAX_DB_SIZE)) != MDB_SUCCESS) goto err_close;
+	if ((mdb_rc = mdb_env_set_maxdbs(ti->env, (MDB_dbi) TXINDEX_NUM_DBS)) != MDB_SUCCESS) goto err_close;
+	log_debug("txindex: Opening database file '%s'", filename);
+	if ((mdb_rc = mdb_env_open(ti->env, filename, MDB_NOSUBDIR | (readonly ? MDB_RDONLY : 0), 0664)) != MDB_SUCCESS) goto err_close;
+	if ((mdb_rc = mdb_txn_begin(ti->env, NULL, readonly ? MDB_RDONLY : 0, &txn)) != MDB_SUCCESS) goto err_close;
+
+	if ((mdb_rc = mdb_dbi_open(txn, "txindex", dbi_flags, &ti->dbi_tx)) != MDB_SUCCESS) goto err_abort;
+	if ((mdb_rc = mdb_dbi_open(txn, "txmeta", dbi_flags, &ti->dbi_meta)) != MDB_SUCCESS) goto err_abort;
+
+	mdb_rc = mdb_get(txn, ti->dbi_meta, &key_next, &data_next);
+	if ((mdb_rc == MDB_SUCCESS) && (data_next.mv_size == sizeof(uint64_t)))
+		memcpy(&ti->next_pos, data_next.mv_data, sizeof(uint64_t));
+	else if (mdb_rc != MDB_NOTFOUND)
+		goto err_abort;
+
+	mdb_rc = mdb_get(txn, ti->dbi_meta, &key_ident, &data_ident);
+	if ((mdb_rc == MDB_SUCCESS) &&
+	    (data_ident.mv_size <= TXINDEX_IDENT_MAX)) {
+		memcpy(ti->ident, data_ident.mv_data, data_ident.mv_size);
+		ti->ident_len = data_ident.mv_size;
+	} else if (mdb_rc != MDB_NOTFOUND)
+		goto err_abort;
+
+	if ((mdb_rc = mdb_txn_commit(txn)) != MDB_SUCCESS) goto err_close;
+
+	ti->sync_pos = ti->next_pos;
+	log_debug("txindex: %s indexed below %llu", filename,
+		  (unsigned long long) ti->next_pos);
+
+	return true;
+
+err_abort:
+	mdb_txn_abort(txn);
+err_close:
+	mdb_env_close(ti->env);
+	ti->env = NULL;
+err_out:
+	log_error("txindex: %s: %s", filename, mdb_strerror(mdb_rc));
+	return false;
+}
+
+/* LMDB keeps working on its files once they are unlinked */
+bool txindex_open_temp(struct txindex *ti)
+{
+	const char *dir = getenv("TMPDIR");
+	char filename[4096], lock_fn[4096 + 5];
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+	snprintf(filename, sizeof(filename), "%s/txindex-XXXXXX", dir);
+
+	int fd = mkstemp(filename);
+	if (fd < 0) {
+		log_error("txindex: cannot create %s", filename);
+		return false;
+	}
+	close(fd);
+
+	bool rc = txindex_open(ti, filename, false);
+
+	snprintf(lock_fn, sizeof(lock_fn), "%s-lock", filename);
+	unlink(filename);
+	unlink(lock_fn);
+
+	return rc;
+}
+
+/* the open batch, and everything since the last commit, is dropped */
+static void txindex_abort(struct txindex *ti, int mdb_rc)
+{
+	if (ti->txn)
+		mdb_txn_abort(ti->txn);
+	ti->txn = NULL;
+	ti->n_batch = 0;
+	ti->next_pos = ti->sync_pos;
+
+	log_error("txindex: %s", mdb_strerror(mdb_rc));
+}
+
+bool txindex_sync(struct txindex *ti)
+{
+	int mdb_rc;
+
+	if (!ti->txn)
+		return true;
+
+	mdb_rc = mdb_txn_commit(ti->txn);
+	ti->txn = NULL;
+	ti->n_batch = 0;
+
+	if (mdb_rc != MDB_SUCCESS) {
+		txindex_abort(ti, mdb_rc);
+		return false;
+	}
+
+	ti->sync_pos = ti->next_pos;
+	return true;
+}
+
+void txindex_close(struct txindex *ti)
+{
+	if (!ti->env)
+		return;
+
+	txindex_sync(ti);
+	mdb_env_close(ti->env);
+	ti->env = NULL;
+}
+
+/* the source the index is of; reset empties the index first */
+bool txindex_set_ident(struct txindex *ti, const void *id, size_t id_len,
+		       bool reset)
+{
+	int mdb_rc;
+	MDB_txn *txn;
+	MDB_val key, data;
+
+	if (ti->readonly || (id_len > TXINDEX_IDENT_MAX) || !txindex_sync(ti))
+		return false;
+
+	if ((mdb_rc = mdb_txn_begin(ti->env, NULL, 0, &txn)) != MDB_SUCCESS)
+		goto err_out;
+
+	if (reset &&
+	    (((mdb_rc = mdb_drop(txn, ti->dbi_tx, 0)) != MDB_SUCCESS) ||
+	     ((mdb_rc = mdb_drop(txn, ti->dbi_meta, 0)) != MDB_SUCCESS)))
+		goto err_abort;
+
+	key.mv_size = sizeof(txindex_ident_key) - 1;
+	key.mv_data = (void *) txindex_ident_key;
+	data.mv_size = id_len;
+	data.mv_data = (void *) id;
+
+	if ((mdb_rc = mdb_put(txn, ti->dbi_meta, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+	if ((mdb_rc = mdb_txn_commit(txn)) != MDB_SUCCESS) goto err_out;
+
+	memcpy(ti->ident, id, id_len);
+	ti->ident_len = id_len;
+	if (reset)
+		ti->next_pos = ti->sync_pos = 0;
+
+	return true;
+
+err_abort:
+	mdb_txn_abort(txn);
+err_out:
+	log_error("txindex: %s", mdb_strerror(mdb_rc));
+	return false;
+}
+
+/* one block's txs; a block ending at or below next_pos is already in */
+bool txindex_add(struct txindex *ti, const bu256_t *txids,
+		 const struct txindex_pos *pos, unsigned int n,
+		 uint64_t next_pos)
+{
+	int mdb_rc;
+	MDB_val key, data;
+	unsigned int i;
+
+	if (ti->readonly)
+		return false;
+	if (next_pos <= ti->next_pos)
+		return true;
+
+	if (!ti->txn &&
+	    ((mdb_rc = mdb_txn_begin(ti->env, NULL, 0, &ti->txn)) != MDB_SUCCESS))
+		goto err_abort;
+
+	for (i = 0; i < n; i++) {
+		key.mv_size = sizeof(bu256_t);
+		key.mv_data = (void *) &txids[i];
+		data.mv_size = sizeof(struct txindex_pos);
+		data.mv_data = (void *) &pos[i];
+
+		if ((mdb_rc = mdb_put(ti->txn, ti->dbi_tx, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+	}
+
+	key.mv_size = sizeof(txindex_next_key) - 1;
+	key.mv_data = (void *) txindex_next_key;
+	data.mv_size = sizeof(uint64_t);
+	data.mv_data = &next_pos;
+
+	if ((mdb_rc = mdb_put(ti->txn, ti->dbi_meta, &key, &data, 0)) != MDB_SUCCESS) goto err_abort;
+
+	ti->next_pos = next_pos;
+
+	if (++ti->n_batch >= TXINDEX_BATCH)
+		return txindex_sync(ti);
+
+	return true;
+
+err_abort:
+	txindex_abort(ti, mdb_rc);
+	return false;
+}
+
+bool txindex_add_block(struct txindex *ti, uint64_t block_pos,
+		       uint64_t next_pos, const struct const_buffer *blk)
+{
+	struct bitc_block block;
+	struct txindex_pos *pos = NULL;
+	bu256_t *txids = NULL;
+	bool rc = false;
+
+	if (next_pos <= ti->next_pos)
+		return true;
+
+	bitc_block_init(&block);
+
+	if (!txindex_deser_block(&block, blk, block_pos, &pos)) {
+		log_error("txindex: block decode failed at %llu",
+			  (unsigned long long) block_pos);
+		goto out;
+	}
+
+	unsigned int i, n = block.vtx->len;
+	txids = malloc((n ? n : 1) * sizeof(bu256_t));
+	if (!txids)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		struct bitc_tx *tx = parr_idx(block.vtx, i);
+
+		bitc_tx_calc_sha256(tx);
+		bu256_copy(&txids[i], &tx->sha256);
+	}
+
+	rc = txindex_add(ti, txids, pos, n, next_pos);
+
+out:
+	free(txids);
+	free(pos);
+	bitc_block_free(&block);
+	return rc;
+}
+
+bool txindex_get(struct txindex *ti, const bu256_t *txid,
+		 struct txindex_pos *pos)
+{
+	int mdb_rc;
+	MDB_txn *txn = ti->txn;
+	MDB_val key, data;
+	bool found;
+
+	key.mv_size = sizeof(bu256_t);
+	key.mv_data = (void *) txid;
+
+	/* the open batch, if any, sees its own writes */
+	if (!txn &&
+	    ((mdb_rc = mdb_txn_begin(ti->env, NULL, MDB_RDONLY, &txn)) != MDB_SUCCESS))
+		goto err_out;
+
+	mdb_rc = mdb_get(txn, ti->dbi_tx, &key, &data);
+	found = (mdb_rc == MDB_SUCCESS) && (data.mv_size == sizeof(*pos));
+	if (found)
+		memcpy(pos, data.mv_data, sizeof(*pos));
+
+	if (txn != ti->txn)
+		mdb_txn_abort(txn);
+
+	if ((mdb_rc != MDB_SUCCESS) && (mdb_rc != MDB_NOTFOUND))
+		goto err_out;
+
+	return found;
+
+err_out:
+	log_error("txindex: %s", mdb_strerror(mdb_rc));
+	return false;
+}
+
+/*
+ * As deser_bitc_block, also noting where each tx lies within blk.
+ * *pos_out gets a malloc'd array, one entry per block->vtx element;
+ * a header-only block decodes to an empty vtx.
+ */
+bool txindex_deser_block(struct bitc_block *block,
+			 const struct const_buffer *blk,
+			 uint64_t block_pos, struct txindex_pos **pos_out)
+{
+	struct const_buffer buf = *blk;
+	struct txindex_pos *pos = NULL;
+	uint32_t vlen;
+	unsigned int i;
+
+	bitc_block_free(block);
+	*pos_out = NULL;
+
+	if (!deser_bitc_block_hdr(block, &buf))
+		return false;
+
+	block->vtx = parr_new(512, bitc_tx_freep);
+
+	if (buf.len == 0)
+		return true;
+
+	/* every tx is larger than a byte */
+	if (!deser_varlen(&vlen, &buf) || (vlen > buf.len))
+		goto err_out;
+
+	pos = calloc(vlen ? vlen : 1, sizeof(*pos));
+	if (!pos)
+		goto err_out;
+
+	for (i = 0; i < vlen; i++) {
+		const unsigned char *start = buf.p;
+		struct bitc_tx *tx;
+
+		tx = calloc(1, sizeof(*tx));
+		bitc_tx_init(tx);
+		if (!deser_bitc_tx(tx, &buf)) {
+			free(tx);
+			goto err_out;
+		}
+
+		parr_add(block->vtx, tx);
+
+		pos[i].block_pos = block_pos;
+		pos[i].offset = start - (const unsigned char *) blk->p;
+		pos[i].len = (const unsigned char *) buf.p - start;
+	}
+
+	*pos_out = pos;
+	return true;
+
+err_out:
+	free(pos);
+	bitc_block_free(block);
+	return false;
+}
+
+/* decode the tx at pos within blk, and check it is the one wanted */
+bool txindex_fetch(struct bitc_tx *tx, const bu256_t *txid,
+		   const struct const_buffer *blk,
+		   const struct txindex_pos *pos)
+{
+	if ((pos->offset > blk->len) || (pos->len > blk->len - pos->offset))
+		return false;
+
+	struct const_buffer buf = {
+		(const unsigned char *) blk->p + pos->offset, pos->len
+	};
+
+	if (!deser_bitc_tx(tx, &buf) || buf.len)
+		return false;
+
+	bitc_tx_calc_sha256(tx);
+	return bu256_equal(&tx->sha256, txid);
+}
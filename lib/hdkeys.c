@@ -73,16 +73,11 @@ bool hd_extended_key_ser_pub(const struct hd_extended_key *ek, cstring *s)
 {
 	hd_extended_key_ser_base(ek, s, MAIN_PUBLIC);
 
-	void *pub = NULL;
-	size_t pub_len = 0;
-	if (bitc_pubkey_get(&ek->key, &pub, &pub_len)) {
-		if (33 == pub_len) {
-			ser_bytes(s, pub, 33);
-			free(pub);
-			return true;
-		}
+	uint8_t pub[33];
+	if (bitc_pubkey_ser(&ek->key, pub)) {
+		ser_bytes(s, pub, 33);
+		return true;
 	}
-	free(pub);
 	return false;
 }
 
@@ -115,63 +110,84 @@ bool hd_extended_key_generate_master(struct hd_extended_key *ek,
 	return false;
 }
 
-bool hd_extended_key_generate_child(const struct hd_extended_key *parent,
-				    uint32_t index,
-				    struct hd_extended_key *out_child)
+/* what every child of one parent has in common */
+struct hd_parent {
+	const struct hd_extended_key	*key;
+	HMAC_SHA512_CTX			hmac;	/* keyed with the chain code */
+	uint8_t				pub[33];
+	uint8_t				fingerprint[4];
+};
+
+static bool hd_parent_init(struct hd_parent *hp,
+			   const struct hd_extended_key *parent)
 {
+	hp->key = parent;
+
+	if (!bitc_pubkey_ser(&parent->key, hp->pub))
+		return false;
+
+	uint8_t md160[RIPEMD160_DIGEST_LENGTH];
+	bu_Hash160(md160, hp->pub, sizeof(hp->pub));
+	memcpy(hp->fingerprint, md160, 4);
+
+	hmac_sha512_Init(&hp->hmac, parent->chaincode.data,
+			 (int)sizeof(parent->chaincode.data));
+	return true;
+}
+
+static void hd_parent_free(struct hd_parent *hp)
+{
+	memset(hp, 0, sizeof(*hp));
+}
+
+static bool hd_parent_child(const struct hd_parent *hp, uint32_t index,
+			    struct hd_extended_key *out_child)
+{
+	const struct hd_extended_key *parent = hp->key;
 	bool result = false;
-	void *parent_pub = NULL;
-	size_t parent_pub_len = 0;
 
 	uint8_t data[33 + sizeof(uint32_t)];
 	if (0 != (0x80000000 & index)) {
-
-		if (!bitc_key_secret_get(&data[1], 32, &parent->key)) {
-			return false;
-		}
 		data[0] = 0;
-
-		if (!bitc_pubkey_get(&parent->key, &parent_pub, &parent_pub_len)) {
+		if (!bitc_key_secret_get(&data[1], 32, &parent->key)) {
 			return false;
 		}
-
 	} else {
-
-		if (!bitc_pubkey_get(&parent->key, &parent_pub, &parent_pub_len)) {
-			return false;
-		}
-		memcpy(&data[0], parent_pub, parent_pub_len);
-
-	}
-
-	if (33 != parent_pub_len) {
-		goto free_parent_pub;
+		memcpy(&data[0], hp->pub, sizeof(hp->pub));
 	}
 
 	const uint32_t indexBE = htobe32(index);
 	memcpy(&data[33], &indexBE, sizeof(uint32_t));
 
 	uint8_t I[64];
-	hmac_sha512(parent->chaincode.data, (int)sizeof(parent->chaincode.data),
-		    data, (int)sizeof(data), I);
-
-	if (!bitc_key_add_secret(&out_child->key, &parent->key, I)) {
-		goto free_parent_pub;
+	hmac_sha512_Raw(&hp->hmac, data, (int)sizeof(data), I);
+
+	if (bitc_key_add_secret(&out_child->key, &parent->key, I)) {
+		memcpy(out_child->chaincode.data, &I[32], 32);
+		out_child->index = index;
+		out_child->version = parent->version;
+		memcpy(out_child->parent_fingerprint, hp->fingerprint, 4);
+		out_child->depth = parent->depth + 1;
+		result = true;
 	}
 
-	uint8_t md160[RIPEMD160_DIGEST_LENGTH];
-	bu_Hash160(md160, parent_pub, parent_pub_len);
+	memset(data, 0, sizeof(data));
+	memset(I, 0, sizeof(I));
 
-	memcpy(out_child->chaincode.data, &I[32], 32);
-	out_child->index = index;
-	out_child->version = parent->version;
-	memcpy(out_child->parent_fingerprint, md160, 4);
-	out_child->depth = parent->depth + 1;
-	result = true;
+	return result;
+}
 
-free_parent_pub:
-	free(parent_pub);
+bool hd_extended_key_generate_child(const struct hd_extended_key *parent,
+				    uint32_t index,
+				    struct hd_extended_key *out_child)
+{
+	struct hd_parent hp;
+	bool result = false;
+
+	if (hd_parent_init(&hp, parent))
+		result = hd_parent_child(&hp, index, out_child);
 
+	hd_parent_free(&hp);
 	return result;
 }
 
@@ -207,3 +223,26 @@ bool hd_derive(struct hd_extended_key *out_child,
 	return true;
 }
 
+/* children first .. first + n - 1 of one parent, sharing its setup */
+bool hd_derive_range(struct hd_extended_key *out_children,
+		     const struct hd_extended_key *parent,
+		     uint32_t first, unsigned int n)
+{
+	if (n == 0)
+		return true;
+	if ((uint64_t) first + n - 1 > UINT32_MAX)
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		hd_extended_key_init(&out_children[i]);
+
+	struct hd_parent hp;
+	bool result = hd_parent_init(&hp, parent);
+
+	for (i = 0; result && i < n; i++)
+		result = hd_parent_child(&hp, first + i, &out_children[i]);
+
+	hd_parent_free(&hp);
+	return result;
+}
@@ -145,18 +145,11 @@ bool bitc_pubkey_get(const struct bitc_key *key, void **pubkey, size_t *pk_len)
 	*pubkey = NULL;
 	*pk_len = 0;
 
-	secp256k1_context *ctx = get_secp256k1_context();
-	if (!ctx) {
-		return false;
-	}
-
 	void *pk = malloc(33);
 	if (pk) {
-		*pk_len = 33;
-		if (secp256k1_ec_pubkey_serialize(ctx, pk, pk_len,
-						  &key->pubkey,
-						  SECP256K1_EC_COMPRESSED)) {
+		if (bitc_pubkey_ser(key, pk)) {
 			*pubkey = pk;
+			*pk_len = 33;
 			return true;
 		}
 		free(pk);
@@ -164,6 +157,20 @@ bool bitc_pubkey_get(const struct bitc_key *key, void **pubkey, size_t *pk_len)
 	return false;
 }
 
+// Compressed, into the caller's buffer.
+bool bitc_pubkey_ser(const struct bitc_key *key, uint8_t pubkey[33])
+{
+	secp256k1_context *ctx = get_secp256k1_context();
+	if (!ctx) {
+		return false;
+	}
+
+	size_t pk_len = 33;
+	return secp256k1_ec_pubkey_serialize(ctx, pubkey, &pk_len,
+					     &key->pubkey,
+					     SECP256K1_EC_COMPRESSED);
+}
+
 bool bitc_key_secret_get(void *p, size_t len, const struct bitc_key *key)
 {
 	if (!p || sizeof(key->secret) > len) {
@@ -50,17 +50,63 @@ bool bitc_keyset_lookup(const struct bitc_keyset *ks, const void *data, size_t d
 	struct const_buffer buf = { data, data_len };
 	struct bitc_hashtab *ht;
 
-	if (is_pubkeyhash)
+	if (is_pubkeyhash) {
+		if ((data_len == ADDRSET_HASH_LEN) &&
+		    bitc_addrset_lookup(&ks->pubhash_set, data))
+			return true;
 		ht = ks->pubhash;
-	else
+	} else
 		ht = ks->pub;
 
+	if (!bitc_hashtab_size(ht))
+		return false;
+
 	return bitc_hashtab_get_ext(ht, &buf, NULL, NULL);
 }
 
+/* build the static set from an array of n hash160s, plus any already in it */
+bool bitc_keyset_add_hashes(struct bitc_keyset *ks, const void *hashes,
+			    size_t n)
+{
+	const struct bitc_addrset *old = &ks->pubhash_set;
+	size_t n_old = old->n;
+
+	uint8_t *all = malloc((n_old + n) * ADDRSET_HASH_LEN + 1);
+	if (!all)
+		return false;
+	if (n_old)
+		memcpy(all, old->hashes, n_old * ADDRSET_HASH_LEN);
+	memcpy(all + n_old * ADDRSET_HASH_LEN, hashes, n * ADDRSET_HASH_LEN);
+
+	struct bitc_addrset set;
+	bool rc = bitc_addrset_build(&set, all, n_old + n);
+	free(all);
+
+	if (!rc)
+		return false;
+
+	bitc_addrset_free(&ks->pubhash_set);
+	ks->pubhash_set = set;
+	return true;
+}
+
+/* map a set written by bitc_addrset_write, replacing the static set */
+bool bitc_keyset_open_hashes(struct bitc_keyset *ks, const char *filename)
+{
+	struct bitc_addrset set;
+
+	if (!bitc_addrset_open(&set, filename))
+		return false;
+
+	bitc_addrset_free(&ks->pubhash_set);
+	ks->pubhash_set = set;
+	return true;
+}
+
 void bitc_keyset_free(struct bitc_keyset *ks)
 {
 	bitc_hashtab_unref(ks->pub);
 	bitc_hashtab_unref(ks->pubhash);
+	bitc_addrset_free(&ks->pubhash_set);
 }
 
@@ -0,0 +1,716 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/mempool.h>               // for bitc_mempool, etc
+#include <bitc/coredefs.h>              // for COINBASE_MATURITY
+#include <bitc/script.h>                // for bitc_verify_sig
+#include <bitc/util.h>                  // for djb2_hash
+
+#include <limits.h>                     // for UINT_MAX
+#include <stdlib.h>                     // for calloc, free, realloc
+#include <string.h>                     // for memset
+#include <time.h>                       // for time
+
+static unsigned long outpt_hash(const void *key_)
+{
+	const struct bitc_outpt *key = key_;
+
+	return djb2_hash(bu256_hash(&key->hash), &key->n, sizeof(key->n));
+}
+
+static bool outpt_equal_(const void *a, const void *b)
+{
+	return bitc_outpt_equal(a, b);
+}
+
+bool bitc_mempool_init(struct bitc_mempool *mp, size_t max_bytes)
+{
+	memset(mp, 0, sizeof(*mp));
+
+	/* keys point into the entry's own tx; entries freed by hand */
+	mp->map = bitc_hashtab_new(bu256_hash, bu256_equal_);
+	mp->spends = bitc_hashtab_new(outpt_hash, outpt_equal_);
+	if (!mp->map || !mp->spends)
+		goto err_out;
+
+	unsigned int h;
+	for (h = 0; h < MEMPOOL_HEAPS; h++) {
+		mp->heap[h].alloc = 1024;
+		mp->heap[h].ent = calloc(mp->heap[h].alloc,
+					 sizeof(struct mempool_entry *));
+		if (!mp->heap[h].ent)
+			goto err_out;
+	}
+
+	mp->max_bytes = max_bytes;
+
+	return true;
+
+err_out:
+	bitc_mempool_free(mp);
+	return false;
+}
+
+/*
+ * fee rate min-heaps: ancestor fee rate, the order txs are worth
+ * mining in; descendant score, the order they are evicted in, so a
+ * low fee parent is kept for a child that pays for it
+ */
+
+static inline int64_t heap_key(unsigned int h, const struct mempool_entry *e)
+{
+	return (h == MEMPOOL_HEAP_ANC) ? e->anc_feerate : e->desc_score;
+}
+
+static inline bool heap_less(unsigned int h, const struct mempool_entry *a,
+			     const struct mempool_entry *b)
+{
+	if (heap_key(h, a) != heap_key(h, b))
+		return heap_key(h, a) < heap_key(h, b);
+
+	/* equal rates: evict the newer first */
+	return a->time > b->time;
+}
+
+static inline void heap_set(struct bitc_mempool *mp, unsigned int h,
+			    size_t idx, struct mempool_entry *e)
+{
+	mp->heap[h].ent[idx] = e;
+	e->heap_idx[h] = idx;
+}
+
+static void heap_sift_up(struct bitc_mempool *mp, unsigned int h, size_t idx)
+{
+	struct mempool_entry **ent = mp->heap[h].ent;
+	struct mempool_entry *e = ent[idx];
+
+	while (idx > 0) {
+		size_t parent = (idx - 1) / 2;
+		if (!heap_less(h, e, ent[parent]))
+			break;
+
+		heap_set(mp, h, idx, ent[parent]);
+		idx = parent;
+	}
+
+	heap_set(mp, h, idx, e);
+}
+
+static void heap_sift_down(struct bitc_mempool *mp, unsigned int h,
+			   size_t idx)
+{
+	struct mempool_entry **ent = mp->heap[h].ent;
+	size_t len = mp->heap[h].len;
+	struct mempool_entry *e = ent[idx];
+
+	while (1) {
+		size_t child = (idx * 2) + 1;
+		if (child >= len)
+			break;
+
+		if (((child + 1) < len) && heap_less(h, ent[child + 1], ent[child]))
+			child++;
+
+		if (!heap_less(h, ent[child], e))
+			break;
+
+		heap_set(mp, h, idx, ent[child]);
+		idx = child;
+	}
+
+	heap_set(mp, h, idx, e);
+}
+
+/* e's key in heap h changed */
+static void heap_update(struct bitc_mempool *mp, unsigned int h,
+			struct mempool_entry *e)
+{
+	heap_sift_up(mp, h, e->heap_idx[h]);
+	heap_sift_down(mp, h, e->heap_idx[h]);
+}
+
+static bool heap_push(struct bitc_mempool *mp, struct mempool_entry *e)
+{
+	unsigned int h;
+
+	for (h = 0; h < MEMPOOL_HEAPS; h++) {
+		struct mempool_heap *heap = &mp->heap[h];
+
+		if (heap->len == heap->alloc) {
+			size_t new_alloc = heap->alloc * 2;
+			struct mempool_entry **new_ent;
+
+			new_ent = realloc(heap->ent,
+					  new_alloc * sizeof(*new_ent));
+			if (!new_ent)
+				return false;
+
+			heap->ent = new_ent;
+			heap->alloc = new_alloc;
+		}
+	}
+
+	for (h = 0; h < MEMPOOL_HEAPS; h++) {
+		heap_set(mp, h, mp->heap[h].len++, e);
+		heap_sift_up(mp, h, e->heap_idx[h]);
+	}
+
+	return true;
+}
+
+static void heap_remove(struct bitc_mempool *mp, struct mempool_entry *e)
+{
+	unsigned int h;
+
+	for (h = 0; h < MEMPOOL_HEAPS; h++) {
+		size_t idx = e->heap_idx[h];
+		struct mempool_entry *last = mp->heap[h].ent[--mp->heap[h].len];
+
+		if (last == e)
+			continue;
+
+		heap_set(mp, h, idx, last);
+		heap_update(mp, h, last);
+	}
+}
+
+static int64_t feerate(int64_t fee, size_t size)
+{
+	return size ? (fee * 1000) / (int64_t) size : 0;
+}
+
+static void entry_set_feerate(struct mempool_entry *e)
+{
+	e->anc_feerate = feerate(e->anc_fee, e->anc_size);
+}
+
+/*
+ * Descendant score: the better of the tx's own fee rate and its
+ * descendant package's, so a low fee child does not drag down its
+ * parent, and a high fee child lifts it.
+ */
+static void entry_set_score(struct mempool_entry *e)
+{
+	int64_t own = feerate(e->fee, e->size);
+	int64_t pkg = feerate(e->desc_fee, e->desc_size);
+
+	e->desc_score = (own > pkg) ? own : pkg;
+}
+
+static void entry_free(struct mempool_entry *e)
+{
+	bitc_tx_freep(e->tx);
+	parr_free(e->parents, true);
+	parr_free(e->children, true);
+
+	memset(e, 0, sizeof(*e));
+	free(e);
+}
+
+/*
+ * Set walks mark each entry they visit with a fresh walk number, so
+ * membership is one compare rather than a search of the set.
+ */
+static unsigned long walk_begin(struct bitc_mempool *mp)
+{
+	return ++mp->walk;
+}
+
+/* append e and every in-pool descendant of e to set, once each */
+static void collect_descendants(struct mempool_entry *e, parr *set,
+				unsigned long walk)
+{
+	if (e->walk == walk)
+		return;
+
+	e->walk = walk;
+	parr_add(set, e);
+
+	unsigned int i;
+	for (i = 0; i < e->children->len; i++)
+		collect_descendants(parr_idx(e->children, i), set, walk);
+}
+
+/* collect ancestors of e into set; false if more than limit */
+static bool collect_ancestors(const parr *parents, parr *set,
+			      unsigned int limit, unsigned long walk)
+{
+	unsigned int i;
+	for (i = 0; i < parents->len; i++) {
+		struct mempool_entry *p = parr_idx(parents, i);
+
+		if (p->walk == walk)
+			continue;
+
+		p->walk = walk;
+		parr_add(set, p);
+		if (set->len > limit)
+			return false;
+
+		if (!collect_ancestors(p->parents, set, limit, walk))
+			return false;
+	}
+
+	return true;
+}
+
+/* d is leaving the pool: take it out of its ancestors' descendants */
+static void drop_from_ancestors(struct bitc_mempool *mp,
+				const struct mempool_entry *d)
+{
+	if (!d->parents->len)
+		return;
+
+	parr *anc = parr_new(MEMPOOL_MAX_ANCESTORS, NULL);
+	collect_ancestors(d->parents, anc, UINT_MAX, walk_begin(mp));
+
+	unsigned int i;
+	for (i = 0; i < anc->len; i++) {
+		struct mempool_entry *a = parr_idx(anc, i);
+
+		a->n_desc--;
+		a->desc_size -= d->size;
+		a->desc_fee -= d->fee;
+		entry_set_score(a);
+		heap_update(mp, MEMPOOL_HEAP_DESC, a);
+	}
+
+	parr_free(anc, true);
+}
+
+/* unhook e from the pool's indexes and its relatives */
+static void entry_unlink(struct bitc_mempool *mp, struct mempool_entry *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < e->parents->len; i++) {
+		struct mempool_entry *p = parr_idx(e->parents, i);
+		parr_remove(p->children, e);
+	}
+	for (i = 0; i < e->children->len; i++) {
+		struct mempool_entry *c = parr_idx(e->children, i);
+		parr_remove(c->parents, e);
+	}
+
+	for (i = 0; i < e->tx->vin->len; i++) {
+		struct bitc_txin *txin = parr_idx(e->tx->vin, i);
+
+		if (bitc_hashtab_get(mp->spends, &txin->prevout) == e)
+			bitc_hashtab_del(mp->spends, &txin->prevout);
+	}
+
+	bitc_hashtab_del(mp->map, &e->tx->sha256);
+	heap_remove(mp, e);
+	mp->bytes -= e->size;
+}
+
+/* remove e along with everything that spends its outputs */
+static void remove_with_descendants(struct bitc_mempool *mp,
+				    struct mempool_entry *e)
+{
+	parr *set = parr_new(16, NULL);
+	collect_descendants(e, set, walk_begin(mp));
+
+	/* ancestors outside the set are left with correct totals */
+	unsigned int i;
+	for (i = 0; i < set->len; i++)
+		drop_from_ancestors(mp, parr_idx(set, i));
+	for (i = 0; i < set->len; i++)
+		entry_unlink(mp, parr_idx(set, i));
+	for (i = 0; i < set->len; i++)
+		entry_free(parr_idx(set, i));
+
+	parr_free(set, true);
+}
+
+/*
+ * remove e, which was confirmed; descendants stay, but no longer
+ * count e in their ancestor package
+ */
+static void remove_confirmed(struct bitc_mempool *mp, struct mempool_entry *e)
+{
+	parr *set = parr_new(16, NULL);
+	collect_descendants(e, set, walk_begin(mp));
+
+	unsigned int i;
+	for (i = 1; i < set->len; i++) {
+		struct mempool_entry *d = parr_idx(set, i);
+
+		d->n_anc--;
+		d->anc_size -= e->size;
+		d->anc_fee -= e->fee;
+		entry_set_feerate(d);
+		heap_update(mp, MEMPOOL_HEAP_ANC, d);
+	}
+
+	parr_free(set, true);
+
+	drop_from_ancestors(mp, e);
+	entry_unlink(mp, e);
+	entry_free(e);
+
+	mp->n_confirmed++;
+}
+
+/* time the next block's lock times are checked against */
+static int64_t mempool_lock_time(const struct bitc_mempool *mp,
+				 unsigned int height)
+{
+	if (!mp->median_time)
+		return time(NULL);
+
+	return height ? mp->median_time(height - 1) : 0;
+}
+
+/* nLockTime met by the block at height */
+static bool tx_final(const struct bitc_tx *tx, unsigned int height,
+		     int64_t lock_time)
+{
+	if (tx->nLockTime == 0)
+		return true;
+
+	int64_t limit = (tx->nLockTime < LOCKTIME_THRESHOLD) ?
+			(int64_t) height : lock_time;
+	if ((int64_t) tx->nLockTime < limit)
+		return true;
+
+	/* a lock time in the future is ignored if no input can replace */
+	unsigned int i;
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bitc_txin *txin = parr_idx(tx->vin, i);
+		if (txin->nSequence != SEQUENCE_FINAL)
+			return false;
+	}
+
+	return true;
+}
+
+/* BIP 68 relative lock of one input, spending a coin from coin_height */
+static bool txin_seq_lock_met(const struct bitc_mempool *mp, uint32_t seq,
+			      unsigned int coin_height, unsigned int height,
+			      int64_t lock_time)
+{
+	if (seq & SEQUENCE_LOCKTIME_DISABLE_FLAG)
+		return true;
+
+	int64_t lock = seq & SEQUENCE_LOCKTIME_MASK;
+
+	if (!(seq & SEQUENCE_LOCKTIME_TYPE_FLAG))
+		return (coin_height + lock) <= height;
+
+	/* units of 512 seconds, from the median time before the coin */
+	if (!mp->median_time)
+		return false;
+
+	int64_t coin_time = mp->median_time(coin_height ? coin_height - 1 : 0);
+	return (coin_time + (lock << 9) - 1) < lock_time;
+}
+
+bool bitc_mempool_remove(struct bitc_mempool *mp, const bu256_t *txid)
+{
+	struct mempool_entry *e = bitc_mempool_lookup(mp, txid);
+	if (!e)
+		return false;
+
+	remove_with_descendants(mp, e);
+	return true;
+}
+
+/*
+ * Accept a loose transaction.  The pool stores its own copy; the
+ * caller retains tx.  Inputs must be in uset or in the pool, and tx
+ * must be final in the block at height; sequence locks are enforced
+ * under SCRIPT_VERIFY_CHECKSEQUENCEVERIFY.
+ */
+enum mempool_result bitc_mempool_add(struct bitc_mempool *mp,
+				     struct bitc_utxo_set *uset,
+				     const struct bitc_tx *tx_in,
+				     unsigned int height,
+				     unsigned int script_flags)
+{
+	enum mempool_result res;
+	int64_t total_in = 0, total_out = 0;
+	parr *anc = NULL;
+	unsigned long walk;
+	unsigned int i;
+
+	struct mempool_entry *e = calloc(1, sizeof(*e));
+	e->tx = calloc(1, sizeof(struct bitc_tx));
+	bitc_tx_init(e->tx);
+	bitc_tx_copy(e->tx, tx_in);
+	bitc_tx_calc_sha256(e->tx);
+	e->parents = parr_new(0, NULL);
+	e->children = parr_new(0, NULL);
+
+	struct bitc_tx *tx = e->tx;
+
+	if (bitc_mempool_lookup(mp, &tx->sha256)) {
+		res = MP_DUPLICATE;
+		goto err_out;
+	}
+
+	if (!bitc_tx_valid(tx) || bitc_tx_coinbase(tx)) {
+		res = MP_INVALID;
+		goto err_out;
+	}
+
+	int64_t lock_time = mempool_lock_time(mp, height);
+	bool seq_locks = (tx->nVersion >= 2) &&
+			 (script_flags & SCRIPT_VERIFY_CHECKSEQUENCEVERIFY);
+
+	if (!tx_final(tx, height, lock_time)) {
+		res = MP_NON_FINAL;
+		goto err_out;
+	}
+
+	/* locate and verify each input */
+	walk = walk_begin(mp);
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bitc_txin *txin = parr_idx(tx->vin, i);
+		struct bitc_txout *txout = NULL;
+		struct bitc_utxo parent_coin;
+		const struct bitc_utxo *coin;
+		unsigned int coin_height;
+
+		if (bitc_mempool_spender(mp, &txin->prevout)) {
+			res = MP_CONFLICT;
+			goto err_out;
+		}
+
+		struct mempool_entry *parent =
+			bitc_mempool_lookup(mp, &txin->prevout.hash);
+		if (parent) {
+			/* view the unconfirmed parent as a coin */
+			bitc_utxo_init(&parent_coin);
+			bu256_copy(&parent_coin.hash, &parent->tx->sha256);
+			parent_coin.version = parent->tx->nVersion;
+			parent_coin.vout = parent->tx->vout;
+			coin = &parent_coin;
+			coin_height = height;	/* mined next, at best */
+
+			if (parent->walk != walk) {
+				parent->walk = walk;
+				parr_add(e->parents, parent);
+			}
+		} else {
+			coin = bitc_utxo_lookup(uset, &txin->prevout.hash);
+			coin_height = coin ? coin->height : 0;
+			if (coin && coin->is_coinbase &&
+			    ((coin->height + COINBASE_MATURITY) > height)) {
+				res = MP_IMMATURE;
+				goto err_out;
+			}
+		}
+
+		if (coin && coin->vout && (txin->prevout.n < coin->vout->len))
+			txout = parr_idx(coin->vout, txin->prevout.n);
+		if (!txout) {
+			res = MP_MISSING_INPUTS;
+			goto err_out;
+		}
+
+		if (seq_locks &&
+		    !txin_seq_lock_met(mp, txin->nSequence, coin_height,
+				       height, lock_time)) {
+			res = MP_NON_FINAL;
+			goto err_out;
+		}
+
+		total_in += txout->nValue;
+
+		if (!bitc_verify_sig(coin, tx, i, script_flags, txout->nValue)) {
+			res = MP_BAD_SCRIPT;
+			goto err_out;
+		}
+	}
+
+	for (i = 0; i < tx->vout->len; i++) {
+		struct bitc_txout *txout = parr_idx(tx->vout, i);
+		total_out += txout->nValue;
+	}
+
+	if (!bitc_valid_value(total_in) || (total_out > total_in)) {
+		res = MP_BAD_FEE;
+		goto err_out;
+	}
+
+	e->size = bitc_tx_ser_size(tx);
+	e->fee = total_in - total_out;
+	e->time = time(NULL);
+
+	/* ancestor package; none may grow too many descendants */
+	anc = parr_new(MEMPOOL_MAX_ANCESTORS, NULL);
+	if (!collect_ancestors(e->parents, anc, MEMPOOL_MAX_ANCESTORS - 1,
+			       walk_begin(mp))) {
+		res = MP_TOO_LONG;
+		goto err_out;
+	}
+
+	e->n_anc = anc->len + 1;
+	e->anc_size = e->size;
+	e->anc_fee = e->fee;
+	for (i = 0; i < anc->len; i++) {
+		struct mempool_entry *a = parr_idx(anc, i);
+
+		if ((a->n_desc >= MEMPOOL_MAX_DESCENDANTS) ||
+		    ((a->desc_size + e->size) > MEMPOOL_MAX_DESC_BYTES)) {
+			res = MP_TOO_LONG;
+			goto err_out;
+		}
+
+		e->anc_size += a->size;
+		e->anc_fee += a->fee;
+	}
+	entry_set_feerate(e);
+
+	e->n_desc = 1;
+	e->desc_size = e->size;
+	e->desc_fee = e->fee;
+	entry_set_score(e);
+
+	/* a full pool only takes txs that pay better than it evicts */
+	struct mempool_entry *worst = bitc_mempool_worst(mp);
+	if (worst && ((mp->bytes + e->size) > mp->max_bytes) &&
+	    (e->desc_score <= worst->desc_score)) {
+		res = MP_FULL;
+		goto err_out;
+	}
+
+	/* insert */
+	if (!heap_push(mp, e)) {
+		res = MP_FULL;
+		goto err_out;
+	}
+
+	bitc_hashtab_put(mp->map, &tx->sha256, e);
+	for (i = 0; i < tx->vin->len; i++) {
+		struct bitc_txin *txin = parr_idx(tx->vin, i);
+		bitc_hashtab_put(mp->spends, &txin->prevout, e);
+	}
+	for (i = 0; i < e->parents->len; i++) {
+		struct mempool_entry *p = parr_idx(e->parents, i);
+		parr_add(p->children, e);
+	}
+	for (i = 0; i < anc->len; i++) {
+		struct mempool_entry *a = parr_idx(anc, i);
+
+		a->n_desc++;
+		a->desc_size += e->size;
+		a->desc_fee += e->fee;
+		entry_set_score(a);
+		heap_update(mp, MEMPOOL_HEAP_DESC, a);
+	}
+
+	parr_free(anc, true);
+	anc = NULL;
+
+	mp->bytes += e->size;
+
+	/* enforce byte budget, lowest descendant score first */
+	bu256_t txid;
+	bu256_copy(&txid, &tx->sha256);
+
+	while (mp->bytes > mp->max_bytes) {
+		remove_with_descendants(mp, bitc_mempool_worst(mp));
+		mp->n_evicted++;
+	}
+
+	if (!bitc_mempool_lookup(mp, &txid))
+		return MP_FULL;
+
+	return MP_OK;
+
+err_out:
+	if (anc)
+		parr_free(anc, true);
+	entry_free(e);
+	return res;
+}
+
+/* drop txs confirmed by block, and any txs its inputs conflict with */
+void bitc_mempool_remove_block(struct bitc_mempool *mp,
+			       const struct bitc_block *block)
+{
+	if (!block->vtx || !bitc_mempool_size(mp))
+		return;
+
+	unsigned int i, j;
+	for (i = 0; i < block->vtx->len; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+		bitc_tx_calc_sha256(tx);
+
+		struct mempool_entry *e = bitc_mempool_lookup(mp, &tx->sha256);
+		if (e)
+			remove_confirmed(mp, e);
+
+		if (bitc_tx_coinbase(tx))
+			continue;
+
+		for (j = 0; j < tx->vin->len; j++) {
+			struct bitc_txin *txin = parr_idx(tx->vin, j);
+			struct mempool_entry *spender;
+
+			spender = bitc_mempool_spender(mp, &txin->prevout);
+			if (spender)
+				remove_with_descendants(mp, spender);
+		}
+	}
+}
+
+/* copy out txids (and optionally txs); arrays must hold bitc_mempool_size() */
+void bitc_mempool_txids(const struct bitc_mempool *mp, bu256_t *txids,
+			struct bitc_tx **txs)
+{
+	const struct mempool_heap *heap = &mp->heap[MEMPOOL_HEAP_ANC];
+	size_t i;
+
+	for (i = 0; i < heap->len; i++) {
+		bu256_copy(&txids[i], &heap->ent[i]->tx->sha256);
+		if (txs)
+			txs[i] = heap->ent[i]->tx;
+	}
+}
+
+const char *mempool_result_str(enum mempool_result res)
+{
+	switch (res) {
+	case MP_OK:			return "ok";
+	case MP_DUPLICATE:		return "duplicate";
+	case MP_INVALID:		return "invalid";
+	case MP_MISSING_INPUTS:		return "missing inputs";
+	case MP_CONFLICT:		return "conflict";
+	case MP_IMMATURE:		return "immature coinbase spend";
+	case MP_BAD_SCRIPT:		return "script verification failed";
+	case MP_BAD_FEE:		return "bad fee";
+	case MP_TOO_LONG:		return "too many relatives";
+	case MP_FULL:			return "mempool full";
+	case MP_NON_FINAL:		return "non-final";
+	}
+
+	return "unknown";
+}
+
+void bitc_mempool_free(struct bitc_mempool *mp)
+{
+	if (!mp)
+		return;
+
+	struct mempool_heap *heap = &mp->heap[MEMPOOL_HEAP_ANC];
+	size_t i;
+
+	for (i = 0; i < heap->len; i++)
+		entry_free(heap->ent[i]);
+
+	if (mp->map)
+		bitc_hashtab_unref(mp->map);
+	if (mp->spends)
+		bitc_hashtab_unref(mp->spends);
+	unsigned int h;
+	for (h = 0; h < MEMPOOL_HEAPS; h++)
+		free(mp->heap[h].ent);
+
+	memset(mp, 0, sizeof(*mp));
+}
@@ -364,3 +364,307 @@ void msg_vinv_push(struct msg_vinv *mv, uint32_t msg_type,
 
 	parr_add(mv->invs, inv);
 }
+
+bool deser_msg_sendcmpct(struct msg_sendcmpct *msc, struct const_buffer *buf)
+{
+	msg_sendcmpct_init(msc);
+
+	if (!deser_bool(&msc->announce, buf)) return false;
+	if (!deser_u64(&msc->version, buf)) return false;
+	return true;
+}
+
+cstring *ser_msg_sendcmpct(const struct msg_sendcmpct *msc)
+{
+	cstring *s = cstr_new_sz(9);
+
+	ser_bool(s, msc->announce);
+	ser_u64(s, msc->version);
+
+	return s;
+}
+
+void bitc_prefilled_tx_freep(void *p)
+{
+	struct bitc_prefilled_tx *ptx = p;
+	if (!ptx)
+		return;
+
+	bitc_tx_free(&ptx->tx);
+
+	memset(ptx, 0, sizeof(*ptx));
+	free(ptx);
+}
+
+/*
+ * Block indexes are differentially encoded on the wire; each
+ * entry is the gap since the previous index, less one.  Decoded
+ * indexes are limited to 16 bits, as in the reference client.
+ */
+static bool cmpct_index_decode(uint32_t *idx, uint32_t diff, bool first,
+			       uint32_t last)
+{
+	uint64_t v = first ? diff : (uint64_t) last + diff + 1;
+	if (v > 0xffff)
+		return false;
+
+	*idx = (uint32_t) v;
+	return true;
+}
+
+static inline uint32_t cmpct_index_encode(uint32_t idx, bool first,
+					  uint32_t last)
+{
+	return first ? idx : idx - last - 1;
+}
+
+bool deser_msg_cmpctblock(struct msg_cmpctblock *mcb, struct const_buffer *buf)
+{
+	msg_cmpctblock_free(mcb);
+
+	if (!deser_bitc_block_hdr(&mcb->hdr, buf)) return false;
+	if (!deser_u64(&mcb->nonce, buf)) return false;
+
+	uint32_t vlen;
+	if (!deser_varlen(&vlen, buf)) return false;
+	if (((uint64_t) vlen * CMPCT_SHORTID_BYTES) > buf->len)
+		return false;
+
+	mcb->n_short_ids = vlen;
+	mcb->short_ids = calloc(vlen ? vlen : 1, sizeof(uint64_t));
+	if (!mcb->short_ids)
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < vlen; i++) {
+		const unsigned char *p = buf->p;
+		uint64_t v = 0;
+		unsigned int j;
+
+		for (j = 0; j < CMPCT_SHORTID_BYTES; j++)
+			v |= ((uint64_t) p[j]) << (j * 8);
+
+		mcb->short_ids[i] = v;
+		buf->p += CMPCT_SHORTID_BYTES;
+		buf->len -= CMPCT_SHORTID_BYTES;
+	}
+
+	if (!deser_varlen(&vlen, buf)) goto err_out;
+
+	mcb->prefilled = parr_new(vlen, bitc_prefilled_tx_freep);
+
+	uint32_t last = 0;
+	for (i = 0; i < vlen; i++) {
+		struct bitc_prefilled_tx *ptx;
+		uint32_t diff;
+
+		if (!deser_varlen(&diff, buf)) goto err_out;
+
+		ptx = calloc(1, sizeof(*ptx));
+		bitc_tx_init(&ptx->tx);
+		if (!cmpct_index_decode(&ptx->index, diff, (i == 0), last) ||
+		    !deser_bitc_tx(&ptx->tx, buf)) {
+			bitc_prefilled_tx_freep(ptx);
+			goto err_out;
+		}
+
+		last = ptx->index;
+		parr_add(mcb->prefilled, ptx);
+	}
+
+	return true;
+
+err_out:
+	msg_cmpctblock_free(mcb);
+	return false;
+}
+
+cstring *ser_msg_cmpctblock(const struct msg_cmpctblock *mcb)
+{
+	cstring *s = cstr_new_sz(80 + 8 + 9 +
+				 (mcb->n_short_ids * CMPCT_SHORTID_BYTES));
+
+	ser_bitc_block_hdr(s, &mcb->hdr);
+	ser_u64(s, mcb->nonce);
+
+	ser_varlen(s, mcb->n_short_ids);
+
+	unsigned int i;
+	for (i = 0; i < mcb->n_short_ids; i++) {
+		unsigned char p[CMPCT_SHORTID_BYTES];
+		unsigned int j;
+
+		for (j = 0; j < CMPCT_SHORTID_BYTES; j++)
+			p[j] = (mcb->short_ids[i] >> (j * 8)) & 0xff;
+
+		ser_bytes(s, p, sizeof(p));
+	}
+
+	if (!mcb->prefilled) {
+		ser_varlen(s, 0);
+		return s;
+	}
+
+	ser_varlen(s, mcb->prefilled->len);
+
+	uint32_t last = 0;
+	for (i = 0; i < mcb->prefilled->len; i++) {
+		struct bitc_prefilled_tx *ptx;
+
+		ptx = parr_idx(mcb->prefilled, i);
+
+		ser_varlen(s, cmpct_index_encode(ptx->index, (i == 0), last));
+		ser_bitc_tx(s, &ptx->tx);
+
+		last = ptx->index;
+	}
+
+	return s;
+}
+
+void msg_cmpctblock_free(struct msg_cmpctblock *mcb)
+{
+	if (!mcb)
+		return;
+
+	bitc_block_free(&mcb->hdr);
+
+	free(mcb->short_ids);
+	mcb->short_ids = NULL;
+	mcb->n_short_ids = 0;
+
+	if (mcb->prefilled) {
+		parr_free(mcb->prefilled, true);
+		mcb->prefilled = NULL;
+	}
+}
+
+bool deser_msg_getblocktxn(struct msg_getblocktxn *mgt, struct const_buffer *buf)
+{
+	msg_getblocktxn_free(mgt);
+
+	if (!deser_u256(&mgt->blockhash, buf)) return false;
+
+	uint32_t vlen;
+	if (!deser_varlen(&vlen, buf)) return false;
+	if (vlen > buf->len)		/* at least one byte per index */
+		return false;
+
+	mgt->n_indexes = vlen;
+	mgt->indexes = calloc(vlen ? vlen : 1, sizeof(uint32_t));
+	if (!mgt->indexes)
+		return false;
+
+	uint32_t last = 0;
+	unsigned int i;
+	for (i = 0; i < vlen; i++) {
+		uint32_t diff;
+
+		if (!deser_varlen(&diff, buf)) goto err_out;
+		if (!cmpct_index_decode(&mgt->indexes[i], diff, (i == 0), last))
+			goto err_out;
+
+		last = mgt->indexes[i];
+	}
+
+	return true;
+
+err_out:
+	msg_getblocktxn_free(mgt);
+	return false;
+}
+
+cstring *ser_msg_getblocktxn(const struct msg_getblocktxn *mgt)
+{
+	cstring *s = cstr_new_sz(32 + 5 + mgt->n_indexes);
+
+	ser_u256(s, &mgt->blockhash);
+	ser_varlen(s, mgt->n_indexes);
+
+	uint32_t last = 0;
+	unsigned int i;
+	for (i = 0; i < mgt->n_indexes; i++) {
+		ser_varlen(s, cmpct_index_encode(mgt->indexes[i], (i == 0), last));
+		last = mgt->indexes[i];
+	}
+
+	return s;
+}
+
+void msg_getblocktxn_free(struct msg_getblocktxn *mgt)
+{
+	if (!mgt)
+		return;
+
+	free(mgt->indexes);
+	mgt->indexes = NULL;
+	mgt->n_indexes = 0;
+}
+
+bool deser_msg_blocktxn(struct msg_blocktxn *mbt, struct const_buffer *buf)
+{
+	msg_blocktxn_free(mbt);
+
+	if (!deser_u256(&mbt->blockhash, buf)) return false;
+
+	uint32_t vlen;
+	if (!deser_varlen(&vlen, buf)) return false;
+
+	mbt->txs = parr_new(vlen, bitc_tx_freep);
+
+	unsigned int i;
+	for (i = 0; i < vlen; i++) {
+		struct bitc_tx *tx;
+
+		tx = calloc(1, sizeof(*tx));
+		bitc_tx_init(tx);
+		if (!deser_bitc_tx(tx, buf)) {
+			bitc_tx_freep(tx);
+			goto err_out;
+		}
+
+		parr_add(mbt->txs, tx);
+	}
+
+	return true;
+
+err_out:
+	msg_blocktxn_free(mbt);
+	return false;
+}
+
+cstring *ser_msg_blocktxn(const struct msg_blocktxn *mbt)
+{
+	cstring *s = cstr_new(NULL);
+
+	ser_u256(s, &mbt->blockhash);
+
+	if (!mbt->txs) {
+		ser_varlen(s, 0);
+		return s;
+	}
+
+	ser_varlen(s, mbt->txs->len);
+
+	unsigned int i;
+	for (i = 0; i < mbt->txs->len; i++) {
+		struct bitc_tx *tx;
+
+		tx = parr_idx(mbt->txs, i);
+
+		ser_bitc_tx(s, tx);
+	}
+
+	return s;
+}
+
+void msg_blocktxn_free(struct msg_blocktxn *mbt)
+{
+	if (!mbt)
+		return;
+
+	if (mbt->txs) {
+		parr_free(mbt->txs, true);
+		mbt->txs = NULL;
+	}
+}
@@ -0,0 +1,372 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/net/capture.h>          // for nc_capture, nc_replay, etc
+#include <bitc/net/net.h>              // for nc_conns_adopt
+#include <bitc/net/peerman.h>          // for peer, peer_init, etc
+#include <bitc/buffer.h>               // for const_buffer
+#include <bitc/cstr.h>                 // for cstring, cstr_free, etc
+#include <bitc/log.h>                  // for log_error, log_info
+#include <bitc/serialize.h>            // for ser_u32, deser_u32, etc
+
+#include <errno.h>                      // for errno, EAGAIN, EINTR
+#include <fcntl.h>                      // for fcntl, O_NONBLOCK
+#include <poll.h>                       // for poll, POLLIN, POLLOUT
+#include <stdlib.h>                     // for calloc, free, realloc
+#include <string.h>                     // for memcpy, memcmp, strerror
+#include <sys/socket.h>                 // for socketpair, send, etc
+#include <time.h>                       // for clock_gettime, nanosleep
+#include <unistd.h>                     // for close, read, write
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int64_t cap_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Capture
+ */
+
+struct nc_capture *nc_capture_open(const char *filename)
+{
+	struct nc_capture *cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+
+	cap->f = fopen(filename, "wb");
+	if (!cap->f)
+		goto err_out;
+
+	if (fwrite(NC_CAPTURE_MAGIC, 8, 1, cap->f) != 1)
+		goto err_out;
+
+	pthread_mutex_init(&cap->lock, NULL);
+	cap->t0_us = cap_now_us();
+
+	return cap;
+
+err_out:
+	log_error("capture: %s: %s", filename, strerror(errno));
+	if (cap->f)
+		fclose(cap->f);
+	free(cap);
+	return NULL;
+}
+
+bool nc_capture_write(struct nc_capture *cap, uint32_t conn_id,
+		      const unsigned char *ip, uint16_t port,
+		      const unsigned char *hdr,
+		      const void *data, uint32_t data_len)
+{
+	cstring *s = cstr_new_sz(NC_CAPTURE_REC_SZ + P2P_HDR_SZ);
+
+	ser_u64(s, cap_now_us() - cap->t0_us);
+	ser_u32(s, conn_id);
+	ser_bytes(s, ip, 16);
+	ser_u16(s, port);
+	ser_bytes(s, hdr, P2P_HDR_SZ);
+
+	/* one record at a time, whichever thread received it */
+	pthread_mutex_lock(&cap->lock);
+	bool rc = (fwrite(s->str, s->len, 1, cap->f) == 1) &&
+		  (!data_len || (fwrite(data, data_len, 1, cap->f) == 1));
+	pthread_mutex_unlock(&cap->lock);
+
+	cstr_free(s, true);
+	return rc;
+}
+
+void nc_capture_close(struct nc_capture *cap)
+{
+	if (!cap)
+		return;
+
+	fclose(cap->f);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+}
+
+bool nc_capture_read_magic(FILE *f)
+{
+	char magic[8];
+
+	return (fread(magic, sizeof(magic), 1, f) == 1) &&
+	       !memcmp(magic, NC_CAPTURE_MAGIC, sizeof(magic));
+}
+
+/* next record; the payload is skipped unless want_data */
+bool nc_capture_read(FILE *f, struct nc_capture_rec *rec, bool want_data)
+{
+	unsigned char raw[NC_CAPTURE_REC_SZ + P2P_HDR_SZ];
+
+	if (fread(raw, sizeof(raw), 1, f) != 1)
+		return false;
+
+	struct const_buffer buf = { raw, sizeof(raw) };
+	uint64_t t_us;
+	struct p2p_message_hdr hdr;
+
+	if (!deser_u64(&t_us, &buf) ||
+	    !deser_u32(&rec->conn_id, &buf) ||
+	    !deser_bytes(rec->ip, &buf, 16) ||
+	    !deser_u16(&rec->port, &buf) ||
+	    !deser_bytes(rec->hdr, &buf, P2P_HDR_SZ))
+		return false;
+
+	rec->t_us = (int64_t) t_us;
+
+	parse_message_hdr(&hdr, rec->hdr);
+	rec->data_len = hdr.data_len;
+
+	if (!want_data)
+		return fseeko(f, rec->data_len, SEEK_CUR) == 0;
+
+	void *data = realloc(rec->data, rec->data_len ? rec->data_len : 1);
+	if (!data)
+		return false;
+	rec->data = data;
+
+	return !rec->data_len || (fread(rec->data, rec->data_len, 1, f) == 1);
+}
+
+void nc_capture_rec_free(struct nc_capture_rec *rec)
+{
+	free(rec->data);
+	rec->data = NULL;
+}
+
+/*
+ * Replay
+ */
+
+static struct nc_replay_conn *replay_conn(struct nc_replay *rp, uint32_t id)
+{
+	unsigned int i;
+	for (i = 0; i < rp->n_conns; i++)
+		if (rp->conns[i].id == id)
+			return &rp->conns[i];
+
+	return NULL;
+}
+
+/* our side's traffic is of no interest, but must not back up */
+static void replay_drain(struct nc_replay *rp)
+{
+	unsigned char buf[4096];
+	unsigned int i;
+
+	for (i = 0; i < rp->n_conns; i++) {
+		if (rp->conns[i].fd < 0)
+			continue;
+		while (read(rp->conns[i].fd, buf, sizeof(buf)) > 0)
+			;
+	}
+}
+
+static bool replay_write(struct nc_replay *rp, int fd,
+			 const void *p_, size_t len)
+{
+	const unsigned char *p = p_;
+
+	while (len > 0) {
+		ssize_t wrc = send(fd, p, len, MSG_NOSIGNAL);
+		if (wrc > 0) {
+			p += wrc;
+			len -= wrc;
+			continue;
+		}
+		if ((wrc < 0) && (errno != EAGAIN) && (errno != EINTR))
+			return false;
+
+		/* full: let our side catch up, and keep reading its replies */
+		replay_drain(rp);
+		struct pollfd pfd = { fd, POLLOUT };
+		poll(&pfd, 1, 100);
+	}
+
+	return true;
+}
+
+static void replay_sleep_until(int64_t t_us)
+{
+	int64_t delta = t_us - cap_now_us();
+	if (delta <= 0)
+		return;
+
+	struct timespec ts = { delta / 1000000, (delta % 1000000) * 1000 };
+	while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR))
+		;
+}
+
+static void *replay_main(void *priv)
+{
+	struct nc_replay *rp = priv;
+	struct nc_capture_rec rec = {};
+	int64_t t_start = cap_now_us();
+	int64_t t_first = -1;
+
+	while (nc_capture_read(rp->f, &rec, true)) {
+		struct nc_replay_conn *rc = replay_conn(rp, rec.conn_id);
+		if (!rc || (rc->fd < 0))
+			continue;
+
+		if (rp->speed > 0) {
+			if (t_first < 0)
+				t_first = rec.t_us;
+			replay_sleep_until(t_start +
+				(int64_t) ((rec.t_us - t_first) / rp->speed));
+		}
+
+		if (!replay_write(rp, rc->fd, rec.hdr, P2P_HDR_SZ) ||
+		    !replay_write(rp, rc->fd, rec.data, rec.data_len)) {
+			/* our side dropped it */
+			close(rc->fd);
+			rc->fd = -1;
+			continue;
+		}
+
+		replay_drain(rp);
+
+		rp->n_msgs++;
+		rp->n_bytes += P2P_HDR_SZ + rec.data_len;
+	}
+
+	nc_capture_rec_free(&rec);
+
+	/* EOF tells our side the peers are gone */
+	unsigned int i;
+	for (i = 0; i < rp->n_conns; i++) {
+		if (rp->conns[i].fd >= 0) {
+			close(rp->conns[i].fd);
+			rp->conns[i].fd = -1;
+		}
+	}
+
+	__atomic_store_n(&rp->done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* list every connection in the file, then rewind */
+static bool replay_scan(struct nc_replay *rp)
+{
+	struct nc_capture_rec rec = {};
+	off_t start = ftello(rp->f);
+
+	while (nc_capture_read(rp->f, &rec, false)) {
+		if (replay_conn(rp, rec.conn_id))
+			continue;
+
+		struct nc_replay_conn *conns;
+		conns = realloc(rp->conns, (rp->n_conns + 1) * sizeof(*conns));
+		if (!conns)
+			return false;
+		rp->conns = conns;
+
+		struct nc_replay_conn *rc = &rp->conns[rp->n_conns++];
+		rc->id = rec.conn_id;
+		rc->fd = -1;
+		memcpy(rc->ip, rec.ip, 16);
+		rc->port = rec.port;
+	}
+
+	return fseeko(rp->f, start, SEEK_SET) == 0;
+}
+
+bool nc_replay_start(struct nc_replay *rp, struct net_child_info *nci,
+		     const char *filename, double speed)
+{
+	memset(rp, 0, sizeof(*rp));
+	rp->speed = speed;
+
+	rp->f = fopen(filename, "rb");
+	if (!rp->f) {
+		log_error("replay: %s: %s", filename, strerror(errno));
+		return false;
+	}
+
+	if (!nc_capture_read_magic(rp->f) || !replay_scan(rp)) {
+		log_error("replay: %s: not a capture file", filename);
+		goto err_out;
+	}
+
+	/* replayed peers are not to be dialed for real */
+	nci->no_dial = true;
+
+	unsigned int i;
+	for (i = 0; i < rp->n_conns; i++) {
+		struct nc_replay_conn *rc = &rp->conns[i];
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			log_error("replay: socketpair: %s", strerror(errno));
+			goto err_out;
+		}
+
+		rc->fd = sv[0];
+		fcntl(rc->fd, F_SETFL, fcntl(rc->fd, F_GETFL) | O_NONBLOCK);
+
+		struct peer peer;
+		peer_init(&peer);
+		memcpy(peer.addr.ip, rc->ip, 16);
+		peer.addr.port = rc->port;
+
+		bool ok = nc_conns_adopt(nci, sv[1], &peer);
+		peer_free(&peer);
+		if (!ok) {
+			log_error("replay: cannot adopt connection %u", rc->id);
+			goto err_out;
+		}
+	}
+
+	log_info("replay: %s: %u connections, speed %g",
+		 filename, rp->n_conns, speed);
+
+	if (pthread_create(&rp->thread, NULL, replay_main, rp)) {
+		log_error("replay: cannot start thread");
+		goto err_out;
+	}
+	rp->started = true;
+
+	return true;
+
+err_out:
+	nc_replay_free(rp);
+	return false;
+}
+
+bool nc_replay_done(const struct nc_replay *rp)
+{
+	return __atomic_load_n(&rp->done, __ATOMIC_ACQUIRE);
+}
+
+void nc_replay_free(struct nc_replay *rp)
+{
+	if (rp->started) {
+		pthread_join(rp->thread, NULL);
+		rp->started = false;
+	}
+
+	unsigned int i;
+	for (i = 0; i < rp->n_conns; i++)
+		if (rp->conns[i].fd >= 0)
+			close(rp->conns[i].fd);
+
+	free(rp->conns);
+	rp->conns = NULL;
+	rp->n_conns = 0;
+
+	if (rp->f) {
+		fclose(rp->f);
+		rp->f = NULL;
+	}
+}
@@ -6,12 +6,18 @@
 
 #include "bitc/net/dns.h"
 #include <bitc/core.h>                 // for bitc_address, etc
+#include <bitc/log.h>                  // for log_error
 #include <bitc/util.h>                 // for ARRAY_SIZE
 
+#include <errno.h>                      // for errno, EINTR, EAGAIN
+#include <fcntl.h>                      // for fcntl, O_NONBLOCK
+#include <poll.h>                       // for poll, POLLIN, pollfd
+#include <pthread.h>                    // for pthread_create, etc
 #include <stdint.h>                     // for uint32_t
 #include <stdlib.h>                     // for NULL, calloc, free
-#include <string.h>                     // for memset, memcpy
+#include <string.h>                     // for memset, memcpy, strdup, etc
 #include <time.h>                       // for time
+#include <unistd.h>                     // for close, pipe, read, write
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -83,13 +89,231 @@ clist *bu_dns_lookup(clist *l, const char *seedname, unsigned int def_port)
 	return l;
 }
 
-clist *bu_dns_seed_addrs(void)
+struct bu_dns_seeder {
+	pthread_mutex_t		lock;
+	unsigned int		refs;		/* owner, plus live threads */
+	bool			closed;		/* owner let go */
+
+	char			**names;
+	unsigned int		n_names;
+	unsigned int		next;		/* next name to look up */
+	unsigned int		n_done;
+	unsigned int		def_port;
+	bu_dns_lookup_fn	lookup;
+
+	clist			*addrs;		/* resolved, not yet taken */
+	int			notify_fd[2];	/* a byte per finished lookup */
+};
+
+static void dns_seeder_destroy(struct bu_dns_seeder *ds)
 {
+	clist_free_ext(ds->addrs, free);
+
 	unsigned int i;
+	for (i = 0; i < ds->n_names; i++)
+		free(ds->names[i]);
+	free(ds->names);
+
+	if (ds->notify_fd[0] >= 0)
+		close(ds->notify_fd[0]);
+	if (ds->notify_fd[1] >= 0)
+		close(ds->notify_fd[1]);
+
+	pthread_mutex_destroy(&ds->lock);
+	free(ds);
+}
+
+static void dns_seeder_unref(struct bu_dns_seeder *ds)
+{
+	pthread_mutex_lock(&ds->lock);
+	bool last = (--ds->refs == 0);
+	pthread_mutex_unlock(&ds->lock);
+
+	if (last)
+		dns_seeder_destroy(ds);
+}
+
+static void *dns_seeder_main(void *priv)
+{
+	struct bu_dns_seeder *ds = priv;
+
+	pthread_mutex_lock(&ds->lock);
+
+	while (!ds->closed && (ds->next < ds->n_names)) {
+		const char *name = ds->names[ds->next++];
+
+		pthread_mutex_unlock(&ds->lock);
+		clist *l = ds->lookup(NULL, name, ds->def_port);
+		pthread_mutex_lock(&ds->lock);
+
+		ds->n_done++;
+
+		if (ds->closed) {
+			clist_free_ext(l, free);
+			continue;
+		}
+
+		/* splice onto the pending list, keeping lookup order */
+		if (!ds->addrs)
+			ds->addrs = l;
+		else if (l) {
+			clist *last = clist_last(ds->addrs);
+			last->next = l;
+			l->prev = last;
+		}
+
+		/* a full pipe already means "wake up" */
+		unsigned char b = 1;
+		if ((write(ds->notify_fd[1], &b, 1) < 0) && (errno != EAGAIN)) {
+			log_error("dns: notify: %s", strerror(errno));
+		}
+	}
+
+	pthread_mutex_unlock(&ds->lock);
+
+	dns_seeder_unref(ds);
+	return NULL;
+}
+
+struct bu_dns_seeder *bu_dns_seeder_new(const char **names,
+					unsigned int n_names,
+					unsigned int def_port,
+					bu_dns_lookup_fn lookup)
+{
+	struct bu_dns_seeder *ds = calloc(1, sizeof(*ds));
+	if (!ds)
+		return NULL;
+
+	pthread_mutex_init(&ds->lock, NULL);
+	ds->refs = 1;
+	ds->def_port = def_port;
+	ds->lookup = lookup ? lookup : bu_dns_lookup;
+	ds->notify_fd[0] = ds->notify_fd[1] = -1;
+
+	ds->names = calloc(n_names ? n_names : 1, sizeof(char *));
+	if (!ds->names)
+		goto err_out;
+
+	unsigned int i;
+	for (i = 0; i < n_names; i++) {
+		ds->names[i] = strdup(names[i]);
+		if (!ds->names[i])
+			goto err_out;
+		ds->n_names++;
+	}
+
+	if (pipe(ds->notify_fd) < 0) {
+		ds->notify_fd[0] = ds->notify_fd[1] = -1;
+		goto err_out;
+	}
+	fcntl(ds->notify_fd[0], F_SETFL,
+	      fcntl(ds->notify_fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(ds->notify_fd[1], F_SETFL,
+	      fcntl(ds->notify_fd[1], F_GETFL) | O_NONBLOCK);
+
+	/* one thread per name, up to a limit; each takes the next name */
+	unsigned int n_threads = MIN(n_names, BU_DNS_MAX_THREADS);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < n_threads; i++) {
+		pthread_t thread;
+
+		pthread_mutex_lock(&ds->lock);
+		ds->refs++;
+		pthread_mutex_unlock(&ds->lock);
+
+		if (pthread_create(&thread, &attr, dns_seeder_main, ds)) {
+			pthread_mutex_lock(&ds->lock);
+			ds->refs--;
+			pthread_mutex_unlock(&ds->lock);
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	/* no thread at all: resolve nothing, rather than hang */
+	if (n_names && (i == 0))
+		goto err_out;
+
+	return ds;
+
+err_out:
+	dns_seeder_destroy(ds);
+	return NULL;
+}
+
+struct bu_dns_seeder *bu_dns_seeder_start(void)
+{
+	return bu_dns_seeder_new(dns_seeds, ARRAY_SIZE(dns_seeds), 8333, NULL);
+}
+
+clist *bu_dns_seeder_take(struct bu_dns_seeder *ds, bool *done)
+{
+	unsigned char buf[64];
+
+	while (read(ds->notify_fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&ds->lock);
+	clist *l = ds->addrs;
+	ds->addrs = NULL;
+	if (done)
+		*done = (ds->n_done == ds->n_names);
+	pthread_mutex_unlock(&ds->lock);
+
+	return l;
+}
+
+int bu_dns_seeder_fd(const struct bu_dns_seeder *ds)
+{
+	return ds->notify_fd[0];
+}
+
+void bu_dns_seeder_free(struct bu_dns_seeder *ds)
+{
+	if (!ds)
+		return;
+
+	/* threads still resolving free the rest on their way out */
+	pthread_mutex_lock(&ds->lock);
+	ds->closed = true;
+	pthread_mutex_unlock(&ds->lock);
+
+	dns_seeder_unref(ds);
+}
+
+clist *bu_dns_seed_addrs(void)
+{
+	struct bu_dns_seeder *ds = bu_dns_seeder_start();
 	clist *l = NULL;
+	bool done = false;
+
+	if (!ds)
+		return NULL;
+
+	/* all seeds at once; wait for the slowest */
+	while (!done) {
+		clist *more = bu_dns_seeder_take(ds, &done);
+
+		if (!l)
+			l = more;
+		else if (more) {
+			clist *last = clist_last(l);
+			last->next = more;
+			more->prev = last;
+		}
+
+		if (!done) {
+			struct pollfd pfd = { bu_dns_seeder_fd(ds), POLLIN };
+			if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+				break;
+		}
+	}
 
-	for (i = 0; i < ARRAY_SIZE(dns_seeds); i++)
-		l = bu_dns_lookup(l, dns_seeds[i], 8333);
+	bu_dns_seeder_free(ds);
 
 	return l;
 }
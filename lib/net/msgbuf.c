@@ -0,0 +1,174 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/net/msgbuf.h>           // for nc_msgbuf, etc
+#include <bitc/endian.h>               // for htole32
+#include <bitc/message.h>              // for P2P_HDR_SZ
+#include <bitc/util.h>                 // for bu_Hash4
+
+#include <pthread.h>                    // for pthread_mutex_lock, etc
+#include <stdlib.h>                     // for malloc, free
+#include <string.h>                     // for memcpy, memset, strncpy
+
+static const size_t nc_msgbuf_class_sz[NC_MSGBUF_CLASSES] = {
+	256,
+	4 * 1024,
+	64 * 1024,
+	1024 * 1024,
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct nc_msgbuf	*free[NC_MSGBUF_CLASSES];
+	struct nc_msgbuf_stats	stats;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* spares kept in a class: NC_MSGBUF_POOL_MAX, or fewer big ones */
+static unsigned int nc_msgbuf_pool_max(unsigned int size_class)
+{
+	size_t n = NC_MSGBUF_POOL_BYTES / nc_msgbuf_class_sz[size_class];
+
+	return (n < NC_MSGBUF_POOL_MAX) ? n : NC_MSGBUF_POOL_MAX;
+}
+
+static unsigned int nc_msgbuf_class(size_t len)
+{
+	unsigned int i;
+	for (i = 0; i < NC_MSGBUF_CLASSES; i++)
+		if (len <= nc_msgbuf_class_sz[i])
+			break;
+
+	return i;
+}
+
+static struct nc_msgbuf *nc_msgbuf_alloc(size_t len)
+{
+	unsigned int size_class = nc_msgbuf_class(len);
+	struct nc_msgbuf *mb = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (size_class < NC_MSGBUF_CLASSES) {
+		mb = pool.free[size_class];
+		if (mb) {
+			pool.free[size_class] = mb->next;
+			pool.stats.n_free[size_class]--;
+			pool.stats.n_reused++;
+		} else
+			pool.stats.n_new++;
+	} else
+		pool.stats.n_unpooled++;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (!mb) {
+		size_t cap = (size_class < NC_MSGBUF_CLASSES) ?
+			     nc_msgbuf_class_sz[size_class] : len;
+		mb = malloc(sizeof(*mb) + cap);
+		if (!mb)
+			return NULL;
+	}
+
+	mb->next = NULL;
+	mb->refs = 1;
+	mb->size_class = size_class;
+	mb->len = len;
+
+	return mb;
+}
+
+struct nc_msgbuf *nc_msgbuf_new(const unsigned char netmagic[4],
+				const char *command,
+				const void *data, uint32_t data_len)
+{
+	struct nc_msgbuf *mb = nc_msgbuf_alloc(P2P_HDR_SZ + (size_t) data_len);
+	if (!mb)
+		return NULL;
+
+	unsigned char *p = mb->data;
+
+	/* network identifier (magic number) */
+	memcpy(p, netmagic, 4);
+
+	/* command string */
+	memset(p + 4, 0, 12);
+	strncpy((char *) p + 4, command, 12);
+
+	/* data length */
+	uint32_t data_len_le = htole32(data_len);
+	memcpy(p + 16, &data_len_le, 4);
+
+	/* data checksum */
+	bu_Hash4(p + 20, data, data_len);
+
+	/* data payload */
+	if (data_len > 0)
+		memcpy(p + P2P_HDR_SZ, data, data_len);
+
+	return mb;
+}
+
+struct nc_msgbuf *nc_msgbuf_ref(struct nc_msgbuf *mb)
+{
+	__atomic_add_fetch(&mb->refs, 1, __ATOMIC_RELAXED);
+	return mb;
+}
+
+void nc_msgbuf_unref(struct nc_msgbuf *mb)
+{
+	if (!mb)
+		return;
+
+	/* last reference: no other thread can see it any more */
+	if (__atomic_sub_fetch(&mb->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	unsigned int size_class = mb->size_class;
+	if (size_class < NC_MSGBUF_CLASSES) {
+		pthread_mutex_lock(&pool.lock);
+		if (pool.stats.n_free[size_class] <
+		    nc_msgbuf_pool_max(size_class)) {
+			mb->next = pool.free[size_class];
+			pool.free[size_class] = mb;
+			pool.stats.n_free[size_class]++;
+			mb = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	free(mb);
+}
+
+void nc_msgbuf_freep(void *mb)
+{
+	nc_msgbuf_unref(mb);
+}
+
+void nc_msgbuf_pool_stats(struct nc_msgbuf_stats *st)
+{
+	pthread_mutex_lock(&pool.lock);
+	*st = pool.stats;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* release all spare buffers */
+void nc_msgbuf_pool_trim(void)
+{
+	struct nc_msgbuf *lists[NC_MSGBUF_CLASSES];
+
+	pthread_mutex_lock(&pool.lock);
+	memcpy(lists, pool.free, sizeof(lists));
+	memset(pool.free, 0, sizeof(pool.free));
+	memset(pool.stats.n_free, 0, sizeof(pool.stats.n_free));
+	pthread_mutex_unlock(&pool.lock);
+
+	unsigned int i;
+	for (i = 0; i < NC_MSGBUF_CLASSES; i++) {
+		while (lists[i]) {
+			struct nc_msgbuf *mb = lists[i];
+			lists[i] = mb->next;
+			free(mb);
+		}
+	}
+}
@@ -5,15 +5,23 @@
 #include "libbitc-config.h"            // for VERSION
 
 #include <bitc/net/net.h>              // for nc_conn, net_child_info, etc
+#include <bitc/net/capture.h>          // for nc_capture_write
+#include <bitc/net/dns.h>              // for bu_dns_seeder_take, etc
+#include <bitc/net/msgbuf.h>           // for nc_msgbuf_new, etc
 #include <bitc/net/netbase.h>          // for bn_address_str, etc
+#include <bitc/net/shmring.h>          // for shmring_init, shmring_free
 #include <bitc/db/chaindb.h>           // for blkdb, blkdb_locator, etc
 #include <bitc/buffer.h>               // for buffer, const_buffer
+#include <bitc/cmpctblock.h>           // for cmpct_partial_init, etc
 #include <bitc/core.h>                 // for bitc_address, bitc_inv, etc
 #include <bitc/coredefs.h>             // for ::CADDR_TIME_VERSION, etc
+#include <bitc/crypto/sha2.h>           // for sha256_Init, sha256_Update, etc
 #include <bitc/cstr.h>                 // for cstring, cstr_free
 #include <bitc/hashtab.h>              // for bitc_hashtab_size
 #include <bitc/log.h>                  // for log_info, log_debug, etc
+#include <bitc/mempool.h>              // for bitc_mempool_lookup
 #include <bitc/parr.h>                 // for parr, parr_idx, parr_add, etc
+#include <bitc/txcache.h>              // for bitc_txcache_add, etc
 #include <bitc/util.h>                 // for MIN
 
 #include <event.h>                     // for event_del, event_add, etc
@@ -21,12 +29,14 @@
 #include <assert.h>                     // for assert
 #include <errno.h>                      // for errno, EAGAIN, EWOULDBLOCK, etc
 #include <fcntl.h>                      // for fcntl
+#include <pthread.h>                    // for pthread_create, etc
 #include <signal.h>                     // for kill, SIGTERM
 #include <stddef.h>                     // for size_t
 #include <stdlib.h>                     // for free, calloc, malloc
 #include <string.h>                     // for strncmp, memcmp, memset, etc
 #include <sys/time.h>                   // for timeval
 #include <sys/wait.h>                   // for waitpid, WNOHANG
+#include <time.h>                       // for clock_gettime, time
 #include <unistd.h>                     // for close, read, write
 #ifdef WIN32
 #include <bitc/net/fakepoll.h>
@@ -38,6 +48,53 @@
 #include <sys/uio.h>                    // for iovec, writev
 #endif
 
+/*
+ * A FIFO of work items between threads.  The consumer watches
+ * wake_fd[0], which becomes readable when the queue turns non-empty.
+ */
+struct nc_queue {
+	pthread_mutex_t		lock;
+	struct nc_qitem		*head;
+	struct nc_qitem		*tail;
+	int			wake_fd[2];
+};
+
+enum nc_qtype {
+	/* main -> shard */
+	NC_OP_ATTACH,			/* start connect(2) watch */
+	NC_OP_SEND,			/* queue buf for writing */
+	NC_OP_KILL,			/* close connection */
+	NC_OP_STOP,			/* exit thread */
+
+	/* shard -> main */
+	NC_IN_MSG,			/* complete, checksummed message */
+	NC_IN_DEAD,			/* connection closed */
+};
+
+struct nc_qitem {
+	struct nc_qitem		*next;
+	enum nc_qtype		type;
+	struct nc_conn		*conn;
+
+	struct nc_msgbuf	*buf;		/* NC_OP_SEND */
+	struct p2p_message	msg;		/* NC_IN_MSG */
+	struct bitc_block	*block;		/* NC_IN_MSG "block", if decoded */
+};
+
+struct nc_shard {
+	struct net_child_info	*nci;
+	pthread_t		thread;
+	bool			started;
+
+	struct event_base	*eb;
+	struct event		*wake_ev;
+	struct nc_queue		ops;
+
+	parr			*conns;		/* I/O thread only */
+	unsigned int		n_conns;	/* main thread only */
+	bool			running;	/* I/O thread only */
+};
+
 static void nc_conn_kill(struct nc_conn *conn);
 static bool nc_conn_read_enable(struct nc_conn *conn);
 static bool nc_conn_read_disable(struct nc_conn *conn);
@@ -49,7 +106,375 @@ void net_set(struct net_settings *_net_settings)
 	net_settings = _net_settings;
 }
 
+static inline struct event_base *nc_conn_eb(const struct nc_conn *conn)
+{
+	return conn->shard ? conn->shard->eb : conn->nci->eb;
+}
+
+/* dead and connected are set on one thread and read on another */
+static inline bool nc_conn_is_dead(const struct nc_conn *conn)
+{
+	return __atomic_load_n(&conn->dead, __ATOMIC_ACQUIRE);
+}
+
+static inline bool nc_conn_is_connected(const struct nc_conn *conn)
+{
+	return __atomic_load_n(&conn->connected, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned int nc_max_conns(const struct net_child_info *nci)
+{
+	return nci->max_conns ? nci->max_conns : NC_MAX_CONN;
+}
+
+static inline unsigned int nc_max_dials(const struct net_child_info *nci)
+{
+	return nci->max_dials ? nci->max_dials : NC_MAX_DIALS;
+}
+
+static bool nc_queue_init(struct nc_queue *q)
+{
+	memset(q, 0, sizeof(*q));
+
+	if (pipe(q->wake_fd) < 0)
+		return false;
+
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		int flags = fcntl(q->wake_fd[i], F_GETFL, 0);
+		if ((flags < 0) ||
+		    (fcntl(q->wake_fd[i], F_SETFL, flags | O_NONBLOCK) < 0))
+			goto err_out;
+	}
+
+	if (pthread_mutex_init(&q->lock, NULL) != 0)
+		goto err_out;
+
+	return true;
+
+err_out:
+	close(q->wake_fd[0]);
+	close(q->wake_fd[1]);
+	return false;
+}
+
+static void nc_qitem_free(struct nc_qitem *item)
+{
+	nc_msgbuf_unref(item->buf);
+	free(item->msg.data);
+	if (item->block) {
+		bitc_block_free(item->block);
+		free(item->block);
+	}
+
+	free(item);
+}
+
+static void nc_qitems_free(struct nc_qitem *item)
+{
+	while (item) {
+		struct nc_qitem *next = item->next;
+		nc_qitem_free(item);
+		item = next;
+	}
+}
+
+static void nc_queue_push(struct nc_queue *q, struct nc_qitem *item)
+{
+	item->next = NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	bool was_empty = (q->head == NULL);
+	if (q->tail)
+		q->tail->next = item;
+	else
+		q->head = item;
+	q->tail = item;
+
+	pthread_mutex_unlock(&q->lock);
+
+	/* one wakeup per empty -> non-empty transition */
+	if (was_empty) {
+		uint8_t v = 0;
+		if ((write(q->wake_fd[1], &v, 1) < 0) && (errno != EAGAIN)) {
+			log_error("net: queue wake: %s", strerror(errno));
+		}
+	}
+}
+
+/* detach and return every queued item, oldest first */
+static struct nc_qitem *nc_queue_take(struct nc_queue *q)
+{
+	uint8_t drain[64];
+	while (read(q->wake_fd[0], drain, sizeof(drain)) > 0)
+		;
+
+	pthread_mutex_lock(&q->lock);
+
+	struct nc_qitem *items = q->head;
+	q->head = NULL;
+	q->tail = NULL;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return items;
+}
+
+static void nc_queue_free(struct nc_queue *q)
+{
+	nc_qitems_free(nc_queue_take(q));
+
+	pthread_mutex_destroy(&q->lock);
+	close(q->wake_fd[0]);
+	close(q->wake_fd[1]);
+}
+
+static void nc_queue_post(struct nc_queue *q, enum nc_qtype type,
+			  struct nc_conn *conn)
+{
+	struct nc_qitem *item = calloc(1, sizeof(*item));
+	item->type = type;
+	item->conn = conn;
+
+	nc_queue_push(q, item);
+}
+
+/*
+ * Traffic accounting
+ */
+
+static const char *nc_msgtype_names[NC_MSG_MAX] = {
+	[NC_MSG_VERSION]	= "version",
+	[NC_MSG_VERACK]		= "verack",
+	[NC_MSG_ADDR]		= "addr",
+	[NC_MSG_GETADDR]	= "getaddr",
+	[NC_MSG_INV]		= "inv",
+	[NC_MSG_GETDATA]	= "getdata",
+	[NC_MSG_NOTFOUND]	= "notfound",
+	[NC_MSG_GETBLOCKS]	= "getblocks",
+	[NC_MSG_GETHEADERS]	= "getheaders",
+	[NC_MSG_HEADERS]	= "headers",
+	[NC_MSG_BLOCK]		= "block",
+	[NC_MSG_TX]		= "tx",
+	[NC_MSG_PING]		= "ping",
+	[NC_MSG_PONG]		= "pong",
+	[NC_MSG_SENDCMPCT]	= "sendcmpct",
+	[NC_MSG_CMPCTBLOCK]	= "cmpctblock",
+	[NC_MSG_GETBLOCKTXN]	= "getblocktxn",
+	[NC_MSG_BLOCKTXN]	= "blocktxn",
+	[NC_MSG_OTHER]		= "other",
+};
+
+enum nc_msgtype nc_msgtype_find(const char *command)
+{
+	unsigned int i;
+	for (i = 0; i < NC_MSG_OTHER; i++)
+		if (!strncmp(command, nc_msgtype_names[i], 12))
+			return i;
+
+	return NC_MSG_OTHER;
+}
+
+const char *nc_msgtype_str(enum nc_msgtype type)
+{
+	if (type >= NC_MSG_MAX)
+		return NULL;
+
+	return nc_msgtype_names[type];
+}
+
+/* count one message against conn and the global totals; main thread */
+static void nc_conn_count(struct nc_conn *conn, const char *command,
+			  size_t bytes, bool tx)
+{
+	enum nc_msgtype type = nc_msgtype_find(command);
+	struct nc_traffic *t[2] = { &conn->traffic, &conn->nci->traffic };
+
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		if (tx) {
+			t[i]->tx_msgs[type]++;
+			t[i]->tx_bytes[type] += bytes;
+		} else {
+			t[i]->rx_msgs[type]++;
+			t[i]->rx_bytes[type] += bytes;
+		}
+	}
+}
+
+static void nc_traffic_sum(const struct nc_traffic *t,
+			   uint64_t *rx_bytes, uint64_t *tx_bytes)
+{
+	*rx_bytes = 0;
+	*tx_bytes = 0;
+
+	unsigned int i;
+	for (i = 0; i < NC_MSG_MAX; i++) {
+		*rx_bytes += t->rx_bytes[i];
+		*tx_bytes += t->tx_bytes[i];
+	}
+}
+
+void nc_stats_log(const struct net_child_info *nci)
+{
+	const struct nc_traffic *t = &nci->traffic;
+	uint64_t rx_bytes, tx_bytes;
+
+	log_info("net: %-12s %10s %14s %10s %14s",
+		 "command", "rx msgs", "rx bytes", "tx msgs", "tx bytes");
+
+	unsigned int i;
+	for (i = 0; i < NC_MSG_MAX; i++) {
+		if (!t->rx_msgs[i] && !t->tx_msgs[i])
+			continue;
+
+		log_info("net: %-12s %10llu %14llu %10llu %14llu",
+			 nc_msgtype_names[i],
+			 (unsigned long long) t->rx_msgs[i],
+			 (unsigned long long) t->rx_bytes[i],
+			 (unsigned long long) t->tx_msgs[i],
+			 (unsigned long long) t->tx_bytes[i]);
+	}
+
+	nc_traffic_sum(t, &rx_bytes, &tx_bytes);
+	log_info("net: total rx %llu bytes, tx %llu bytes",
+		 (unsigned long long) rx_bytes,
+		 (unsigned long long) tx_bytes);
+
+	if (nci->upload) {
+		pthread_mutex_lock(&nci->upload->lock);
+		uint64_t n_throttled = nci->upload->n_throttled;
+		pthread_mutex_unlock(&nci->upload->lock);
+
+		log_info("net: upload capped at %llu bytes/sec, %llu writes deferred",
+			 (unsigned long long) nci->upload->rate,
+			 (unsigned long long) n_throttled);
+	}
+
+	struct nc_msgbuf_stats mst;
+	nc_msgbuf_pool_stats(&mst);
+	log_info("net: message buffers: %llu allocated, %llu reused, "
+		 "%llu unpooled",
+		 (unsigned long long) mst.n_new,
+		 (unsigned long long) mst.n_reused,
+		 (unsigned long long) mst.n_unpooled);
+
+	for (i = 0; i < nci->conns->len; i++) {
+		const struct nc_conn *conn = parr_idx(nci->conns, i);
+		if (!nc_conn_is_connected(conn) || nc_conn_is_dead(conn))
+			continue;
+
+		nc_traffic_sum(&conn->traffic, &rx_bytes, &tx_bytes);
+		log_info("net: %s%s rx %llu bytes, tx %llu bytes",
+			 conn->addr_str, conn->spare ? " (spare)" : "",
+			 (unsigned long long) rx_bytes,
+			 (unsigned long long) tx_bytes);
+	}
+}
+
+/*
+ * Upload rate limit
+ */
+
+static int64_t nc_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct nc_ratelimit *nc_ratelimit_new(uint64_t rate)
+{
+	struct nc_ratelimit *rl = calloc(1, sizeof(*rl));
+	if (!rl)
+		return NULL;
+
+	pthread_mutex_init(&rl->lock, NULL);
+	rl->rate = rate ? rate : 1;
+	rl->tokens = rl->rate;
+	rl->t_fill_us = nc_now_us();
+
+	return rl;
+}
+
+void nc_ratelimit_free(struct nc_ratelimit *rl)
+{
+	if (!rl)
+		return;
+
+	pthread_mutex_destroy(&rl->lock);
+	free(rl);
+}
+
+/* add tokens earned since the last fill; caller holds the lock */
+static void nc_ratelimit_fill(struct nc_ratelimit *rl)
+{
+	int64_t now = nc_now_us();
+	int64_t elapsed = now - rl->t_fill_us;
+
+	if (elapsed >= 1000000) {
+		rl->tokens = rl->rate;
+		rl->t_fill_us = now;
+		return;
+	}
+
+	uint64_t earned = rl->rate * (uint64_t) elapsed / 1000000;
+	if (!earned)
+		return;
+
+	/* advance by the time actually paid for, keeping the remainder */
+	rl->t_fill_us += earned * 1000000 / rl->rate;
+	rl->tokens = MIN(rl->tokens + earned, rl->rate);
+}
+
+/*
+ * Take up to want tokens.  When none are left, returns 0 and sets
+ * *wait_ms to when a useful amount will have been earned.
+ */
+size_t nc_ratelimit_take(struct nc_ratelimit *rl, size_t want,
+			 unsigned int *wait_ms)
+{
+	pthread_mutex_lock(&rl->lock);
+
+	nc_ratelimit_fill(rl);
+
+	size_t n = MIN(want, rl->tokens);
+	rl->tokens -= n;
+
+	if (!n && want) {
+		/* wake for a tenth of a second's worth, or all of want */
+		uint64_t need = MIN(want, rl->rate / 10 + 1);
+		*wait_ms = (need * 1000 + rl->rate - 1) / rl->rate;
+		if (!*wait_ms)
+			*wait_ms = 1;
+		rl->n_throttled++;
+	}
+
+	pthread_mutex_unlock(&rl->lock);
+
+	return n;
+}
+
+/* return tokens taken but not spent */
+void nc_ratelimit_give(struct nc_ratelimit *rl, size_t n)
+{
+	if (!n)
+		return;
+
+	pthread_mutex_lock(&rl->lock);
+	rl->tokens = MIN(rl->tokens + n, rl->rate);
+	pthread_mutex_unlock(&rl->lock);
+}
+
+/*
+ * Output.  Everything below runs on the connection's I/O thread.
+ */
+
+/* iovecs for at most max_bytes from the head of write_q */
 static void nc_conn_build_iov(clist *write_q, unsigned int partial,
+			      size_t max_bytes,
 			      struct iovec **iov_, unsigned int *iov_len_)
 {
 	*iov_ = NULL;
@@ -61,10 +486,10 @@ static void nc_conn_build_iov(clist *write_q, unsigned int partial,
 	clist *tmp = write_q;
 
 	i = 0;
-	while (tmp) {
-		struct buffer *buf = tmp->data;
+	while (tmp && max_bytes) {
+		struct nc_msgbuf *buf = tmp->data;
 
-		iov[i].iov_base = buf->p;
+		iov[i].iov_base = buf->data;
 		iov[i].iov_len = buf->len;
 
 		if (i == 0) {
@@ -72,29 +497,34 @@ static void nc_conn_build_iov(clist *write_q, unsigned int partial,
 			iov[0].iov_len -= partial;
 		}
 
+		if (iov[i].iov_len > max_bytes)
+			iov[i].iov_len = max_bytes;
+		max_bytes -= iov[i].iov_len;
+
 		tmp = tmp->next;
 		i++;
 	}
 
 	*iov_ = iov;
-	*iov_len_ = iov_len;
+	*iov_len_ = i;
 }
 
 static void nc_conn_written(struct nc_conn *conn, size_t bytes)
 {
+	conn->write_q_bytes -= bytes;
+
 	while (bytes > 0) {
 		clist *tmp;
-		struct buffer *buf;
+		struct nc_msgbuf *buf;
 		unsigned int left;
 
 		tmp = conn->write_q;
 		buf = tmp->data;
 		left = buf->len - conn->write_partial;
 
-		/* buffer fully written; free */
+		/* buffer fully written; drop our reference */
 		if (bytes >= left) {
-			free(buf->p);
-			free(buf);
+			nc_msgbuf_unref(buf);
 			conn->write_partial = 0;
 			conn->write_q = clist_delete(tmp, tmp);
 
@@ -109,91 +539,414 @@ static void nc_conn_written(struct nc_conn *conn, size_t bytes)
 	}
 }
 
-static void nc_conn_write_evt(int fd, short events, void *priv)
-{
-	struct nc_conn *conn = priv;
-	struct iovec *iov = NULL;
-	unsigned int iov_len = 0;
+/* stop reading from a peer that is not reading from us */
+static void nc_conn_sendq_check(struct nc_conn *conn)
+{
+	size_t hwm = conn->nci->sendq_max ? conn->nci->sendq_max : NC_SENDQ_MAX;
+
+	if (!nc_conn_is_connected(conn))
+		return;
+
+	if (!conn->read_paused && (conn->write_q_bytes > hwm)) {
+		log_debug("net: %s send queue %zu bytes, pausing read",
+			  conn->addr_str, conn->write_q_bytes);
+		conn->read_paused = true;
+		nc_conn_read_disable(conn);
+	} else if (conn->read_paused && (conn->write_q_bytes <= hwm / 2)) {
+		conn->read_paused = false;
+		nc_conn_read_enable(conn);
+	}
+}
+
+static void nc_conn_throttle_evt(int fd, short events, void *priv);
+
+/* out of upload tokens: stop polling for writable until some are due */
+static bool nc_conn_throttle(struct nc_conn *conn, unsigned int wait_ms)
+{
+	nc_conn_write_disable(conn);
+
+	if (!conn->throttle_ev) {
+		conn->throttle_ev = event_new(nc_conn_eb(conn), -1, 0,
+					      nc_conn_throttle_evt, conn);
+		if (!conn->throttle_ev)
+			return false;
+	}
+
+	struct timeval tv = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+	return event_add(conn->throttle_ev, &tv) == 0;
+}
+
+/* write out as much of write_q as the socket and upload cap allow */
+static bool nc_conn_flush(struct nc_conn *conn)
+{
+	struct nc_ratelimit *upload = conn->nci->upload;
+
+	while (conn->write_q) {
+		size_t budget = conn->write_q_bytes;
+
+		if (upload) {
+			unsigned int wait_ms = 0;
+
+			budget = nc_ratelimit_take(upload, budget, &wait_ms);
+			if (!budget)
+				return nc_conn_throttle(conn, wait_ms);
+		}
+
+		/* build list of outgoing data buffers */
+		struct iovec *iov = NULL;
+		unsigned int iov_len = 0;
+		nc_conn_build_iov(conn->write_q, conn->write_partial, budget,
+				  &iov, &iov_len);
+
+		/* send data to network */
+		ssize_t wrc = writev(conn->fd, iov, iov_len);
+
+		free(iov);
+
+		if (wrc < 0) {
+			if (upload)
+				nc_ratelimit_give(upload, budget);
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			wrc = 0;
+		} else if (upload)
+			nc_ratelimit_give(upload, budget - wrc);
+
+		/* handle partially and fully completed buffers */
+		nc_conn_written(conn, wrc);
+		nc_conn_sendq_check(conn);
+
+		/* socket full; poll for writable */
+		if ((size_t) wrc < budget)
+			return nc_conn_write_enable(conn);
+	}
+
+	return nc_conn_write_disable(conn);
+}
+
+static void nc_conn_write_evt(int fd, short events, void *priv)
+{
+	struct nc_conn *conn = priv;
+
+	if (!nc_conn_flush(conn))
+		nc_conn_kill(conn);
+}
+
+static void nc_conn_throttle_evt(int fd, short events, void *priv)
+{
+	struct nc_conn *conn = priv;
+
+	if (!nc_conn_flush(conn))
+		nc_conn_kill(conn);
+}
+
+/* build a wire message, shareable between connections */
+static struct nc_msgbuf *nc_msg_buf(const struct net_child_info *nci,
+				    const char *command,
+				    const void *data, size_t data_len)
+{
+	return nc_msgbuf_new(nci->chain->netmagic, command, data, data_len);
+}
+
+/* queue buf, taking over the caller's reference, and write it if
+ * nothing was queued ahead of it
+ */
+static bool nc_conn_send_buf(struct nc_conn *conn, struct nc_msgbuf *buf)
+{
+	bool idle = (conn->write_q == NULL);
+
+	conn->write_q = clist_append(conn->write_q, buf);
+	conn->write_q_bytes += buf->len;
+
+	/* if write q existed, write_evt or the throttle handles output */
+	if (!idle) {
+		nc_conn_sendq_check(conn);
+		return true;
+	}
+
+	return nc_conn_flush(conn);
+}
+
+/* queue a reference to buf; the caller keeps its own */
+static bool nc_conn_send_msg(struct nc_conn *conn, struct nc_msgbuf *buf)
+{
+	nc_conn_count(conn, nc_msgbuf_command(buf), buf->len, true);
+
+	if (!conn->shard)
+		return nc_conn_send_buf(conn, nc_msgbuf_ref(buf));
+
+	/* hand off to the connection's I/O thread */
+	if (nc_conn_is_dead(conn))
+		return true;
+
+	struct nc_qitem *item = calloc(1, sizeof(*item));
+	item->type = NC_OP_SEND;
+	item->conn = conn;
+	item->buf = nc_msgbuf_ref(buf);
+	nc_queue_push(&conn->shard->ops, item);
+
+	return true;
+}
+
+static bool nc_conn_send(struct nc_conn *conn, const char *command,
+			 const void *data, size_t data_len)
+{
+	struct nc_msgbuf *buf = nc_msg_buf(conn->nci, command, data, data_len);
+	if (!buf)
+		return false;
+
+	bool rc = nc_conn_send_msg(conn, buf);
+	nc_msgbuf_unref(buf);
+
+	return rc;
+}
+
+/*
+ * Send one message to every handshaked peer.  It is serialized once,
+ * and the same buffer is queued on each connection.  Returns the
+ * number of peers it was queued for.
+ */
+unsigned int nc_conns_broadcast(struct net_child_info *nci,
+				const char *command,
+				const void *data, size_t data_len)
+{
+	struct nc_msgbuf *buf = nc_msg_buf(nci, command, data, data_len);
+	if (!buf)
+		return 0;
+
+	unsigned int i, n_sent = 0;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = parr_idx(nci->conns, i);
+
+		if (nc_conn_is_dead(conn) || !conn->seen_verack)
+			continue;
+
+		if (nc_conn_send_msg(conn, buf))
+			n_sent++;
+		else
+			nc_conn_kill(conn);
+	}
+
+	nc_msgbuf_unref(buf);
+
+	return n_sent;
+}
+
+/*
+ * Peer measurements.  Kept in conn->peer, and copied to the peer
+ * manager's record so they are persisted in the peers file.
+ */
+
+static int64_t nc_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void nc_conn_peer_sync(struct nc_conn *conn)
+{
+	struct peer *peer = peerman_lookup(conn->nci->peers,
+					   conn->peer.addr.ip);
+	if (!peer)
+		return;
+
+	peer->ping_ms = conn->peer.ping_ms;
+	peer->handshake_ms = conn->peer.handshake_ms;
+	peer->rx_rate = conn->peer.rx_rate;
+	peer->n_stalls = conn->peer.n_stalls;
+}
+
+static bool nc_conn_ping(struct nc_conn *conn)
+{
+	/* BIP 31: pong echoes our nonce */
+	if (conn->protover <= BIP0031_VERSION)
+		return true;
+
+	int64_t now = nc_now_ms();
+	struct msg_ping mp = { *conn->nci->instance_nonce ^ (uint64_t) now };
+
+	cstring *s = ser_msg_ping(conn->protover, &mp);
+	bool rc = nc_conn_send(conn, "ping", s->str, s->len);
+	cstr_free(s, true);
+
+	conn->ping_nonce = mp.nonce;
+	conn->t_ping_ms = now;
+	conn->t_last_ping_ms = now;
+	return rc;
+}
+
+static void nc_conn_blocks_requested(struct nc_conn *conn, unsigned int n)
+{
+	if (!n)
+		return;
+	if (!conn->n_blk_pending)
+		conn->t_blk_ms = nc_now_ms();
+	conn->n_blk_pending += n;
+}
+
+static void nc_conn_block_delivered(struct nc_conn *conn, size_t bytes)
+{
+	/* unsolicited */
+	if (!conn->n_blk_pending)
+		return;
+
+	int64_t now = nc_now_ms();
+	int64_t elapsed = now - conn->t_blk_ms;
+	if (elapsed < 1)
+		elapsed = 1;
+	uint64_t rate = (uint64_t) bytes * 1000 / elapsed;
+
+	conn->peer.rx_rate = peer_ewma(conn->peer.rx_rate,
+				       MIN(rate, UINT32_MAX));
+
+	/* the stall clock restarts on each delivery */
+	conn->n_blk_pending--;
+	conn->t_blk_ms = now;
+
+	if ((++conn->n_blk_ok % NC_STALL_FORGIVE) == 0 && conn->peer.n_stalls)
+		conn->peer.n_stalls--;
+
+	nc_conn_peer_sync(conn);
+}
+
+static bool nc_conn_stalled(const struct nc_conn *conn, int64_t now)
+{
+	return conn->n_blk_pending &&
+	       ((now - conn->t_blk_ms) > (NC_STALL_SECS * 1000));
+}
+
+/*
+ * Connection slots
+ */
+
+struct nc_conn_counts {
+	unsigned int	dialing;	/* connect or handshake in progress */
+	unsigned int	active;
+	unsigned int	spare;
+};
+
+static void nc_conns_count(const struct net_child_info *nci,
+			   struct nc_conn_counts *cnt)
+{
+	memset(cnt, 0, sizeof(*cnt));
+
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		const struct nc_conn *conn = parr_idx(nci->conns, i);
+
+		if (nc_conn_is_dead(conn))
+			continue;
+		if (!conn->seen_verack)
+			cnt->dialing++;
+		else if (conn->spare)
+			cnt->spare++;
+		else
+			cnt->active++;
+	}
+}
+
+/* a few handshake RTTs: this peer's, else the average */
+static unsigned int nc_dial_timeout_ms(const struct nc_conn *conn)
+{
+	const struct net_child_info *nci = conn->nci;
+	uint64_t est = conn->peer.handshake_ms;
+
+	if (!est)
+		est = nci->handshake_ms ? nci->handshake_ms :
+					  PEER_DEF_HANDSHAKE_MS;
+
+	uint64_t ms = est * NC_DIAL_RTT_MULT;
+	uint64_t max_ms = (uint64_t) nci->net_conn_timeout * 1000;
+
+	if (ms < NC_DIAL_MIN_MS)
+		ms = NC_DIAL_MIN_MS;
+	if (max_ms && (ms > max_ms))
+		ms = max_ms;
+
+	return (unsigned int) ms;
+}
+
+static bool nc_conn_getblocks(struct nc_conn *conn)
+{
+	time_t now = time(NULL);
+	time_t cutoff = now - (24 * 60 * 60);
+
+	if (conn->nci->last_getblocks >= cutoff)
+		return true;
+
+	struct msg_getblocks gb;
+	msg_getblocks_init(&gb);
+	chaindb_locator(conn->nci->db, NULL, &gb.locator);
+	cstring *s = ser_msg_getblocks(&gb);
 
-	/* build list of outgoing data buffers */
-	nc_conn_build_iov(conn->write_q, conn->write_partial, &iov, &iov_len);
+	bool rc = nc_conn_send(conn, "getblocks", s->str, s->len);
 
-	/* send data to network */
-	ssize_t wrc = writev(conn->fd, iov, iov_len);
+	cstr_free(s, true);
+	msg_getblocks_free(&gb);
 
-	free(iov);
+	conn->nci->last_getblocks = now;
+	conn->syncing = rc;
 
-	if (wrc < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK)
-			goto err_out;
-		return;
-	}
+	return rc;
+}
 
-	/* handle partially and fully completed buffers */
-	nc_conn_written(conn, wrc);
+/* the peer we synced from is gone: resume from the best one left */
+static void nc_conns_resync(struct net_child_info *nci)
+{
+	struct nc_conn *best = NULL;
 
-	/* thaw read, if write fully drained */
-	if (!conn->write_q) {
-		nc_conn_write_disable(conn);
-		nc_conn_read_enable(conn);
-	}
+	nci->last_getblocks = 0;
 
-	return;
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = parr_idx(nci->conns, i);
 
-err_out:
-	nc_conn_kill(conn);
+		if (nc_conn_is_dead(conn) || !conn->seen_verack || conn->spare)
+			continue;
+		if (!best ||
+		    (peer_cost(&conn->peer) < peer_cost(&best->peer)))
+			best = conn;
+	}
+
+	/* else the next peer to finish its handshake asks */
+	if (best && !nc_conn_getblocks(best))
+		nc_conn_kill(best);
 }
 
-static bool nc_conn_send(struct nc_conn *conn, const char *command,
-			 const void *data, size_t data_len)
+/* refill active slots from the spares, best peers first */
+static void nc_conns_promote(struct net_child_info *nci)
 {
-	/* build wire message */
-	cstring *msg = message_str(conn->nci->chain->netmagic, command, data, data_len);
-	if (!msg)
-		return false;
+	struct nc_conn_counts cnt;
+	nc_conns_count(nci, &cnt);
 
-	/* buffer now owns message data */
-	struct buffer *buf = calloc(1, sizeof(struct buffer));
-	buf->p = msg->str;
-	buf->len = msg->len;
+	unsigned int max_conns = nc_max_conns(nci);
 
-	cstr_free(msg, false);
-
-	/* if write q exists, write_evt will handle output */
-	if (conn->write_q) {
-		conn->write_q = clist_append(conn->write_q, buf);
-		return true;
-	}
+	while (cnt.spare && (cnt.active < max_conns)) {
+		struct nc_conn *best = NULL;
 
-	/* attempt optimistic write */
-	ssize_t wrc = write(conn->fd, buf->p, buf->len);
+		unsigned int i;
+		for (i = 0; i < nci->conns->len; i++) {
+			struct nc_conn *conn = parr_idx(nci->conns, i);
 
-	if (wrc < 0) {
-		if (errno != EAGAIN && errno != EWOULDBLOCK) {
-			free(buf->p);
-			free(buf);
-			return false;
+			if (nc_conn_is_dead(conn) || !conn->spare)
+				continue;
+			if (!best ||
+			    (peer_cost(&conn->peer) < peer_cost(&best->peer)))
+				best = conn;
 		}
 
-		conn->write_q = clist_append(conn->write_q, buf);
-		goto out_wrstart;
-	}
-
-	/* message fully sent */
-	if (wrc == buf->len) {
-		free(buf->p);
-		free(buf);
-		return true;
-	}
+		log_info("net: promoting spare %s", best->addr_str);
 
-	/* message partially sent; pause read; poll for writable */
-	conn->write_q = clist_append(conn->write_q, buf);
-	conn->write_partial = wrc;
+		best->spare = false;
+		cnt.spare--;
 
-out_wrstart:
-	nc_conn_read_disable(conn);
-	nc_conn_write_enable(conn);
-	return true;
+		if (nc_conn_getblocks(best))
+			cnt.active++;
+		else
+			nc_conn_kill(best);
+	}
 }
 
 static bool nc_msg_version(struct nc_conn *conn)
@@ -304,32 +1057,67 @@ static bool nc_msg_verack(struct nc_conn *conn)
 	conn->peer.last_ok = time(NULL);
 	conn->peer.n_ok++;
 	conn->peer.addr.nTime = (uint32_t) conn->peer.last_ok;
+	uint32_t handshake_ms = nc_now_ms() - conn->t_open_ms;
+	conn->peer.handshake_ms = peer_ewma(conn->peer.handshake_ms,
+					    handshake_ms);
+	conn->nci->handshake_ms = peer_ewma(conn->nci->handshake_ms,
+					    handshake_ms);
 	peerman_add(conn->nci->peers, &conn->peer, true);
 
+	/* beyond the connection target: keep as a spare, or drop */
+	struct net_child_info *nci = conn->nci;
+	struct nc_conn_counts cnt;
+	nc_conns_count(nci, &cnt);
+
+	if ((cnt.active - 1) >= nc_max_conns(nci)) {
+		if (cnt.spare >= nci->max_spare) {
+			log_debug("net: %s surplus, closing", conn->addr_str);
+			return false;
+		}
+
+		log_debug("net: %s held as spare", conn->addr_str);
+		conn->spare = true;
+	}
+
+	/* first RTT sample */
+	if (!nc_conn_ping(conn))
+		return false;
+
 	/* request peer addresses */
 	if ((conn->protover >= CADDR_TIME_VERSION) &&
 	    (!nc_conn_send(conn, "getaddr", NULL, 0)))
 		return false;
 
-	/* request blocks */
-	bool rc = true;
-	time_t now = time(NULL);
-	time_t cutoff = now - (24 * 60 * 60);
-	if (conn->nci->last_getblocks < cutoff) {
-		struct msg_getblocks gb;
-		msg_getblocks_init(&gb);
-		chaindb_locator(conn->nci->db, NULL, &gb.locator);
-		cstring *s = ser_msg_getblocks(&gb);
+	/* offer low-bandwidth compact block relay */
+	if (conn->nci->txcache &&
+	    (conn->protover >= SHORT_IDS_BLOCKS_VERSION)) {
+		struct msg_sendcmpct msc = { false, CMPCT_VERSION };
+		cstring *s = ser_msg_sendcmpct(&msc);
 
-		rc = nc_conn_send(conn, "getblocks", s->str, s->len);
+		bool rc = nc_conn_send(conn, "sendcmpct", s->str, s->len);
 
 		cstr_free(s, true);
-		msg_getblocks_free(&gb);
-
-		conn->nci->last_getblocks = now;
+		if (!rc)
+			return false;
 	}
 
-	return rc;
+	/* a slot filled: dial more, if still short */
+	event_base_loopbreak(nci->eb);
+
+	/* request blocks; spares wait until promoted */
+	if (conn->spare)
+		return true;
+
+	return nc_conn_getblocks(conn);
+}
+
+/* loose txs are only worth fetching once the chain is nearly synced */
+static bool nc_near_tip(const struct net_child_info *nci)
+{
+	const struct blkinfo *best = nci->db ? nci->db->best_chain : NULL;
+
+	return best && ((time(NULL) - (time_t) best->hdr.nTime) <
+			NC_NEAR_TIP_SECS);
 }
 
 static bool nc_msg_inv(struct nc_conn *conn)
@@ -338,6 +1126,10 @@ static bool nc_msg_inv(struct nc_conn *conn)
 	struct msg_vinv mv, mv_out;
 	bool rc = false;
 
+	/* spares fetch nothing until promoted */
+	if (conn->spare)
+		return true;
+
 	msg_vinv_init(&mv);
 	msg_vinv_init(&mv_out);
 
@@ -367,17 +1159,42 @@ static bool nc_msg_inv(struct nc_conn *conn)
 	if (!mv.invs || !mv.invs->len)
 		goto out_ok;
 
+	/*
+	 * a lone block inv is a new-block announcement; fetch it as a
+	 * compact block.  bulk invs (initial sync) are fetched whole.
+	 */
+	struct bitc_txcache *txcache = conn->nci->txcache;
+	struct bitc_mempool *mempool = conn->nci->mempool;
+	bool want_cmpct = conn->cmpct_ok && (mv.invs->len == 1);
+	bool want_tx = (conn->cmpct_ok && txcache) ||
+		       (conn->nci->tx_process && nc_near_tip(conn->nci));
+
 	/* scan incoming inv's for interesting material */
-	unsigned int i;
+	unsigned int i, n_blocks = 0;
 	for (i = 0; i < mv.invs->len; i++) {
 		struct bitc_inv *inv = parr_idx(mv.invs, i);
 		switch (inv->type) {
 		case MSG_BLOCK:
-			if (conn->nci->inv_block_process(&inv->hash))
-				msg_vinv_push(&mv_out, MSG_BLOCK, &inv->hash);
+			if (conn->nci->inv_block_process(&inv->hash)) {
+				msg_vinv_push(&mv_out,
+					      want_cmpct ? MSG_CMPCT_BLOCK :
+							   MSG_BLOCK,
+					      &inv->hash);
+				n_blocks++;
+			}
 			break;
 
 		case MSG_TX:
+			/* collect relayed txs for the pool, and for
+			 * block reconstruction */
+			if (want_tx &&
+			    !(txcache &&
+			      bitc_txcache_lookup(txcache, &inv->hash)) &&
+			    !(mempool &&
+			      bitc_mempool_lookup(mempool, &inv->hash)))
+				msg_vinv_push(&mv_out, MSG_TX, &inv->hash);
+			break;
+
 		default:
 			break;
 		}
@@ -390,6 +1207,8 @@ static bool nc_msg_inv(struct nc_conn *conn)
 		rc = nc_conn_send(conn, "getdata", s->str, s->len);
 
 		cstr_free(s, true);
+
+		nc_conn_blocks_requested(conn, n_blocks);
 	}
 
 out_ok:
@@ -401,45 +1220,332 @@ out:
 	return rc;
 }
 
+/* deserialize and check a "block" message; safe on any thread */
+static bool nc_block_decode(const struct p2p_message *msg,
+			    struct bitc_block *block)
+{
+	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+
+	if (!deser_bitc_block(block, &buf))
+		return false;
+	bitc_block_calc_sha256(block);
+
+	return bitc_block_valid(block);
+}
+
 static bool nc_msg_block(struct nc_conn *conn)
 {
-	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
-	struct bitc_block block;
-	bitc_block_init(&block);
+	struct bitc_block local, *block = conn->msg_block;
+	bitc_block_init(&local);
 
 	bool rc = false;
 
-	if (!deser_bitc_block(&block, &buf))
-		goto out;
-	bitc_block_calc_sha256(&block);
+	nc_conn_block_delivered(conn, conn->msg.hdr.data_len);
+
+	/* sharded connections decode blocks on their I/O thread */
+	if (!block) {
+		block = &local;
+		if (!nc_block_decode(&conn->msg, block)) {
+			log_info("net: %s invalid block", conn->addr_str);
+			goto out;
+		}
+	}
+
 	char hexstr[BU256_STRSZ];
-	bu256_hex(hexstr, &block.sha256);
+	bu256_hex(hexstr, &block->sha256);
 
 	log_debug("net: %s block %s",
 			conn->addr_str, hexstr);
 
+	struct const_buffer ser_data = { conn->msg.data, conn->msg.hdr.data_len };
+
+	if (!conn->nci->block_process(block, &ser_data))
+		goto out;
+
+	rc = true;
+
+out:
+	bitc_block_free(&local);
+	return rc;
+}
+
+static bool nc_msg_ping(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_ping mp;
+
+	msg_ping_init(&mp);
+
+	if (!deser_msg_ping(conn->protover, &mp, &buf))
+		return false;
+
+	/* BIP 31: echo nonce back */
+	if (conn->protover <= BIP0031_VERSION)
+		return true;
+
+	cstring *s = ser_msg_ping(conn->protover, &mp);
+	bool rc = nc_conn_send(conn, "pong", s->str, s->len);
+
+	cstr_free(s, true);
+	msg_ping_free(&mp);
+	return rc;
+}
+
+static bool nc_msg_pong(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_ping mp;
+
+	msg_ping_init(&mp);
+
+	if (!deser_msg_ping(conn->protover, &mp, &buf))
+		return false;
+
+	/* stale or unsolicited pongs are ignored */
+	if (conn->t_ping_ms && (mp.nonce == conn->ping_nonce)) {
+		conn->peer.ping_ms = peer_ewma(conn->peer.ping_ms,
+					       nc_now_ms() - conn->t_ping_ms);
+		conn->t_ping_ms = 0;
+		nc_conn_peer_sync(conn);
+	}
+
+	msg_ping_free(&mp);
+	return true;
+}
+
+static bool nc_msg_tx(struct nc_conn *conn)
+{
+	struct bitc_txcache *txcache = conn->nci->txcache;
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+
+	if (!txcache && !conn->nci->tx_process)
+		return true;
+
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+	bitc_tx_init(tx);
+
+	if (!deser_bitc_tx(tx, &buf) || !bitc_tx_valid(tx)) {
+		log_info("net: %s invalid tx", conn->addr_str);
+		bitc_tx_freep(tx);
+		return false;
+	}
+
+	/* pool keeps its own copy; a rejected tx is not a protocol error */
+	if (conn->nci->tx_process)
+		conn->nci->tx_process(tx);
+
+	/* cache owns tx, if added */
+	if (!txcache || !bitc_txcache_add(txcache, tx, conn->msg.hdr.data_len))
+		bitc_tx_freep(tx);
+
+	return true;
+}
+
+static bool nc_msg_sendcmpct(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_sendcmpct msc;
+
+	if (!deser_msg_sendcmpct(&msc, &buf))
+		return false;
+
+	log_debug("net: %s sendcmpct(%d, %llu)",
+		conn->addr_str, msc.announce ? 1 : 0,
+		(unsigned long long) msc.version);
+
+	/* we only speak version 1 (txid-based short IDs) */
+	if ((msc.version == CMPCT_VERSION) && conn->nci->txcache)
+		conn->cmpct_ok = true;
+
+	msg_sendcmpct_free(&msc);
+	return true;
+}
+
+/* fall back to requesting the full block */
+static bool nc_conn_getblock(struct nc_conn *conn, const bu256_t *hash)
+{
+	struct msg_vinv mv;
+	msg_vinv_init(&mv);
+	msg_vinv_push(&mv, MSG_BLOCK, hash);
+
+	cstring *s = ser_msg_vinv(&mv);
+	bool rc = nc_conn_send(conn, "getdata", s->str, s->len);
+
+	cstr_free(s, true);
+	msg_vinv_free(&mv);
+
+	nc_conn_blocks_requested(conn, 1);
+	return rc;
+}
+
+static void nc_conn_cmpct_clear(struct nc_conn *conn)
+{
+	if (!conn->cmpct_pend)
+		return;
+
+	cmpct_partial_free(conn->cmpct_pend);
+	free(conn->cmpct_pend);
+	conn->cmpct_pend = NULL;
+}
+
+/* hand a fully reassembled compact block to the block processor */
+static bool nc_conn_cmpct_finish(struct nc_conn *conn,
+				 struct cmpct_partial *pb)
+{
+	struct bitc_block block;
+	bitc_block_init(&block);
+
+	bool rc = false;
+	char hexstr[BU256_STRSZ];
+	bu256_hex(hexstr, &pb->hash);
+
+	cmpct_partial_block(pb, &block);
+
+	/* a short ID collision yields a bad merkle root */
 	if (!bitc_block_valid(&block)) {
-		log_info("net: %s invalid block %s",
+		log_info("net: %s cmpctblock %s failed; fetching full block",
 			conn->addr_str, hexstr);
+		rc = nc_conn_getblock(conn, &pb->hash);
 		goto out;
 	}
 
-    struct const_buffer ser_data = { conn->msg.data, conn->msg.hdr.data_len };
+	log_debug("net: %s cmpctblock %s (%u tx, %u prefilled, %u cached)",
+		conn->addr_str, hexstr, pb->n_tx,
+		pb->n_prefilled, pb->n_cached);
 
-    if (!conn->nci->block_process(&block, &ser_data))
-    goto out;
+	cstring *s = cstr_new_sz(bitc_block_ser_size(&block));
+	ser_bitc_block(s, &block);
 
-	rc = true;
+	struct const_buffer ser_data = { s->str, s->len };
+	rc = conn->nci->block_process(&block, &ser_data);
+
+	cstr_free(s, true);
 
 out:
 	bitc_block_free(&block);
 	return rc;
 }
 
+static bool nc_msg_cmpctblock(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_cmpctblock mcb;
+	bool rc = false;
+
+	msg_cmpctblock_init(&mcb);
+
+	if (!deser_msg_cmpctblock(&mcb, &buf))
+		goto out;
+
+	nc_conn_block_delivered(conn, conn->msg.hdr.data_len);
+
+	bitc_block_calc_sha256(&mcb.hdr);
+
+	/* already have it? */
+	if (!conn->nci->inv_block_process(&mcb.hdr.sha256)) {
+		rc = true;
+		goto out;
+	}
+
+	nc_conn_cmpct_clear(conn);
+
+	struct cmpct_partial *pb = calloc(1, sizeof(*pb));
+	if (!cmpct_partial_init(pb, &mcb, conn->nci->txcache,
+				conn->nci->mempool)) {
+		log_info("net: %s unusable cmpctblock; fetching full block",
+			conn->addr_str);
+		free(pb);
+		rc = nc_conn_getblock(conn, &mcb.hdr.sha256);
+		goto out;
+	}
+
+	if (pb->n_missing == 0) {
+		rc = nc_conn_cmpct_finish(conn, pb);
+		cmpct_partial_free(pb);
+		free(pb);
+		goto out;
+	}
+
+	/* request the transactions we lack */
+	struct msg_getblocktxn mgt;
+	msg_getblocktxn_init(&mgt);
+	cmpct_partial_missing(pb, &mgt);
+
+	cstring *s = ser_msg_getblocktxn(&mgt);
+	rc = nc_conn_send(conn, "getblocktxn", s->str, s->len);
+
+	cstr_free(s, true);
+	msg_getblocktxn_free(&mgt);
+
+	conn->cmpct_pend = pb;
+
+out:
+	msg_cmpctblock_free(&mcb);
+	return rc;
+}
+
+static bool nc_msg_blocktxn(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_blocktxn mbt;
+	bool rc = false;
+
+	msg_blocktxn_init(&mbt);
+
+	if (!deser_msg_blocktxn(&mbt, &buf))
+		goto out;
+
+	/* unsolicited, or for a block we gave up on */
+	struct cmpct_partial *pb = conn->cmpct_pend;
+	if (!pb || !bu256_equal(&pb->hash, &mbt.blockhash)) {
+		rc = true;
+		goto out;
+	}
+
+	if (!cmpct_partial_fill(pb, &mbt))
+		rc = nc_conn_getblock(conn, &pb->hash);
+	else
+		rc = nc_conn_cmpct_finish(conn, pb);
+
+	nc_conn_cmpct_clear(conn);
+
+out:
+	msg_blocktxn_free(&mbt);
+	return rc;
+}
+
+/* blocks the peer could not serve are no longer awaited */
+static bool nc_msg_notfound(struct nc_conn *conn)
+{
+	struct const_buffer buf = { conn->msg.data, conn->msg.hdr.data_len };
+	struct msg_vinv mv;
+
+	msg_vinv_init(&mv);
+
+	if (!deser_msg_vinv(&mv, &buf)) {
+		msg_vinv_free(&mv);
+		return false;
+	}
+
+	unsigned int i;
+	for (i = 0; mv.invs && i < mv.invs->len; i++) {
+		struct bitc_inv *inv = parr_idx(mv.invs, i);
+		if (((inv->type == MSG_BLOCK) ||
+		     (inv->type == MSG_CMPCT_BLOCK)) && conn->n_blk_pending)
+			conn->n_blk_pending--;
+	}
+
+	msg_vinv_free(&mv);
+	return true;
+}
+
 static bool nc_conn_message(struct nc_conn *conn)
 {
 	char *command = conn->msg.hdr.command;
 
+	nc_conn_count(conn, command, P2P_HDR_SZ + conn->msg.hdr.data_len,
+		      false);
+
 	/* verify correct network */
 	if (memcmp(conn->msg.hdr.netmagic, conn->nci->chain->netmagic, 4)) {
 		log_info("net: %s invalid network",
@@ -481,6 +1587,39 @@ static bool nc_conn_message(struct nc_conn *conn)
 	else if (!strncmp(command, "block", 12))
 		return nc_msg_block(conn);
 
+	/* incoming message: ping */
+	else if (!strncmp(command, "ping", 12))
+		return nc_msg_ping(conn);
+
+	/* incoming message: pong */
+	else if (!strncmp(command, "pong", 12))
+		return nc_msg_pong(conn);
+
+	/* incoming message: notfound */
+	else if (!strncmp(command, "notfound", 12))
+		return nc_msg_notfound(conn);
+
+	/* incoming message: tx */
+	else if (!strncmp(command, "tx", 12))
+		return nc_msg_tx(conn);
+
+	/* incoming message: sendcmpct */
+	else if (!strncmp(command, "sendcmpct", 12))
+		return nc_msg_sendcmpct(conn);
+
+	/* incoming message: cmpctblock */
+	else if (!strncmp(command, "cmpctblock", 12))
+		return nc_msg_cmpctblock(conn);
+
+	/* incoming message: blocktxn */
+	else if (!strncmp(command, "blocktxn", 12))
+		return nc_msg_blocktxn(conn);
+
+	/*
+	 * "getblocktxn" is not served: blocks are stored by the block
+	 * processor, not the network layer.  Fall through and ignore.
+	 */
+
 	log_debug("net: %s unknown message %s",
 		conn->addr_str,
 		command);
@@ -540,48 +1679,80 @@ static struct nc_conn *nc_conn_new(const struct peer *peer)
 	return conn;
 }
 
+static void nc_shard_conn_close(struct nc_conn *conn);
+
 static void nc_conn_kill(struct nc_conn *_conn)
 {
 	struct nc_conn *conn = _conn;
 
-	assert(conn->dead == false);
+	/* I/O thread: close now, then tell the main thread */
+	if (conn->shard && pthread_equal(pthread_self(), conn->shard->thread)) {
+		nc_shard_conn_close(conn);
+		return;
+	}
+
+	assert(!nc_conn_is_dead(conn));
 
-	conn->dead = true;
-	event_base_loopbreak(conn->nci->eb);
+	__atomic_store_n(&conn->dead, true, __ATOMIC_RELEASE);
+
+	if (conn->shard)
+		nc_queue_post(&conn->shard->ops, NC_OP_KILL, conn);
+	else
+		event_base_loopbreak(conn->nci->eb);
 }
 
-static void nc_conn_free(struct nc_conn *conn)
+/* release socket, events and I/O buffers */
+static void nc_conn_io_free(struct nc_conn *conn)
 {
-	if (!conn)
-		return;
-
 	if (conn->write_q) {
 		clist *tmp = conn->write_q;
 
 		while (tmp) {
-			struct buffer *buf;
-
-			buf = tmp->data;
+			nc_msgbuf_unref(tmp->data);
 			tmp = tmp->next;
-
-			free(buf->p);
-			free(buf);
 		}
 
 		clist_free(conn->write_q);
+		conn->write_q = NULL;
+		conn->write_q_bytes = 0;
 	}
 
 	if (conn->ev) {
 		event_del(conn->ev);
 		event_free(conn->ev);
+		conn->ev = NULL;
 	}
 	if (conn->write_ev) {
 		event_del(conn->write_ev);
 		event_free(conn->write_ev);
+		conn->write_ev = NULL;
+	}
+	if (conn->throttle_ev) {
+		event_del(conn->throttle_ev);
+		event_free(conn->throttle_ev);
+		conn->throttle_ev = NULL;
 	}
 
-	if (conn->fd >= 0)
-		close(conn->fd);
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		conn->fd = -1;
+	}
+
+	free(conn->rd_msg.data);
+	conn->rd_msg.data = NULL;
+
+	nc_msgbuf_unref(conn->version_buf);
+	conn->version_buf = NULL;
+}
+
+static void nc_conn_free(struct nc_conn *conn)
+{
+	if (!conn)
+		return;
+
+	nc_conn_io_free(conn);
+
+	nc_conn_cmpct_clear(conn);
 
 	free(conn->msg.data);
 
@@ -653,39 +1824,92 @@ static bool nc_conn_start(struct nc_conn *conn)
 
 static bool nc_conn_got_header(struct nc_conn *conn)
 {
-	parse_message_hdr(&conn->msg.hdr, conn->hdrbuf);
+	parse_message_hdr(&conn->rd_msg.hdr, conn->hdrbuf);
 
-	unsigned int data_len = conn->msg.hdr.data_len;
+	unsigned int data_len = conn->rd_msg.hdr.data_len;
 
 	if (data_len > (16 * 1024 * 1024)) {
-		free(conn->msg.data);
-		conn->msg.data = NULL;
+		free(conn->rd_msg.data);
+		conn->rd_msg.data = NULL;
 		return false;
 	}
 
-	conn->msg.data = malloc(data_len);
+	conn->rd_msg.data = malloc(data_len);
+
+	/* payload is hashed as it arrives */
+	sha256_Init(&conn->rd_sha);
 
 	/* switch to read-body state */
-	conn->msg_p = conn->msg.data;
+	conn->msg_p = conn->rd_msg.data;
 	conn->expected = data_len;
 	conn->reading_hdr = false;
 
 	return true;
 }
 
+/* finish the payload hash, and check it against the header */
+static bool nc_conn_rd_checksum_ok(struct nc_conn *conn)
+{
+	unsigned char md1[SHA256_DIGEST_LENGTH];
+	unsigned char md256[SHA256_DIGEST_LENGTH];
+
+	sha256_Final(md1, &conn->rd_sha);
+	sha256_Raw(md1, sizeof(md1), md256);
+
+	return !memcmp(md256, conn->rd_msg.hdr.hash, 4);
+}
+
 static bool nc_conn_got_msg(struct nc_conn *conn)
 {
-	if (!message_valid(&conn->msg)) {
+	struct nc_capture *cap = conn->nci->capture;
+
+	/* record as received, valid or not */
+	if (cap && !nc_capture_write(cap, conn->id, conn->peer.addr.ip,
+				     conn->peer.addr.port, conn->hdrbuf,
+				     conn->rd_msg.data,
+				     conn->rd_msg.hdr.data_len)) {
+		log_error("net: capture write failed");
+	}
+
+	if (!nc_conn_rd_checksum_ok(conn)) {
 		log_info("llnet: %s invalid message",
 			conn->addr_str);
 		return false;
 	}
 
-	if (!nc_conn_message(conn))
-		return false;
+	bool rc = true;
 
-	free(conn->msg.data);
-	conn->msg.data = NULL;
+	if (conn->shard) {
+		/* hand off to the main thread, decoding blocks here */
+		struct nc_qitem *item = calloc(1, sizeof(*item));
+		item->type = NC_IN_MSG;
+		item->conn = conn;
+		item->msg = conn->rd_msg;
+
+		if (!strncmp(item->msg.hdr.command, "block", 12)) {
+			struct bitc_block *block = calloc(1, sizeof(*block));
+			bitc_block_init(block);
+
+			if (nc_block_decode(&item->msg, block))
+				item->block = block;
+			else {
+				bitc_block_free(block);
+				free(block);
+			}
+		}
+
+		nc_queue_push(conn->nci->inbox, item);
+	} else {
+		conn->msg = conn->rd_msg;
+		rc = nc_conn_message(conn);
+
+		free(conn->msg.data);
+		conn->msg.data = NULL;
+	}
+
+	conn->rd_msg.data = NULL;
+	if (!rc)
+		return false;
 
 	/* switch to read-header state */
 	conn->msg_p = conn->hdrbuf;
@@ -710,6 +1934,10 @@ static void nc_conn_read_evt(int fd, short events, void *priv)
 		goto err_out;
 	}
 
+	/* overlap checksumming with the rest of the payload's arrival */
+	if (!conn->reading_hdr)
+		sha256_Update(&conn->rd_sha, conn->msg_p, rrc);
+
 	conn->msg_p += rrc;
 	conn->expected -= rrc;
 
@@ -759,7 +1987,7 @@ static bool nc_conn_read_enable(struct nc_conn *conn)
 	if (conn->ev)
 		return true;
 
-	conn->ev = event_new(conn->nci->eb, conn->fd, EV_READ | EV_PERSIST,
+	conn->ev = event_new(nc_conn_eb(conn), conn->fd, EV_READ | EV_PERSIST,
 			     nc_conn_read_evt, conn);
 	if (!conn->ev)
 		return false;
@@ -791,7 +2019,7 @@ static bool nc_conn_write_enable(struct nc_conn *conn)
 	if (conn->write_ev)
 		return true;
 
-	conn->write_ev = event_new(conn->nci->eb, conn->fd,
+	conn->write_ev = event_new(nc_conn_eb(conn), conn->fd,
 				   EV_WRITE | EV_PERSIST,
 				   nc_conn_write_evt, conn);
 	if (!conn->write_ev)
@@ -841,16 +2069,22 @@ static void nc_conn_evt_connected(int fd, short events, void *priv)
 
 	log_debug("net: connected to %s", conn->addr_str);
 
-	conn->connected = true;
+	__atomic_store_n(&conn->connected, true, __ATOMIC_RELEASE);
 
 	/* clear event used for watching connect(2) */
 	event_free(conn->ev);
 	conn->ev = NULL;
 
-	/* build and send "version" message */
-	cstring *msg_data = nc_version_build(conn);
-	bool rc = nc_conn_send(conn, "version", msg_data->str, msg_data->len);
-	cstr_free(msg_data, true);
+	/* send "version" message; shards get it prebuilt */
+	bool rc;
+	if (conn->shard) {
+		rc = nc_conn_send_buf(conn, conn->version_buf);
+		conn->version_buf = NULL;
+	} else {
+		cstring *msg_data = nc_version_build(conn);
+		rc = nc_conn_send(conn, "version", msg_data->str, msg_data->len);
+		cstr_free(msg_data, true);
+	}
 
 	if (!rc) {
 		log_info("net: %s !conn_send", conn->addr_str);
@@ -862,7 +2096,7 @@ static void nc_conn_evt_connected(int fd, short events, void *priv)
 	conn->expected = P2P_HDR_SZ;
 	conn->reading_hdr = true;
 
-	if (!nc_conn_read_enable(conn)) {
+	if (!conn->read_paused && !nc_conn_read_enable(conn)) {
 		log_info("net: %s read not enabled", conn->addr_str);
 		goto err_out;
 	}
@@ -873,6 +2107,8 @@ err_out:
 	nc_conn_kill(conn);
 }
 
+static void nc_dns_stop(struct net_child_info *nci);
+
 void nc_conns_gc(struct net_child_info *nci, bool free_all)
 {
 	clist *dead = NULL;
@@ -882,16 +2118,23 @@ void nc_conns_gc(struct net_child_info *nci, bool free_all)
 	unsigned int i;
 	for (i = 0; i < nci->conns->len; i++) {
 		struct nc_conn *conn = parr_idx(nci->conns, i);
-		if (free_all || conn->dead)
+
+		/* sharded conns linger until their I/O thread lets go */
+		if (free_all ||
+		    (nc_conn_is_dead(conn) && (!conn->shard || conn->closed)))
 			dead = clist_prepend(dead, conn);
 	}
 
 	/* remove and free dead connections */
+	bool lost_sync = false;
 	clist *tmp = dead;
 	while (tmp) {
 		struct nc_conn *conn = tmp->data;
 		tmp = tmp->next;
 
+		if (conn->syncing)
+			lost_sync = true;
+
 		parr_remove(nci->conns, conn);
 		nc_conn_free(conn);
 		n_gc++;
@@ -899,23 +2142,395 @@ void nc_conns_gc(struct net_child_info *nci, bool free_all)
 
 	clist_free(dead);
 
+	if (lost_sync && !free_all)
+		nc_conns_resync(nci);
+
+	/* shutting down: stop housekeeping and seeding as well */
+	if (free_all && nci->tick_ev) {
+		event_del(nci->tick_ev);
+		event_free(nci->tick_ev);
+		nci->tick_ev = NULL;
+	}
+	if (free_all)
+		nc_dns_stop(nci);
+
 	log_debug("net: gc'd %u connections", n_gc);
 }
 
+/*
+ * I/O threads
+ */
+
+static void nc_shard_conn_close(struct nc_conn *conn)
+{
+	struct nc_shard *shard = conn->shard;
+
+	if (parr_find(shard->conns, conn) < 0)
+		return;
+
+	parr_remove(shard->conns, conn);
+	nc_conn_io_free(conn);
+
+	/* last word on conn from this thread */
+	nc_queue_post(conn->nci->inbox, NC_IN_DEAD, conn);
+}
+
+static void nc_shard_attach(struct nc_shard *shard, struct nc_conn *conn)
+{
+	parr_add(shard->conns, conn);
+
+	conn->ev = event_new(shard->eb, conn->fd, EV_WRITE,
+			     nc_conn_evt_connected, conn);
+
+	struct timeval timeout = { conn->dial_ms / 1000,
+				   (conn->dial_ms % 1000) * 1000 };
+	if (!conn->ev || (event_add(conn->ev, &timeout) != 0)) {
+		log_info("net: event_add failed on %s", conn->addr_str);
+		nc_shard_conn_close(conn);
+	}
+}
+
+static void nc_shard_wake_evt(int fd, short events, void *priv)
+{
+	struct nc_shard *shard = priv;
+	struct nc_qitem *item = nc_queue_take(&shard->ops);
+
+	while (item) {
+		struct nc_qitem *next = item->next;
+		struct nc_conn *conn = item->conn;
+
+		/* conn may be closed (and freed); only compare pointers */
+		bool open = conn && (parr_find(shard->conns, conn) >= 0);
+
+		switch (item->type) {
+		case NC_OP_ATTACH:
+			nc_shard_attach(shard, conn);
+			break;
+
+		case NC_OP_SEND: {
+			struct nc_msgbuf *buf = item->buf;
+			item->buf = NULL;
+
+			if (!open)
+				nc_msgbuf_unref(buf);
+			else if (!nc_conn_send_buf(conn, buf))
+				nc_shard_conn_close(conn);
+			break;
+		}
+
+		case NC_OP_KILL:
+			if (open)
+				nc_shard_conn_close(conn);
+			break;
+
+		case NC_OP_STOP:
+			shard->running = false;
+			event_base_loopbreak(shard->eb);
+			break;
+
+		default:
+			break;
+		}
+
+		nc_qitem_free(item);
+		item = next;
+	}
+}
+
+static void *nc_shard_main(void *priv)
+{
+	struct nc_shard *shard = priv;
+
+	while (shard->running)
+		event_base_dispatch(shard->eb);
+
+	return NULL;
+}
+
+static void nc_shard_free(struct nc_shard *shard)
+{
+	if (shard->wake_ev) {
+		event_del(shard->wake_ev);
+		event_free(shard->wake_ev);
+	}
+	if (shard->eb)
+		event_base_free(shard->eb);
+	parr_free(shard->conns, true);
+	nc_queue_free(&shard->ops);
+
+	memset(shard, 0, sizeof(*shard));
+}
+
+static bool nc_shard_init(struct nc_shard *shard, struct net_child_info *nci)
+{
+	memset(shard, 0, sizeof(*shard));
+	shard->nci = nci;
+
+	if (!nc_queue_init(&shard->ops))
+		return false;
+
+	shard->conns = parr_new(0, NULL);
+	shard->eb = event_base_new();
+	if (!shard->eb)
+		goto err_out;
+
+	shard->wake_ev = event_new(shard->eb, shard->ops.wake_fd[0],
+				   EV_READ | EV_PERSIST,
+				   nc_shard_wake_evt, shard);
+	if (!shard->wake_ev || (event_add(shard->wake_ev, NULL) != 0))
+		goto err_out;
+
+	shard->running = true;
+	if (pthread_create(&shard->thread, NULL, nc_shard_main, shard) != 0)
+		goto err_out;
+	shard->started = true;
+
+	return true;
+
+err_out:
+	nc_shard_free(shard);
+	return false;
+}
+
+/* messages and closures from the I/O threads */
+static void nc_inbox_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	struct nc_qitem *item = nc_queue_take(nci->inbox);
+
+	while (item) {
+		struct nc_qitem *next = item->next;
+		struct nc_conn *conn = item->conn;
+
+		if (item->type == NC_IN_DEAD) {
+			__atomic_store_n(&conn->dead, true, __ATOMIC_RELEASE);
+			conn->closed = true;
+			conn->shard->n_conns--;
+			event_base_loopbreak(nci->eb);
+		}
+
+		else if ((item->type == NC_IN_MSG) && !nc_conn_is_dead(conn)) {
+			conn->msg = item->msg;
+			conn->msg_block = item->block;
+			item->msg.data = NULL;
+			item->block = NULL;
+
+			bool rc = nc_conn_message(conn);
+
+			free(conn->msg.data);
+			conn->msg.data = NULL;
+			if (conn->msg_block) {
+				bitc_block_free(conn->msg_block);
+				free(conn->msg_block);
+				conn->msg_block = NULL;
+			}
+
+			if (!rc)
+				nc_conn_kill(conn);
+		}
+
+		nc_qitem_free(item);
+		item = next;
+	}
+}
+
+bool nc_shards_start(struct net_child_info *nci, unsigned int n_shards)
+{
+	if (!n_shards || nci->shards)
+		return true;
+	if (n_shards > NC_MAX_SHARDS)
+		n_shards = NC_MAX_SHARDS;
+
+	nci->inbox = calloc(1, sizeof(struct nc_queue));
+	if (!nci->inbox || !nc_queue_init(nci->inbox)) {
+		free(nci->inbox);
+		nci->inbox = NULL;
+		return false;
+	}
+
+	nci->inbox_ev = event_new(nci->eb, nci->inbox->wake_fd[0],
+				  EV_READ | EV_PERSIST, nc_inbox_evt, nci);
+	if (!nci->inbox_ev || (event_add(nci->inbox_ev, NULL) != 0))
+		goto err_out;
+
+	nci->shards = calloc(n_shards, sizeof(struct nc_shard));
+	if (!nci->shards)
+		goto err_out;
+
+	/* signals are for the main thread; I/O threads inherit this mask */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	unsigned int i;
+	for (i = 0; i < n_shards; i++)
+		if (!nc_shard_init(&nci->shards[i], nci))
+			break;
+	nci->n_shards = i;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (i < n_shards)
+		goto err_out;
+
+	log_debug("net: started %u I/O threads", n_shards);
+
+	return true;
+
+err_out:
+	log_error("net: failed to start I/O threads");
+	nc_shards_stop(nci);
+	return false;
+}
+
+void nc_shards_stop(struct net_child_info *nci)
+{
+	unsigned int i;
+
+	for (i = 0; i < nci->n_shards; i++)
+		nc_queue_post(&nci->shards[i].ops, NC_OP_STOP, NULL);
+	for (i = 0; i < nci->n_shards; i++)
+		pthread_join(nci->shards[i].thread, NULL);
+
+	/* free connections while their event loops still exist */
+	if (nci->n_shards)
+		nc_conns_gc(nci, true);
+
+	for (i = 0; i < nci->n_shards; i++)
+		nc_shard_free(&nci->shards[i]);
+
+	free(nci->shards);
+	nci->shards = NULL;
+	nci->n_shards = 0;
+
+	if (nci->inbox_ev) {
+		event_del(nci->inbox_ev);
+		event_free(nci->inbox_ev);
+		nci->inbox_ev = NULL;
+	}
+	if (nci->inbox) {
+		nc_queue_free(nci->inbox);
+		free(nci->inbox);
+		nci->inbox = NULL;
+	}
+}
+
+static void nc_conns_attach(struct net_child_info *nci, struct nc_conn *conn)
+{
+	struct nc_shard *shard = &nci->shards[0];
+
+	unsigned int i;
+	for (i = 1; i < nci->n_shards; i++)
+		if (nci->shards[i].n_conns < shard->n_conns)
+			shard = &nci->shards[i];
+
+	/* the I/O thread sends it once connected */
+	cstring *msg_data = nc_version_build(conn);
+	conn->version_buf = nc_msg_buf(nci, "version",
+				       msg_data->str, msg_data->len);
+	cstr_free(msg_data, true);
+	if (conn->version_buf)
+		nc_conn_count(conn, "version", conn->version_buf->len, true);
+
+	conn->shard = shard;
+	shard->n_conns++;
+
+	parr_add(nci->conns, conn);
+	nc_queue_post(&shard->ops, NC_OP_ATTACH, conn);
+}
+
+/* wait for connect(2) to finish, then start the handshake */
+static bool nc_conn_watch(struct net_child_info *nci, struct nc_conn *conn)
+{
+	/* hand to the least loaded I/O thread */
+	if (nci->n_shards) {
+		nc_conns_attach(nci, conn);
+		return true;
+	}
+
+	/* add to our list of monitored event sources */
+	conn->ev = event_new(nci->eb, conn->fd, EV_WRITE,
+			     nc_conn_evt_connected, conn);
+	if (!conn->ev) {
+		log_info("net: event_new failed on %s",
+			conn->addr_str);
+		return false;
+	}
+
+	struct timeval timeout = { conn->dial_ms / 1000,
+				   (conn->dial_ms % 1000) * 1000 };
+	if (event_add(conn->ev, &timeout) != 0) {
+		log_info("net: event_add failed on %s",
+			conn->addr_str);
+		return false;
+	}
+
+	/* add to our list of active connections */
+	parr_add(nci->conns, conn);
+
+	return true;
+}
+
+/* take on an already connected socket, e.g. one end of a socketpair */
+bool nc_conns_adopt(struct net_child_info *nci, int fd,
+		    const struct peer *peer)
+{
+	struct nc_conn *conn = nc_conn_new(peer);
+	if (!conn) {
+		close(fd);
+		return false;
+	}
+
+	conn->nci = nci;
+	conn->fd = fd;
+	conn->ipv4 = is_ipv4_mapped(conn->peer.addr.ip);
+	conn->id = nci->next_conn_id++;
+	conn->t_open_ms = nc_now_ms();
+	conn->dial_ms = nc_dial_timeout_ms(conn);
+
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) ||
+	    !nc_conn_watch(nci, conn)) {
+		nc_conn_free(conn);
+		return false;
+	}
+
+	return true;
+}
+
 static void nc_conns_open(struct net_child_info *nci)
 {
-	log_debug("net: open connections (have %zu, want %zu more)",
-		nci->conns->len,
-		NC_MAX_CONN - nci->conns->len);
+	if (nci->no_dial)
+		return;
+
+	struct nc_conn_counts cnt;
+	nc_conns_count(nci, &cnt);
 
-	while ((bitc_hashtab_size(nci->peers->map_addr) > 0) &&
-	       (nci->conns->len < NC_MAX_CONN)) {
+	/* over-dial: slow or dead addresses must not hold up the rest */
+	unsigned int want = nc_max_conns(nci) + nci->max_spare;
+	unsigned int have = cnt.active + cnt.spare;
+	unsigned int need = (have < want) ? (want - have) : 0;
+	unsigned int max_dials = MIN(need * 2, nc_max_dials(nci));
+
+	log_debug("net: open connections (have %u, want %u more, %u dialing)",
+		have, need, cnt.dialing);
+
+	clist *busy = NULL;
+
+	while ((peerman_size(nci->peers) > 0) &&
+	       (cnt.dialing < max_dials)) {
 
 		/* delete peer from front of address list.  it will be
 		 * re-added before writing peer file, if successful
 		 */
 		struct peer *peer = peerman_pop(nci->peers);
 
+		/* already connected to this IP: set aside, put back below */
+		if (nc_conn_ip_active(nci, peer->addr.ip)) {
+			busy = clist_prepend(busy, peer);
+			continue;
+		}
+
 		struct nc_conn *conn = nc_conn_new(peer);
 		conn->nci = nci;
 		peer_free(peer);
@@ -924,13 +2539,6 @@ static void nc_conns_open(struct net_child_info *nci)
 		log_debug("net: connecting to %s",
 			conn->addr_str);
 
-		/* are we already connected to this IP? */
-		if (nc_conn_ip_active(nci, conn->peer.addr.ip)) {
-			log_info("net: already connected to %s",
-				conn->addr_str);
-			goto err_loop;
-		}
-
 		/* are we already connected to this network group? */
 		if (nc_conn_group_active(nci, &conn->peer)) {
 			log_info("net: already grouped to %s",
@@ -939,41 +2547,133 @@ static void nc_conns_open(struct net_child_info *nci)
 		}
 
 		/* initiate non-blocking connect(2) */
+		conn->id = nci->next_conn_id++;
+		conn->t_open_ms = nc_now_ms();
+		conn->dial_ms = nc_dial_timeout_ms(conn);
 		if (!nc_conn_start(conn)) {
 			log_info("net: failed to start connection to %s",
 				conn->addr_str);
 			goto err_loop;
 		}
 
-		/* add to our list of monitored event sources */
-		conn->ev = event_new(nci->eb, conn->fd, EV_WRITE,
-				     nc_conn_evt_connected, conn);
-		if (!conn->ev) {
-			log_info("net: event_new failed on %s",
-				conn->addr_str);
+		cnt.dialing++;
+
+		if (!nc_conn_watch(nci, conn))
 			goto err_loop;
+
+		continue;
+
+err_loop:
+		/* never listed, so nc_conns_gc() would not find it */
+		nc_conn_free(conn);
+	}
+
+	clist *tmp;
+	for (tmp = busy; tmp; tmp = tmp->next) {
+		struct peer *peer = tmp->data;
+
+		peerman_add(nci->peers, peer, peer->tried);
+		peer_free(peer);
+		free(peer);
+	}
+	clist_free(busy);
+}
+
+/* drop stuck handshakes and peers sitting on block requests;
+ * keep RTT samples fresh
+ */
+static void nc_conns_tick(struct net_child_info *nci)
+{
+	int64_t now = nc_now_ms();
+
+	unsigned int i;
+	for (i = 0; i < nci->conns->len; i++) {
+		struct nc_conn *conn = parr_idx(nci->conns, i);
+
+		if (nc_conn_is_dead(conn))
+			continue;
+
+		if (!conn->seen_verack) {
+			if ((now - conn->t_open_ms) >
+			    (NC_HANDSHAKE_SECS * 1000)) {
+				log_info("net: %s handshake timeout",
+					 conn->addr_str);
+				nc_conn_kill(conn);
+			}
+			continue;
 		}
 
-		struct timeval timeout = { conn->nci->net_conn_timeout, };
-		if (event_add(conn->ev, &timeout) != 0) {
-			log_info("net: event_add failed on %s",
-				conn->addr_str);
-			goto err_loop;
+		if (nc_conn_stalled(conn, now)) {
+			log_info("net: %s stalled, %u blocks outstanding",
+				 conn->addr_str, conn->n_blk_pending);
+			conn->peer.n_stalls++;
+			nc_conn_peer_sync(conn);
+			nc_conn_kill(conn);
+			continue;
 		}
 
-		/* add to our list of active connections */
-		parr_add(nci->conns, conn);
+		if (!conn->t_ping_ms &&
+		    ((now - conn->t_last_ping_ms) >= (NC_PING_SECS * 1000)) &&
+		    !nc_conn_ping(conn))
+			nc_conn_kill(conn);
+	}
+}
+
+static void nc_tick_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
 
-		continue;
+	nc_conns_tick(nci);
 
-err_loop:
-		nc_conn_kill(conn);
+	struct timeval tv = { NC_TICK_SECS, };
+	event_add(nci->tick_ev, &tv);
+}
+
+static void nc_dns_stop(struct net_child_info *nci)
+{
+	if (nci->dns_ev) {
+		event_del(nci->dns_ev);
+		event_free(nci->dns_ev);
+		nci->dns_ev = NULL;
 	}
+
+	bu_dns_seeder_free(nci->dns);
+	nci->dns = NULL;
+}
+
+/* seed addresses arrived: dial them while slower seeds still resolve */
+static void nc_dns_evt(int fd, short events, void *priv)
+{
+	struct net_child_info *nci = priv;
+	bool done;
+
+	peerman_add_seeds(nci->peers, bu_dns_seeder_take(nci->dns, &done));
+
+	if (done)
+		nc_dns_stop(nci);
+
+	event_base_loopbreak(nci->eb);
 }
 
 void nc_conns_process(struct net_child_info *nci)
 {
+	if (!nci->tick_ev) {
+		struct timeval tv = { NC_TICK_SECS, };
+
+		nci->tick_ev = event_new(nci->eb, -1, 0, nc_tick_evt, nci);
+		if (nci->tick_ev)
+			event_add(nci->tick_ev, &tv);
+	}
+
+	if (nci->dns && !nci->dns_ev) {
+		nci->dns_ev = event_new(nci->eb, bu_dns_seeder_fd(nci->dns),
+					EV_READ | EV_PERSIST, nc_dns_evt, nci);
+		if (nci->dns_ev)
+			event_add(nci->dns_ev, NULL);
+	}
+
 	nc_conns_gc(nci, false);
+	nc_conns_promote(nci);
 	nc_conns_open(nci);
 }
 
@@ -997,19 +2697,6 @@ static void sendcmd(int fd, enum netcmds nc)
 {
 	uint8_t v = nc;
 	pipwr(fd, &v, 1);
-if (nc == NC_STOP) {
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-pipwr(fd, &v, 1);
-}
-
-
 }
 
 static enum netcmds readcmd(int fd, int timeout_secs)
@@ -1099,8 +2786,19 @@ bool neteng_start(struct net_engine *neteng)
 	if (neteng->running)
 		return false;
 
+	/* shared before fork, so both processes map the same ring */
+	if (neteng->ring_size) {
+		neteng->ring = calloc(1, sizeof(struct shmring));
+		if (!neteng->ring ||
+		    !shmring_init(neteng->ring, neteng->ring_size)) {
+			free(neteng->ring);
+			neteng->ring = NULL;
+			return false;
+		}
+	}
+
 	if (pipe(neteng->rx_pipefd) < 0)
-		return false;
+		goto err_out_ring;
 	if (pipe(neteng->tx_pipefd) < 0)
 		goto err_out_rxfd;
 
@@ -1114,7 +2812,9 @@ bool neteng_start(struct net_engine *neteng)
 
 	/* child execution path continues here */
 	if (neteng->child == 0) {
-		neteng->network_child_process(neteng->tx_pipefd[0], neteng->rx_pipefd[1]);
+		neteng->network_child_process(neteng->tx_pipefd[0],
+					      neteng->rx_pipefd[1],
+					      neteng->ring);
 		exit(0);
 	}
 
@@ -1145,6 +2845,10 @@ err_out_rxfd:
 	neteng->rx_pipefd[1] = -1;
 	neteng->tx_pipefd[0] = -1;
 	neteng->tx_pipefd[1] = -1;
+err_out_ring:
+	shmring_free(neteng->ring);
+	free(neteng->ring);
+	neteng->ring = NULL;
 	return false;
 }
 
@@ -1171,6 +2875,10 @@ void neteng_stop(struct net_engine *neteng)
 	neteng->tx_pipefd[0] = -1;
 	neteng->tx_pipefd[1] = -1;
 
+	shmring_free(neteng->ring);
+	free(neteng->ring);
+	neteng->ring = NULL;
+
 	neteng->running = false;
 }
 
@@ -1182,7 +2890,9 @@ void neteng_free(struct net_engine *neteng)
 	free(neteng);
 }
 
-struct net_engine *neteng_new_start(void (*network_child)(int read_fd, int write_fd))
+struct net_engine *neteng_new_start(void (*network_child)(int read_fd,
+				    int write_fd, struct shmring *ring),
+				    size_t ring_size)
 {
 	struct net_engine *neteng;
 
@@ -1193,6 +2903,7 @@ struct net_engine *neteng_new_start(void (*network_child)(int read_fd, int write
 	}
 
 	neteng->network_child_process = network_child;
+	neteng->ring_size = ring_size;
 
 	if (!neteng_start(neteng)) {
 		log_info("net: failed to start engine");
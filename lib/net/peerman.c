@@ -7,6 +7,8 @@
 #include "bitc/net/peerman.h"          // for peer, peer_manager, etc
 #include <bitc/buffer.h>               // for const_buffer
 #include <bitc/coredefs.h>             // for ::CADDR_TIME_VERSION, etc
+#include <bitc/crypto/prng.h>          // for prng_get_random_bytes
+#include <bitc/crypto/siphash.h>       // for siphash24
 #include <bitc/hashtab.h>              // for bitc_hashtab_del, etc
 #include <bitc/message.h>              // for p2p_message, etc
 #include <bitc/mbr.h>                  // for fread_message
@@ -19,6 +21,7 @@
 #include <errno.h>                      // for errno
 #include <stdio.h>                      // for NULL, fprintf, stderr, etc
 #include <stdlib.h>                     // for free, calloc, malloc, atoi, etc
+#include <time.h>                       // for time
 #include <unistd.h>                     // for close, write, unlink, etc
 
 static unsigned long addr_hash(const void *key)
@@ -44,6 +47,15 @@ bool deser_peer(unsigned int protover,
 	if (!deser_s64(&peer->last_fail, buf)) return false;
 	if (!deser_u32(&peer->n_fail, buf)) return false;
 
+	/* performance stats; absent in older peer files */
+	if (buf->len == 0)
+		return true;
+
+	if (!deser_u32(&peer->ping_ms, buf)) return false;
+	if (!deser_u32(&peer->handshake_ms, buf)) return false;
+	if (!deser_u32(&peer->rx_rate, buf)) return false;
+	if (!deser_u32(&peer->n_stalls, buf)) return false;
+
 	return true;
 }
 
@@ -56,17 +68,90 @@ void ser_peer(cstring *s, unsigned int protover, const struct peer *peer)
 
 	ser_s64(s, peer->last_fail);
 	ser_u32(s, peer->n_fail);
+
+	ser_u32(s, peer->ping_ms);
+	ser_u32(s, peer->handshake_ms);
+	ser_u32(s, peer->rx_rate);
+	ser_u32(s, peer->n_stalls);
+}
+
+/* estimated cost of using a peer, in ms; lower is better */
+int64_t peer_cost(const struct peer *peer)
+{
+	int64_t cost = peer->ping_ms ? peer->ping_ms : PEER_DEF_PING_MS;
+
+	cost += (peer->handshake_ms ? peer->handshake_ms :
+				      PEER_DEF_HANDSHAKE_MS) / 2;
+	cost += (int64_t) peer->n_stalls * PEER_STALL_COST_MS;
+
+	/* reward throughput: 1ms per KB/s, up to a second */
+	cost -= MIN(peer->rx_rate / 1024, 1000);
+
+	return cost;
+}
+
+/* connected successfully, recently enough for its stats to matter */
+static bool peer_proven(const struct peer *peer, int64_t cutoff)
+{
+	return peer->n_ok && (peer->last_ok >= cutoff);
 }
 
 int peer_cmp(const void *a_, const void *b_, void *user_priv)
 {
 	const struct peer *a = a_;
 	const struct peer *b = b_;
+	const int64_t *now = user_priv;
+	int64_t cutoff = now ? *now - PEER_FRESH_SECS : 0;
+
+	/* proven peers first, cheapest first */
+	bool a_good = peer_proven(a, cutoff);
+	bool b_good = peer_proven(b, cutoff);
+	if (a_good != b_good)
+		return a_good ? -1 : 1;
+
+	if (a_good) {
+		int64_t a_cost = peer_cost(a);
+		int64_t b_cost = peer_cost(b);
+		if (a_cost != b_cost)
+			return (a_cost < b_cost) ? -1 : 1;
+	}
 
 	int64_t a_time = (a->last_ok > a->addr.nTime) ? a->last_ok : a->addr.nTime;
 	int64_t b_time = (b->last_ok > b->addr.nTime) ? b->last_ok : b->addr.nTime;
 	/* reverse sort, greatest first */
-	return (int) (b_time - a_time);
+	if (a_time == b_time)
+		return 0;
+	return (b_time > a_time) ? 1 : -1;
+}
+
+static void peer_ent_free(void *data)
+{
+	if (!data)
+		return;
+	struct peer *peer = data;
+
+	peer_free(peer);
+	free(peer);
+}
+
+static bool peer_table_init(struct peer_table *tab, unsigned int n_buckets)
+{
+	tab->n_buckets = n_buckets;
+	tab->slots = calloc((size_t) n_buckets * PEERMAN_BUCKET_SIZE,
+			    sizeof(struct peer *));
+	tab->ids = parr_new(0, peer_ent_free);
+
+	return tab->slots && tab->ids;
+}
+
+static void peer_table_free(struct peer_table *tab)
+{
+	if (tab->ids)
+		parr_free(tab->ids, true);
+	free(tab->slots);
+
+	tab->ids = NULL;
+	tab->slots = NULL;
 }
 
 static struct peer_manager *peerman_new(void)
@@ -78,22 +163,20 @@ static struct peer_manager *peerman_new(void)
 		return NULL;
 
 	peers->map_addr = bitc_hashtab_new(addr_hash, addr_equal);
-	if (!peers->map_addr) {
-		free(peers);
+	if (!peers->map_addr ||
+	    !peer_table_init(&peers->new_tab, PEERMAN_NEW_BUCKETS) ||
+	    !peer_table_init(&peers->tried_tab, PEERMAN_TRIED_BUCKETS)) {
+		peerman_free(peers);
 		return NULL;
 	}
 
-	return peers;
-}
-
-static void peer_ent_free(void *data)
-{
-	if (!data)
-		return;
-	struct peer *peer = data;
+	/* secret key, so remote peers cannot aim at one bucket */
+	if (prng_get_random_bytes((uint8_t *) peers->key,
+				  sizeof(peers->key)) < 0)
+		peers->key[0] = (uint64_t) time(NULL);
+	peers->rng = peers->key[0] ^ peers->key[1] ^ 0x9e3779b97f4a7c15ULL;
 
-	peer_free(peer);
-	free(peer);
+	return peers;
 }
 
 void peerman_free(struct peer_manager *peers)
@@ -103,22 +186,118 @@ void peerman_free(struct peer_manager *peers)
 
 	bitc_hashtab_unref(peers->map_addr);
 
-	clist_free_ext(peers->addrlist, peer_ent_free);
+	peer_table_free(&peers->new_tab);
+	peer_table_free(&peers->tried_tab);
 
 	memset(peers, 0, sizeof(*peers));
 	free(peers);
 }
 
+/* xorshift64*; selection only needs to be unpredictable-ish and fast */
+static uint64_t peerman_rand(struct peer_manager *peers)
+{
+	uint64_t x = peers->rng;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	peers->rng = x;
+
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * The bucket depends on the network group, plus a few bits of the
+ * address so one group may spread over per_group buckets.
+ */
+static unsigned int peer_slot(const struct peer_manager *peers,
+			      const struct peer *peer,
+			      const struct peer_table *tab,
+			      unsigned int per_group)
+{
+	uint64_t h = siphash24(peers->key[0], peers->key[1],
+			       peer->addr.ip, sizeof(peer->addr.ip));
+
+	unsigned char buf[sizeof(peer->group) + 2];
+	memcpy(buf, peer->group, peer->group_len);
+	buf[peer->group_len] = (unsigned char) (h % per_group);
+	buf[peer->group_len + 1] = (tab->n_buckets == PEERMAN_TRIED_BUCKETS);
+
+	uint64_t bucket = siphash24(peers->key[1], peers->key[0],
+				    buf, peer->group_len + 2) % tab->n_buckets;
+
+	return (unsigned int) (bucket * PEERMAN_BUCKET_SIZE +
+			       ((h >> 32) % PEERMAN_BUCKET_SIZE));
+}
+
+static void peer_table_put(struct peer_table *tab, struct peer *peer,
+			   unsigned int slot)
+{
+	peer->slot = slot;
+	peer->id = tab->ids->len;
+	tab->slots[slot] = peer;
+	parr_add(tab->ids, peer);
+}
+
+/* unlink from table; O(1), by moving the last id into the hole */
+static void peer_table_del(struct peer_table *tab, struct peer *peer)
+{
+	struct peer *last = parr_idx(tab->ids, tab->ids->len - 1);
+
+	tab->ids->data[peer->id] = last;
+	last->id = peer->id;
+	tab->ids->len--;
+
+	tab->slots[peer->slot] = NULL;
+}
+
+static struct peer_table *peer_tab(struct peer_manager *peers,
+				   const struct peer *peer)
+{
+	return peer->tried ? &peers->tried_tab : &peers->new_tab;
+}
+
+static void peerman_unlink(struct peer_manager *peers, struct peer *peer)
+{
+	peer_table_del(peer_tab(peers, peer), peer);
+	bitc_hashtab_del(peers->map_addr, peer->addr.ip);
+}
+
+static void peerman_drop(struct peer_manager *peers, struct peer *peer)
+{
+	peerman_unlink(peers, peer);
+	peer_ent_free(peer);
+}
+
+/* takes ownership of peer; it may be dropped for lack of room */
 static void __peerman_add(struct peer_manager *peers, struct peer *peer,
-			  bool prepend_front)
+			  bool tried)
 {
 	bn_group(peer->group, &peer->group_len, peer->addr.ip);
+	peer->tried = tried;
+
+	struct peer_table *tab = peer_tab(peers, peer);
+	unsigned int slot = peer_slot(peers, peer, tab, tried ?
+				      PEERMAN_TRIED_PER_GROUP :
+				      PEERMAN_NEW_PER_GROUP);
+	struct peer *old = tab->slots[slot];
+
+	if (old && !tried) {
+		/* keep whichever was heard from more recently */
+		if (old->addr.nTime >= peer->addr.nTime) {
+			peer_ent_free(peer);
+			return;
+		}
+		peerman_drop(peers, old);
+	}
 
-	if (prepend_front)
-		peers->addrlist = clist_prepend(peers->addrlist, peer);
-	else
-		peers->addrlist = clist_append(peers->addrlist, peer);
+	else if (old) {
+		/* a tried peer displaced from its slot gets another go */
+		peerman_unlink(peers, old);
+		__peerman_add(peers, old, false);
+	}
 
+	peer_table_put(tab, peer, slot);
 	bitc_hashtab_put(peers->map_addr, peer->addr.ip, peer);
 }
 
@@ -143,9 +322,12 @@ static bool peerman_read_rec(struct peer_manager *peers,
 	peer = calloc(1, sizeof(*peer));
 	peer_init(peer);
 
+	/* peers we have recently connected to go straight to "tried" */
+	int64_t cutoff = (int64_t) time(NULL) - PEER_FRESH_SECS;
+
 	if (deser_peer(CADDR_TIME_VERSION, peer, &buf) &&
 	    !peerman_has_addr(peers, peer->addr.ip))
-		__peerman_add(peers, peer, false);
+		__peerman_add(peers, peer, peer_proven(peer, cutoff));
 	else {
 		peer_free(peer);
 		free(peer);
@@ -211,27 +393,30 @@ struct peer_manager *peerman_seed(bool use_dns)
 		return NULL;
 
 	/* make DNS query for seed data */
-	clist *tmp, *seedlist = NULL;
+	clist *seedlist = NULL;
 	if (use_dns)
 		seedlist = bu_dns_seed_addrs();
 
+	peerman_add_seeds(peers, seedlist);
+
+	return peers;
+}
+
+/* import seed data into peerman; untested until connected */
+void peerman_add_seeds(struct peer_manager *peers, clist *seedlist)
+{
 	log_debug("peerman: DNS returned %zu addresses",
 		clist_length(seedlist));
 
-	clist_shuffle(seedlist);
-
-	/* import seed data into peerman */
-	tmp = seedlist;
+	clist *tmp = seedlist;
 	while (tmp) {
 		struct bitc_address *addr = tmp->data;
 		tmp = tmp->next;
 
-		peerman_add_addr(peers, addr, true);
+		peerman_add_addr(peers, addr, false);
 		free(addr);
 	}
 	clist_free(seedlist);
-
-	return peers;
 }
 
 static bool ser_peerman(struct peer_manager *peers, int fd,  const struct chain_info *chain)
@@ -246,16 +431,15 @@ static bool ser_peerman(struct peer_manager *peers, int fd,  const struct chain_
 	if (wrc != rec_len)
 		return false;
 
-	log_debug("peerman: %zu peers to write",
-		clist_length(peers->addrlist));
+	log_debug("peerman: %zu peers to write", peerman_size(peers));
 
-	/* write peer list */
-	clist *tmp = peers->addrlist;
-	while (tmp) {
-		struct peer *peer;
-
-		peer = tmp->data;
-		tmp = tmp->next;
+	/* write peer list, tried first */
+	unsigned int i;
+	for (i = 0; i < peerman_size(peers); i++) {
+		const parr *tried_ids = peers->tried_tab.ids;
+		struct peer *peer = (i < tried_ids->len) ?
+			parr_idx(tried_ids, i) :
+			parr_idx(peers->new_tab.ids, i - tried_ids->len);
 
 		cstring *msg_data = cstr_new_sz(sizeof(struct peer));
 		ser_peer(msg_data, CADDR_TIME_VERSION, peer);
@@ -312,34 +496,57 @@ err_out:
 	return false;
 }
 
-void peerman_sort(struct peer_manager *peers)
-{
-	peers->addrlist = clist_sort(peers->addrlist, peer_cmp, NULL);
-}
-
+/*
+ * Sample a few random addresses, preferring the tried table, and take
+ * the best of them.  Constant time, whatever the table sizes.
+ */
 struct peer *peerman_pop(struct peer_manager *peers)
 {
-	struct peer *peer;
-	clist *tmp;
+	struct peer_table *tab = &peers->tried_tab;
+	size_t n_new = peers->new_tab.ids->len;
 
-	tmp = peers->addrlist;
-	if (!tmp)
+	/* mostly proven peers, but keep exploring new ones */
+	if (!tab->ids->len || (n_new && (peerman_rand(peers) % 4 == 0)))
+		tab = &peers->new_tab;
+	if (!tab->ids->len)
 		return NULL;
 
-	peer = tmp->data;
+	int64_t now = time(NULL);
+	size_t n = tab->ids->len;
+	struct peer *best = NULL;
+	unsigned int i;
 
-	peers->addrlist = clist_delete(tmp, tmp);
+	for (i = 0; i < PEERMAN_POP_WINDOW && i < n; i++) {
+		/* small tables are scanned whole */
+		size_t idx = (n <= PEERMAN_POP_WINDOW) ? i :
+			     (peerman_rand(peers) % n);
+		struct peer *peer = parr_idx(tab->ids, idx);
 
-	bitc_hashtab_del(peers->map_addr, peer->addr.ip);
+		if (!best || (peer_cmp(peer, best, &now) < 0))
+			best = peer;
+	}
 
-	return peer;
+	peerman_unlink(peers, best);
+
+	return best;
+}
+
+struct peer *peerman_lookup(struct peer_manager *peers,
+			    const unsigned char *ip)
+{
+	return bitc_hashtab_get(peers->map_addr, ip);
 }
 
 void peerman_add(struct peer_manager *peers,
 		 const struct peer *peer_in, bool known_working)
 {
-	if (peerman_has_addr(peers, peer_in->addr.ip))
-		return;
+	/* a gossiped copy is superseded by a working peer */
+	struct peer *old = peerman_lookup(peers, peer_in->addr.ip);
+	if (old) {
+		if (!known_working || old->tried)
+			return;
+		peerman_drop(peers, old);
+	}
 
 	struct peer *peer;
 	peer = malloc(sizeof(*peer));
@@ -348,7 +555,7 @@ void peerman_add(struct peer_manager *peers,
 
 	peer_copy(peer, peer_in);
 
-	__peerman_add(peers, peer, !known_working);
+	__peerman_add(peers, peer, known_working);
 }
 
 void peerman_add_addr(struct peer_manager *peers,
@@ -365,7 +572,7 @@ void peerman_add_addr(struct peer_manager *peers,
 	peer_init(peer);
 	bitc_addr_copy(&peer->addr, addr_in);
 
-	__peerman_add(peers, peer, !known_working);
+	__peerman_add(peers, peer, known_working);
 }
 
 void peerman_addstr(struct peer_manager *peers,
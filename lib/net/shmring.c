@@ -0,0 +1,249 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#define _GNU_SOURCE                     // for memfd_create
+
+#include <bitc/net/shmring.h>          // for shmring, shmring_rec, etc
+#include <bitc/log.h>                  // for log_error
+
+#include <errno.h>                      // for errno, EINTR
+#include <fcntl.h>                      // for fcntl, O_NONBLOCK
+#include <poll.h>                       // for poll, POLLIN, pollfd
+#include <string.h>                     // for memcpy, memset, strerror
+#include <sys/mman.h>                   // for mmap, munmap, memfd_create
+#include <unistd.h>                     // for close, read, write, etc
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>                // for eventfd, EFD_NONBLOCK
+#endif
+
+/* shared control block; head and tail on separate cache lines */
+struct shmring_ctl {
+	uint64_t	tail;			/* written by producer */
+	unsigned char	pad0[64 - sizeof(uint64_t)];
+	uint64_t	head;			/* written by consumer */
+	unsigned char	pad1[64 - sizeof(uint64_t)];
+};
+
+#define SHMRING_CTL_SZ	4096
+
+static size_t rec_size(size_t len)
+{
+	size_t sz = sizeof(struct shmring_rec) + len;
+	return (sz + SHMRING_ALIGN - 1) & ~((size_t) SHMRING_ALIGN - 1);
+}
+
+static bool notify_open(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+	int fd = eventfd(0, EFD_NONBLOCK);
+	if (fd < 0)
+		return false;
+	fds[0] = fds[1] = fd;
+#else
+	if (pipe(fds) < 0)
+		return false;
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+	return true;
+}
+
+static void notify_close(int fds[2])
+{
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0 && fds[1] != fds[0])
+		close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+static void notify_post(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+	uint64_t v = 1;
+#else
+	uint8_t v = 1;
+#endif
+	/* a full pipe already means "wake up" */
+	if (write(fds[1], &v, sizeof(v)) < 0 && errno != EAGAIN) {
+		log_error("shmring: notify: %s", strerror(errno));
+	}
+}
+
+static void notify_drain(int fds[2])
+{
+	unsigned char buf[64];
+
+	while (read(fds[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+static bool notify_wait(int fds[2], int timeout_ms)
+{
+	struct pollfd pfd = { fds[0], POLLIN };
+
+	int prc = poll(&pfd, 1, timeout_ms);
+	if (prc < 0 && errno != EINTR) {
+		log_error("shmring: poll: %s", strerror(errno));
+		return false;
+	}
+
+	notify_drain(fds);
+	return prc > 0;
+}
+
+bool shmring_init(struct shmring *ring, size_t size)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->mem_fd = -1;
+	ring->data_fd[0] = ring->data_fd[1] = -1;
+	ring->space_fd[0] = ring->space_fd[1] = -1;
+
+	/* round up to a power of 2, so positions wrap with a mask */
+	size_t sz = SHMRING_CTL_SZ;
+	while (sz < size)
+		sz <<= 1;
+	ring->size = sz;
+	ring->map_len = SHMRING_CTL_SZ + sz;
+
+	void *p;
+#ifdef HAVE_MEMFD_CREATE
+	ring->mem_fd = memfd_create("bitc-shmring", MFD_CLOEXEC);
+	if (ring->mem_fd < 0)
+		goto err_out;
+	if (ftruncate(ring->mem_fd, ring->map_len) < 0)
+		goto err_out;
+	p = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 ring->mem_fd, 0);
+#else
+	p = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#endif
+	if (p == MAP_FAILED)
+		goto err_out;
+
+	ring->ctl = p;
+	ring->base = (unsigned char *) p + SHMRING_CTL_SZ;
+
+	if (!notify_open(ring->data_fd) || !notify_open(ring->space_fd))
+		goto err_out;
+
+	return true;
+
+err_out:
+	log_error("shmring: init: %s", strerror(errno));
+	shmring_free(ring);
+	return false;
+}
+
+void shmring_free(struct shmring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->ctl)
+		munmap(ring->ctl, ring->map_len);
+	if (ring->mem_fd >= 0)
+		close(ring->mem_fd);
+	notify_close(ring->data_fd);
+	notify_close(ring->space_fd);
+
+	ring->ctl = NULL;
+	ring->base = NULL;
+	ring->mem_fd = -1;
+}
+
+bool shmring_put(struct shmring *ring, enum shmring_type type,
+		 const void *data, size_t len)
+{
+	if (len > shmring_max_len(ring))
+		return false;
+
+	size_t need = rec_size(len);
+	uint64_t tail = ring->ctl->tail;
+	uint64_t head = __atomic_load_n(&ring->ctl->head, __ATOMIC_ACQUIRE);
+
+	/* records never wrap; pad out the end of the ring instead */
+	size_t off = tail & (ring->size - 1);
+	size_t contig = ring->size - off;
+	size_t pad = (contig < need) ? contig : 0;
+
+	if ((tail - head) + pad + need > ring->size)
+		return false;
+
+	struct shmring_rec *rec;
+	if (pad) {
+		rec = (struct shmring_rec *) (ring->base + off);
+		rec->type = SHMR_PAD;
+		rec->len = pad - sizeof(*rec);
+		tail += pad;
+		off = 0;
+	}
+
+	rec = (struct shmring_rec *) (ring->base + off);
+	rec->type = type;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+
+	__atomic_store_n(&ring->ctl->tail, tail + need, __ATOMIC_RELEASE);
+	notify_post(ring->data_fd);
+
+	return true;
+}
+
+bool shmring_put_wait(struct shmring *ring, enum shmring_type type,
+		      const void *data, size_t len, int timeout_ms)
+{
+	if (len > shmring_max_len(ring))
+		return false;
+
+	while (!shmring_put(ring, type, data, len)) {
+		if (!notify_wait(ring->space_fd, timeout_ms))
+			return false;
+	}
+
+	return true;
+}
+
+const struct shmring_rec *shmring_peek(struct shmring *ring)
+{
+	uint64_t head = ring->ctl->head;
+	uint64_t tail = __atomic_load_n(&ring->ctl->tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct shmring_rec *rec = (struct shmring_rec *)
+			(ring->base + (head & (ring->size - 1)));
+		if (rec->type != SHMR_PAD)
+			return rec;
+
+		head += rec_size(rec->len);
+		__atomic_store_n(&ring->ctl->head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+void shmring_release(struct shmring *ring)
+{
+	const struct shmring_rec *rec = shmring_peek(ring);
+	if (!rec)
+		return;
+
+	uint64_t head = ring->ctl->head + rec_size(rec->len);
+	__atomic_store_n(&ring->ctl->head, head, __ATOMIC_RELEASE);
+	notify_post(ring->space_fd);
+}
+
+bool shmring_wait(struct shmring *ring, int timeout_ms)
+{
+	/* wakeups may be stale: records seen earlier were not drained */
+	while (!shmring_peek(ring)) {
+		if (!notify_wait(ring->data_fd, timeout_ms))
+			return shmring_peek(ring) != NULL;
+	}
+
+	return true;
+}
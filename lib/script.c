@@ -252,28 +252,170 @@ enum txnouttype bsp_classify(parr *ops)
 	return TX_NONSTANDARD;
 }
 
+enum {
+	BSP_TMPL_MAX_OPS	= BSP_TMPL_MAX_DATA + 3,
+};
+
+static void tmpl_push(struct bscript_tmpl *tmpl, const void *p, size_t len)
+{
+	tmpl->data[tmpl->n_data].p = p;
+	tmpl->data[tmpl->n_data].len = len;
+	tmpl->n_data++;
+}
+
+/* fixed-layout templates, straight from the bytes; true if decided */
+static bool tmpl_match_bytes(struct bscript_tmpl *tmpl,
+			     const unsigned char *vch, size_t len)
+{
+	struct const_buffer buf = { vch, len };
+
+	// OP_DUP, OP_HASH160, <20 bytes>, OP_EQUALVERIFY, OP_CHECKSIG
+	if (len == 25 &&
+	    vch[0] == OP_DUP &&
+	    vch[1] == OP_HASH160 &&
+	    vch[2] == 20 &&
+	    vch[23] == OP_EQUALVERIFY &&
+	    vch[24] == OP_CHECKSIG) {
+		tmpl->txtype = TX_PUBKEYHASH;
+		tmpl_push(tmpl, vch + 3, 20);
+		return true;
+	}
+
+	if (is_bsp_p2sh(&buf)) {
+		tmpl->txtype = TX_SCRIPTHASH;
+		tmpl_push(tmpl, vch + 2, 20);
+		return true;
+	}
+
+	// version opcode, then a single push of 2 to 40 bytes
+	if (len >= 4 && len <= 42 &&
+	    (vch[0] == OP_0 || (vch[0] >= OP_1 && vch[0] <= OP_16)) &&
+	    (size_t) vch[1] + 2 == len) {
+		tmpl->version = DecodeOP_N((enum opcodetype) vch[0]);
+
+		if (tmpl->version == 0 && len - 2 == 20)
+			tmpl->txtype = TX_WITNESS_V0_KEYHASH;
+		else if (tmpl->version == 0 && len - 2 == 32)
+			tmpl->txtype = TX_WITNESS_V0_SCRIPTHASH;
+		else if (tmpl->version == 0)
+			return true;		/* nonstandard */
+		else
+			tmpl->txtype = TX_WITNESS_UNKNOWN;
+
+		tmpl_push(tmpl, vch + 2, len - 2);
+		return true;
+	}
+
+	return false;
+}
+
+/* same templates as bsp_classify, over a stack array of ops */
+static void tmpl_match_ops(struct bscript_tmpl *tmpl,
+			   const struct bscript_op *ops, unsigned int n_ops)
+{
+	unsigned int i;
+
+	if (n_ops == 5 &&
+	    is_bsp_op(&ops[0], OP_DUP) &&
+	    is_bsp_op(&ops[1], OP_HASH160) &&
+	    is_bsp_op_pubkeyhash(&ops[2]) &&
+	    is_bsp_op(&ops[3], OP_EQUALVERIFY) &&
+	    is_bsp_op(&ops[4], OP_CHECKSIG)) {
+		tmpl->txtype = TX_PUBKEYHASH;
+		tmpl_push(tmpl, ops[2].data.p, ops[2].data.len);
+		return;
+	}
+
+	if (n_ops == 3 &&
+	    is_bsp_op(&ops[0], OP_HASH160) &&
+	    is_bsp_op_pubkeyhash(&ops[1]) &&
+	    is_bsp_op(&ops[2], OP_EQUAL)) {
+		tmpl->txtype = TX_SCRIPTHASH;
+		tmpl_push(tmpl, ops[1].data.p, ops[1].data.len);
+		return;
+	}
+
+	if (n_ops == 2 &&
+	    is_bsp_op_pubkey(&ops[0]) &&
+	    is_bsp_op(&ops[1], OP_CHECKSIG)) {
+		tmpl->txtype = TX_PUBKEY;
+		tmpl_push(tmpl, ops[0].data.p, ops[0].data.len);
+		return;
+	}
+
+	if (n_ops < 3 ||
+	    !is_bsp_op_smallint(&ops[0]) ||
+	    !is_bsp_op_smallint(&ops[n_ops - 2]) ||
+	    !is_bsp_op(&ops[n_ops - 1], OP_CHECKMULTISIG))
+		return;
+
+	for (i = 1; i < (n_ops - 2); i++)
+		if (!is_bsp_op_pubkey(&ops[i]))
+			return;
+
+	tmpl->txtype = TX_MULTISIG;
+	tmpl->n_req = DecodeOP_N(ops[0].op);
+	for (i = 1; i < (n_ops - 2); i++)
+		tmpl_push(tmpl, ops[i].data.p, ops[i].data.len);
+}
+
+/*
+ * Match an output script against the standard templates, without
+ * allocating.  False only if the script does not parse.
+ */
+bool bsp_tmpl_match(struct bscript_tmpl *tmpl,
+		    const void *data, size_t data_len)
+{
+	tmpl->txtype = TX_NONSTANDARD;
+	tmpl->version = 0;
+	tmpl->n_req = 0;
+	tmpl->n_data = 0;
+
+	if (tmpl_match_bytes(tmpl, data, data_len))
+		return true;
+
+	struct const_buffer buf = { data, data_len };
+	struct bscript_parser bp;
+	struct bscript_op op, ops[BSP_TMPL_MAX_OPS];
+	unsigned int n_ops = 0;
+
+	/* the whole script must parse; only the first few ops are kept */
+	bsp_start(&bp, &buf);
+	while (bsp_getop(&op, &bp)) {
+		if (n_ops < BSP_TMPL_MAX_OPS)
+			ops[n_ops] = op;
+		n_ops++;
+	}
+	if (bp.error)
+		return false;
+
+	if (n_ops <= BSP_TMPL_MAX_OPS)
+		tmpl_match_ops(tmpl, ops, n_ops);
+
+	return true;
+}
+
 bool bsp_addr_parse(struct bscript_addr *addr,
 		    const void *data, size_t data_len)
 {
 	memset(addr, 0, sizeof(*addr));
 
-	parr *ops = bsp_parse_all(data, data_len);
-	if (!ops)
+	struct bscript_tmpl tmpl;
+	if (!bsp_tmpl_match(&tmpl, data, data_len))
 		return false;
 
-	enum txnouttype txtype = bsp_classify(ops);
-	switch (txtype) {
+	switch (tmpl.txtype) {
 
 	case TX_PUBKEY: {
-		struct bscript_op *op = parr_idx(ops, 0);
-		struct buffer *buf = buffer_copy(op->data.p, op->data.len);
+		struct buffer *buf = buffer_copy(tmpl.data[0].p,
+						 tmpl.data[0].len);
 		addr->pub = clist_append(addr->pub, buf);
 		break;
 	}
 
 	case TX_PUBKEYHASH: {
-		struct bscript_op *op = parr_idx(ops, 2);
-		struct buffer *buf = buffer_copy(op->data.p, op->data.len);
+		struct buffer *buf = buffer_copy(tmpl.data[0].p,
+						 tmpl.data[0].len);
 		addr->pubhash = clist_append(addr->pubhash, buf);
 		break;
 	}
@@ -283,9 +425,8 @@ bool bsp_addr_parse(struct bscript_addr *addr,
 		break;
 	}
 
-	addr->txtype = txtype;
+	addr->txtype = tmpl.txtype;
 
-	parr_free(ops, true);
 	return true;
 }
 
@@ -92,6 +92,9 @@ bool bitc_script_sign(struct bitc_keystore *ks, const cstring *fromPubKey,
 
 	case TX_SCRIPTHASH:		/* TODO; not supported yet */
 	case TX_MULTISIG:
+	case TX_WITNESS_V0_KEYHASH:
+	case TX_WITNESS_V0_SCRIPTHASH:
+	case TX_WITNESS_UNKNOWN:
 		goto out;
 
 	case TX_NONSTANDARD:		/* unknown script type, cannot sign */
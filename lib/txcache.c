@@ -0,0 +1,99 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/txcache.h>               // for bitc_txcache, etc
+
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+
+bool bitc_txcache_init(struct bitc_txcache *tc, size_t max_txs,
+		       size_t max_bytes)
+{
+	memset(tc, 0, sizeof(*tc));
+
+	if (!max_txs)
+		return false;
+
+	tc->ring = calloc(max_txs, sizeof(struct bitc_txcache_ent));
+	if (!tc->ring)
+		return false;
+
+	/* keys point into the cached tx; the ring owns the tx */
+	tc->map = bitc_hashtab_new(bu256_hash, bu256_equal_);
+	if (!tc->map) {
+		free(tc->ring);
+		tc->ring = NULL;
+		return false;
+	}
+
+	tc->max_txs = max_txs;
+	tc->max_bytes = max_bytes;
+
+	return true;
+}
+
+static void bitc_txcache_evict(struct bitc_txcache *tc)
+{
+	struct bitc_txcache_ent *ent = &tc->ring[tc->head];
+
+	bitc_hashtab_del(tc->map, &ent->tx->sha256);
+	bitc_tx_freep(ent->tx);
+
+	tc->bytes -= ent->size;
+	memset(ent, 0, sizeof(*ent));
+
+	tc->head = (tc->head + 1) % tc->max_txs;
+	tc->count--;
+}
+
+bool bitc_txcache_add(struct bitc_txcache *tc, struct bitc_tx *tx,
+		      size_t ser_size)
+{
+	bitc_tx_calc_sha256(tx);
+
+	if (bitc_txcache_lookup(tc, &tx->sha256))
+		return false;
+	if (ser_size > tc->max_bytes)
+		return false;
+
+	while ((tc->count == tc->max_txs) ||
+	       (tc->count && (tc->bytes + ser_size > tc->max_bytes)))
+		bitc_txcache_evict(tc);
+
+	struct bitc_txcache_ent *ent;
+	ent = &tc->ring[(tc->head + tc->count) % tc->max_txs];
+	ent->tx = tx;
+	ent->size = ser_size;
+
+	tc->count++;
+	tc->bytes += ser_size;
+
+	bitc_hashtab_put(tc->map, &tx->sha256, tx);
+
+	return true;
+}
+
+/* copy out txids, oldest first; txids must hold bitc_txcache_size() */
+void bitc_txcache_txids(const struct bitc_txcache *tc, bu256_t *txids)
+{
+	size_t i;
+	for (i = 0; i < tc->count; i++)
+		bu256_copy(&txids[i], &bitc_txcache_idx(tc, i)->sha256);
+}
+
+void bitc_txcache_free(struct bitc_txcache *tc)
+{
+	if (!tc || !tc->ring)
+		return;
+
+	while (tc->count)
+		bitc_txcache_evict(tc);
+
+	bitc_hashtab_unref(tc->map);
+	free(tc->ring);
+
+	memset(tc, 0, sizeof(*tc));
+}
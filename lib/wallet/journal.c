@@ -0,0 +1,397 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/wallet/journal.h>        // for wallet_journal, etc
+
+#include <bitc/crypto/aes_util.h>       // for aes256_ctr, etc
+#include <bitc/crypto/hmac.h>           // for hmac_sha256, etc
+#include <bitc/crypto/prng.h>           // for prng_get_random_bytes
+#include <bitc/crypto/sha2.h>           // for SHA512_DIGEST_LENGTH, etc
+#include <bitc/endian.h>                // for htole32, le32toh, etc
+
+#include <errno.h>                      // for errno, EINTR
+#include <fcntl.h>                      // for open, O_RDWR
+#include <stddef.h>                     // for offsetof
+#include <stdio.h>                      // for rename
+#include <stdlib.h>                     // for malloc, free
+#include <string.h>                     // for memcpy, memset, strlen
+#include <sys/stat.h>                   // for fstat, stat
+#include <unistd.h>                     // for pread, pwrite, close, etc
+
+enum {
+	JOURNAL_SALT_LEN	= 16,
+	JOURNAL_IV_LEN		= 16,
+	JOURNAL_TAG_LEN		= SHA256_DIGEST_LENGTH,
+	JOURNAL_REC_HDR		= 4 + JOURNAL_IV_LEN,
+	JOURNAL_SEQ_LEN		= 8,		/* MAC'd, not stored */
+	JOURNAL_MAX_ROUNDS	= 10000000,
+};
+
+static const char journal_magic[8] = "bitcwjnl";
+
+struct journal_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	kdf_rounds;
+	uint8_t		salt[JOURNAL_SALT_LEN];
+	uint8_t		check[JOURNAL_TAG_LEN];	/* MAC of the above */
+};
+
+void wallet_journal_init(struct wallet_journal *wj)
+{
+	memset(wj, 0, sizeof(*wj));
+	wj->fd = -1;
+}
+
+static bool tag_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+	unsigned int i;
+
+	for (i = 0; i < JOURNAL_TAG_LEN; i++)
+		diff |= a[i] ^ b[i];
+
+	return (diff == 0);
+}
+
+/* PBKDF2-HMAC-SHA512, one block: the AES key, then the MAC key */
+static void journal_kdf(struct wallet_journal *wj, const void *pass,
+			size_t pass_len, const uint8_t *salt, uint32_t rounds)
+{
+	HMAC_SHA512_CTX hctx;
+	uint8_t msg[JOURNAL_SALT_LEN + 4];
+	uint8_t u[SHA512_DIGEST_LENGTH];
+	uint8_t t[SHA512_DIGEST_LENGTH];
+	unsigned int i, j;
+
+	memcpy(msg, salt, JOURNAL_SALT_LEN);
+	msg[JOURNAL_SALT_LEN + 0] = 0;
+	msg[JOURNAL_SALT_LEN + 1] = 0;
+	msg[JOURNAL_SALT_LEN + 2] = 0;
+	msg[JOURNAL_SALT_LEN + 3] = 1;
+
+	hmac_sha512_Init(&hctx, pass, pass_len);
+	hmac_sha512_Raw(&hctx, msg, sizeof(msg), u);
+	memcpy(t, u, sizeof(t));
+
+	for (i = 1; i < rounds; i++) {
+		hmac_sha512_Raw(&hctx, u, sizeof(u), u);
+		for (j = 0; j < sizeof(t); j++)
+			t[j] ^= u[j];
+	}
+
+	memcpy(wj->enc_key, t, sizeof(wj->enc_key));
+	memcpy(wj->mac_key, t + sizeof(wj->enc_key), sizeof(wj->mac_key));
+
+	memset(&hctx, 0, sizeof(hctx));
+	memset(u, 0, sizeof(u));
+	memset(t, 0, sizeof(t));
+}
+
+static void hdr_check(const struct wallet_journal *wj,
+		      const struct journal_hdr *hdr, uint8_t *check)
+{
+	hmac_sha256(wj->mac_key, sizeof(wj->mac_key), hdr,
+		    offsetof(struct journal_hdr, check), check);
+}
+
+static void journal_ctr(const struct wallet_journal *wj, const uint8_t *iv,
+			uint8_t *data, size_t len)
+{
+	struct aes256_ctx ctx;
+
+	aes256_init(&ctx, wj->enc_key);
+	aes256_ctr(&ctx, iv, data, len);
+	aes256_free(&ctx);
+}
+
+/* buf: room for the sequence number, then the record; tag goes last */
+static void record_tag(const struct wallet_journal *wj, uint64_t seq,
+		       uint8_t *buf, size_t len, uint8_t *tag)
+{
+	uint64_t seq_le = htole64(seq);
+
+	memcpy(buf, &seq_le, sizeof(seq_le));
+	hmac_sha256(wj->mac_key, sizeof(wj->mac_key), buf,
+		    JOURNAL_SEQ_LEN + JOURNAL_REC_HDR + len, tag);
+}
+
+static bool read_at(int fd, void *buf, size_t len, uint64_t off)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t rrc = pread(fd, p, len, off);
+		if (rrc < 0 && errno == EINTR)
+			continue;
+		if (rrc <= 0)
+			return false;
+
+		p += rrc;
+		len -= rrc;
+		off += rrc;
+	}
+
+	return true;
+}
+
+static bool write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t wrc = pwrite(fd, p, len, off);
+		if (wrc < 0 && errno == EINTR)
+			continue;
+		if (wrc <= 0)
+			return false;
+
+		p += wrc;
+		len -= wrc;
+		off += wrc;
+	}
+
+	return true;
+}
+
+bool wallet_journal_detect(const char *filename)
+{
+	char magic[sizeof(journal_magic)];
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	bool rc = read_at(fd, magic, sizeof(magic), 0) &&
+		  !memcmp(magic, journal_magic, sizeof(magic));
+
+	close(fd);
+	return rc;
+}
+
+bool wallet_journal_create(struct wallet_journal *wj, const char *filename,
+			   const void *pass, size_t pass_len)
+{
+	struct journal_hdr hdr;
+
+	wallet_journal_init(wj);
+
+	wj->filename = strdup(filename);
+	wj->tmpname = malloc(strlen(filename) + 16);
+	if (!wj->filename || !wj->tmpname)
+		goto err_out;
+	strcpy(wj->tmpname, filename);
+	strcat(wj->tmpname, ".XXXXXX");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, journal_magic, sizeof(hdr.magic));
+	hdr.version = htole32(WJOURNAL_VERSION);
+	hdr.kdf_rounds = htole32(WJOURNAL_KDF_ROUNDS);
+	if (prng_get_random_bytes(hdr.salt, sizeof(hdr.salt)) < 0)
+		goto err_out;
+
+	journal_kdf(wj, pass, pass_len, hdr.salt, WJOURNAL_KDF_ROUNDS);
+	hdr_check(wj, &hdr, hdr.check);
+
+	wj->fd = mkstemp(wj->tmpname);
+	if (wj->fd < 0)
+		goto err_out;
+
+	if (!write_at(wj->fd, &hdr, sizeof(hdr), 0))
+		goto err_out;
+
+	wj->size = sizeof(hdr);
+	return true;
+
+err_out:
+	wallet_journal_free(wj);
+	return false;
+}
+
+bool wallet_journal_open(struct wallet_journal *wj, const char *filename,
+			 const void *pass, size_t pass_len,
+			 wallet_journal_func f, void *priv)
+{
+	struct journal_hdr hdr;
+	uint8_t check[JOURNAL_TAG_LEN];
+	uint8_t *buf = NULL;
+	size_t buf_len = 0;
+
+	wallet_journal_init(wj);
+
+	wj->filename = strdup(filename);
+	if (!wj->filename)
+		goto err_out;
+
+	wj->fd = open(filename, O_RDWR);
+	if (wj->fd < 0)
+		goto err_out;
+
+	struct stat st;
+	if (fstat(wj->fd, &st) < 0 ||
+	    !read_at(wj->fd, &hdr, sizeof(hdr), 0))
+		goto err_out;
+
+	uint32_t rounds = le32toh(hdr.kdf_rounds);
+	if (memcmp(hdr.magic, journal_magic, sizeof(hdr.magic)) ||
+	    (le32toh(hdr.version) != WJOURNAL_VERSION) ||
+	    (rounds == 0) || (rounds > JOURNAL_MAX_ROUNDS))
+		goto err_out;
+
+	journal_kdf(wj, pass, pass_len, hdr.salt, rounds);
+	hdr_check(wj, &hdr, check);
+	if (!tag_equal(check, hdr.check))
+		goto err_out;
+
+	uint64_t file_size = st.st_size;
+	uint64_t off = sizeof(hdr);
+
+	while (off < file_size) {
+		uint8_t rec_hdr[JOURNAL_REC_HDR];
+		uint32_t len;
+
+		/* cut short: the end */
+		if ((file_size - off < JOURNAL_REC_HDR + JOURNAL_TAG_LEN) ||
+		    !read_at(wj->fd, rec_hdr, sizeof(rec_hdr), off))
+			break;
+		memcpy(&len, rec_hdr, sizeof(len));
+		len = le32toh(len);
+		if ((len > WJOURNAL_MAX_RECORD) ||
+		    (file_size - off < JOURNAL_REC_HDR + len + JOURNAL_TAG_LEN))
+			break;
+
+		size_t need = JOURNAL_SEQ_LEN + JOURNAL_REC_HDR + len +
+			      JOURNAL_TAG_LEN;
+		if (need > buf_len) {
+			uint8_t *nbuf = malloc(need);
+			if (!nbuf)
+				goto err_out;
+			if (buf) {
+				memset(buf, 0, buf_len);
+				free(buf);
+			}
+			buf = nbuf;
+			buf_len = need;
+		}
+
+		uint8_t *rec = buf + JOURNAL_SEQ_LEN;
+		uint8_t *data = rec + JOURNAL_REC_HDR;
+		memcpy(rec, rec_hdr, sizeof(rec_hdr));
+		if (!read_at(wj->fd, data, len + JOURNAL_TAG_LEN,
+			     off + JOURNAL_REC_HDR))
+			goto err_out;
+
+		uint64_t rec_end = off + JOURNAL_REC_HDR + len +
+				   JOURNAL_TAG_LEN;
+		record_tag(wj, wj->n_records, buf, len, check);
+		if (!tag_equal(check, data + len)) {
+			if (rec_end == file_size)
+				break;		/* torn last append */
+			goto err_out;
+		}
+
+		journal_ctr(wj, rec + 4, data, len);
+		bool rc = f(priv, data, len);
+		memset(data, 0, len);
+		if (!rc)
+			goto err_out;
+
+		off = rec_end;
+		wj->n_records++;
+	}
+
+	wj->size = off;
+	wj->torn = (off != file_size);
+
+	if (buf) {
+		memset(buf, 0, buf_len);
+		free(buf);
+	}
+	return true;
+
+err_out:
+	if (buf) {
+		memset(buf, 0, buf_len);
+		free(buf);
+	}
+	wallet_journal_free(wj);
+	return false;
+}
+
+bool wallet_journal_append(struct wallet_journal *wj, const void *data,
+			   size_t len)
+{
+	if ((wj->fd < 0) || (len > WJOURNAL_MAX_RECORD))
+		return false;
+
+	size_t rec_len = JOURNAL_REC_HDR + len + JOURNAL_TAG_LEN;
+	uint8_t *buf = malloc(JOURNAL_SEQ_LEN + rec_len);
+	if (!buf)
+		return false;
+
+	uint8_t *rec = buf + JOURNAL_SEQ_LEN;
+	uint8_t *ct = rec + JOURNAL_REC_HDR;
+	uint32_t len_le = htole32(len);
+	bool rc = false;
+
+	memcpy(rec, &len_le, sizeof(len_le));
+	if (prng_get_random_bytes(rec + 4, JOURNAL_IV_LEN) < 0)
+		goto out;
+
+	memcpy(ct, data, len);
+	journal_ctr(wj, rec + 4, ct, len);
+	record_tag(wj, wj->n_records, buf, len, ct + len);
+
+	/* whatever did get written is junk past the end */
+	wj->torn = true;
+	if (!write_at(wj->fd, rec, rec_len, wj->size) ||
+	    (ftruncate(wj->fd, wj->size + rec_len) < 0))
+		goto out;
+
+	/* a new journal is synced once, when committed */
+	if (!wj->tmpname && (fdatasync(wj->fd) < 0))
+		goto out;
+
+	wj->torn = false;
+	wj->size += rec_len;
+	wj->n_records++;
+	rc = true;
+
+out:
+	memset(buf, 0, JOURNAL_SEQ_LEN + rec_len);
+	free(buf);
+	return rc;
+}
+
+bool wallet_journal_commit(struct wallet_journal *wj)
+{
+	if (wj->fd < 0)
+		return false;
+	if (!wj->tmpname)
+		return true;
+
+	if ((fsync(wj->fd) < 0) ||
+	    (rename(wj->tmpname, wj->filename) < 0))
+		return false;
+
+	free(wj->tmpname);
+	wj->tmpname = NULL;
+	return true;
+}
+
+void wallet_journal_free(struct wallet_journal *wj)
+{
+	if (wj->fd >= 0)
+		close(wj->fd);
+	if (wj->tmpname) {
+		unlink(wj->tmpname);
+		free(wj->tmpname);
+	}
+	free(wj->filename);
+
+	memset(wj, 0, sizeof(*wj));
+	wj->fd = -1;
+}
@@ -0,0 +1,702 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/wallet/rescan.h>         // for wallet_rescan, etc
+
+#include <bitc/addrset.h>               // for bitc_addrset, etc
+#include <bitc/buint.h>                 // for bu160_t, bu160_hash, etc
+#include <bitc/core.h>                  // for bitc_block, bitc_tx, etc
+#include <bitc/hashtab.h>               // for bitc_hashtab_get, etc
+#include <bitc/hdkeys.h>                // for hd_extended_key, etc
+#include <bitc/key.h>                   // for bitc_pubkey_ser
+#include <bitc/log.h>                   // for log_error
+#include <bitc/parr.h>                  // for parr_idx, parr_add
+#include <bitc/script.h>                // for bsp_tmpl_match, etc
+#include <bitc/util.h>                  // for bu_Hash160, MIN
+
+#include <pthread.h>                    // for pthread_create, etc
+#include <stdlib.h>                     // for calloc, malloc, qsort, etc
+#include <string.h>                     // for memcmp, memcpy, memset
+
+/* a watched key */
+struct rescan_key {
+	bu160_t			hash;		/* of the compressed pubkey */
+	unsigned int		chain;		/* in wallet_rescan.chains */
+	uint32_t		key_idx;
+	size_t			seq;		/* in wallet_rescan.hashes */
+};
+
+/* an account's receive or change chain */
+struct rescan_chain {
+	struct wallet_account	*acct;
+	bool			change;
+	uint32_t		n_watched;	/* keys 0 .. n_watched - 1 */
+	uint32_t		n_derived;	/* the same, in wallet_rescan.keys */
+	uint32_t		n_used;		/* highest used, plus one */
+};
+
+/* what the workers match against; fixed while a batch is in flight */
+struct rescan_snap {
+	unsigned int		ref;		/* caller's thread only */
+	uint64_t		gen;
+	size_t			n_hashes;	/* keys derived when taken */
+	unsigned int		n_coins;	/* coins found when taken */
+	struct bitc_addrset	keys;
+	struct bitc_outpt	*unspent;	/* sorted */
+	size_t			n_unspent;
+};
+
+/* a block, decoded, with the txs that may concern the wallet */
+struct rescan_prep {
+	uint32_t		height;
+	struct buffer		*raw;
+	struct bitc_block	block;
+	uint32_t		*hits;		/* tx indices, ascending */
+	unsigned int		n_hits;
+	bool			ok;
+};
+
+struct rescan_batch {
+	struct rescan_prep	prep[RESCAN_BATCH];
+	unsigned int		n;
+	unsigned int		next_claim;
+	struct rescan_snap	*snap;
+
+	pthread_t		*threads;
+	unsigned int		n_threads;	/* running */
+};
+
+struct wallet_rescan {
+	struct wallet		*wlt;
+	unsigned int		gap_limit;
+	unsigned int		max_threads;
+
+	struct rescan_chain	*chains;
+	unsigned int		n_chains;
+	struct bitc_hashtab	*keys;		/* hash160 -> rescan_key */
+	bu160_t			*hashes;	/* the same, as an array */
+	size_t			n_hashes;
+	size_t			alloc_hashes;
+	size_t			n_unspent;
+
+	uint64_t		gen;		/* bumped by new keys, coins */
+	struct rescan_snap	*snap;		/* latest taken */
+
+	uint32_t		last_height;	/* of the last block pushed */
+	bool			pushed;
+
+	struct rescan_batch	batch[2];
+	unsigned int		cur;		/* being filled */
+	bool			ok;
+
+	struct wallet_rescan_stats stats;
+};
+
+static int outpt_cmp(const void *a_, const void *b_)
+{
+	const struct bitc_outpt *a = a_;
+	const struct bitc_outpt *b = b_;
+
+	int cmp = memcmp(&a->hash, &b->hash, sizeof(a->hash));
+	if (cmp)
+		return cmp;
+	if (a->n != b->n)
+		return (a->n < b->n) ? -1 : 1;
+	return 0;
+}
+
+/* the key hash an output pays to, if any */
+static bool txout_key_hash(bu160_t *hash, const struct bitc_txout *txout)
+{
+	struct bscript_tmpl tmpl;
+
+	if (!bsp_tmpl_match(&tmpl, txout->scriptPubKey->str,
+			    txout->scriptPubKey->len))
+		return false;
+
+	switch (tmpl.txtype) {
+	case TX_PUBKEY:
+		bu_Hash160((unsigned char *) hash, tmpl.data[0].p,
+			   tmpl.data[0].len);
+		return true;
+	case TX_PUBKEYHASH:
+	case TX_WITNESS_V0_KEYHASH:
+		if (tmpl.data[0].len != sizeof(*hash))
+			return false;
+		memcpy(hash, tmpl.data[0].p, sizeof(*hash));
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Watched keys
+ */
+
+static bool add_key(struct wallet_rescan *rs, unsigned int chain,
+		    uint32_t key_idx, const struct hd_extended_key *ek)
+{
+	uint8_t pubkey[33];
+
+	if (!bitc_pubkey_ser(&ek->key, pubkey))
+		return false;
+
+	struct rescan_key *key = calloc(1, sizeof(*key));
+	if (!key)
+		return false;
+
+	bu_Hash160((unsigned char *) &key->hash, pubkey, sizeof(pubkey));
+	key->chain = chain;
+	key->key_idx = key_idx;
+	key->seq = rs->n_hashes;
+
+	if (rs->n_hashes == rs->alloc_hashes) {
+		size_t alloc = rs->alloc_hashes ? rs->alloc_hashes * 2 : 256;
+		bu160_t *tmp = realloc(rs->hashes, alloc * sizeof(bu160_t));
+		if (!tmp) {
+			free(key);
+			return false;
+		}
+		rs->hashes = tmp;
+		rs->alloc_hashes = alloc;
+	}
+	rs->hashes[rs->n_hashes++] = key->hash;
+
+	bitc_hashtab_put(rs->keys, &key->hash, key);
+	return true;
+}
+
+/* derive a chain's keys up to n */
+static bool derive_chain(struct wallet_rescan *rs, unsigned int idx,
+			 uint32_t n_derived)
+{
+	struct rescan_chain *ch = &rs->chains[idx];
+
+	unsigned int i, n = n_derived - ch->n_derived;
+	struct hd_extended_key *eks = calloc(n, sizeof(*eks));
+	if (!eks)
+		return false;
+
+	bool rc = wallet_account_keys(rs->wlt, ch->acct, ch->change,
+				      ch->n_derived, n, eks);
+
+	for (i = 0; i < n; i++) {
+		if (rc)
+			rc = add_key(rs, idx, ch->n_derived + i, &eks[i]);
+		hd_extended_key_free(&eks[i]);
+	}
+	free(eks);
+
+	if (!rc)
+		return false;
+
+	ch->n_derived = n_derived;
+	rs->gen++;
+	return true;
+}
+
+static uint32_t key_limit(uint64_t n)
+{
+	return (n > 0x80000000ULL) ? 0x80000000U : n;
+}
+
+/*
+ * Watch a chain out to gap_limit keys past the last used.  Keys past
+ * the window are derived ahead, a lookahead at a time; they are in
+ * snapshots, but only watched keys count.
+ */
+static bool watch_chain(struct wallet_rescan *rs, unsigned int idx)
+{
+	struct rescan_chain *ch = &rs->chains[idx];
+
+	uint32_t used = ch->n_used;
+	if (!ch->change && (ch->acct->next_key_idx > used))
+		used = ch->acct->next_key_idx;
+
+	uint32_t want = key_limit((uint64_t) used + rs->gap_limit);
+	if (want <= ch->n_watched)
+		return true;
+
+	if ((want > ch->n_derived) &&
+	    !derive_chain(rs, idx, key_limit((uint64_t) want +
+					      RESCAN_LOOKAHEAD)))
+		return false;
+
+	ch->n_watched = want;
+	return true;
+}
+
+static bool use_key(struct wallet_rescan *rs, const struct rescan_key *key)
+{
+	struct rescan_chain *ch = &rs->chains[key->chain];
+
+	if (key->key_idx < ch->n_used)
+		return true;
+
+	ch->n_used = key->key_idx + 1;
+	if (!ch->change && (ch->acct->next_key_idx < ch->n_used))
+		ch->acct->next_key_idx = ch->n_used;
+
+	return watch_chain(rs, key->chain);
+}
+
+/*
+ * Snapshots
+ */
+
+static void snap_unref(struct rescan_snap *snap)
+{
+	if (!snap || --snap->ref)
+		return;
+
+	bitc_addrset_free(&snap->keys);
+	free(snap->unspent);
+	free(snap);
+}
+
+static struct rescan_snap *snap_take(struct wallet_rescan *rs)
+{
+	if (rs->snap && (rs->snap->gen == rs->gen))
+		goto out;
+
+	struct rescan_snap *snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+
+	snap->ref = 1;
+	snap->gen = rs->gen;
+	snap->n_hashes = rs->n_hashes;
+	snap->n_coins = rs->stats.n_coins;
+	snap->unspent = malloc((rs->n_unspent + 1) * sizeof(struct bitc_outpt));
+	if (!snap->unspent ||
+	    !bitc_addrset_build(&snap->keys, rs->hashes, rs->n_hashes)) {
+		free(snap->unspent);
+		free(snap);
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < rs->wlt->coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(rs->wlt->coins, i);
+		if (!coin->spent)
+			snap->unspent[snap->n_unspent++] = coin->outpt;
+	}
+	qsort(snap->unspent, snap->n_unspent, sizeof(struct bitc_outpt),
+	      outpt_cmp);
+
+	snap_unref(rs->snap);
+	rs->snap = snap;
+
+out:
+	rs->snap->ref++;
+	return rs->snap;
+}
+
+static bool snap_match_tx(const struct rescan_snap *snap,
+			  const struct bitc_tx *tx)
+{
+	unsigned int i;
+
+	if (snap->n_unspent) {
+		for (i = 0; i < tx->vin->len; i++) {
+			struct bitc_txin *txin = parr_idx(tx->vin, i);
+			if (bsearch(&txin->prevout, snap->unspent,
+				    snap->n_unspent, sizeof(struct bitc_outpt),
+				    outpt_cmp))
+				return true;
+		}
+	}
+
+	for (i = 0; i < tx->vout->len; i++) {
+		struct bitc_txout *txout = parr_idx(tx->vout, i);
+		bu160_t hash;
+
+		if (txout_key_hash(&hash, txout) &&
+		    bitc_addrset_lookup(&snap->keys, &hash))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Workers: decode, and match against the batch's snapshot
+ */
+
+static void prep_free(struct rescan_prep *p)
+{
+	if (p->raw)
+		buffer_freep(p->raw);
+	bitc_block_free(&p->block);
+	free(p->hits);
+	memset(p, 0, sizeof(*p));
+}
+
+static void prep_raw(struct rescan_prep *p, const struct rescan_snap *snap)
+{
+	struct const_buffer buf = { p->raw->p, p->raw->len };
+
+	if (!deser_bitc_block(&p->block, &buf))
+		return;
+
+	buffer_freep(p->raw);
+	p->raw = NULL;
+
+	unsigned int i, alloc = 0;
+	for (i = 0; i < p->block.vtx->len; i++) {
+		struct bitc_tx *tx = parr_idx(p->block.vtx, i);
+
+		if (!snap_match_tx(snap, tx))
+			continue;
+
+		if (p->n_hits == alloc) {
+			alloc = alloc ? alloc * 2 : 4;
+			uint32_t *tmp = realloc(p->hits, alloc * sizeof(uint32_t));
+			if (!tmp)
+				return;
+			p->hits = tmp;
+		}
+		p->hits[p->n_hits++] = i;
+	}
+
+	p->ok = true;
+}
+
+static void *rescan_worker(void *priv)
+{
+	struct rescan_batch *batch = priv;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&batch->next_claim, 1,
+				       __ATOMIC_RELAXED)) < batch->n)
+		prep_raw(&batch->prep[i], batch->snap);
+
+	return NULL;
+}
+
+/*
+ * Caller's thread: apply matches in order
+ */
+
+static bool apply_tx(struct wallet_rescan *rs, uint32_t height,
+		     struct bitc_tx *tx)
+{
+	unsigned int i;
+
+	/* spends of our coins */
+	for (i = 0; rs->n_unspent && (i < tx->vin->len); i++) {
+		struct bitc_txin *txin = parr_idx(tx->vin, i);
+		struct wallet_coin *coin;
+
+		coin = wallet_coin_find(rs->wlt, &txin->prevout);
+		if (!coin || coin->spent)
+			continue;
+
+		bitc_tx_calc_sha256(tx);
+		coin->spent = true;
+		coin->dirty = true;
+		bu256_copy(&coin->spent_txid, &tx->sha256);
+		coin->spent_height = height;
+
+		rs->n_unspent--;
+		rs->stats.n_spends++;
+	}
+
+	/* payments to our keys */
+	for (i = 0; i < tx->vout->len; i++) {
+		struct bitc_txout *txout = parr_idx(tx->vout, i);
+		struct rescan_key *key;
+		bu160_t hash;
+
+		if (!txout_key_hash(&hash, txout))
+			continue;
+		key = bitc_hashtab_get(rs->keys, &hash);
+		if (!key || (key->key_idx >= rs->chains[key->chain].n_watched))
+			continue;
+
+		bitc_tx_calc_sha256(tx);
+
+		struct bitc_outpt outpt;
+		bu256_copy(&outpt.hash, &tx->sha256);
+		outpt.n = i;
+
+		if (!wallet_coin_find(rs->wlt, &outpt)) {
+			const struct rescan_chain *ch = &rs->chains[key->chain];
+			struct wallet_coin *coin = calloc(1, sizeof(*coin));
+			if (!coin)
+				return false;
+
+			coin->outpt = outpt;
+			coin->value = txout->nValue;
+			coin->height = height;
+			coin->acct_idx = ch->acct->acct_idx;
+			coin->change = ch->change ? 1 : 0;
+			coin->key_idx = key->key_idx;
+			coin->dirty = true;
+
+			if (!wallet_add_coin(rs->wlt, coin)) {
+				free(coin);
+				return false;
+			}
+
+			rs->n_unspent++;
+			rs->stats.n_coins++;
+			rs->gen++;
+		}
+
+		if (!use_key(rs, key))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Could tx, passed over by a worker, concern keys or coins added since
+ * snap was taken?  An unspent coin of ours it spends can only be new;
+ * a key it pays to is new if derived after snap.
+ */
+static bool snap_missed(const struct wallet_rescan *rs,
+			const struct rescan_snap *snap,
+			const struct bitc_tx *tx)
+{
+	unsigned int i;
+
+	if (rs->stats.n_coins > snap->n_coins) {
+		for (i = 0; i < tx->vin->len; i++) {
+			struct bitc_txin *txin = parr_idx(tx->vin, i);
+			struct wallet_coin *coin;
+
+			coin = wallet_coin_find(rs->wlt, &txin->prevout);
+			if (coin && !coin->spent)
+				return true;
+		}
+	}
+
+	if (rs->n_hashes > snap->n_hashes) {
+		for (i = 0; i < tx->vout->len; i++) {
+			struct bitc_txout *txout = parr_idx(tx->vout, i);
+			const struct rescan_key *key;
+			bu160_t hash;
+
+			if (!txout_key_hash(&hash, txout))
+				continue;
+			key = bitc_hashtab_get(rs->keys, &hash);
+			if (key && (key->seq >= snap->n_hashes))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static bool apply_block(struct wallet_rescan *rs,
+			const struct rescan_snap *snap,
+			struct rescan_prep *p)
+{
+	unsigned int i, h = 0;
+
+	for (i = 0; i < p->block.vtx->len; i++) {
+		bool hit = (h < p->n_hits) && (p->hits[h] == i);
+		if (hit)
+			h++;
+
+		struct bitc_tx *tx = parr_idx(p->block.vtx, i);
+
+		/* no hit, and nothing added since that could make one */
+		if (!hit && ((snap->gen == rs->gen) ||
+			     !snap_missed(rs, snap, tx)))
+			continue;
+
+		if (!apply_tx(rs, p->height, tx))
+			return false;
+	}
+
+	rs->stats.n_blocks++;
+	rs->stats.n_txs += p->block.vtx->len;
+	return true;
+}
+
+static void batch_start(struct wallet_rescan *rs, struct rescan_batch *batch)
+{
+	unsigned int i, n_threads = MIN(rs->max_threads, batch->n);
+
+	batch->next_claim = 0;
+	batch->n_threads = 0;
+
+	batch->snap = snap_take(rs);
+	if (!batch->snap) {
+		rs->ok = false;
+		return;
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&batch->threads[i], NULL, rescan_worker,
+				   batch))
+			break;
+		batch->n_threads++;
+	}
+
+	/* no threads to be had: do it here */
+	if (!batch->n_threads)
+		rescan_worker(batch);
+}
+
+static void batch_finish(struct wallet_rescan *rs, struct rescan_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->n_threads; i++)
+		pthread_join(batch->threads[i], NULL);
+	batch->n_threads = 0;
+
+	for (i = 0; i < batch->n; i++) {
+		struct rescan_prep *p = &batch->prep[i];
+
+		if (rs->ok && !p->ok) {
+			log_error("rescan: block decode failed at height %u",
+				  p->height);
+			rs->ok = false;
+		}
+		if (rs->ok && !apply_block(rs, batch->snap, p))
+			rs->ok = false;
+
+		prep_free(p);
+	}
+
+	snap_unref(batch->snap);
+	batch->snap = NULL;
+	batch->n = 0;
+}
+
+/*
+ * Public interface
+ */
+
+static void rescan_free(struct wallet_rescan *rs)
+{
+	snap_unref(rs->snap);
+	if (rs->keys)
+		bitc_hashtab_unref(rs->keys);
+	free(rs->hashes);
+	free(rs->chains);
+	free(rs->batch[0].threads);
+	free(rs->batch[1].threads);
+	free(rs);
+}
+
+struct wallet_rescan *wallet_rescan_new(struct wallet *wlt,
+					unsigned int gap_limit,
+					unsigned int n_threads)
+{
+	if (!wlt->hdmaster || !wlt->hdmaster->len)
+		return NULL;
+
+	struct wallet_rescan *rs = calloc(1, sizeof(*rs));
+	if (!rs)
+		return NULL;
+
+	rs->wlt = wlt;
+	rs->gap_limit = gap_limit ? gap_limit : RESCAN_GAP_LIMIT;
+	rs->max_threads = n_threads ? n_threads : 1;
+	rs->ok = true;
+
+	/* keys point into the values */
+	rs->keys = bitc_hashtab_new_ext(bu160_hash, bu160_equal_, NULL, free);
+	rs->n_chains = wlt->accounts->len * 2;
+	rs->chains = calloc(rs->n_chains + 1, sizeof(struct rescan_chain));
+	if (!rs->keys || !rs->chains)
+		goto err_out;
+
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		rs->batch[i].threads = calloc(rs->max_threads,
+					      sizeof(pthread_t));
+		if (!rs->batch[i].threads)
+			goto err_out;
+	}
+
+	for (i = 0; i < wlt->coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(wlt->coins, i);
+
+		if (!coin->spent)
+			rs->n_unspent++;
+	}
+
+	for (i = 0; i < rs->n_chains; i++) {
+		struct rescan_chain *ch = &rs->chains[i];
+
+		ch->acct = parr_idx(wlt->accounts, i / 2);
+		ch->change = (i % 2 == 1);
+		if (!watch_chain(rs, i))
+			goto err_out;
+	}
+
+	return rs;
+
+err_out:
+	rescan_free(rs);
+	return NULL;
+}
+
+/* blocks must come in height order */
+bool wallet_rescan_push(struct wallet_rescan *rs, uint32_t height,
+			const struct const_buffer *blk)
+{
+	if (!rs->ok)
+		return false;
+
+	if (rs->pushed && (height <= rs->last_height)) {
+		log_error("rescan: block at height %u follows height %u",
+			  height, rs->last_height);
+		rs->ok = false;
+		return false;
+	}
+	rs->pushed = true;
+	rs->last_height = height;
+
+	struct rescan_batch *batch = &rs->batch[rs->cur];
+	struct rescan_prep *p = &batch->prep[batch->n];
+
+	memset(p, 0, sizeof(*p));
+	bitc_block_init(&p->block);
+	p->height = height;
+	p->raw = buffer_copy(blk->p, blk->len);
+	if (!p->raw) {
+		rs->ok = false;
+		return false;
+	}
+	batch->n++;
+
+	if (batch->n < RESCAN_BATCH)
+		return true;
+
+	/* match this one while applying the last */
+	batch_start(rs, batch);
+	rs->cur ^= 1;
+	batch_finish(rs, &rs->batch[rs->cur]);
+
+	return rs->ok;
+}
+
+bool wallet_rescan_finish(struct wallet_rescan *rs,
+			  struct wallet_rescan_stats *stats)
+{
+	struct rescan_batch *last = &rs->batch[rs->cur];
+
+	if (last->n)
+		batch_start(rs, last);
+	batch_finish(rs, &rs->batch[rs->cur ^ 1]);
+	batch_finish(rs, last);
+
+	bool ok = rs->ok;
+	if (stats)
+		*stats = rs->stats;
+
+	rescan_free(rs);
+	return ok;
+}
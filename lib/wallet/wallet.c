@@ -10,6 +10,7 @@
 
 #include <bitc/address.h>               // for bitc_pubkey_get_address
 #include <bitc/coredefs.h>              // for chain_info, etc
+#include <bitc/hashtab.h>               // for bitc_hashtab_get, etc
 #include <bitc/hdkeys.h>                // for hd_extended_key_free, etc
 #include <bitc/key.h>                   // for bitc_key_free, bitc_key, etc
 #include <bitc/mbr.h>                   // for mbr_free, mbuf_reader, etc
@@ -72,6 +73,18 @@ static void wallet_free_account(void *p)
 	account_free(acct);
 }
 
+static unsigned long outpt_hash(const void *key_)
+{
+	const struct bitc_outpt *key = key_;
+
+	return djb2_hash(bu256_hash(&key->hash), &key->n, sizeof(key->n));
+}
+
+static bool outpt_equal_(const void *a, const void *b)
+{
+	return bitc_outpt_equal(a, b);
+}
+
 bool wallet_init(struct wallet *wlt, const struct chain_info *chain)
 {
 	wlt->version = 1;
@@ -80,8 +93,13 @@ bool wallet_init(struct wallet *wlt, const struct chain_info *chain)
 	wlt->keys = parr_new(1000, wallet_free_key);
 	wlt->hdmaster = parr_new(10, wallet_free_hdkey);
 	wlt->accounts = parr_new(10, wallet_free_account);
+	wlt->coins = parr_new(0, free);
 
-	return ((wlt->keys != NULL) && (wlt->hdmaster != NULL));
+	/* keys point into the values, which belong to coins */
+	wlt->coin_map = bitc_hashtab_new(outpt_hash, outpt_equal_);
+
+	return ((wlt->keys != NULL) && (wlt->hdmaster != NULL) &&
+		(wlt->coins != NULL) && (wlt->coin_map != NULL));
 }
 
 void wallet_free(struct wallet *wlt)
@@ -93,6 +111,9 @@ void wallet_free(struct wallet *wlt)
 	parr_free(wlt->keys, true);
 	parr_free(wlt->hdmaster, true);
 	parr_free(wlt->accounts, true);
+	parr_free(wlt->coins, true);
+	if (wlt->coin_map)
+		bitc_hashtab_unref(wlt->coin_map);
 	memset(wlt, 0, sizeof(*wlt));
 }
 
@@ -111,32 +132,103 @@ struct wallet_account *account_byname(struct wallet *wlt, const char *name)
 	return NULL;
 }
 
-cstring *wallet_new_address(struct wallet *wlt)
+static struct wallet_account *account_byidx(struct wallet *wlt,
+					    uint32_t acct_idx)
 {
+	unsigned int i;
+	for (i = 0; i < wlt->accounts->len; i++) {
+		struct wallet_account *acct = parr_idx(wlt->accounts, i);
+		if (acct->acct_idx == acct_idx)
+			return acct;
+	}
+
+	return NULL;
+}
+
+struct wallet_coin *wallet_coin_find(struct wallet *wlt,
+				     const struct bitc_outpt *outpt)
+{
+	return bitc_hashtab_get(wlt->coin_map, outpt);
+}
+
+/* takes ownership of coin, which must not be in the wallet already */
+bool wallet_add_coin(struct wallet *wlt, struct wallet_coin *coin)
+{
+	if (!bitc_hashtab_put(wlt->coin_map, &coin->outpt, coin))
+		return false;
+
+	if (!parr_add(wlt->coins, coin)) {
+		bitc_hashtab_del(wlt->coin_map, &coin->outpt);
+		return false;
+	}
+
+	return true;
+}
+
+static const struct hd_extended_key *
+account_chain_key(struct wallet *wlt, struct wallet_account *acct, bool change)
+{
+	struct hd_extended_key **cached = &acct->chain_keys[change ? 1 : 0];
+	if (*cached)
+		return *cached;
+
 	struct hd_path_seg hdpath[] = {
 		{ 44, true },	// BIP 44
 		{ 0, true },	// chain: BTC
 		{ 0, true },	// acct#
 		{ 0, false },	// change?
-		{ 0, false },	// key index
 	};
 
-	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
-	if (!acct)
-		return NULL;
-
 	// patch HD path based on account settings
 	hdpath[2].index = acct->acct_idx;
-	hdpath[4].index = acct->next_key_idx;
+	hdpath[3].index = change ? 1 : 0;
 
 	assert(wlt->hdmaster && (wlt->hdmaster->len > 0));
 	struct hd_extended_key *master = parr_idx(wlt->hdmaster, 0);
 	assert(master != NULL);
 
+	struct hd_extended_key *chain_key = calloc(1, sizeof(*chain_key));
+	if (!chain_key)
+		return NULL;
+	hd_extended_key_init(chain_key);
+
+	if (!hd_derive(chain_key, master, hdpath, ARRAY_SIZE(hdpath))) {
+		wallet_free_hdkey(chain_key);
+		return NULL;
+	}
+
+	*cached = chain_key;
+	return chain_key;
+}
+
+/* keys first .. first + n - 1 of an account's receive or change chain */
+bool wallet_account_keys(struct wallet *wlt, struct wallet_account *acct,
+			 bool change, uint32_t first, unsigned int n,
+			 struct hd_extended_key *keys)
+{
+	// non-hardened indices only
+	if ((uint64_t) first + n > 0x80000000ULL)
+		return false;
+
+	const struct hd_extended_key *chain_key;
+	chain_key = account_chain_key(wlt, acct, change);
+	if (!chain_key)
+		return false;
+
+	return hd_derive_range(keys, chain_key, first, n);
+}
+
+cstring *wallet_new_address(struct wallet *wlt)
+{
+	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
+	if (!acct)
+		return NULL;
+
 	struct hd_extended_key child;
 	hd_extended_key_init(&child);
 
-	if (!hd_derive(&child, master, hdpath, ARRAY_SIZE(hdpath))) {
+	if (!wallet_account_keys(wlt, acct, false, acct->next_key_idx, 1,
+				 &child)) {
 		hd_extended_key_free(&child);
 		return NULL;
 	}
@@ -179,6 +271,8 @@ static void account_free(struct wallet_account *acct)
 		return;
 
 	cstr_free(acct->name, true);
+	wallet_free_hdkey(acct->chain_keys[0]);
+	wallet_free_hdkey(acct->chain_keys[1]);
 
 	memset(acct, 0, sizeof(*acct));
 	free(acct);
@@ -197,6 +291,17 @@ static bool deser_wallet_account(struct wallet *wlt, struct const_buffer *buf)
 	    !deser_u32(&acct->next_key_idx, buf))
 		goto err_out;
 
+	/* a later record for an account updates it */
+	struct wallet_account *old = account_byidx(wlt, acct->acct_idx);
+	if (old) {
+		cstr_free(old->name, true);
+		old->name = acct->name;
+		old->next_key_idx = acct->next_key_idx;
+		acct->name = NULL;
+		account_free(acct);
+		return true;
+	}
+
 	parr_add(wlt->accounts, acct);
 
 	return true;
@@ -213,25 +318,103 @@ static void ser_account(cstring *s, const struct wallet_account *acct)
 	ser_u32(s, acct->next_key_idx);
 }
 
-cstring *ser_wallet(const struct wallet *wlt)
+static void ser_coin(cstring *s, const struct wallet_coin *coin)
 {
-	struct bitc_key *key;
+	ser_bitc_outpt(s, &coin->outpt);
+	ser_s64(s, coin->value);
+	ser_u32(s, coin->height);
+	ser_u32(s, coin->acct_idx);
+	ser_u32(s, coin->change);
+	ser_u32(s, coin->key_idx);
+	ser_u32(s, coin->spent ? 1 : 0);
+	ser_u256(s, &coin->spent_txid);
+	ser_u32(s, coin->spent_height);
+}
 
-	cstring *rs = cstr_new_sz(20 * 1024);
+static bool deser_coin(struct wallet_coin *coin, struct const_buffer *buf)
+{
+	uint32_t spent;
+
+	if (!deser_bitc_outpt(&coin->outpt, buf) ||
+	    !deser_s64(&coin->value, buf) ||
+	    !deser_u32(&coin->height, buf) ||
+	    !deser_u32(&coin->acct_idx, buf) ||
+	    !deser_u32(&coin->change, buf) ||
+	    !deser_u32(&coin->key_idx, buf) ||
+	    !deser_u32(&spent, buf) ||
+	    !deser_u256(&coin->spent_txid, buf) ||
+	    !deser_u32(&coin->spent_height, buf))
+		return false;
+
+	coin->spent = (spent != 0);
+	return true;
+}
 
-	/*
-	 * ser "root" record
-	 */
-	{
+cstring *wallet_record_root(const struct wallet *wlt)
+{
 	cstring *s_root = ser_wallet_root(wlt);
 	cstring *recdata = message_str(wlt->chain->netmagic,
 				       "root", s_root->str, s_root->len);
-	cstr_append_buf(rs, recdata->str, recdata->len);
-	cstr_free(recdata, true);
 	cstr_free(s_root, true);
-	}
 
-	/* ser "privkey" records */
+	return recdata;
+}
+
+cstring *wallet_record_account(const struct wallet *wlt,
+			       const struct wallet_account *acct)
+{
+	cstring *acct_raw = cstr_new_sz(64);
+	ser_account(acct_raw, acct);
+
+	cstring *recdata = message_str(wlt->chain->netmagic,
+				       "account",
+				       acct_raw->str,
+				       acct_raw->len);
+	cstr_free(acct_raw, true);
+
+	return recdata;
+}
+
+cstring *wallet_record_coin(const struct wallet *wlt,
+			    const struct wallet_coin *coin)
+{
+	cstring *coin_raw = cstr_new_sz(128);
+	ser_coin(coin_raw, coin);
+
+	cstring *recdata = message_str(wlt->chain->netmagic,
+				       "coin",
+				       coin_raw->str,
+				       coin_raw->len);
+	cstr_free(coin_raw, true);
+
+	return recdata;
+}
+
+/* hand a record to f, then wipe it: some hold private keys */
+static bool emit_record(wallet_record_func f, void *priv, cstring *recdata)
+{
+	if (!recdata)
+		return false;
+
+	bool rc = f(priv, recdata);
+
+	memset(recdata->str, 0, recdata->len);
+	cstr_free(recdata, true);
+
+	return rc;
+}
+
+/* every record of the wallet, in the order ser_wallet() writes them */
+bool wallet_records(const struct wallet *wlt, wallet_record_func f,
+		    void *priv)
+{
+	struct bitc_key *key;
+
+	/* "root" record */
+	if (!emit_record(f, priv, wallet_record_root(wlt)))
+		return false;
+
+	/* "privkey" records */
 	wallet_for_each_key(wlt, key) {
 		void *privkey = NULL;
 		size_t pk_len = 0;
@@ -241,13 +424,15 @@ cstring *ser_wallet(const struct wallet *wlt)
 		cstring *recdata = message_str(wlt->chain->netmagic,
 					       "privkey",
 					       privkey, pk_len);
+		if (privkey)
+			memset(privkey, 0, pk_len);
 		free(privkey);
 
-		cstr_append_buf(rs, recdata->str, recdata->len);
-		cstr_free(recdata, true);
+		if (!emit_record(f, priv, recdata))
+			return false;
 	}
 
-	/* ser "hdmaster" records */
+	/* "hdmaster" records */
 	struct hd_extended_key *hdkey;
 	wallet_for_each_mkey(wlt, hdkey) {
 
@@ -259,30 +444,48 @@ cstring *ser_wallet(const struct wallet *wlt)
 					       "hdmaster",
 					       hdraw.data,
 					       sizeof(hdraw.data) - 1);
+		memset(&hdraw, 0, sizeof(hdraw));
 
-		assert(recdata != NULL);
-
-		cstr_append_buf(rs, recdata->str, recdata->len);
-		cstr_free(recdata, true);
+		if (!emit_record(f, priv, recdata))
+			return false;
 	}
 
-	/* Ser "account" records */
+	/* "account" records */
 	unsigned int i;
 	for (i = 0; i < wlt->accounts->len; i++) {
 		struct wallet_account *acct = parr_idx(wlt->accounts, i);
 
-		cstring *acct_raw = cstr_new_sz(64);
-		ser_account(acct_raw, acct);
+		if (!emit_record(f, priv, wallet_record_account(wlt, acct)))
+			return false;
+	}
 
-		cstring *recdata = message_str(wlt->chain->netmagic,
-					       "account",
-					       acct_raw->str,
-					       acct_raw->len);
-		assert(recdata != NULL);
-
-		cstr_append_buf(rs, recdata->str, recdata->len);
-		cstr_free(recdata, true);
-		cstr_free(acct_raw, true);
+	/* "coin" records */
+	for (i = 0; i < wlt->coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(wlt->coins, i);
+
+		if (!emit_record(f, priv, wallet_record_coin(wlt, coin)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool append_record(void *priv, const cstring *recdata)
+{
+	cstring *rs = priv;
+
+	return cstr_append_buf(rs, recdata->str, recdata->len);
+}
+
+cstring *ser_wallet(const struct wallet *wlt)
+{
+	cstring *rs = cstr_new_sz(20 * 1024);
+	if (!rs)
+		return NULL;
+
+	if (!wallet_records(wlt, append_record, rs)) {
+		cstr_free(rs, true);
+		return NULL;
 	}
 
 	return rs;
@@ -312,6 +515,7 @@ static bool deser_wallet_root(struct wallet *wlt, struct const_buffer *buf)
 			return false;
 
 		if (!strcmp(key->str, "def_acct")) {
+			cstr_free(wlt->def_acct, true);
 			wlt->def_acct = value;
 			value = NULL;	// steal ref
 		}
@@ -376,6 +580,35 @@ static bool load_rec_account(struct wallet *wlt, const void *data, size_t data_l
 	return true;
 }
 
+static bool load_rec_coin(struct wallet *wlt, const void *data, size_t data_len)
+{
+	struct const_buffer buf = { data, data_len };
+
+	struct wallet_coin *coin = calloc(1, sizeof(*coin));
+	if (!coin)
+		return false;
+
+	if (!deser_coin(coin, &buf)) {
+		free(coin);
+		return false;
+	}
+
+	/* a later record for a coin updates it */
+	struct wallet_coin *old = wallet_coin_find(wlt, &coin->outpt);
+	if (old) {
+		*old = *coin;
+		free(coin);
+		return true;
+	}
+
+	if (!wallet_add_coin(wlt, coin)) {
+		free(coin);
+		return false;
+	}
+
+	return true;
+}
+
 static bool load_rec_root(struct wallet *wlt, const void *data, size_t data_len)
 {
 	struct const_buffer buf = { data, data_len };
@@ -399,6 +632,9 @@ static bool load_record(struct wallet *wlt, const struct p2p_message *msg)
 	else if (!strncmp(msg->hdr.command, "account", sizeof(msg->hdr.command)))
 		return load_rec_account(wlt, msg->data, msg->hdr.data_len);
 
+	else if (!strncmp(msg->hdr.command, "coin", sizeof(msg->hdr.command)))
+		return load_rec_coin(wlt, msg->data, msg->hdr.data_len);
+
 	else if (!strncmp(msg->hdr.command, "privkey", sizeof(msg->hdr.command)))
 		return load_rec_privkey(wlt, msg->data, msg->hdr.data_len);
 
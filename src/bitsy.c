@@ -12,10 +12,12 @@
 #include <bitc/coredefs.h>              // for chain_find, chain_info
 #include <bitc/crypto/prng.h>           // for prng_get_random_bytes
 #include <bitc/log.h>                   // for log_info, log_debug, etc
-#include <bitc/net/dns.h>               // for bu_dns_seed_addrs
+#include <bitc/net/capture.h>           // for nc_capture_open, etc
+#include <bitc/net/dns.h>               // for bu_dns_seed_addrs, etc
 #include <bitc/net/net.h>               // for net_child_info, nc_conns_gc, etc
 #include <bitc/net/netbase.h>           // for bn_address_str, etc
 #include <bitc/net/peerman.h>           // for peer_manager, peerman_write, etc
+#include <bitc/net/shmring.h>           // for shmring_wait, shmring_peek, etc
 #include <bitc/util.h>                  // for ARRAY_SIZE, czstr_equal, etc
 #include "wallet.h"                     // for cur_wallet_addresses, etc
 
@@ -26,10 +28,12 @@
 #include <assert.h>                     // for assert
 #include <stdbool.h>                    // for bool
 #include <ctype.h>                      // for isspace
+#include <poll.h>                       // for poll, pollfd, POLLIN
 #include <stdio.h>                      // for fprintf, printf, NULL, etc
 #include <stdint.h>                     // for uint64_t
 #include <stdlib.h>                     // for free, exit
 #include <string.h>                     // for strcmp, strdup, strlen, etc
+#include <time.h>                       // for time, time_t
 #include <unistd.h>                     // for sleep
 
 enum command_type {
@@ -44,6 +48,7 @@ enum command_type {
 	CMD_WALLET_INFO,
 	CMD_ACCT_DEFAULT,
 	CMD_ACCT_CREATE,
+	CMD_WALLET_RESCAN,
 };
 
 const char *prog_name = "bitsy";
@@ -99,6 +104,7 @@ static char global_doc[] =
 	"\taddressList - List all legacy addresses (non-HD) in the wallet.\n"
 	"\tdump - Dump entire wallet contents, including private keys.\n"
 	"\tinfo - Print informational summary of wallet data.\n"
+	"\trescan - Find the wallet's coins in stored blocks.\n"
 	"\n"
 	"Run \"bitsy cmd --help\" for extended, per-command help.\n"
 	"\n"
@@ -213,6 +219,12 @@ static char cmd_addressList_doc[] = "Wallet addressList\n";
 
 static struct argp argp_cmd_addressList = { cmd_no_options, parse_no_opt, NULL, cmd_addressList_doc };
 
+// ======================== command: rescan ==========================
+
+static char cmd_rescan_doc[] = "Rescan stored blocks for wallet coins\n";
+
+static struct argp argp_cmd_rescan = { cmd_no_options, parse_no_opt, NULL, cmd_rescan_doc };
+
 // ======================== top-level command processing ================
 
 static void parse_secondary_cmd(struct argp_state* state,
@@ -280,6 +292,9 @@ static error_t parse_global_opt (int key, char *arg, struct argp_state *state)
 		} else if (strcmp(arg, "info") == 0) {
 			opt_command = CMD_WALLET_INFO;
 			parse_secondary_cmd(state, &argp_cmd_info, "info");
+		} else if (strcmp(arg, "rescan") == 0) {
+			opt_command = CMD_WALLET_RESCAN;
+			parse_secondary_cmd(state, &argp_cmd_rescan, "rescan");
 		} else {
 			argp_error(state, "%s is not a valid command", arg);
 		}
@@ -493,23 +508,25 @@ static void init_peers(struct net_child_info *nci)
 	if (!peers) {
 		log_info("%s: initializing empty peer list", prog_name);
 
-		peers = peerman_seed(setting("no_dns") == NULL ? true : false);
+		peers = peerman_seed(false);
 		if (!peerman_write(peers, peer_filename, chain)) {
 			log_info("%s: failed to write peer list", prog_name);
 			exit(1);
 		}
+
+		/* seeds resolve in the background; dialing starts at once */
+		if (!setting("no_dns"))
+			nci->dns = bu_dns_seeder_start();
 	}
 
 	char *addnode = setting("addnode");
 	if (addnode)
 		peerman_addstr(peers, addnode);
 
-	peerman_sort(peers);
-
-	log_debug("%s: have %u/%zu peers",
+	log_debug("%s: have %zu/%zu peers (new/tried)",
 		prog_name,
-		bitc_hashtab_size(peers->map_addr),
-		clist_length(peers->addrlist));
+		peers->new_tab.ids->len,
+		peers->tried_tab.ids->len);
 
 	nci->peers = peers;
 }
@@ -528,6 +545,8 @@ static void shutdown_nci(struct net_child_info *nci)
 {
 	nci->read_fd = -1;
 	nci->write_fd = -1;
+	nc_capture_close(nci->capture);
+	nci->capture = NULL;
 	peerman_free(nci->peers);
 	nc_conns_gc(nci, true);
 	assert(nci->conns->len == 0);
@@ -548,13 +567,75 @@ static void init_nci(struct net_child_info *nci)
 	nci->instance_nonce = &instance_nonce;
 	nci->running = false;
 	nci->last_getblocks = 2147483647;
+
+	/* record inbound traffic, for replay */
+	char *capture_fn = setting("net.capture");
+	if (capture_fn)
+		nci->capture = nc_capture_open(capture_fn);
+}
+
+/* blocks passed to the parent; NULL forwards nothing */
+static struct shmring *block_ring;
+static int block_ring_cmd_fd = -1;	/* parent's commands to the child */
+
+static bool child_inv_block_process(bu256_t *hash)
+{
+	return !chaindb_lookup(&db, hash);
+}
+
+/* a command (NC_STOP), or EOF, is waiting from the parent */
+static bool child_cmd_pending(void)
+{
+	struct pollfd pfd = { .fd = block_ring_cmd_fd, .events = POLLIN };
+
+	return (block_ring_cmd_fd >= 0) && (poll(&pfd, 1, 0) > 0);
+}
+
+/*
+ * Network child: hand the block to the parent for validation.  A
+ * block dropped here would not be fetched again, so while the parent
+ * is behind, wait for ring space, and give up only when told to stop.
+ * The header is then indexed, so further announcements are ignored.
+ */
+static bool child_block_process(struct bitc_block *block,
+				struct const_buffer *buf)
+{
+	if (chaindb_lookup(&db, &block->sha256))
+		return true;
+
+	if (block_ring && (buf->len > shmring_max_len(block_ring))) {
+		log_info("%s: block too large for ring, %zu bytes", prog_name,
+			 buf->len);
+		return false;
+	}
+
+	while (block_ring &&
+	       !shmring_put_wait(block_ring, SHMR_BLOCK, buf->p, buf->len,
+				 1000)) {
+		if (child_cmd_pending())
+			return true;
+	}
+
+	struct blkinfo *bi = bi_new();
+	bu256_copy(&bi->hash, &block->sha256);
+	bitc_block_copy_hdr(&bi->hdr, block);
+
+	struct chaindb_reorg reorg;
+	if (!chaindb_add(&db, bi, &reorg))
+		bi_free(bi);
+
+	return true;
 }
 
-static void network_child(int read_fd, int write_fd)
+static void network_child(int read_fd, int write_fd, struct shmring *ring)
 {
     struct net_child_info nci;
 
     init_nci(&nci);
+    block_ring = ring;
+    block_ring_cmd_fd = read_fd;
+    nci.inv_block_process = child_inv_block_process;
+    nci.block_process = child_block_process;
 
     nci.read_fd = read_fd;
     nci.write_fd = write_fd;
@@ -590,6 +671,68 @@ static void network_child(int read_fd, int write_fd)
 	exit(0);
 }
 
+/* parent: validate and index blocks received by the network child */
+static bool sync_block(const struct shmring_rec *rec)
+{
+	struct const_buffer buf = { rec->data, rec->len };
+	struct bitc_block block;
+	bool rc = false;
+
+	bitc_block_init(&block);
+
+	if (!deser_bitc_block(&block, &buf))
+		goto out;
+	bitc_block_calc_sha256(&block);
+	if (!bitc_block_valid(&block))
+		goto out;
+
+	if (chaindb_lookup(&db, &block.sha256)) {
+		rc = true;
+		goto out;
+	}
+
+	struct blkinfo *bi = bi_new();
+	bu256_copy(&bi->hash, &block.sha256);
+	bitc_block_copy_hdr(&bi->hdr, &block);
+
+	struct chaindb_reorg reorg;
+	if (!chaindb_add(&db, bi, &reorg)) {
+		bi_free(bi);
+		goto out;
+	}
+
+	rc = true;
+
+out:
+	bitc_block_free(&block);
+	return rc;
+}
+
+static void sync_blocks(struct shmring *ring, time_t deadline)
+{
+	unsigned int n_blocks = 0, n_bad = 0;
+	time_t now;
+
+	while ((now = time(NULL)) < deadline) {
+		if (!shmring_wait(ring, (deadline - now) * 1000))
+			continue;
+
+		const struct shmring_rec *rec;
+		while ((rec = shmring_peek(ring)) != NULL) {
+			if (rec->type == SHMR_BLOCK) {
+				if (sync_block(rec))
+					n_blocks++;
+				else
+					n_bad++;
+			}
+			shmring_release(ring);
+		}
+	}
+
+	log_info("%s: synced %u blocks (%u rejected), height %d", prog_name,
+		 n_blocks, n_bad, db.best_chain ? (int) db.best_chain->height : -1);
+}
+
 void network_sync(void)
 {
 	char *sleep_str = setting("sleep");
@@ -602,14 +745,23 @@ void network_sync(void)
 	if (v > 0)
 		net_conn_timeout = (unsigned int) v;
 
-	struct net_engine *neteng = neteng_new_start(network_child);
+	char *ring_str = setting("net.ring_size");
+	size_t ring_size = ring_str ? strtoull(ring_str, NULL, 10) :
+				      SHMRING_DEF_SIZE;
+
+	struct net_engine *neteng = neteng_new_start(network_child, ring_size);
 
-	log_debug("net: engine started. sleeping %d %s (cxn tmout %u sec)",
+	log_debug("net: engine started. syncing %d %s (cxn tmout %u sec)",
 			(nsec > 60) ? nsec/60 : nsec,
 			(nsec > 60) ? "minutes" : "seconds",
 			net_conn_timeout);
 
-	sleep(nsec);
+	if (neteng->ring) {
+		init_chaindb();
+		sync_blocks(neteng->ring, time(NULL) + nsec);
+		chaindb_free(&db);
+	} else
+		sleep(nsec);
 
 	neteng_free(neteng);
 }
@@ -649,6 +801,7 @@ int main (int argc, char *argv[])
 	case CMD_WALLET_INFO:	cur_wallet_info(); break;
 	case CMD_ACCT_CREATE:	cur_wallet_createAccount(opt_arg1); break;
 	case CMD_ACCT_DEFAULT:	cur_wallet_defaultAccount(opt_arg1); break;
+	case CMD_WALLET_RESCAN:	cur_wallet_rescan(); break;
 	}
 
 	free(log_state);
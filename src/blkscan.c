@@ -10,12 +10,18 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <argp.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <bitc/crypto/ripemd160.h>
 #include <bitc/coredefs.h>
 #include <bitc/base58.h>
 #include <bitc/buffer.h>
 #include <bitc/key.h>
 #include <bitc/core.h>
+#include <bitc/crypto/sha2.h>
+#include <bitc/db/txindex.h>
+#include <bitc/endian.h>
+#include <bitc/log.h>
 #include <bitc/util.h>
 #include <bitc/mbr.h>
 #include <bitc/script.h>
@@ -23,13 +29,19 @@
 #include <bitc/message.h>
 #include <bitc/hashtab.h>
 
+struct logging *log_state;
+
 const char *argp_program_version = PACKAGE_VERSION;
 
 static struct argp_option options[] = {
 	{ "addresses", 'a', "FILE", 0,
-	  "Load bitcoin addresses from text FILE.  Default filename \"blocks.dat\"." },
+	  "Load bitcoin addresses from text FILE, or from a set saved by -A.  Default filename \"blocks.dat\"." },
+	{ "save-addresses", 'A', "FILE", 0,
+	  "Save the loaded addresses to FILE as a compact set, for -a to map directly on later runs." },
 	{ "blocks", 'b', "FILE", 0,
 	  "Load blockchain data from mkbootstrap-produced FILE.  Default filename \"addresses.txt\"." },
+	{ "txindex", 'i', "FILE", 0,
+	  "Keep the transaction index in FILE, updated as blocks are scanned.  Default: a temporary index, for this run only." },
 
 	{ "no-decimal", 'N', NULL, 0,
 	  "Print values as integers (satoshis), not decimal numbers" },
@@ -37,19 +49,35 @@ static struct argp_option options[] = {
 	{ "quiet", 'q', NULL, 0,
 	  "Silence informational messages" },
 
+	{ "threads", 'j', "N", 0,
+	  "Decode and match blocks on N threads.  Default 1." },
+
 	{ }
 };
 
 static const char doc[] =
 "blkscan - command line interface to scan blocks";
 
+enum {
+	SCAN_CHUNK	= 64,		/* blocks per work unit */
+	SCAN_WINDOW	= 4,		/* chunks in flight, per thread */
+	SCAN_MAX_THREADS = 256,
+
+	SCAN_IDENT_TAIL	= 4096,		/* file bytes hashed, at the end */
+	SCAN_IDENT_LEN	= 32 + 8 + 32,
+};
+
 static char *blocks_fn = "blocks.dat";
 static char *address_fn = "addresses.txt";
+static char *addrset_fn = NULL;
+static char *txindex_fn = NULL;
 static bool opt_quiet = false;
 static bool opt_decimal = true;
+static unsigned int opt_threads = 1;
 
 static struct bitc_keyset bitc_ks;
-static struct bitc_hashtab *tx_idx = NULL;
+static struct txindex txidx;
+static unsigned int tx_count = 0;
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state);
 
@@ -62,15 +90,26 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	case 'a':
 		address_fn = arg;
 		break;
+	case 'A':
+		addrset_fn = arg;
+		break;
 	case 'b':
 		blocks_fn = arg;
 		break;
+	case 'i':
+		txindex_fn = arg;
+		break;
 	case 'N':
 		opt_decimal = false;
 		break;
 	case 'q':
 		opt_quiet = true;
 		break;
+	case 'j': {
+		int n = atoi(arg);
+		opt_threads = n > 0 ? MIN(n, SCAN_MAX_THREADS) : 1;
+		break;
+	}
 
 	default:
 		return ARGP_ERR_UNKNOWN;
@@ -79,32 +118,47 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
+/* decoded hash160s, handed to the keyset in one go */
+static uint8_t *addr_hashes = NULL;
+static size_t n_addr_hashes = 0, alloc_addr_hashes = 0;
+
 static void load_address(unsigned int line_no, const char *line)
 {
-	unsigned char addrtype;
-	cstring *s = base58_decode_check(&addrtype, line);
+	unsigned char addrtype, md160[BASE58_MAX_DATA];
+	size_t len;
 
-	if (!s || addrtype != PUBKEY_ADDRESS) {
+	if (!base58_decode_check_buf(&addrtype, md160, sizeof(md160), &len,
+				     line) ||
+	    addrtype != PUBKEY_ADDRESS) {
 		fprintf(stderr, "Invalid address on line %d: %s\n", line_no, line);
 		exit(1);
 	}
 
-	if (s->len != RIPEMD160_DIGEST_LENGTH) {
+	if (len != RIPEMD160_DIGEST_LENGTH) {
 		fprintf(stderr, "Invalid decoded address length %u on line %d: %s\n",
-			(unsigned int) s->len, line_no, line);
+			(unsigned int) len, line_no, line);
 		exit(1);
 	}
 
-	struct buffer *buf_pkhash = buffer_copy(s->str,RIPEMD160_DIGEST_LENGTH);
-	bitc_hashtab_put(bitc_ks.pubhash, buf_pkhash, buf_pkhash);
-
-	cstr_free(s, true);
+	if (n_addr_hashes == alloc_addr_hashes) {
+		alloc_addr_hashes = alloc_addr_hashes ?
+				    alloc_addr_hashes * 2 : 1024;
+		addr_hashes = realloc(addr_hashes,
+				alloc_addr_hashes * RIPEMD160_DIGEST_LENGTH);
+	}
+	memcpy(addr_hashes + n_addr_hashes * RIPEMD160_DIGEST_LENGTH,
+	       md160, RIPEMD160_DIGEST_LENGTH);
+	n_addr_hashes++;
 }
 
 static void load_addresses(void)
 {
 	char line[512];
 
+	/* a saved set is mapped as is */
+	if (bitc_keyset_open_hashes(&bitc_ks, address_fn))
+		goto out;
+
 	FILE *f = fopen(address_fn, "r");
 	if (!f) {
 		perror(address_fn);
@@ -129,96 +183,45 @@ static void load_addresses(void)
 
 	fclose(f);
 
+	if (!bitc_keyset_add_hashes(&bitc_ks, addr_hashes, n_addr_hashes)) {
+		fprintf(stderr, "%s: address set build failed\n", address_fn);
+		exit(1);
+	}
+	free(addr_hashes);
+	addr_hashes = NULL;
+
+out:
+	if (addrset_fn &&
+	    !bitc_addrset_write(&bitc_ks.pubhash_set, addrset_fn)) {
+		perror(addrset_fn);
+		exit(1);
+	}
+
 	if (!opt_quiet)
-		fprintf(stderr, "%d addresses loaded\n",
-			bitc_hashtab_size(bitc_ks.pubhash));
+		fprintf(stderr, "%lu addresses loaded\n",
+			(unsigned long) bitc_ks.pubhash_set.n);
 }
 
 /* file pos -> block lookup */
-static bool reload_block(int fd, uint64_t fpos, struct bitc_block *block)
+static bool reload_block(const struct blkfile *bf, uint64_t fpos,
+			 struct bitc_block *block)
 {
-	off_t save_ofs = lseek(fd, 0, SEEK_CUR);
-	if (save_ofs == (off_t)-1) {
-		perror("lseek 1");
-		return false;
-	}
+	struct const_buffer buf;
 
-	if (lseek(fd, (off_t) fpos, SEEK_SET) != (off_t) fpos) {
-		perror("lseek 2");
+	if (!blkfile_at(bf, fpos, &buf)) {
+		fprintf(stderr, "reload_block blkfile_at fail\n");
 		return false;
 	}
 
-	struct p2p_message msg = {};
-	bool read_ok = false;
-
-	if (!fread_block(fd, &msg, &read_ok)) {
-		fprintf(stderr, "reload_block fread_block fail\n");
-		goto err_out;
-	}
-
-	struct const_buffer buf = { msg.data, msg.hdr.data_len };
-
-	bool rc = deser_bitc_block(block, &buf);
-	if (!rc) {
+	if (!deser_bitc_block(block, &buf)) {
 		fprintf(stderr, "reload_block deser_block fail\n");
-		goto err_out;
+		return false;
 	}
 
-	if (lseek(fd, save_ofs, SEEK_SET) != save_ofs)
-		perror("lseek restore true");
-	free(msg.data);
 	return true;
-
-err_out:
-	if (lseek(fd, save_ofs, SEEK_SET) != save_ofs)
-		perror("lseek restore false");
-	free(msg.data);
-	return false;
-}
-
-/* search for tx_hash within given block; return full tx */
-static bool tx_from_block(struct bitc_tx *dest, bu256_t *tx_hash,
-			  const struct bitc_block *block)
-{
-	unsigned int n;
-	for (n = 0; n < block->vtx->len; n++) {
-		struct bitc_tx *tx;
-
-		tx = parr_idx(block->vtx, n);
-
-		bitc_tx_calc_sha256(tx);
-
-		if (bu256_equal(&tx->sha256, tx_hash)) {
-			bitc_tx_copy(dest, tx);
-			return true;
-		}
-	}
-
-	return false;
-}
-
-static bool tx_from_fpos(struct bitc_tx *dest, bu256_t *tx_hash,
-			 int fd, uint64_t fpos)
-{
-	struct bitc_block block;
-	bool rc = false;
-
-	bitc_block_init(&block);
-
-	if (!reload_block(fd, fpos, &block))
-		goto out;
-
-	if (!tx_from_block(dest, tx_hash, &block))
-		goto out;
-
-	rc = true;
-
-out:
-	bitc_block_free(&block);
-	return rc;
 }
 
-static int block_fd = -1;
+static struct blkfile blocks;
 
 static void print_txout(bool show_from, unsigned int i, struct bitc_txout *txout)
 {
@@ -233,45 +236,35 @@ static void print_txout(bool show_from, unsigned int i, struct bitc_txout *txout
 		show_from ? "\tFrom" : "Output",
 		i, valstr);
 
-	struct bscript_addr addrs;
-	if (!bsp_addr_parse(&addrs, txout->scriptPubKey->str,
+	struct bscript_tmpl tmpl;
+	if (!bsp_tmpl_match(&tmpl, txout->scriptPubKey->str,
 			    txout->scriptPubKey->len)) {
 		printf(" UNPARSEABLE-ADDRESS!\n");
 		return;
 	}
 
-	if (addrs.pub)
+	if (tmpl.txtype == TX_PUBKEY)
 		printf(" SOME-PUBKEYS!");
 
-	struct const_buffer *buf;
-	clist *tmp = addrs.pubhash;
-	bool is_mine;
-	while (tmp) {
-		buf = tmp->data;
-		tmp = tmp->next;
-
-		is_mine = bitc_keyset_lookup(&bitc_ks, buf->p, buf->len, true);
+	if (tmpl.txtype == TX_PUBKEYHASH) {
+		const struct const_buffer *buf = &tmpl.data[0];
+		bool is_mine = bitc_keyset_lookup(&bitc_ks, buf->p, buf->len,
+						  true);
 
-		cstring *addr = base58_encode_check(PUBKEY_ADDRESS, true,
-						    buf->p, buf->len);
-		if (!addr) {
+		char addr[BASE58_ADDR_STR_SZ];
+		if (!base58_encode_check_buf(addr, sizeof(addr), PUBKEY_ADDRESS,
+					     true, buf->p, buf->len)) {
 			printf(" ENCODE-FAILED!\n");
-			goto out;
+			return;
 		}
 
 		printf(" %s%s%s",
 		       is_mine ? "*" : "",
-		       addr->str,
+		       addr,
 		       is_mine ? "*" : "");
-
-		cstr_free(addr, true);
 	}
 
 	printf("\n");
-
-out:
-        clist_free_ext(addrs.pub, buffer_freep);
-        clist_free_ext(addrs.pubhash, buffer_freep);
 }
 
 static void print_txouts(struct bitc_tx *tx, int idx)
@@ -298,16 +291,18 @@ static void print_txin(unsigned int i, struct bitc_txin *txin)
 	printf("\tInput %u: %s %u\n",
 		i, hexstr, txin->prevout.n);
 
-	uint64_t *fpos_p = bitc_hashtab_get(tx_idx, &txin->prevout.hash);
-	if (!fpos_p) {
+	struct txindex_pos pos;
+	if (!txindex_get(&txidx, &txin->prevout.hash, &pos)) {
 		printf("\t\tINPUT NOT FOUND!\n");
 		return;
 	}
 
 	struct bitc_tx tx;
+	struct const_buffer blk;
 	bitc_tx_init(&tx);
 
-	if (!tx_from_fpos(&tx, &txin->prevout.hash, block_fd, *fpos_p)) {
+	if (!blkfile_at(&blocks, pos.block_pos, &blk) ||
+	    !txindex_fetch(&tx, &txin->prevout.hash, &blk, &pos)) {
 		printf("\t\tINPUT NOT READ!\n");
 		goto out;
 	}
@@ -330,30 +325,58 @@ static void print_txins(struct bitc_tx *tx)
 	}
 }
 
-static void index_block(unsigned int height, struct bitc_block *block,
-			uint64_t fpos)
+static void index_txs(const bu256_t *txids, const struct txindex_pos *pos,
+		      unsigned int n, uint64_t next_pos)
 {
-	unsigned int n;
-	for (n = 0; n < block->vtx->len; n++) {
-		struct bitc_tx *tx;
-		uint64_t *fpos_copy;
+	if (!txindex_add(&txidx, txids, pos, n, next_pos)) {
+		fprintf(stderr, "txindex %s update failed\n", txindex_fn);
+		exit(1);
+	}
+}
 
-		tx = parr_idx(block->vtx, n);
+/* blocks the index already has, from an earlier run, are skipped */
+static void index_block(struct bitc_block *block,
+			const struct txindex_pos *pos, uint64_t next_pos)
+{
+	unsigned int n, n_txs = block->vtx->len;
 
-		bitc_tx_calc_sha256(tx);
+	tx_count += n_txs;
 
-		bu256_t *hash = bu256_new(&tx->sha256);
+	if (next_pos <= txidx.next_pos)
+		return;
 
-		fpos_copy = malloc(sizeof(fpos));
-		if (fpos_copy)
-			*fpos_copy = fpos;
+	bu256_t *txids = malloc((n_txs ? n_txs : 1) * sizeof(bu256_t));
+	for (n = 0; n < n_txs; n++) {
+		struct bitc_tx *tx;
 
-		bitc_hashtab_put(tx_idx, hash, fpos_copy);
+		tx = parr_idx(block->vtx, n);
+
+		bitc_tx_calc_sha256(tx);
+		bu256_copy(&txids[n], &tx->sha256);
 	}
+
+	index_txs(txids, pos, n_txs, next_pos);
+	free(txids);
 }
 
 static unsigned int tx_matches = 0;
 
+static void print_match(const struct bitc_block *block, struct bitc_tx *tx)
+{
+	char hashstr[BU256_STRSZ];
+	bitc_tx_calc_sha256(tx);
+	bu256_hex(hashstr, &tx->sha256);
+
+	printf("%u, %s\n",
+	       block->nTime,
+	       hashstr);
+
+	print_txins(tx);
+	print_txouts(tx, -1);
+
+	tx_matches++;
+}
+
 static void scan_block(unsigned int height, struct bitc_block *block)
 {
 	unsigned int n;
@@ -362,81 +385,440 @@ static void scan_block(unsigned int height, struct bitc_block *block)
 
 		tx = parr_idx(block->vtx, n);
 
-		if (bitc_tx_match(tx, &bitc_ks)) {
-			char hashstr[BU256_STRSZ];
-			bitc_tx_calc_sha256(tx);
-			bu256_hex(hashstr, &tx->sha256);
-
-			printf("%u, %s\n",
-			       block->nTime,
-			       hashstr);
-
-			print_txins(tx);
-			print_txouts(tx, -1);
-
-			tx_matches++;
-		}
+		if (bitc_tx_match(tx, &bitc_ks))
+			print_match(block, tx);
 	}
 }
 
-static void scan_decode_block(unsigned int height, struct p2p_message *msg,
-			      uint64_t *fpos)
+static void scan_decode_block(unsigned int height, struct const_buffer *buf,
+			      uint64_t fpos, uint64_t next_pos)
 {
 	struct bitc_block block;
+	struct txindex_pos *pos;
 	bitc_block_init(&block);
 
-	struct const_buffer buf = { msg->data, msg->hdr.data_len };
-
-	bool rc = deser_bitc_block(&block, &buf);
+	bool rc = txindex_deser_block(&block, buf, fpos, &pos);
 	if (!rc) {
 		fprintf(stderr, "block deser failed at height %u\n", height);
 		exit(1);
 	}
 
-	index_block(height, &block, *fpos);
+	index_block(&block, pos, next_pos);
 	scan_block(height, &block);
 
-	uint64_t pos_tmp = msg->hdr.data_len;
-	*fpos += (pos_tmp + 8);
+	free(pos);
+	bitc_block_free(&block);
+}
+
+static void scan_progress(unsigned int height)
+{
+	if ((height % 10000 == 0) && (!opt_quiet))
+		fprintf(stderr, "Scanned %u transactions at height %u\n",
+			tx_count,
+			height);
+}
+
+/* grows *p to hold n elements of sz bytes */
+static bool scan_grow(void **p, size_t n, size_t sz)
+{
+	void *np = realloc(*p, n * sz);
+	if (!np)
+		return false;
+
+	*p = np;
+	return true;
+}
+
+/*
+ * Parallel scan.  A pass over the record headers finds every block's
+ * offset; workers then decode, hash and match runs of blocks, and the
+ * main thread merges the results in height order, so the txindex and
+ * the output are exactly as a sequential scan leaves them.
+ */
+
+struct scan_match {
+	unsigned int	block;		/* within chunk */
+	unsigned int	tx;
+};
+
+struct scan_chunk {
+	bool		done;
+	bool		oom;
+	int		bad_height;	/* failed to decode, or -1 */
+
+	unsigned int	n_txs[SCAN_CHUNK];	/* per block */
+	bu256_t		*txids;			/* all blocks, in order */
+	struct txindex_pos *pos;		/* ditto */
+	struct scan_match *matches;		/* in order */
+	unsigned int	n_matches;
+};
+
+struct scan_pool {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+
+	uint64_t		*fpos;		/* per height, and end */
+	unsigned int		n_blocks;
+	uint64_t		index_from;	/* txidx.next_pos, at start */
+
+	struct scan_chunk	*chunks;
+	unsigned int		n_chunks;
+	unsigned int		next_claim;
+	unsigned int		next_merge;
+	unsigned int		window;
+};
 
+static void scan_chunk_run(struct scan_pool *pool, unsigned int k)
+{
+	struct scan_chunk *chunk = &pool->chunks[k];
+	unsigned int start = k * SCAN_CHUNK;
+	unsigned int end = MIN(start + SCAN_CHUNK, pool->n_blocks);
+	unsigned int i, alloc_txids = 0, alloc_matches = 0, n_txids = 0;
+
+	chunk->bad_height = -1;
+
+	for (i = start; i < end; i++) {
+		struct bitc_block block;
+		struct txindex_pos *pos = NULL;
+		struct const_buffer buf;
+
+		bitc_block_init(&block);
+
+		if (!blkfile_at(&blocks, pool->fpos[i], &buf) ||
+		    !txindex_deser_block(&block, &buf, pool->fpos[i], &pos)) {
+			chunk->bad_height = i;
+			bitc_block_free(&block);
+			return;
+		}
+
+		/* already indexed: only matching to do */
+		bool indexing = (pool->fpos[i + 1] > pool->index_from);
+
+		unsigned int n;
+		for (n = 0; n < block.vtx->len; n++) {
+			struct bitc_tx *tx = parr_idx(block.vtx, n);
+
+			if (indexing) {
+				if (n_txids == alloc_txids) {
+					alloc_txids = alloc_txids ? alloc_txids * 2 : 256;
+					if (!scan_grow((void **) &chunk->txids,
+						       alloc_txids, sizeof(bu256_t)) ||
+					    !scan_grow((void **) &chunk->pos,
+						       alloc_txids,
+						       sizeof(struct txindex_pos)))
+						goto err_oom;
+				}
+
+				bitc_tx_calc_sha256(tx);
+				chunk->txids[n_txids] = tx->sha256;
+				chunk->pos[n_txids] = pos[n];
+				n_txids++;
+			}
+
+			if (!bitc_tx_match(tx, &bitc_ks))
+				continue;
+
+			if (chunk->n_matches == alloc_matches) {
+				alloc_matches = alloc_matches ? alloc_matches * 2 : 16;
+				if (!scan_grow((void **) &chunk->matches,
+					       alloc_matches,
+					       sizeof(struct scan_match)))
+					goto err_oom;
+			}
+			chunk->matches[chunk->n_matches].block = i - start;
+			chunk->matches[chunk->n_matches].tx = n;
+			chunk->n_matches++;
+		}
+
+		chunk->n_txs[i - start] = block.vtx->len;
+		free(pos);
+		bitc_block_free(&block);
+		continue;
+
+err_oom:
+		chunk->oom = true;
+		free(pos);
+		bitc_block_free(&block);
+		return;
+	}
+}
+
+static void *scan_worker(void *priv)
+{
+	struct scan_pool *pool = priv;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->next_claim < pool->n_chunks) {
+		/* stay within reach of the merge */
+		if (pool->next_claim >= pool->next_merge + pool->window) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		unsigned int k = pool->next_claim++;
+
+		pthread_mutex_unlock(&pool->lock);
+		scan_chunk_run(pool, k);
+		pthread_mutex_lock(&pool->lock);
+
+		pool->chunks[k].done = true;
+		pthread_cond_broadcast(&pool->cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void scan_chunk_merge(struct scan_pool *pool, unsigned int k)
+{
+	struct scan_chunk *chunk = &pool->chunks[k];
+	unsigned int start = k * SCAN_CHUNK;
+	unsigned int end = MIN(start + SCAN_CHUNK, pool->n_blocks);
+	unsigned int i, t = 0, m = 0;
+
+	if (chunk->oom) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
+
+	if (chunk->bad_height >= 0) {
+		fprintf(stderr, "block deser failed at height %d\n",
+			chunk->bad_height);
+		exit(1);
+	}
+
+	for (i = start; i < end; i++) {
+		uint64_t fpos = pool->fpos[i];
+		unsigned int n_txs = chunk->n_txs[i - start];
+
+		if (pool->fpos[i + 1] > pool->index_from) {
+			index_txs(&chunk->txids[t], &chunk->pos[t], n_txs,
+				  pool->fpos[i + 1]);
+			t += n_txs;
+		}
+		tx_count += n_txs;
+
+		/* matches are rare; decode their block again to print */
+		if ((m < chunk->n_matches) &&
+		    (chunk->matches[m].block == i - start)) {
+			struct bitc_block block;
+			bitc_block_init(&block);
+
+			if (!reload_block(&blocks, fpos, &block))
+				exit(1);
+
+			while ((m < chunk->n_matches) &&
+			       (chunk->matches[m].block == i - start)) {
+				unsigned int tx_n = chunk->matches[m++].tx;
+				print_match(&block, parr_idx(block.vtx, tx_n));
+			}
+
+			bitc_block_free(&block);
+		}
+
+		scan_progress(i + 1);
+	}
+
+	free(chunk->txids);
+	free(chunk->pos);
+	free(chunk->matches);
+	chunk->txids = NULL;
+	chunk->pos = NULL;
+	chunk->matches = NULL;
+}
+
+static unsigned int scan_blocks_parallel(void)
+{
+	struct scan_pool pool = {};
+	unsigned int alloc = 4096;
+	struct const_buffer buf;
+	uint64_t fpos = 0;
+
+	pool.fpos = malloc(alloc * sizeof(uint64_t));
+	if (!pool.fpos) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
+
+	/*
+	 * Headers only: find block boundaries.  blkfile_next() would read
+	 * every block ahead and drop it behind, for the workers to read
+	 * it all again; touch just the pages holding record headers.
+	 */
+	blkfile_advise_random(&blocks, true);
+
+	while (fpos < blocks.len) {
+		if (!blkfile_at(&blocks, fpos, &buf)) {
+			blocks.error = true;
+			free(pool.fpos);
+			return 0;
+		}
+
+		if (pool.n_blocks + 1 == alloc) {
+			alloc *= 2;
+			if (!scan_grow((void **) &pool.fpos, alloc,
+				       sizeof(uint64_t))) {
+				fprintf(stderr, "OOM\n");
+				exit(1);
+			}
+		}
+		pool.fpos[pool.n_blocks++] = fpos;
+		fpos += sizeof(struct p2p_blockfile_hdr) + buf.len;
+	}
+
+	pool.fpos[pool.n_blocks] = fpos;
+
+	/* workers read runs of blocks, out of order */
+	blkfile_advise_random(&blocks, false);
+	pool.index_from = txidx.next_pos;
+
+	pool.n_chunks = (pool.n_blocks + SCAN_CHUNK - 1) / SCAN_CHUNK;
+	pool.chunks = calloc(pool.n_chunks ? pool.n_chunks : 1,
+			     sizeof(struct scan_chunk));
+	if (!pool.chunks) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
+	pool.window = opt_threads * SCAN_WINDOW;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	pthread_t threads[opt_threads];
+	unsigned int i;
+	for (i = 0; i < opt_threads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, &pool)) {
+			fprintf(stderr, "cannot start scan thread\n");
+			exit(1);
+		}
+	}
+
+	unsigned int k;
+	for (k = 0; k < pool.n_chunks; k++) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.chunks[k].done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		scan_chunk_merge(&pool, k);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.next_merge = k + 1;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	for (i = 0; i < opt_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.chunks);
+	free(pool.fpos);
+
+	return pool.n_blocks;
+}
+
+/* the first block's hash, the size, and a hash of the tail, of size bytes */
+static void blocks_ident(uint8_t *id, size_t size)
+{
+	struct bitc_block block;
+	struct const_buffer buf;
+
+	memset(id, 0, SCAN_IDENT_LEN);
+
+	bitc_block_init(&block);
+	if (blkfile_at(&blocks, 0, &buf) && deser_bitc_block_hdr(&block, &buf)) {
+		bitc_block_calc_sha256(&block);
+		memcpy(id, &block.sha256, 32);
+	}
 	bitc_block_free(&block);
+
+	uint64_t le_size = htole64(size);
+	memcpy(id + 32, &le_size, 8);
+
+	size_t tail = MIN(size, SCAN_IDENT_TAIL);
+	if (tail)
+		sha256_Raw(blocks.base + size - tail, tail, id + 40);
+}
+
+/*
+ * An index of a file that has only grown since is caught up; of any
+ * other file, say one replaced or rewritten, it is rebuilt.
+ */
+static void check_txindex(void)
+{
+	uint8_t id[SCAN_IDENT_LEN], old_id[SCAN_IDENT_LEN];
+	uint64_t old_size = 0;
+	bool same = false;
+
+	blocks_ident(id, blocks.len);
+
+	if (txidx.ident_len == sizeof(id)) {
+		memcpy(&old_size, txidx.ident + 32, 8);
+		old_size = le64toh(old_size);
+
+		if ((old_size <= blocks.len) && (txidx.next_pos <= old_size)) {
+			blocks_ident(old_id, old_size);
+			same = !memcmp(old_id, txidx.ident, sizeof(old_id));
+		}
+	}
+
+	if (same && (old_size == blocks.len))
+		return;
+
+	if (!same && (txidx.next_pos > 0) && !opt_quiet)
+		fprintf(stderr, "txindex %s is of other blocks, rebuilding\n",
+			txindex_fn);
+
+	if (!txindex_set_ident(&txidx, id, sizeof(id), !same)) {
+		fprintf(stderr, "txindex %s update failed\n", txindex_fn);
+		exit(1);
+	}
 }
 
 static void scan_blocks(void)
 {
-	int fd = file_seq_open(blocks_fn);
-	if (fd < 0) {
+	if (!blkfile_open(&blocks, blocks_fn)) {
 		perror(blocks_fn);
 		exit(1);
 	}
 
-	struct p2p_message msg = {};
-	bool read_ok = false;
+	check_txindex();
+
+	if (opt_threads > 1) {
+		unsigned int height = scan_blocks_parallel();
+		if (blocks.error) {
+			fprintf(stderr, "block read %s failed\n", blocks_fn);
+			exit(1);
+		}
+
+		blkfile_close(&blocks);
 
+		if (!opt_quiet) {
+			fprintf(stderr, "Scanned to height %u\n", height);
+			fprintf(stderr, "TX matches: %u\n", tx_matches);
+		}
+		return;
+	}
+
+	struct const_buffer buf;
 	unsigned int height = 0;
 	uint64_t fpos = 0;
 
-	block_fd = fd;
-
-	while (fread_block(fd, &msg, &read_ok)) {
-		scan_decode_block(height, &msg, &fpos);
+	while (blkfile_next(&blocks, &buf, &fpos)) {
+		scan_decode_block(height, &buf, fpos, blocks.pos);
 		height++;
 
-		if ((height % 10000 == 0) && (!opt_quiet))
-			fprintf(stderr, "Scanned %u transactions at height %u\n",
-				bitc_hashtab_size(tx_idx),
-				height);
+		scan_progress(height);
 	}
 
-	block_fd = -1;
-
-	if (!read_ok) {
+	if (blocks.error) {
 		fprintf(stderr, "block read %s failed\n", blocks_fn);
 		exit(1);
 	}
 
-	close(fd);
-	free(msg.data);
+	blkfile_close(&blocks);
 
 	if (!opt_quiet) {
 		fprintf(stderr, "Scanned to height %u\n", height);
@@ -454,14 +836,28 @@ int main (int argc, char *argv[])
 		return 1;
 	}
 
+	log_state = calloc(1, sizeof(struct logging));
+	log_state->stream = stderr;
+
 	bitc_keyset_init(&bitc_ks);
 
-	tx_idx = bitc_hashtab_new_ext(bu256_hash, bu256_equal_,
-				    bu256_freep, free);
+	/* kept only if asked for; the blocks may well be read-only */
+	if (txindex_fn) {
+		if (!txindex_open(&txidx, txindex_fn, false))
+			return 1;
+	} else {
+		txindex_fn = "(temporary)";
+		if (!txindex_open_temp(&txidx))
+			return 1;
+	}
 
 	load_addresses();
 	scan_blocks();
 
+	txindex_close(&txidx);
+	bitc_keyset_free(&bitc_ks);
+	free(log_state);
+
 	return 0;
 }
 
@@ -98,32 +98,35 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-static int block_fd = -1;
-
-static bool match_op_pos(parr *script, enum opcodetype opcode,
+/* opcode at position pos in the script, if it gets that far */
+static bool match_op_pos(const cstring *script, enum opcodetype opcode,
 			 unsigned int pos)
 {
-	if (pos >= script->len)
-		return false;
+	struct const_buffer buf = { script->str, script->len };
+	struct bscript_parser bp;
+	struct bscript_op op;
+	unsigned int i;
+
+	bsp_start(&bp, &buf);
+	for (i = 0; i <= pos; i++)
+		if (!bsp_getop(&op, &bp))
+			return false;
 
-	struct bscript_op *op = parr_idx(script, pos);
-	return (op->op == opcode);
+	return (op.op == opcode);
 }
 
 static void scan_txout(struct bitc_txout *txout)
 {
 	incstat(STA_TXOUT);
 
-	parr *script = bsp_parse_all(txout->scriptPubKey->str,
-					  txout->scriptPubKey->len);
-	if (!script) {
+	struct bscript_tmpl tmpl;
+	if (!bsp_tmpl_match(&tmpl, txout->scriptPubKey->str,
+			    txout->scriptPubKey->len)) {
 		fprintf(stderr, "error at txout %lu\n", getstat(STA_TXOUT)-1);
 		return;
 	}
 
-	enum txnouttype outtype = bsp_classify(script);
-
-	switch (outtype) {
+	switch (tmpl.txtype) {
 	case TX_PUBKEY:
 		incstat(STA_PUBKEY);
 		break;
@@ -137,17 +140,15 @@ static void scan_txout(struct bitc_txout *txout)
 		incstat(STA_MULTISIG);
 		break;
 	default: {
-		if (match_op_pos(script, OP_RETURN, 0))
+		if (match_op_pos(txout->scriptPubKey, OP_RETURN, 0))
 			incstat(STA_OP_RETURN);
-		else if (match_op_pos(script, OP_DROP, 1))
+		else if (match_op_pos(txout->scriptPubKey, OP_DROP, 1))
 			incstat(STA_OP_DROP);
 		else
 			incstat(STA_UNKNOWN);
 		break;
 	 }
 	}
-
-	parr_free(script, true);
 }
 
 static void scan_tx(struct bitc_tx *tx)
@@ -178,14 +179,12 @@ static void scan_block(struct bitc_block *block)
 	incstat(STA_BLOCK);
 }
 
-static void scan_decode_block(struct p2p_message *msg, uint64_t *fpos)
+static void scan_decode_block(struct const_buffer *buf)
 {
 	struct bitc_block block;
 	bitc_block_init(&block);
 
-	struct const_buffer buf = { msg->data, msg->hdr.data_len };
-
-	bool rc = deser_bitc_block(&block, &buf);
+	bool rc = deser_bitc_block(&block, buf);
 	if (!rc) {
 		fprintf(stderr, "block deser failed at block %lu\n",
 			getstat(STA_BLOCK));
@@ -194,44 +193,34 @@ static void scan_decode_block(struct p2p_message *msg, uint64_t *fpos)
 
 	scan_block(&block);
 
-	uint64_t pos_tmp = msg->hdr.data_len;
-	*fpos += (pos_tmp + 8);
-
 	bitc_block_free(&block);
 }
 
 static void scan_blocks(void)
 {
-	int fd = file_seq_open(blocks_fn);
-	if (fd < 0) {
+	struct blkfile bf;
+
+	if (!blkfile_open(&bf, blocks_fn)) {
 		perror(blocks_fn);
 		exit(1);
 	}
 
-	struct p2p_message msg = {};
-	bool read_ok = false;
-
-	uint64_t fpos = 0;
+	struct const_buffer buf;
 
-	block_fd = fd;
-
-	while (fread_block(fd, &msg, &read_ok)) {
-		scan_decode_block(&msg, &fpos);
+	while (blkfile_next(&bf, &buf, NULL)) {
+		scan_decode_block(&buf);
 
 		if ((getstat(STA_BLOCK) % 10000 == 0) && (!opt_quiet))
 			fprintf(stderr, "Scanned block %lu\n",
 				getstat(STA_BLOCK));
 	}
 
-	block_fd = -1;
-
-	if (!read_ok) {
+	if (bf.error) {
 		fprintf(stderr, "block read %s failed\n", blocks_fn);
 		exit(1);
 	}
 
-	close(fd);
-	free(msg.data);
+	blkfile_close(&bf);
 }
 
 static void show_report(void)
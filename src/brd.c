@@ -5,8 +5,10 @@
 #include "libbitc-config.h"           // for VERSION, _LARGE_FILES, etc
 
 #include "brd.h"
+#include <bitc/db/addrindex.h>         // for addrindex, addrindex_add_block, etc
 #include <bitc/db/chaindb.h>           // for blkinfo, blkdb, etc
 #include <bitc/db/db.h>                // for blockdb_init, db_close, etc
+#include <bitc/db/txindex.h>           // for txindex, txindex_add_block, etc
 #include <bitc/buffer.h>               // for const_buffer, buffer_copy, etc
 #include <bitc/clist.h>                // for clist_length
 #include <bitc/core.h>                 // for bitc_block, bitc_utxo, bitc_tx, etc
@@ -16,11 +18,16 @@
 #include <bitc/hexcode.h>              // for decode_hex
 #include <bitc/log.h>                  // for log_info, logging, etc
 #include <bitc/mbr.h>                  // for fread_message
+#include <bitc/mempool.h>              // for bitc_mempool_add, etc
 #include <bitc/message.h>              // for p2p_message, etc
+#include <bitc/net/capture.h>          // for nc_replay, nc_capture_open, etc
+#include <bitc/net/msgbuf.h>           // for nc_msgbuf_pool_trim
+#include <bitc/net/dns.h>              // for bu_dns_seeder_start
 #include <bitc/net/net.h>              // for net_child_info, nc_conns_gc, etc
 #include <bitc/net/peerman.h>          // for peer_manager, peerman_write, etc
 #include <bitc/parr.h>                 // for parr, parr_idx, parr_free, etc
 #include <bitc/script.h>               // for bitc_verify_sig
+#include <bitc/txcache.h>              // for bitc_txcache_init, etc
 #include <bitc/util.h>                 // for ARRAY_SIZE, czstr_equal, etc
 
 #include <event.h>                     // for event_base_dispatch, etc
@@ -36,12 +43,8 @@
 #include <stdlib.h>                     // for exit, free, calloc
 #include <string.h>                     // for strcmp, strlen, strdup, etc
 #include <sys/uio.h>                    // for iovec, writev
-#include <unistd.h>                     // for for access, F_OK
-
-#if defined(__GNUC__)
-/* For add_orphan */
-# pragma GCC diagnostic ignored "-Wunused-function"
-#endif
+#include <time.h>                       // for clock_gettime
+#include <unistd.h>                     // for for access, F_OK, sysconf
 
 const char *prog_name = "brd";
 struct bitc_hashtab *settings;
@@ -53,11 +56,48 @@ bool debugging = false;
 
 static char *peer_filename = NULL;
 static struct chaindb db;
-static struct bitc_hashtab *orphans;
+
+/* blocks whose parent has not arrived yet */
+struct orphan_blk {
+	bu256_t			hash;
+	bu256_t			prev_hash;
+	struct buffer		*buf;		/* serialized block */
+
+	/* arrival order */
+	struct orphan_blk	*older;
+	struct orphan_blk	*newer;
+};
+
+enum {
+	ORPHAN_DEF_MAX_BYTES	= 32 * 1024 * 1024,
+};
+
+static struct orphan_pool {
+	struct bitc_hashtab	*map;		/* of hash -> orphan_blk */
+	struct bitc_hashtab	*by_prev;	/* of prev hash -> parr */
+	struct orphan_blk	*oldest;
+	struct orphan_blk	*newest;
+
+	size_t			bytes;
+	size_t			max_bytes;
+
+	unsigned long		n_hits;		/* connected via parent */
+	unsigned long		n_evicted;
+} orphans;
 static struct bitc_utxo_set uset;
+static struct bitc_txcache txcache;
+static struct bitc_mempool mempool;
 static bool script_verf = false;
 static unsigned int net_conn_timeout = 11;
 struct net_child_info global_nci;
+static struct nc_replay replay;
+static bool replaying = false;
+static struct txindex txidx;
+static bool txindex_on = false;
+static struct addrindex addridx;
+static struct addrindex_builder *addridx_build;
+static bool addrindex_on = false;
+static volatile sig_atomic_t stats_requested = 0;
 
 static const char *const_settings[] = {
 	"net.connect.timeout=11",
@@ -65,9 +105,11 @@ static const char *const_settings[] = {
 	"log=-", /* "log=brd.log", */
 };
 
-static bool block_process(const struct bitc_block *block);
+static bool block_process(const struct bitc_block *block,
+			  const struct const_buffer *buf);
 static bool have_orphan(const bu256_t *v);
-static bool add_orphan(const bu256_t *hash_in, struct const_buffer *buf_in);
+static bool add_orphan(const bu256_t *hash_in, const bu256_t *prev_hash,
+		       struct const_buffer *buf_in);
 
 static bool parse_kvstr(const char *s, char **key, char **value)
 {
@@ -353,7 +395,8 @@ static bool spend_block(struct bitc_utxo_set *uset, const struct bitc_block *blo
 	return true;
 }
 
-static bool block_process(const struct bitc_block *block)
+static bool block_process(const struct bitc_block *block,
+			  const struct const_buffer *buf)
 {
 	struct blkinfo *bi = bi_new();
 	bu256_copy(&bi->hash, &block->sha256);
@@ -382,6 +425,28 @@ static bool block_process(const struct bitc_block *block)
 			/* FIXME: bad record is now in chaindb */
 			goto err_out;
 		}
+
+		if (global_nci.mempool)
+			bitc_mempool_remove_block(global_nci.mempool, block);
+
+		/* by height; blocks already indexed are skipped */
+		if (txindex_on &&
+		    !txindex_add_block(&txidx, bi->height, bi->height + 1, buf)) {
+			log_error("%s: txindex update failed at height %u",
+				  prog_name, bi->height);
+		}
+
+		/* stored blocks go to the builder, new ones one by one */
+		if (addridx_build) {
+			if (!addrindex_build_push(addridx_build, bi->height, buf)) {
+				log_error("%s: addrindex build failed at height %u",
+					  prog_name, bi->height);
+			}
+		} else if (addrindex_on &&
+			   !addrindex_add_block(&addridx, bi->height, block)) {
+			log_error("%s: addrindex update failed at height %u",
+				  prog_name, bi->height);
+		}
 	}
 
 	return true;
@@ -412,47 +477,187 @@ static bool read_block(void *p, size_t len)
 	/* used at runtime */
 	bool		sha256_valid;
 	bu256_t		sha256;
-	rc = block_process(&block);
+	struct const_buffer ser = { p, len };
+	rc = block_process(&block, &ser);
 
 out:
 	bitc_block_free(&block);
 	return rc;
 }
 
+static void parr_freep(void *pa)
+{
+	parr_free(pa, true);
+}
+
 static void init_orphans(void)
 {
-	orphans = bitc_hashtab_new_ext(bu256_hash, bu256_equal_,
-				     bu256_freep, buffer_freep);
+	orphans.map = bitc_hashtab_new(bu256_hash, bu256_equal_);
+	orphans.by_prev = bitc_hashtab_new_ext(bu256_hash, bu256_equal_,
+					       bu256_freep, parr_freep);
+
+	char *max_str = setting("orphan.max_bytes");
+	orphans.max_bytes = max_str ? strtoull(max_str, NULL, 10) :
+				      ORPHAN_DEF_MAX_BYTES;
 }
 
 static bool have_orphan(const bu256_t *v)
 {
-	return bitc_hashtab_get(orphans, v);
+	return bitc_hashtab_get(orphans.map, v);
+}
+
+/* detach orphan from every index; caller frees it */
+static void orphan_unlink(struct orphan_blk *o)
+{
+	parr *siblings = bitc_hashtab_get(orphans.by_prev, &o->prev_hash);
+	if (siblings) {
+		parr_remove(siblings, o);
+		if (!siblings->len)
+			bitc_hashtab_del(orphans.by_prev, &o->prev_hash);
+	}
+
+	if (o->older)
+		o->older->newer = o->newer;
+	else
+		orphans.oldest = o->newer;
+	if (o->newer)
+		o->newer->older = o->older;
+	else
+		orphans.newest = o->older;
+
+	bitc_hashtab_del(orphans.map, &o->hash);
+	orphans.bytes -= o->buf->len;
+}
+
+static void orphan_free(struct orphan_blk *o)
+{
+	buffer_freep(o->buf);
+	free(o);
 }
 
-static bool add_orphan(const bu256_t *hash_in, struct const_buffer *buf_in)
+static void free_orphans(void)
 {
-	if (have_orphan(hash_in))
+	while (orphans.oldest) {
+		struct orphan_blk *o = orphans.oldest;
+		orphan_unlink(o);
+		orphan_free(o);
+	}
+
+	bitc_hashtab_unref(orphans.map);
+	bitc_hashtab_unref(orphans.by_prev);
+}
+
+static bool add_orphan(const bu256_t *hash_in, const bu256_t *prev_hash,
+		       struct const_buffer *buf_in)
+{
+	if (have_orphan(hash_in) || (buf_in->len > orphans.max_bytes))
 		return false;
 
-	bu256_t *hash = bu256_new(hash_in);
-	if (!hash) {
+	struct orphan_blk *o = calloc(1, sizeof(*o));
+	if (!o) {
 		log_info("%s: OOM", prog_name);
 		return false;
 	}
 
-	struct buffer *buf = buffer_copy(buf_in->p, buf_in->len);
-	if (!buf) {
-		bu256_freep(hash);
+	o->buf = buffer_copy(buf_in->p, buf_in->len);
+	if (!o->buf) {
+		free(o);
 		log_info("%s: OOM", prog_name);
 		return false;
 	}
 
-	bitc_hashtab_put(orphans, hash, buf);
+	bu256_copy(&o->hash, hash_in);
+	bu256_copy(&o->prev_hash, prev_hash);
+
+	parr *siblings = bitc_hashtab_get(orphans.by_prev, prev_hash);
+	if (!siblings) {
+		siblings = parr_new(1, NULL);
+		bitc_hashtab_put(orphans.by_prev, bu256_new(prev_hash),
+				 siblings);
+	}
+	parr_add(siblings, o);
+
+	bitc_hashtab_put(orphans.map, &o->hash, o);
+
+	o->older = orphans.newest;
+	if (orphans.newest)
+		orphans.newest->newer = o;
+	else
+		orphans.oldest = o;
+	orphans.newest = o;
+
+	orphans.bytes += o->buf->len;
+
+	/* stay within budget, dropping the oldest first */
+	while (orphans.bytes > orphans.max_bytes) {
+		struct orphan_blk *old = orphans.oldest;
+		char hexstr[BU256_STRSZ];
+		bu256_hex(hexstr, &old->hash);
+		log_debug("%s: evicting orphan %s", prog_name, hexstr);
+
+		orphan_unlink(old);
+		orphan_free(old);
+		orphans.n_evicted++;
+	}
 
 	return true;
 }
 
+/* store and process an orphan whose parent is now known */
+static bool orphan_connect(struct orphan_blk *o)
+{
+	struct bitc_block block;
+	bitc_block_init(&block);
+
+	bool rc = false;
+	struct const_buffer buf = { o->buf->p, o->buf->len };
+
+	/* validated on receipt */
+	if (!deser_bitc_block(&block, &buf))
+		goto out;
+	bitc_block_calc_sha256(&block);
+
+	struct const_buffer ser = { o->buf->p, o->buf->len };
+	blockdb_add(&block.sha256, &ser);
+
+	rc = block_process(&block, &ser);
+
+out:
+	bitc_block_free(&block);
+	return rc;
+}
+
+/* connect every orphan descending from the newly accepted parent */
+static void connect_orphans(const bu256_t *parent)
+{
+	if (!orphans.oldest)
+		return;
+
+	parr *queue = parr_new(0, bu256_freep);
+	parr_add(queue, bu256_new(parent));
+
+	unsigned int i;
+	for (i = 0; i < queue->len; i++) {
+		const bu256_t *hash = parr_idx(queue, i);
+		parr *children;
+
+		while ((children = bitc_hashtab_get(orphans.by_prev,
+						     hash)) != NULL) {
+			struct orphan_blk *o = parr_idx(children, 0);
+			orphan_unlink(o);
+
+			if (orphan_connect(o)) {
+				orphans.n_hits++;
+				parr_add(queue, bu256_new(&o->hash));
+			}
+
+			orphan_free(o);
+		}
+	}
+
+	parr_free(queue, true);
+}
+
 static void init_peers(struct net_child_info *nci)
 {
 	/*
@@ -460,27 +665,35 @@ static void init_peers(struct net_child_info *nci)
 	 */
 	struct peer_manager *peers;
 
+	/* replayed peers only; leave the peers file alone */
+	if (replaying) {
+		nci->peers = peerman_seed(false);
+		return;
+	}
+
 	peers = peerman_read(peer_filename);
 	if (!peers) {
 		log_info("%s: initializing empty peer list", prog_name);
 
-		peers = peerman_seed(setting("no_dns") == NULL ? true : false);
+		peers = peerman_seed(false);
 		if (!peerman_write(peers, peer_filename, chain)) {
 			log_info("%s: failed to write peer list", prog_name);
 			exit(1);
 		}
+
+		/* seeds resolve in the background; dialing starts at once */
+		if (!setting("no_dns"))
+			nci->dns = bu_dns_seeder_start();
 	}
 
 	char *addnode = setting("addnode");
 	if (addnode)
 		peerman_addstr(peers, addnode);
 
-	peerman_sort(peers);
-
-	log_debug("%s: have %u/%zu peers",
+	log_debug("%s: have %zu/%zu peers (new/tried)",
 		prog_name,
-		bitc_hashtab_size(peers->map_addr),
-		clist_length(peers->addrlist));
+		peers->new_tab.ids->len,
+		peers->tried_tab.ids->len);
 
 	nci->peers = peers;
 }
@@ -493,18 +706,74 @@ static bool inv_block_process(bu256_t *hash)
 
 static bool add_block(struct bitc_block *block, struct const_buffer *buf)
 {
-    /* check for duplicate block */
-    if (chaindb_lookup(&db, &block->sha256) ||
-        have_orphan(&block->sha256))
-        return true;
+	/* check for duplicate block */
+	if (chaindb_lookup(&db, &block->sha256) ||
+	    have_orphan(&block->sha256))
+		return true;
+
+	/* hold until its parent arrives */
+	if (!chaindb_lookup(&db, &block->hashPrevBlock)) {
+		add_orphan(&block->sha256, &block->hashPrevBlock, buf);
+		return true;
+	}
 
 	blockdb_add(&block->sha256, buf);
-    /* process block */
-    if (!block_process(block))
-        return false;
 
-    return true;
+	/* process block */
+	if (!block_process(block, buf))
+		return false;
+
+	connect_orphans(&block->sha256);
+
+	/* stored blocks are replayed in batches at startup; new ones not */
+	if (txindex_on)
+		txindex_sync(&txidx);
+	if (addrindex_on)
+		addrindex_sync(&addridx);
 
+	return true;
+}
+
+/* policy flags for loose transactions, stricter than for blocks */
+static const unsigned int mempool_script_flags =
+	SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG |
+	SCRIPT_VERIFY_LOW_S | SCRIPT_VERIFY_NULLDUMMY |
+	SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY | SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+
+/* median of the last 11 block times, up to height on the best chain */
+static int64_t chain_median_time(unsigned int height)
+{
+	struct blkinfo *bi = db.best_chain;
+	uint32_t times[11];
+	unsigned int n = 0, i;
+
+	while (bi && (bi->height > (int) height))
+		bi = bi->prev;
+
+	for (; bi && (n < ARRAY_SIZE(times)); bi = bi->prev) {
+		uint32_t t = bi->hdr.nTime;
+
+		for (i = n++; (i > 0) && (times[i - 1] > t); i--)
+			times[i] = times[i - 1];
+		times[i] = t;
+	}
+
+	return n ? times[n / 2] : 0;
+}
+
+static bool tx_process(const struct bitc_tx *tx)
+{
+	unsigned int height = db.best_chain ? db.best_chain->height + 1 : 0;
+
+	enum mempool_result res = bitc_mempool_add(&mempool, &uset, tx, height,
+						   mempool_script_flags);
+	if (res != MP_OK) {
+		log_debug("%s: tx rejected: %s", prog_name,
+			  mempool_result_str(res));
+		return false;
+	}
+
+	return true;
 }
 
 static void init_nci(struct net_child_info *nci)
@@ -522,6 +791,148 @@ static void init_nci(struct net_child_info *nci)
         nci->chain = chain;
         nci->instance_nonce = &instance_nonce;
 	nci->running = true;
+
+	/* connection limit, and optional event-loop threads for peer I/O */
+	char *max_conns_str = setting("net.max_connections");
+	if (max_conns_str) {
+		long max_conns = strtol(max_conns_str, NULL, 10);
+		if (max_conns > 0)
+			nci->max_conns = max_conns > NC_MAX_CONN_LIMIT ?
+					 NC_MAX_CONN_LIMIT : max_conns;
+	}
+
+	/* parallel connects, and handshaked spares held in reserve */
+	nci->max_spare = NC_SPARE_CONN;
+	char *spare_str = setting("net.spare_connections");
+	if (spare_str) {
+		long n_spare = strtol(spare_str, NULL, 10);
+		if (n_spare >= 0)
+			nci->max_spare = n_spare > NC_MAX_CONN_LIMIT ?
+					 NC_MAX_CONN_LIMIT : n_spare;
+	}
+
+	char *dials_str = setting("net.max_dials");
+	if (dials_str) {
+		long max_dials = strtol(dials_str, NULL, 10);
+		if (max_dials > 0)
+			nci->max_dials = max_dials > NC_MAX_CONN_LIMIT ?
+					 NC_MAX_CONN_LIMIT : max_dials;
+	}
+
+	char *threads_str = setting("net.threads");
+	if (threads_str) {
+		long n_threads = strtol(threads_str, NULL, 10);
+		if (n_threads > 0 && !nc_shards_start(nci, n_threads)) {
+			log_error("%s: failed to start %ld net threads",
+				  prog_name, n_threads);
+		}
+	}
+
+	/* outbound flow control */
+	char *sendq_str = setting("net.sendq_max");
+	if (sendq_str) {
+		long long sendq_max = strtoll(sendq_str, NULL, 10);
+		if (sendq_max > 0)
+			nci->sendq_max = sendq_max;
+	}
+
+	char *upload_str = setting("net.max_upload");
+	if (upload_str) {
+		long long max_upload = strtoll(upload_str, NULL, 10);
+		if (max_upload > 0)
+			nci->upload = nc_ratelimit_new(max_upload);
+	}
+
+	/* record inbound traffic, for replay */
+	char *capture_fn = setting("net.capture");
+	if (capture_fn && !replaying) {
+		nci->capture = nc_capture_open(capture_fn);
+		if (!nci->capture)
+			exit(1);
+	}
+
+	/* relayed tx cache, for compact block reconstruction */
+	if (!setting("no_cmpct") &&
+	    bitc_txcache_init(&txcache, TXCACHE_DEF_MAX_TXS,
+			      TXCACHE_DEF_MAX_BYTES))
+		nci->txcache = &txcache;
+
+	/* unconfirmed tx pool */
+	if (!setting("no_mempool") &&
+	    bitc_mempool_init(&mempool, MEMPOOL_DEF_MAX_BYTES)) {
+		mempool.median_time = chain_median_time;
+		nci->mempool = &mempool;
+		nci->tx_process = tx_process;
+	}
+}
+
+/* txid -> (height, offset, length) */
+static void init_txindex(void)
+{
+	char *fn = setting("txindex");
+	if (!fn)
+		return;
+
+	char fn_tmp[strlen(chain->name) + 6 + 1];
+	if (!*fn) {
+		snprintf(fn_tmp, sizeof(fn_tmp), "%s.txidx", chain->name);
+		fn = fn_tmp;
+	}
+
+	if (!txindex_open(&txidx, fn, false)) {
+		log_error("%s: txindex initialisation failed", prog_name);
+		exit(1);
+	}
+	txindex_on = true;
+}
+
+/* script hash -> funding and spending history */
+static void init_addrindex(void)
+{
+	char *fn = setting("addrindex");
+	if (!fn)
+		return;
+
+	char fn_tmp[strlen(chain->name) + 8 + 1];
+	if (!*fn) {
+		snprintf(fn_tmp, sizeof(fn_tmp), "%s.addridx", chain->name);
+		fn = fn_tmp;
+	}
+
+	if (!addrindex_open(&addridx, fn, false)) {
+		log_error("%s: addrindex initialisation failed", prog_name);
+		exit(1);
+	}
+
+	char *threads_str = setting("addrindex.threads");
+	long n_threads = threads_str ? strtol(threads_str, NULL, 10) :
+			 sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads < 1)
+		n_threads = 1;
+
+	addridx_build = addrindex_build_new(&addridx, n_threads);
+	if (!addridx_build) {
+		log_error("%s: addrindex initialisation failed", prog_name);
+		exit(1);
+	}
+}
+
+/* the stored chain is in; from here on, blocks are indexed as they come */
+static void init_addrindex_done(void)
+{
+	if (!addridx_build)
+		return;
+
+	bool rc = addrindex_build_finish(addridx_build);
+	addridx_build = NULL;
+	if (!rc) {
+		log_error("%s: addrindex build failed", prog_name);
+		exit(1);
+	}
+
+	log_info("%s: addrindex at height %u", prog_name,
+		 addridx.next_height);
+	addrindex_on = true;
 }
 
 static void init_daemon(struct net_child_info *nci)
@@ -530,16 +941,72 @@ static void init_daemon(struct net_child_info *nci)
 	bitc_utxo_set_init(&uset);
 	init_block0();
 	init_orphans();
+	init_txindex();
+	init_addrindex();
 	blockheightdb_getall(read_block);
+	init_addrindex_done();
 	init_nci(nci);
 }
 
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* feed a capture file through the net engine, then report the rate */
+static void run_replay(struct net_child_info *nci)
+{
+	char *speed_str = setting("replay.speed");
+	double speed = speed_str ? strtod(speed_str, NULL) : 0.0;
+	int start_height = db.best_chain ? db.best_chain->height : -1;
+	double t_start = now_secs();
+
+	if (!nc_replay_start(&replay, nci, setting("replay"), speed))
+		exit(1);
+
+	do {
+		nc_conns_process(nci);
+		if (nc_replay_done(&replay) && (nci->conns->len == 0))
+			break;
+		event_base_dispatch(nci->eb);
+	} while (nci->running);
+
+	double secs = now_secs() - t_start;
+	int height = db.best_chain ? db.best_chain->height : -1;
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	log_info("%s: replay: %llu messages, %.1f MB in %.2f sec "
+		 "(%.0f msg/sec, %.2f MB/sec), height %d -> %d",
+		 prog_name,
+		 (unsigned long long) replay.n_msgs,
+		 replay.n_bytes / 1e6, secs,
+		 replay.n_msgs / secs, replay.n_bytes / 1e6 / secs,
+		 start_height, height);
+
+	nc_replay_free(&replay);
+}
+
 static void run_daemon(struct net_child_info *nci)
 {
+	if (replaying) {
+		run_replay(nci);
+		return;
+	}
+
 	/* main loop */
 	do {
 		nc_conns_process(nci);
 		event_base_dispatch(nci->eb);
+
+		if (stats_requested) {
+			stats_requested = 0;
+			nc_stats_log(nci);
+		}
 	} while (nci->running);
 }
 
@@ -550,16 +1017,37 @@ static void shutdown_nci(struct net_child_info *nci)
 	assert(nci->conns->len == 0);
 	parr_free(nci->conns, true);
 	event_base_free(nci->eb);
+	bitc_txcache_free(nci->txcache);
+	bitc_mempool_free(nci->mempool);
+	nc_msgbuf_pool_trim();
 }
 
 static void shutdown_daemon(struct net_child_info *nci)
 {
-	bool rc = peerman_write(nci->peers, peer_filename, chain);
-	log_info("%s: %s %u/%zu peers", prog_name,
-		rc ? "wrote" : "failed to write",
-		bitc_hashtab_size(nci->peers->map_addr),
-		clist_length(nci->peers->addrlist));
+	nc_shards_stop(nci);
+
+	/* no I/O threads left to write to it */
+	nc_capture_close(nci->capture);
+	nci->capture = NULL;
+
+	if (!replaying) {
+		bool rc = peerman_write(nci->peers, peer_filename, chain);
+		log_info("%s: %s %zu/%zu peers (new/tried)", prog_name,
+			rc ? "wrote" : "failed to write",
+			nci->peers->new_tab.ids->len,
+			nci->peers->tried_tab.ids->len);
+	}
+
+	log_info("%s: orphans: %u held, %lu connected, %lu evicted",
+		prog_name, bitc_hashtab_size(orphans.map),
+		orphans.n_hits, orphans.n_evicted);
 
+	nc_stats_log(nci);
+	nc_ratelimit_free(nci->upload);
+	nci->upload = NULL;
+
+	txindex_close(&txidx);
+	addrindex_close(&addridx);
 	db_close();
 
 	if (log_state->logtofile) {
@@ -570,7 +1058,7 @@ static void shutdown_daemon(struct net_child_info *nci)
 
 	if (setting("free")) {
 		shutdown_nci(nci);
-		bitc_hashtab_unref(orphans);
+		free_orphans();
 		bitc_hashtab_unref(settings);
 		chaindb_free(&db);
 		bitc_utxo_set_free(&uset);
@@ -583,6 +1071,13 @@ static void term_signal(int signo)
 	event_base_loopbreak(global_nci.eb);
 }
 
+/* traffic counters to the log, from the main loop */
+static void stats_signal(int signo)
+{
+	stats_requested = 1;
+	event_base_loopbreak(global_nci.eb);
+}
+
 int main (int argc, char *argv[])
 {
 	settings = bitc_hashtab_new_ext(czstr_hash, czstr_equal,
@@ -605,6 +1100,7 @@ int main (int argc, char *argv[])
 
 	init_log();
 	chain_set();
+	replaying = (setting("replay") != NULL);
 
 	char peer_filename_tmp[strlen(chain->name) + 6 + 1];
 	snprintf(peer_filename_tmp, sizeof(peer_filename_tmp), "%s.peers", chain->name);
@@ -617,6 +1113,7 @@ int main (int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGINT, term_signal);
 	signal(SIGTERM, term_signal);
+	signal(SIGUSR1, stats_signal);
 
 	init_daemon(&global_nci);
 	run_daemon(&global_nci);
@@ -4,7 +4,7 @@
  */
 #include "libbitc-config.h"             // for PACKAGE_VERSION
 
-#include <bitc/base58.h>                // for base58_decode_check
+#include <bitc/base58.h>                // for base58_decode_check, etc
 #include <bitc/buffer.h>                // for const_buffer
 #include <bitc/buint.h>                 // for bu256_copy, bu256_hex, etc
 #include <bitc/clist.h>                 // for clist, clist_append
@@ -162,10 +162,11 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		memcpy(addrstr, arg, partlen);
 		addrstr[partlen] = 0;
 
-		cstring *payload = base58_decode_check(NULL, addrstr);
-		bool payload_invalid = (!payload || (payload->len != 21));
-		cstr_free(payload, true);
-		if (payload_invalid)
+		unsigned char payload[BASE58_ADDR_LEN];
+		size_t payload_len;
+		if (!base58_decode_check_buf(NULL, payload, sizeof(payload),
+					     &payload_len, addrstr) ||
+		    (payload_len != BASE58_ADDR_LEN))
 			return ARGP_ERR_UNKNOWN;
 
 		opt_txout = clist_append(opt_txout, strdup(arg));
@@ -13,9 +13,14 @@
 #include <bitc/coredefs.h>              // for chain_info
 #include <bitc/crypto/aes_util.h>       // for read_aes_file, etc
 #include <bitc/crypto/prng.h>           // for prng_get_random_bytes
+#include <bitc/db/db.h>                 // for blockheightdb_getall_height, etc
 #include <bitc/hdkeys.h>                // for hd_extended_key_free, etc
 #include <bitc/hexcode.h>               // for encode_hex
 #include <bitc/key.h>                   // for bitc_privkey_get, etc
+#include <bitc/mbr.h>                   // for blkfile_open, blkfile_next
+#include <bitc/util.h>                  // for bu_Hash
+#include <bitc/wallet/journal.h>        // for wallet_journal_open, etc
+#include <bitc/wallet/rescan.h>         // for wallet_rescan_new, etc
 #include <bitc/wallet/wallet.h>         // for wallet, wallet_free, etc
 #include <bitc/compat.h>                // for parr_new
 
@@ -24,10 +29,10 @@
 #include <assert.h>                     // for assert
 #include <fcntl.h>                      // for open
 #include <stdio.h>                      // for fprintf, printf, stderr, etc
-#include <stdlib.h>                     // for free, calloc, getenv
+#include <stdlib.h>                     // for free, calloc, getenv, atoi
 #include <string.h>                     // for strlen, memset
 #include <stdbool.h>                    // for true, bool, false
-#include <unistd.h>                     // for access, close, read, F_OK
+#include <unistd.h>                     // for access, close, sysconf, etc
 
 struct hd_extended_key_serialized {
 	uint8_t data[78 + 1];	// 78 + NUL (the latter not written)
@@ -48,6 +53,39 @@ static char *wallet_filename(void)
 	return filename;
 }
 
+/* the journal cur_wallet was loaded from, and changes go to */
+static struct wallet_journal cur_journal = { .fd = -1 };
+
+enum {
+	/* records superseded before the journal is compacted */
+	JOURNAL_SLACK		= 64,
+};
+
+static bool load_journal_rec(void *priv, const void *data, size_t len)
+{
+	struct const_buffer buf = { data, len };
+
+	return deser_wallet(priv, &buf);
+}
+
+/* a wallet file from before journals: one AES blob, replaced on store */
+static bool load_wallet_legacy(struct wallet *wlt, const char *filename,
+			       char *passphrase)
+{
+	cstring *data = read_aes_file(filename, passphrase, strlen(passphrase),
+				      100 * 1024 * 1024);
+	if (!data)
+		return false;
+
+	struct const_buffer buf = { data->str, data->len };
+	bool rc = deser_wallet(wlt, &buf);
+
+	memset(data->str, 0, data->len);
+	cstr_free(data, true);
+
+	return rc;
+}
+
 static struct wallet *load_wallet(void)
 {
 	char *passphrase = getenv("BITSY_PASSPHRASE");
@@ -62,31 +100,28 @@ static struct wallet *load_wallet(void)
 		return NULL;
 	}
 
-	cstring *data = read_aes_file(filename, passphrase, strlen(passphrase),
-				      100 * 1024 * 1024);
-	if (!data) {
-		fprintf(stderr, "wallet: missing or invalid\n");
-		return NULL;
-	}
-
 	struct wallet *wlt = calloc(1, sizeof(*wlt));
 	if (!wlt) {
 		fprintf(stderr, "wallet: failed to allocate wallet\n");
-		cstr_free(data, true);
 		return NULL;
 	}
 
 	if (!wallet_init(wlt, chain)) {
 		free(wlt);
-		cstr_free(data, true);
 		return NULL;
 	}
 
-	struct const_buffer buf = { data->str, data->len };
-
-	if (!deser_wallet(wlt, &buf)) {
-		fprintf(stderr, "wallet: deserialization failed\n");
-		goto err_out;
+	bool rc;
+	wallet_journal_free(&cur_journal);
+	if (wallet_journal_detect(filename))
+		rc = wallet_journal_open(&cur_journal, filename, passphrase,
+					 strlen(passphrase),
+					 load_journal_rec, wlt);
+	else
+		rc = load_wallet_legacy(wlt, filename, passphrase);
+	if (!rc) {
+		fprintf(stderr, "wallet: missing or invalid\n");
+		goto err_free;
 	}
 
 	if (chain != wlt->chain) {
@@ -98,12 +133,26 @@ static struct wallet *load_wallet(void)
 
 err_out:
 	fprintf(stderr, "wallet: invalid data found\n");
+err_free:
+	wallet_journal_free(&cur_journal);
 	wallet_free(wlt);
-	cstr_free(data, true);
+	free(wlt);
 	return NULL;
 }
 
-static bool store_wallet(struct wallet *wlt)
+static size_t wallet_n_records(const struct wallet *wlt)
+{
+	return 1 + wlt->keys->len + wlt->hdmaster->len +
+	       wlt->accounts->len + wlt->coins->len;
+}
+
+static bool journal_rec(void *priv, const cstring *rec)
+{
+	return wallet_journal_append(priv, rec->str, rec->len);
+}
+
+/* write the whole wallet to a new journal, replacing the file */
+static bool compact_wallet(struct wallet *wlt)
 {
 	char *passphrase = getenv("BITSY_PASSPHRASE");
 	if (!passphrase) {
@@ -115,19 +164,57 @@ static bool store_wallet(struct wallet *wlt)
 	if (!filename)
 		return false;
 
-	cstring *plaintext = ser_wallet(wlt);
-	if (!plaintext)
+	struct wallet_journal wj;
+	if (!wallet_journal_create(&wj, filename, passphrase,
+				   strlen(passphrase)))
+		return false;
+
+	if (!wallet_records(wlt, journal_rec, &wj) ||
+	    !wallet_journal_commit(&wj)) {
+		wallet_journal_free(&wj);
+		return false;
+	}
+
+	unsigned int i;
+	for (i = 0; i < wlt->coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(wlt->coins, i);
+		coin->dirty = false;
+	}
+
+	wallet_journal_free(&cur_journal);
+	cur_journal = wj;
+	return true;
+}
+
+/* append one changed record to the wallet's journal */
+static bool store_record(cstring *rec)
+{
+	if (!rec)
 		return false;
 
-	bool rc = write_aes_file(filename, passphrase, strlen(passphrase),
-				 plaintext->str, plaintext->len);
+	bool rc = (cur_journal.fd >= 0) &&
+		  wallet_journal_append(&cur_journal, rec->str, rec->len);
 
-	memset(plaintext->str, 0, plaintext->len);
-	cstr_free(plaintext, true);
+	memset(rec->str, 0, rec->len);
+	cstr_free(rec, true);
 
 	return rc;
 }
 
+/*
+ * Finish storing a change, whose records were appended if "appended":
+ * if they were not, or the journal is now mostly superseded records,
+ * the wallet is written out whole.
+ */
+static bool store_wallet(struct wallet *wlt, bool appended)
+{
+	if (appended &&
+	    (cur_journal.n_records <= 2 * wallet_n_records(wlt) + JOURNAL_SLACK))
+		return true;
+
+	return compact_wallet(wlt);
+}
+
 static bool cur_wallet_load(void)
 {
 	if (!cur_wallet)
@@ -148,8 +235,17 @@ void cur_wallet_new_address(void)
 	cstring *btc_addr;
 
 	btc_addr = wallet_new_address(wlt);
+	if (!btc_addr) {
+		fprintf(stderr, "wallet: no new address\n");
+		return;
+	}
 
-	store_wallet(wlt);
+	struct wallet_account *acct = account_byname(wlt, wlt->def_acct->str);
+	if (!store_wallet(wlt, store_record(wallet_record_account(wlt, acct)))) {
+		fprintf(stderr, "wallet: failed to store\n");
+		cstr_free(btc_addr, true);
+		return;
+	}
 
 	printf("%s\n", btc_addr->str);
 
@@ -163,6 +259,7 @@ void cur_wallet_free(void)
 
 	wallet_free(cur_wallet);
 	cur_wallet = NULL;
+	wallet_journal_free(&cur_journal);
 }
 
 static void cur_wallet_update(struct wallet *wlt)
@@ -223,7 +320,7 @@ void cur_wallet_create(void)
 		return;
 	}
 
-	if (!store_wallet(wlt)) {
+	if (!store_wallet(wlt, false)) {
 		fprintf(stderr, "wallet: failed to store %s\n", filename);
 		wallet_free(wlt);
 		free(wlt);
@@ -404,7 +501,8 @@ void cur_wallet_createAccount(const char *acct_name)
 		return;
 	}
 
-	if (!store_wallet(wlt)) {
+	struct wallet_account *acct = account_byname(wlt, acct_name);
+	if (!store_wallet(wlt, store_record(wallet_record_account(wlt, acct)))) {
 		fprintf(stderr, "wallet: failed to store\n");
 		return;
 	}
@@ -430,9 +528,163 @@ void cur_wallet_defaultAccount(const char *acct_name)
 	cstr_free(wlt->def_acct, true);
 	wlt->def_acct = cstr_new(acct_name);
 
-	if (!store_wallet(wlt)) {
+	if (!store_wallet(wlt, store_record(wallet_record_root(wlt)))) {
 		fprintf(stderr, "wallet: failed to store\n");
 		return;
 	}
 }
 
+
+static struct wallet_rescan *rescan_state;
+
+static bool rescan_read_block(int height, void *p, size_t len)
+{
+	struct const_buffer buf = { p, len };
+
+	return wallet_rescan_push(rescan_state, height, &buf);
+}
+
+/*
+ * A blocks file carries no heights: it must hold the chain in order,
+ * from genesis, each block naming the one before it.
+ */
+static bool rescan_blkfile(const char *filename)
+{
+	struct blkfile bf;
+	struct const_buffer buf;
+	uint64_t fpos;
+	bu256_t prev;
+	uint32_t height = 0;
+	bool rc = true;
+
+	if (!blkfile_open(&bf, filename)) {
+		perror(filename);
+		return false;
+	}
+
+	while (rc && blkfile_next(&bf, &buf, &fpos)) {
+		bu256_t hash;
+
+		if ((buf.len < 80) ||
+		    (height && memcmp((const char *)buf.p + 4, &prev,
+				      sizeof(prev)))) {
+			fprintf(stderr,
+				"wallet: %s is not in chain order at block %u\n",
+				filename, height);
+			rc = false;
+			break;
+		}
+
+		bu_Hash((unsigned char *)&hash, buf.p, 80);
+		if (!height && !bu256_equal(&hash, &chain_genesis)) {
+			fprintf(stderr, "wallet: %s does not start at genesis\n",
+				filename);
+			rc = false;
+			break;
+		}
+
+		rc = wallet_rescan_push(rescan_state, height++, &buf);
+		prev = hash;
+	}
+
+	if (bf.error) {
+		fprintf(stderr, "wallet: block read %s failed\n", filename);
+		rc = false;
+	}
+
+	blkfile_close(&bf);
+	return rc;
+}
+
+/* blocks stored by brd, in height order */
+static bool rescan_blockdb(void)
+{
+	if (!metadb_init(chain->netmagic, &chain_genesis) ||
+	    !blockdb_init() ||
+	    !blockheightdb_init()) {
+		fprintf(stderr, "wallet: cannot open block database\n");
+		return false;
+	}
+
+	bool rc = blockheightdb_getall_height(rescan_read_block);
+
+	db_close();
+	return rc;
+}
+
+void cur_wallet_rescan(void)
+{
+	if (!cur_wallet_load())
+		return;
+	struct wallet *wlt = cur_wallet;
+
+	char *threads_str = setting("rescan.threads");
+	long n_threads = threads_str ? atol(threads_str) :
+				       sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_threads < 1)
+		n_threads = 1;
+
+	char *gap_str = setting("rescan.gap");
+	int gap = atoi(gap_str ? gap_str : "0");
+	if (gap < 1)
+		gap = RESCAN_GAP_LIMIT;
+
+	rescan_state = wallet_rescan_new(wlt, gap, n_threads);
+	if (!rescan_state) {
+		fprintf(stderr, "wallet: rescan setup failed\n");
+		return;
+	}
+
+	char *blocks_fn = setting("blocks");
+	bool rc = blocks_fn ? rescan_blkfile(blocks_fn) : rescan_blockdb();
+
+	struct wallet_rescan_stats stats;
+	if (!wallet_rescan_finish(rescan_state, &stats))
+		rc = false;
+	rescan_state = NULL;
+
+	if (!rc) {
+		fprintf(stderr, "wallet: rescan failed\n");
+		return;
+	}
+
+	/* accounts moved on, coins found or spent */
+	bool appended = true;
+	unsigned int i;
+	for (i = 0; appended && (i < wlt->accounts->len); i++) {
+		struct wallet_account *acct = parr_idx(wlt->accounts, i);
+		appended = store_record(wallet_record_account(wlt, acct));
+	}
+	for (i = 0; appended && (i < wlt->coins->len); i++) {
+		struct wallet_coin *coin = parr_idx(wlt->coins, i);
+		if (!coin->dirty)
+			continue;
+		appended = store_record(wallet_record_coin(wlt, coin));
+		coin->dirty = !appended;
+	}
+
+	if (!store_wallet(wlt, appended)) {
+		fprintf(stderr, "wallet: failed to store\n");
+		return;
+	}
+
+	int64_t balance = 0;
+	unsigned int n_unspent = 0;
+	for (i = 0; i < wlt->coins->len; i++) {
+		struct wallet_coin *coin = parr_idx(wlt->coins, i);
+		if (coin->spent)
+			continue;
+		balance += coin->value;
+		n_unspent++;
+	}
+
+	printf("{\n");
+	printf("\t\"n_blocks\":\t%u,\n", stats.n_blocks);
+	printf("\t\"n_txs\":\t%llu,\n", (unsigned long long) stats.n_txs);
+	printf("\t\"new_coins\":\t%u,\n", stats.n_coins);
+	printf("\t\"new_spends\":\t%u,\n", stats.n_spends);
+	printf("\t\"n_coins\":\t%zu,\n", wlt->coins->len);
+	printf("\t\"n_unspent\":\t%u,\n", n_unspent);
+	printf("\t\"balance\":\t%lld\n", (long long) balance);
+	printf("}\n");
+}
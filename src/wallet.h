@@ -12,6 +12,7 @@ extern void cur_wallet_defaultAccount(const char *acct_name);
 extern void cur_wallet_info(void);
 extern void cur_wallet_dump(void);
 extern void cur_wallet_addresses(void);
+extern void cur_wallet_rescan(void);
 extern void cur_wallet_free(void);
 
 #endif /* __LIBBITC_WALLET_H___ */
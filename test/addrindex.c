@@ -0,0 +1,253 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/base58.h>                // for base58_encode_check
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/core.h>                  // for bitc_block, bitc_tx, etc
+#include <bitc/coredefs.h>              // for chain_metadata, etc
+#include <bitc/cstr.h>                  // for cstring, cstr_free, etc
+#include <bitc/db/addrindex.h>          // for addrindex, addrindex_get, etc
+#include <bitc/key.h>                   // for bitc_key_static_shutdown
+#include <bitc/log.h>                   // for logging
+#include <bitc/parr.h>                  // for parr, parr_idx, etc
+#include <bitc/script.h>                // for bsp_addr_parse, etc
+#include <bitc/util.h>                  // for bu_read_file
+#include "libtest.h"                    // for test_filename
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, bool
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+#include <unistd.h>                     // for unlink
+
+struct logging *log_state;
+
+static const char *seq_fn = "addrindex-seq.mdb";
+static const char *build_fn = "addrindex-build.mdb";
+
+enum {
+	N_BLOCKS	= 3 * ADDRINDEX_BUILD_BATCH + 5,
+};
+
+static struct bitc_tx *spend_tx(const bu256_t *prev_hash, uint32_t prev_n,
+				const struct bitc_txout *prev_out)
+{
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+	bitc_tx_init(tx);
+	tx->vin = parr_new(1, bitc_txin_freep);
+	tx->vout = parr_new(1, bitc_txout_freep);
+
+	struct bitc_txin *txin = calloc(1, sizeof(*txin));
+	bitc_txin_init(txin);
+	bu256_copy(&txin->prevout.hash, prev_hash);
+	txin->prevout.n = prev_n;
+	txin->scriptSig = cstr_new("");
+	txin->nSequence = 0xffffffffU;
+	parr_add(tx->vin, txin);
+
+	struct bitc_txout *txout = calloc(1, sizeof(*txout));
+	bitc_txout_init(txout);
+	bitc_txout_copy(txout, prev_out);
+	txout->nValue -= 1000;
+	parr_add(tx->vout, txout);
+
+	bitc_tx_calc_sha256(tx);
+	return tx;
+}
+
+/*
+ * blk120383, then a chain of blocks each spending the one output of
+ * the last, starting from the first output of its third tx
+ */
+static parr *make_blocks(void)
+{
+	char *fn = test_filename("data/blk120383.ser");
+	void *data;
+	size_t data_len;
+
+	assert(bu_read_file(fn, &data, &data_len, 1 * 1024 * 1024));
+	free(fn);
+
+	parr *blocks = parr_new(N_BLOCKS, bitc_block_freep);
+
+	/* skip the p2p message header */
+	struct const_buffer buf = { (char *) data + 24, data_len - 24 };
+	struct bitc_block *block = calloc(1, sizeof(*block));
+	bitc_block_init(block);
+	assert(deser_bitc_block(block, &buf));
+	parr_add(blocks, block);
+	free(data);
+
+	struct bitc_tx *prev = parr_idx(block->vtx, 2);
+	bitc_tx_calc_sha256(prev);
+
+	unsigned int height;
+	for (height = 1; height < N_BLOCKS; height++) {
+		struct bitc_block *next = calloc(1, sizeof(*next));
+		bitc_block_init(next);
+		bitc_block_copy_hdr(next, block);
+		next->nNonce = height;
+		next->vtx = parr_new(1, bitc_tx_freep);
+
+		struct bitc_tx *tx = spend_tx(&prev->sha256, 0,
+					      parr_idx(prev->vout, 0));
+		parr_add(next->vtx, tx);
+		parr_add(blocks, next);
+
+		prev = tx;
+	}
+
+	return blocks;
+}
+
+static void check_history(struct addrindex *ai, const bu256_t *script_hash,
+			  int64_t value0)
+{
+	struct addrindex_entry *ents;
+	size_t n, i;
+
+	assert(addrindex_get(ai, script_hash, &ents, &n));
+	assert(n == 1 + 2 * (N_BLOCKS - 1));
+
+	int64_t balance = 0;
+	for (i = 0; i < n; i++) {
+		struct addrindex_entry *ent = &ents[i];
+
+		/* by height; within one, funding sorts first */
+		assert(ent->height == (i + 1) / 2);
+		if ((i == 0) || (i % 2 == 1)) {
+			assert(ent->kind == ADDRINDEX_FUND);
+			assert(ent->n == 0);
+			assert(ent->value == value0 - 1000 * (int64_t) ent->height);
+			balance += ent->value;
+		} else {
+			/* of the output funded one block back */
+			struct addrindex_entry *fund = &ents[i == 2 ? 0 : i - 3];
+
+			assert(ent->kind == ADDRINDEX_SPEND);
+			assert(ent->n == 0);
+			assert(ent->prevout.n == 0);
+			assert(bu256_equal(&ent->prevout.hash, &fund->txid));
+			assert(ent->value == fund->value);
+			balance -= ent->value;
+		}
+	}
+
+	assert(balance == value0 - 1000 * (N_BLOCKS - 1));
+	free(ents);
+
+	bu256_t unknown;
+	memset(&unknown, 0x5a, sizeof(unknown));
+	assert(addrindex_get(ai, &unknown, &ents, &n));
+	assert(n == 0 && ents == NULL);
+}
+
+static void runtest(void)
+{
+	parr *blocks = make_blocks();
+	struct bitc_block *block0 = parr_idx(blocks, 0);
+	struct bitc_tx *tx2 = parr_idx(block0->vtx, 2);
+	struct bitc_txout *txout = parr_idx(tx2->vout, 0);
+
+	bu256_t script_hash;
+	addrindex_script_hash(&script_hash, txout->scriptPubKey->str,
+			      txout->scriptPubKey->len);
+
+	/* one block at a time */
+	struct addrindex ai;
+	unsigned int height;
+
+	unlink(seq_fn);
+	assert(addrindex_open(&ai, seq_fn, false));
+	assert(ai.next_height == 0);
+	for (height = 0; height < N_BLOCKS; height++)
+		assert(addrindex_add_block(&ai, height,
+					   parr_idx(blocks, height)));
+	assert(ai.next_height == N_BLOCKS);
+	check_history(&ai, &script_hash, txout->nValue);
+	addrindex_close(&ai);
+
+	/* resumes where it left off; no gaps */
+	assert(addrindex_open(&ai, seq_fn, false));
+	assert(ai.next_height == N_BLOCKS);
+	assert(addrindex_add_block(&ai, N_BLOCKS - 1, block0));
+	assert(!addrindex_add_block(&ai, N_BLOCKS + 1, block0));
+	check_history(&ai, &script_hash, txout->nValue);
+	addrindex_close(&ai);
+
+	/* in bulk, from serialized blocks, in two runs */
+	unsigned int split = ADDRINDEX_BUILD_BATCH + 7;
+
+	unlink(build_fn);
+	assert(addrindex_open(&ai, build_fn, false));
+
+	struct addrindex_builder *b = addrindex_build_new(&ai, 3);
+	assert(b != NULL);
+	for (height = 0; height < N_BLOCKS; height++) {
+		cstring *s = cstr_new_sz(1024);
+		ser_bitc_block(s, parr_idx(blocks, height));
+		struct const_buffer buf = { s->str, s->len };
+
+		if (height == split) {
+			assert(addrindex_build_finish(b));
+			assert(ai.next_height == split);
+			b = addrindex_build_new(&ai, 3);
+			assert(b != NULL);
+
+			/* already in */
+			struct const_buffer buf0 = { s->str, 0 };
+			assert(addrindex_build_push(b, 0, &buf0));
+		}
+
+		assert(addrindex_build_push(b, height, &buf));
+		cstr_free(s, true);
+	}
+	assert(addrindex_build_finish(b));
+	assert(ai.next_height == N_BLOCKS);
+	addrindex_close(&ai);
+
+	assert(addrindex_open(&ai, build_fn, true));
+	check_history(&ai, &script_hash, txout->nValue);
+	assert(!addrindex_add_block(&ai, N_BLOCKS, block0));
+
+	/* the same script, by address */
+	struct bscript_addr addrs;
+	assert(bsp_addr_parse(&addrs, txout->scriptPubKey->str,
+			      txout->scriptPubKey->len));
+	assert(addrs.pubhash != NULL);
+
+	const struct chain_info *chain = &chain_metadata[CHAIN_BITCOIN];
+	struct const_buffer *pkh = addrs.pubhash->data;
+	cstring *addr = base58_encode_check(chain->addr_pubkey, true,
+					    pkh->p, pkh->len);
+	bu256_t addr_hash;
+	assert(addrindex_addr_hash(&addr_hash, chain, addr->str));
+	assert(bu256_equal(&addr_hash, &script_hash));
+	assert(!addrindex_addr_hash(&addr_hash, chain, "1NotAnAddress"));
+	cstr_free(addr, true);
+	bsp_addr_free(&addrs);
+
+	addrindex_close(&ai);
+
+	unlink(seq_fn);
+	unlink(build_fn);
+	parr_free(blocks, true);
+}
+
+int main (int argc, char *argv[])
+{
+	log_state = calloc(1, sizeof(struct logging));
+
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+	log_state->debug = false;
+
+	runtest();
+
+	bitc_key_static_shutdown();
+	free(log_state);
+	return 0;
+}
@@ -0,0 +1,180 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/addrset.h>               // for bitc_addrset, etc
+#include <bitc/crypto/sha2.h>           // for sha256_Raw
+#include <bitc/key.h>                   // for bitc_keyset, etc
+#include <bitc/util.h>                  // for bu_read_file, bu_write_file
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, bool
+#include <stdint.h>                     // for uint8_t, uint32_t
+#include <stdlib.h>                     // for malloc, free
+#include <string.h>                     // for memcpy
+#include <unistd.h>                     // for unlink
+
+static const char *set_fn = "addrset-test.dat";
+static const char *bad_fn = "addrset-bad.dat";
+
+enum {
+	N_HASHES	= 20000,
+};
+
+/* hash160-like values: even ones go in the set, odd ones do not */
+static void make_hash(uint8_t *h, uint32_t i)
+{
+	uint8_t md[32];
+
+	sha256_Raw((const uint8_t *) &i, sizeof(i), md);
+	memcpy(h, md, ADDRSET_HASH_LEN);
+}
+
+static uint8_t *make_hashes(unsigned int n)
+{
+	uint8_t *hashes = malloc(n * ADDRSET_HASH_LEN);
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		make_hash(hashes + i * ADDRSET_HASH_LEN, i * 2);
+
+	return hashes;
+}
+
+static void check_set(const struct bitc_addrset *set, unsigned int n)
+{
+	uint8_t h[ADDRSET_HASH_LEN];
+	unsigned int i;
+
+	assert(set->n == n);
+	for (i = 0; i < n * 2; i++) {
+		make_hash(h, i);
+		assert(bitc_addrset_lookup(set, h) == ((i & 1) == 0));
+	}
+}
+
+static void test_build(void)
+{
+	struct bitc_addrset set;
+	uint8_t h[ADDRSET_HASH_LEN];
+
+	/* empty */
+	assert(bitc_addrset_build(&set, NULL, 0));
+	make_hash(h, 0);
+	assert(!bitc_addrset_lookup(&set, h));
+	bitc_addrset_free(&set);
+
+	/* never built */
+	bitc_addrset_init(&set);
+	assert(!bitc_addrset_lookup(&set, h));
+	assert(!bitc_addrset_write(&set, set_fn));
+	bitc_addrset_free(&set);
+
+	/* small, with duplicates */
+	uint8_t *hashes = make_hashes(3);
+	uint8_t dups[6 * ADDRSET_HASH_LEN];
+	memcpy(dups, hashes, 3 * ADDRSET_HASH_LEN);
+	memcpy(dups + 3 * ADDRSET_HASH_LEN, hashes, 3 * ADDRSET_HASH_LEN);
+	assert(bitc_addrset_build(&set, dups, 6));
+	check_set(&set, 3);
+	bitc_addrset_free(&set);
+	free(hashes);
+
+	/* large, written out and mapped back */
+	hashes = make_hashes(N_HASHES);
+	assert(bitc_addrset_build(&set, hashes, N_HASHES));
+	assert(set.bucket_bits > 0);
+	check_set(&set, N_HASHES);
+
+	unlink(set_fn);
+	assert(bitc_addrset_write(&set, set_fn));
+	bitc_addrset_free(&set);
+	free(hashes);
+
+	assert(bitc_addrset_open(&set, set_fn));
+	assert(set.mapped);
+	check_set(&set, N_HASHES);
+	bitc_addrset_free(&set);
+}
+
+static void test_bad_files(void)
+{
+	struct bitc_addrset set;
+	void *data;
+	size_t len;
+
+	assert(!bitc_addrset_open(&set, "no-such-addrset.dat"));
+
+	assert(bu_read_file(set_fn, &data, &len, 100 * 1024 * 1024));
+
+	/* truncated */
+	assert(bu_write_file(bad_fn, data, len - 1));
+	assert(!bitc_addrset_open(&set, bad_fn));
+
+	/* bad magic */
+	((uint8_t *) data)[0] ^= 1;
+	assert(bu_write_file(bad_fn, data, len));
+	assert(!bitc_addrset_open(&set, bad_fn));
+	((uint8_t *) data)[0] ^= 1;
+
+	/* a prefix table pointing past the hashes */
+	uint32_t last;
+	memcpy(&last, (uint8_t *) data + len - N_HASHES * ADDRSET_HASH_LEN -
+	       sizeof(last), sizeof(last));
+	last++;
+	memcpy((uint8_t *) data + len - N_HASHES * ADDRSET_HASH_LEN -
+	       sizeof(last), &last, sizeof(last));
+	assert(bu_write_file(bad_fn, data, len));
+	assert(!bitc_addrset_open(&set, bad_fn));
+
+	/* not a set at all */
+	assert(bu_write_file(bad_fn, "1BitcoinEaterAddressDontSendf59kuE\n", 35));
+	assert(!bitc_addrset_open(&set, bad_fn));
+
+	free(data);
+	unlink(bad_fn);
+}
+
+static void test_keyset(void)
+{
+	struct bitc_keyset ks;
+	uint8_t h[ADDRSET_HASH_LEN];
+
+	bitc_keyset_init(&ks);
+
+	/* in two lots; the second merges with the first */
+	uint8_t *hashes = make_hashes(N_HASHES);
+	assert(bitc_keyset_add_hashes(&ks, hashes, N_HASHES / 2));
+	assert(bitc_keyset_add_hashes(&ks, hashes + (N_HASHES / 2) *
+				      ADDRSET_HASH_LEN, N_HASHES / 2));
+	check_set(&ks.pubhash_set, N_HASHES);
+	free(hashes);
+
+	make_hash(h, 2);
+	assert(bitc_keyset_lookup(&ks, h, sizeof(h), true));
+	assert(!bitc_keyset_lookup(&ks, h, sizeof(h), false));
+	assert(!bitc_keyset_lookup(&ks, h, sizeof(h) - 1, true));
+	make_hash(h, 3);
+	assert(!bitc_keyset_lookup(&ks, h, sizeof(h), true));
+	bitc_keyset_free(&ks);
+
+	/* or mapped from the file */
+	bitc_keyset_init(&ks);
+	assert(bitc_keyset_open_hashes(&ks, set_fn));
+	make_hash(h, 2 * (N_HASHES - 1));
+	assert(bitc_keyset_lookup(&ks, h, sizeof(h), true));
+	bitc_keyset_free(&ks);
+}
+
+int main (int argc, char *argv[])
+{
+	test_build();
+	test_bad_files();
+	test_keyset();
+
+	unlink(set_fn);
+	bitc_key_static_shutdown();
+	return 0;
+}
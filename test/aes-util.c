@@ -6,6 +6,7 @@
 
 #include <bitc/crypto/aes_util.h>      // for read_aes_file, etc
 #include <bitc/cstr.h>
+#include <bitc/hexcode.h>              // for decode_hex
 #include <bitc/util.h>
 
 #include <assert.h>                     // for assert
@@ -195,10 +196,108 @@ static void test_decryption()
 			   (uint8_t *)s_plaintext_2, strlen(s_plaintext_2));
 }
 
+/* NIST SP 800-38A, F.5.5 CTR-AES256.Encrypt */
+static const char ctr_key[] =
+	"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4";
+static const char ctr_iv[] = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char ctr_pt[] =
+	"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+static const char ctr_ct[] =
+	"601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+	"2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6";
+
+static void test_ctr(void)
+{
+	unsigned char key[32], iv[16], pt[64], ct[64], buf[64];
+	size_t len;
+	struct aes256_ctx ctx;
+
+	assert(decode_hex(key, sizeof(key), ctr_key, &len) && len == 32);
+	assert(decode_hex(iv, sizeof(iv), ctr_iv, &len) && len == 16);
+	assert(decode_hex(pt, sizeof(pt), ctr_pt, &len) && len == 64);
+	assert(decode_hex(ct, sizeof(ct), ctr_ct, &len) && len == 64);
+
+	aes256_init(&ctx, key);
+
+	memcpy(buf, pt, sizeof(buf));
+	aes256_ctr(&ctx, iv, buf, sizeof(buf));
+	assert(!memcmp(buf, ct, sizeof(ct)));
+
+	/* a partial last block */
+	memcpy(buf, ct, sizeof(buf));
+	aes256_ctr(&ctx, iv, buf, 37);
+	assert(!memcmp(buf, pt, 37));
+	assert(!memcmp(buf + 37, ct + 37, sizeof(buf) - 37));
+
+	aes256_free(&ctx);
+}
+
+/* the two backends agree, on every length, and across counter wrap */
+static void test_backends_agree(void)
+{
+	enum { MAX_LEN = 16 * 20 + 5 };
+	unsigned char key[32], iv[16], data[MAX_LEN], sw[MAX_LEN], hw[MAX_LEN];
+	struct aes256_ctx sw_ctx, hw_ctx;
+	size_t i, len;
+
+	if (!aes_set_impl(AES_IMPL_AESNI)) {
+		fprintf(stderr, "AES-NI not available, skipped\n");
+		return;
+	}
+	assert(aes_get_impl() == AES_IMPL_AESNI);
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i * 31 + 7;
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 13 + 5;
+	memset(iv, 0xff, sizeof(iv));
+	iv[15] = 0xfd;
+
+	aes256_init(&hw_ctx, key);
+	assert(aes_set_impl(AES_IMPL_CTAES));
+	aes256_init(&sw_ctx, key);
+	assert(hw_ctx.aesni && !sw_ctx.aesni);
+
+	for (len = 0; len <= MAX_LEN; len++) {
+		memcpy(sw, data, len);
+		memcpy(hw, data, len);
+		aes256_ctr(&sw_ctx, iv, sw, len);
+		aes256_ctr(&hw_ctx, iv, hw, len);
+		assert(!memcmp(sw, hw, len));
+
+		if (len % 16)
+			continue;
+		aes256_encrypt(&sw_ctx, len / 16, sw, data);
+		aes256_encrypt(&hw_ctx, len / 16, hw, data);
+		assert(!memcmp(sw, hw, len));
+		aes256_decrypt(&hw_ctx, len / 16, hw, sw);
+		assert(!memcmp(hw, data, len));
+	}
+
+	aes256_free(&sw_ctx);
+	aes256_free(&hw_ctx);
+}
+
 int main(int argc, char **argv)
 {
-	test_encryption();
-	test_decryption();
+	static const enum aes_impl impls[] = {
+		AES_IMPL_CTAES, AES_IMPL_AESNI,
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(impls); i++) {
+		if (!aes_set_impl(impls[i])) {
+			fprintf(stderr, "AES-NI not available, skipped\n");
+			continue;
+		}
+
+		test_encryption();
+		test_decryption();
+		test_ctr();
+	}
+
+	test_backends_agree();
 
 	return 0;
 }
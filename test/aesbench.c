@@ -0,0 +1,121 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+/*
+ * AES-256 throughput of each backend: raw blocks, CTR (wallet journal
+ * records) and wallet files, which are CBC.  Each backend's output is
+ * checked against ctaes' as it goes.  "aesbench [MB]", default 1.
+ */
+
+#include <bitc/crypto/aes_util.h>       // for aes256_init, etc
+#include <bitc/cstr.h>                  // for cstring, cstr_free
+#include <bitc/util.h>                  // for ARRAY_SIZE
+
+#include <assert.h>                     // for assert
+#include <stdio.h>                      // for printf
+#include <stdlib.h>                     // for malloc, free, atoi
+#include <string.h>                     // for memcmp, memcpy
+#include <time.h>                       // for clock_gettime
+#include <unistd.h>                     // for unlink
+
+static const char *bench_fn = "aesbench.dat";
+static char pass[] = "aesbench";
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *impl, const char *what, size_t len,
+		   double secs)
+{
+	printf("%-6s %-14s %9.1f MB/s\n", impl, what,
+	       len / (1024.0 * 1024.0) / (secs > 0 ? secs : 1e-9));
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		enum aes_impl	impl;
+		const char	*name;
+	} impls[] = {
+		{ AES_IMPL_CTAES, "ctaes" },
+		{ AES_IMPL_AESNI, "aesni" },
+	};
+	size_t mb = (argc > 1) ? atoi(argv[1]) : 1;
+	size_t len = (mb ? mb : 1) * 1024 * 1024;
+	unsigned char key[32], iv[16];
+	unsigned int i;
+	size_t j;
+
+	unsigned char *data = malloc(len);
+	unsigned char *out = malloc(len);
+	unsigned char *ref_ecb = malloc(len);
+	unsigned char *ref_ctr = malloc(len);
+	assert(data && out && ref_ecb && ref_ctr);
+
+	for (j = 0; j < len; j++)
+		data[j] = j * 7 + (j >> 11);
+	for (j = 0; j < sizeof(key); j++)
+		key[j] = j * 3 + 1;
+	memset(iv, 0xa5, sizeof(iv));
+
+	for (i = 0; i < ARRAY_SIZE(impls); i++) {
+		const char *name = impls[i].name;
+		struct aes256_ctx ctx;
+		double t;
+
+		if (!aes_set_impl(impls[i].impl)) {
+			printf("%-6s not available\n", name);
+			continue;
+		}
+		aes256_init(&ctx, key);
+
+		t = now_secs();
+		aes256_encrypt(&ctx, len / 16, out, data);
+		report(name, "encrypt", len, now_secs() - t);
+		if (i == 0)
+			memcpy(ref_ecb, out, len);
+		assert(!memcmp(out, ref_ecb, len));
+
+		t = now_secs();
+		aes256_decrypt(&ctx, len / 16, out, ref_ecb);
+		report(name, "decrypt", len, now_secs() - t);
+		assert(!memcmp(out, data, len));
+
+		memcpy(out, data, len);
+		t = now_secs();
+		aes256_ctr(&ctx, iv, out, len);
+		report(name, "ctr", len, now_secs() - t);
+		if (i == 0)
+			memcpy(ref_ctr, out, len);
+		assert(!memcmp(out, ref_ctr, len));
+
+		aes256_free(&ctx);
+
+		/* key derivation included */
+		t = now_secs();
+		assert(write_aes_file(bench_fn, pass, strlen(pass), data, len));
+		report(name, "wallet write", len, now_secs() - t);
+
+		t = now_secs();
+		cstring *s = read_aes_file(bench_fn, pass, strlen(pass),
+					   len + 16);
+		report(name, "wallet read", len, now_secs() - t);
+		assert(s && (s->len == len) && !memcmp(s->str, data, len));
+		cstr_free(s, true);
+	}
+
+	unlink(bench_fn);
+	free(data);
+	free(out);
+	free(ref_ecb);
+	free(ref_ctr);
+	return 0;
+}
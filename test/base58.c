@@ -18,7 +18,7 @@
 #include <stddef.h>                     // for size_t
 #include <stdio.h>                      // for fprintf, NULL, stderr
 #include <stdlib.h>                     // for free, calloc
-#include <string.h>                     // for strcmp, memcmp, strlen
+#include <string.h>                     // for strcmp, memcmp, strlen, etc
 
 static void test_encode(const char *hexstr, const char *enc)
 {
@@ -40,6 +40,12 @@ static void test_encode(const char *hexstr, const char *enc)
 		assert(!strcmp(s->str, enc));
 	}
 
+	/* the fixed-buffer call, exactly big enough, then one short */
+	char buf[BASE58_ENCODE_SIZE(BASE58_MAX_DATA)];
+	assert(base58_encode_buf(buf, s->len + 1, raw, out_len));
+	assert(!strcmp(buf, enc));
+	assert(!base58_encode_buf(buf, s->len, raw, out_len));
+
 	free(raw);
 	cstr_free(s, true);
 }
@@ -72,6 +78,14 @@ static void test_decode(const char *hexstr, const char *base58_str)
 		assert(s->len == out_len);
 	}
 
+	unsigned char buf[BASE58_MAX_DATA];
+	size_t buf_len;
+	assert(base58_decode_buf(buf, out_len, &buf_len, base58_str));
+	assert((buf_len == out_len) && !memcmp(buf, raw, out_len));
+	if (out_len > 0)
+		assert(!base58_decode_buf(buf, out_len - 1, &buf_len,
+					  base58_str));
+
 	free(raw);
 	cstr_free(s, true);
 }
@@ -105,6 +119,15 @@ static void runtest_encdec(const char *json_base_fn)
 	cJSON_Delete(tests);
 }
 
+/* the address test vectors, for the batch calls */
+enum {
+	MAX_BATCH_ADDRS		= 64,
+};
+
+static unsigned char batch_addrs[MAX_BATCH_ADDRS][BASE58_ADDR_LEN];
+static char batch_strs[MAX_BATCH_ADDRS][BASE58_ADDR_STR_SZ];
+static unsigned int n_batch_addrs;
+
 static void test_privkey_valid_enc(const char *base58_str,
 				cstring *payload,
 				bool compress, bool is_testnet)
@@ -235,6 +258,12 @@ static void test_pubkey_valid_dec(const char *base58_str,
 	assert(payload->len == dec->len);
 	assert(memcmp(payload->str, dec->str, dec->len) == 0);
 
+	assert(n_batch_addrs < MAX_BATCH_ADDRS);
+	batch_addrs[n_batch_addrs][0] = addrtype;
+	memcpy(&batch_addrs[n_batch_addrs][1], dec->str, dec->len);
+	assert(strlen(base58_str) < BASE58_ADDR_STR_SZ);
+	strcpy(batch_strs[n_batch_addrs++], base58_str);
+
 	cstr_free(dec, true);
 	cstr_free(payload, true);
 }
@@ -300,6 +329,91 @@ static void runtest_keys_valid(const char *json_base_fn)
 	cJSON_Delete(tests);
 }
 
+static void test_batch(void)
+{
+	char strs[MAX_BATCH_ADDRS][BASE58_ADDR_STR_SZ];
+	unsigned char dec[MAX_BATCH_ADDRS * (BASE58_ADDR_LEN + 4)];
+	const char *strp[MAX_BATCH_ADDRS];
+	bool ok[MAX_BATCH_ADDRS];
+	unsigned int i, n = n_batch_addrs;
+
+	assert(n > 0);
+	for (i = 0; i < n; i++)
+		strp[i] = batch_strs[i];
+
+	/* addrtype + hash160, with checksums added */
+	assert(base58_encode_check_batch(strs[0], sizeof(strs[0]),
+					 batch_addrs, BASE58_ADDR_LEN, n));
+	for (i = 0; i < n; i++)
+		assert(!strcmp(strs[i], batch_strs[i]));
+
+	memset(dec, 0, sizeof(dec));
+	assert(base58_decode_check_batch(dec, BASE58_ADDR_LEN, strp,
+					 n, ok) == n);
+	assert(!memcmp(dec, batch_addrs, n * BASE58_ADDR_LEN));
+
+	/* the same 25 bytes, raw */
+	assert(base58_decode_batch(dec, BASE58_ADDR_LEN + 4, strp,
+				   n, ok) == n);
+	memset(strs, 0, sizeof(strs));
+	assert(base58_encode_batch(strs[0], sizeof(strs[0]),
+				   dec, BASE58_ADDR_LEN + 4, n));
+	for (i = 0; i < n; i++)
+		assert(!strcmp(strs[i], batch_strs[i]));
+
+	/* strings that don't come to data_len bytes are flagged */
+	const char *mixed[3] = { strp[0], "1111", strp[1] };
+	assert(base58_decode_check_batch(dec, BASE58_ADDR_LEN, mixed,
+					 3, ok) == 2);
+	assert(ok[0] && !ok[1] && ok[2]);
+	assert(!memcmp(dec + 2 * BASE58_ADDR_LEN, batch_addrs[1],
+		       BASE58_ADDR_LEN));
+	assert(base58_decode_batch(dec, BASE58_ADDR_LEN, strp,
+				   n, ok) == 0);
+}
+
+static void test_edges(void)
+{
+	unsigned char data[BASE58_MAX_DATA + 1];
+	cstring *s, *d;
+
+	/* surrounding whitespace is skipped, not inner */
+	d = base58_decode(" \t1z\n");
+	assert(d && (d->len == 2) && (d->str[0] == 0) && (d->str[1] == 57));
+	cstr_free(d, true);
+	d = base58_decode("  ");
+	assert(d && (d->len == 0));
+	cstr_free(d, true);
+	assert(base58_decode("1z z") == NULL);
+	assert(base58_decode("0OIl") == NULL);
+
+	/* trailing zero bytes survive the round trip */
+	static const unsigned char tz[] = { 0x00, 0x80, 0x00 };
+	s = base58_encode(tz, sizeof(tz));
+	d = base58_decode(s->str);
+	assert((d->len == sizeof(tz)) && !memcmp(d->str, tz, sizeof(tz)));
+	cstr_free(s, true);
+	cstr_free(d, true);
+
+	/* payloads up to BASE58_MAX_DATA bytes */
+	memset(data, 0xff, sizeof(data));
+	s = base58_encode(data, BASE58_MAX_DATA);
+	assert(s && (s->len < BASE58_ENCODE_SIZE(BASE58_MAX_DATA)));
+	d = base58_decode(s->str);
+	assert(d && (d->len == BASE58_MAX_DATA));
+	assert(!memcmp(d->str, data, d->len));
+	cstr_free(d, true);
+	cstr_append_c(s, 'z');
+	assert(base58_decode(s->str) == NULL);
+	cstr_free(s, true);
+
+	assert(base58_encode(data, BASE58_MAX_DATA + 1) == NULL);
+	assert(base58_encode_check(0, true, data, BASE58_MAX_DATA - 4) == NULL);
+	s = base58_encode_check(0, true, data, BASE58_MAX_DATA - 5);
+	assert(s != NULL);
+	cstr_free(s, true);
+}
+
 static void runtest_keys_invalid(const char *json_base_fn)
 {
 	char *json_fn = test_filename(json_base_fn);
@@ -347,6 +461,8 @@ int main (int argc, char *argv[])
 	runtest_encdec("data/base58_encode_decode.json");
 	runtest_keys_valid("data/base58_keys_valid.json");
 	runtest_keys_invalid("data/base58_keys_invalid.json");
+	test_batch();
+	test_edges();
 
 	bitc_key_static_shutdown();
 	return 0;
@@ -9,6 +9,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
 #include <bitc/message.h>
 #include <bitc/mbr.h>
 #include <bitc/buffer.h>
@@ -56,9 +57,81 @@ static void runtest(const char *ser_fn_base)
 	free(ser_fn);
 }
 
+/* mapped slices match what fread_block() copies out */
+static void runtest_map(const char *ser_fn_base)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	int fd = file_seq_open(ser_fn);
+	assert(fd >= 0);
+
+	struct blkfile bf;
+	assert(blkfile_open(&bf, ser_fn));
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	struct const_buffer buf;
+	uint64_t fpos, fpos_list[11];
+	unsigned int n_blocks = 0;
+
+	while (blkfile_next(&bf, &buf, &fpos)) {
+		assert(n_blocks < 11);
+		assert(fread_block(fd, &msg, &read_ok));
+		assert(buf.len == msg.hdr.data_len);
+		assert(!memcmp(buf.p, msg.data, buf.len));
+
+		handle_block(&msg);
+		fpos_list[n_blocks++] = fpos;
+	}
+
+	assert(!bf.error);
+	assert(n_blocks == 11);
+	assert(!fread_block(fd, &msg, &read_ok) && read_ok);
+
+	/* random access, by record offset */
+	blkfile_advise_random(&bf, true);
+	unsigned int i;
+	for (i = n_blocks; i-- > 0; ) {
+		assert(blkfile_at(&bf, fpos_list[i], &buf));
+		if (i + 1 < n_blocks)
+			assert(fpos_list[i] + 8 + buf.len == fpos_list[i + 1]);
+	}
+	assert(!blkfile_at(&bf, bf.len, &buf));
+	assert(!blkfile_at(&bf, bf.len - 4, &buf));
+	assert(!blkfile_at(&bf, bf.len + 100, &buf));
+	blkfile_advise_random(&bf, false);
+	assert(blkfile_at(&bf, fpos_list[0], &buf));
+
+	blkfile_close(&bf);
+	close(fd);
+	free(msg.data);
+
+	/* truncated record */
+	char tmp_fn[] = "blockfile-XXXXXX";
+	int tfd = mkstemp(tmp_fn);
+	assert(tfd >= 0);
+	unsigned char hdr[8] = { 0xf9, 0xbe, 0xb4, 0xd9, 100, 0, 0, 0 };
+	assert(write(tfd, hdr, sizeof(hdr)) == sizeof(hdr));
+	close(tfd);
+
+	assert(blkfile_open(&bf, tmp_fn));
+	assert(!blkfile_next(&bf, &buf, NULL) && bf.error);
+	blkfile_close(&bf);
+
+	/* empty file */
+	tfd = open(tmp_fn, O_WRONLY | O_TRUNC);
+	close(tfd);
+	assert(blkfile_open(&bf, tmp_fn));
+	assert(!blkfile_next(&bf, &buf, NULL) && !bf.error);
+	blkfile_close(&bf);
+
+	unlink(tmp_fn);
+	free(ser_fn);
+}
+
 int main (int argc, char *argv[])
 {
 	runtest("data/blks10.ser");
+	runtest_map("data/blks10.ser");
 
 	bitc_key_static_shutdown();
 	return 0;
@@ -0,0 +1,301 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/cmpctblock.h>            // for cmpct_partial_init, etc
+#include <bitc/core.h>                  // for bitc_block, bitc_tx, etc
+#include <bitc/crypto/siphash.h>        // for siphash24, etc
+#include <bitc/cstr.h>                  // for cstring, cstr_free
+#include <bitc/message.h>               // for msg_cmpctblock, etc
+#include <bitc/parr.h>                  // for parr_idx, parr_add, etc
+#include <bitc/txcache.h>               // for bitc_txcache_add, etc
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, false
+#include <stdint.h>                     // for uint64_t
+#include <stdio.h>                      // for fprintf, stderr
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+#include <time.h>                       // for clock_gettime
+
+enum {
+	SYNTH_BLOCK_TXS	= 4000,
+	BENCH_ROUNDS	= 200,
+};
+
+static const uint64_t sip_k0 = 0x0706050403020100ULL;
+static const uint64_t sip_k1 = 0x0F0E0D0C0B0A0908ULL;
+
+static void test_siphash(void)
+{
+	unsigned char msg[32];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(msg); i++)
+		msg[i] = i;
+
+	/* reference vectors, SipHash-2-4 paper appendix */
+	assert(siphash24(sip_k0, sip_k1, msg, 0) == 0x726fdb47dd0e0e31ULL);
+	assert(siphash24(sip_k0, sip_k1, msg, 15) == 0xa129ca6149be45e5ULL);
+	assert(siphash24(sip_k0, sip_k1, msg, 32) == 0x7127512f72f27cceULL);
+
+	assert(siphash24_u256(sip_k0, sip_k1, msg) == 0x7127512f72f27cceULL);
+
+	uint64_t out[1];
+	siphash24_u256_batch(sip_k0, sip_k1, msg, 1, out);
+	assert(out[0] == 0x7127512f72f27cceULL);
+}
+
+static struct bitc_tx *synth_tx(unsigned int n, bool coinbase)
+{
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+	bitc_tx_init(tx);
+
+	tx->vin = parr_new(1, bitc_txin_freep);
+	tx->vout = parr_new(1, bitc_txout_freep);
+
+	struct bitc_txin *txin = calloc(1, sizeof(*txin));
+	bitc_txin_init(txin);
+	if (coinbase) {
+		bu256_zero(&txin->prevout.hash);
+		txin->prevout.n = 0xffffffff;
+	} else {
+		bu256_set_u64(&txin->prevout.hash, n);
+		txin->prevout.n = n % 3;
+	}
+	txin->scriptSig = cstr_new_buf(&n, sizeof(n));
+	txin->nSequence = SEQUENCE_FINAL;
+	parr_add(tx->vin, txin);
+
+	struct bitc_txout *txout = calloc(1, sizeof(*txout));
+	bitc_txout_init(txout);
+	txout->nValue = 1000 + n;
+	txout->scriptPubKey = cstr_new_buf("\x51", 1);
+	parr_add(tx->vout, txout);
+
+	bitc_tx_calc_sha256(tx);
+	return tx;
+}
+
+static void synth_block(struct bitc_block *block, unsigned int n_tx)
+{
+	bitc_block_init(block);
+	block->nVersion = 4;
+	block->nTime = 1480000000;
+	block->nBits = 0x1d00ffff;
+	block->vtx = parr_new(n_tx, bitc_tx_freep);
+
+	unsigned int i;
+	for (i = 0; i < n_tx; i++)
+		parr_add(block->vtx, synth_tx(i, (i == 0)));
+
+	bitc_block_merkle(&block->hashMerkleRoot, block);
+	bitc_block_calc_sha256(block);
+}
+
+static void test_msg_roundtrip(struct bitc_block *block)
+{
+	struct msg_cmpctblock mcb, mcb2;
+	msg_cmpctblock_init(&mcb);
+	msg_cmpctblock_init(&mcb2);
+
+	cmpct_block_build(&mcb, block, 0x1122334455667788ULL);
+	assert(mcb.n_short_ids == block->vtx->len - 1);
+	assert(mcb.prefilled->len == 1);
+
+	cstring *s = ser_msg_cmpctblock(&mcb);
+	struct const_buffer buf = { s->str, s->len };
+	assert(deser_msg_cmpctblock(&mcb2, &buf));
+	assert(buf.len == 0);
+
+	assert(mcb2.nonce == mcb.nonce);
+	assert(mcb2.n_short_ids == mcb.n_short_ids);
+	assert(memcmp(mcb2.short_ids, mcb.short_ids,
+		      mcb.n_short_ids * sizeof(uint64_t)) == 0);
+	assert(mcb2.prefilled->len == 1);
+
+	bitc_block_calc_sha256(&mcb2.hdr);
+	assert(bu256_equal(&mcb2.hdr.sha256, &block->sha256));
+
+	cstring *s2 = ser_msg_cmpctblock(&mcb2);
+	assert(cstr_equal(s, s2));
+
+	cstr_free(s, true);
+	cstr_free(s2, true);
+	msg_cmpctblock_free(&mcb);
+	msg_cmpctblock_free(&mcb2);
+
+	/* differentially encoded indexes */
+	struct msg_getblocktxn mgt, mgt2;
+	uint32_t indexes[] = { 0, 1, 5, 6, 300, 3999 };
+	msg_getblocktxn_init(&mgt);
+	msg_getblocktxn_init(&mgt2);
+	bu256_copy(&mgt.blockhash, &block->sha256);
+	mgt.indexes = indexes;
+	mgt.n_indexes = 6;
+
+	s = ser_msg_getblocktxn(&mgt);
+	buf.p = s->str;
+	buf.len = s->len;
+	assert(deser_msg_getblocktxn(&mgt2, &buf));
+	assert(mgt2.n_indexes == 6);
+	assert(memcmp(mgt2.indexes, indexes, sizeof(indexes)) == 0);
+	assert(bu256_equal(&mgt2.blockhash, &block->sha256));
+
+	cstr_free(s, true);
+	msg_getblocktxn_free(&mgt2);
+}
+
+static void test_reconstruct(struct bitc_block *block)
+{
+	struct bitc_txcache tc;
+	unsigned int i, n_tx = block->vtx->len;
+
+	assert(bitc_txcache_init(&tc, n_tx, TXCACHE_DEF_MAX_BYTES));
+
+	/* unrelated tx */
+	struct bitc_tx *decoy = synth_tx(n_tx + 1, false);
+	assert(bitc_txcache_add(&tc, decoy, bitc_tx_ser_size(decoy)));
+
+	/* peer relayed nine of every ten txs */
+	for (i = 1; i < n_tx; i++) {
+		if ((i % 10) == 0)
+			continue;
+
+		struct bitc_tx *tx = calloc(1, sizeof(*tx));
+		bitc_tx_init(tx);
+		bitc_tx_copy(tx, parr_idx(block->vtx, i));
+		assert(bitc_txcache_add(&tc, tx, bitc_tx_ser_size(tx)));
+		assert(!bitc_txcache_add(&tc, tx, bitc_tx_ser_size(tx)));
+	}
+	assert(bitc_txcache_size(&tc) <= n_tx);
+
+	struct msg_cmpctblock mcb;
+	msg_cmpctblock_init(&mcb);
+	cmpct_block_build(&mcb, block, 42);
+
+	struct cmpct_partial pb;
+	assert(cmpct_partial_init(&pb, &mcb, &tc, NULL));
+	assert(pb.n_tx == n_tx);
+	assert(pb.n_prefilled == 1);
+	assert(pb.n_missing == (n_tx - 1) / 10);
+	assert(pb.n_cached + pb.n_missing + pb.n_prefilled == n_tx);
+
+	/* peer answers getblocktxn */
+	struct msg_getblocktxn mgt;
+	msg_getblocktxn_init(&mgt);
+	cmpct_partial_missing(&pb, &mgt);
+	assert(mgt.n_indexes == pb.n_missing);
+
+	struct msg_blocktxn mbt;
+	msg_blocktxn_init(&mbt);
+	bu256_copy(&mbt.blockhash, &mgt.blockhash);
+	mbt.txs = parr_new(mgt.n_indexes, bitc_tx_freep);
+	for (i = 0; i < mgt.n_indexes; i++) {
+		assert((mgt.indexes[i] % 10) == 0);
+
+		struct bitc_tx *tx = calloc(1, sizeof(*tx));
+		bitc_tx_init(tx);
+		bitc_tx_copy(tx, parr_idx(block->vtx, mgt.indexes[i]));
+		parr_add(mbt.txs, tx);
+	}
+
+	assert(cmpct_partial_fill(&pb, &mbt));
+
+	struct bitc_block block2;
+	bitc_block_init(&block2);
+	cmpct_partial_block(&pb, &block2);
+
+	bu256_t merkle;
+	bitc_block_merkle(&merkle, &block2);
+	assert(bu256_equal(&merkle, &block->hashMerkleRoot));
+
+	bitc_block_calc_sha256(&block2);
+	assert(bu256_equal(&block2.sha256, &block->sha256));
+
+	bitc_block_free(&block2);
+	cmpct_partial_free(&pb);
+	msg_blocktxn_free(&mbt);
+	msg_getblocktxn_free(&mgt);
+
+	/* duplicate short IDs force a full block fetch */
+	cmpct_block_build(&mcb, block, 42);
+	mcb.short_ids[1] = mcb.short_ids[0];
+	assert(!cmpct_partial_init(&pb, &mcb, &tc, NULL));
+
+	msg_cmpctblock_free(&mcb);
+	bitc_txcache_free(&tc);
+}
+
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) +
+	       ((t1->tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+static void bench_short_ids(struct bitc_block *block)
+{
+	struct timespec t0, t1;
+	struct cmpct_keys keys;
+	unsigned int i, r, n_tx = block->vtx->len;
+
+	bu256_t *txids = calloc(n_tx, sizeof(bu256_t));
+	uint64_t *ids = calloc(n_tx, sizeof(uint64_t));
+	uint64_t *ids2 = calloc(n_tx, sizeof(uint64_t));
+
+	for (i = 0; i < n_tx; i++) {
+		struct bitc_tx *tx = parr_idx(block->vtx, i);
+		bu256_copy(&txids[i], &tx->sha256);
+	}
+
+	cmpct_keys_init(&keys, block, 42);
+
+	/* one short ID per call */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < n_tx; i++)
+			ids[i] = siphash24(keys.k0, keys.k1, &txids[i], 32) &
+				 CMPCT_SHORTID_MASK;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double t_single = elapsed(&t0, &t1);
+
+	/* batch */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		cmpct_short_ids(&keys, txids, n_tx, ids2);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double t_batch = elapsed(&t0, &t1);
+
+	assert(memcmp(ids, ids2, n_tx * sizeof(uint64_t)) == 0);
+	for (i = 0; i < n_tx; i++)
+		assert(ids[i] == cmpct_short_id(&keys, &txids[i]));
+
+	fprintf(stderr, "cmpctblock: %u-tx block, %u rounds: "
+		"generic %.3f us/block, batch %.3f us/block\n",
+		n_tx, BENCH_ROUNDS,
+		(t_single * 1e6) / BENCH_ROUNDS,
+		(t_batch * 1e6) / BENCH_ROUNDS);
+
+	free(txids);
+	free(ids);
+	free(ids2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bitc_block block;
+
+	test_siphash();
+
+	synth_block(&block, SYNTH_BLOCK_TXS);
+
+	test_msg_roundtrip(&block);
+	test_reconstruct(&block);
+	bench_short_ids(&block);
+
+	bitc_block_free(&block);
+
+	return 0;
+}
@@ -3,7 +3,7 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.
  */
 
-#include <bitc/crypto/hmac.h>           // for hmac_sha256, hmac_sha512
+#include <bitc/crypto/hmac.h>           // for hmac_sha256, hmac_sha512, etc
 #include <bitc/crypto/ripemd160.h>      // for RIPEMD160_DIGEST_LENGTH, etc
 #include <bitc/crypto/sha1.h>           // for SHA1_DIGEST_LENGTH, etc
 #include <bitc/crypto/sha2.h>           // for SHA256_DIGEST_LENGTH, etc
@@ -129,6 +129,17 @@ static void test_hmac(void)
 
 	cstr_free(s256, true);
 	cstr_free(s512, true);
+
+	/* one key setup, reused */
+	HMAC_SHA512_CTX hctx;
+	unsigned char md512_2[SHA512_DIGEST_LENGTH];
+
+	hmac_sha512_Init(&hctx, key, strlen(key));
+	hmac_sha512_Raw(&hctx, test_data, strlen(test_data), md512_2);
+	assert(memcmp(md512, md512_2, sizeof(md512)) == 0);
+	hmac_sha512_Raw(&hctx, key, strlen(key), md512_2);
+	hmac_sha512_Raw(&hctx, test_data, strlen(test_data), md512_2);
+	assert(memcmp(md512, md512_2, sizeof(md512)) == 0);
 }
 
 int main (int argc, char *argv[])
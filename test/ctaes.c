@@ -4,6 +4,7 @@
  * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
  **********************************************************************/
 
+#include <bitc/crypto/aesni.h>
 #include <bitc/crypto/ctaes.h>
 
 #include <stdio.h>
@@ -57,6 +58,37 @@ static void from_hex(unsigned char* data, int len, const char* hex) {
     assert(*hex == 0);
 }
 
+/* many blocks at once, in and out of step with its interleave */
+static int test_aesni_blocks(void) {
+    unsigned char key[32], plain[16 * 11], sw[16 * 11], hw[16 * 11], back[16 * 11];
+    AES256_ctx ctx;
+    AESNI256_ctx nctx;
+    int i, n, fail = 0;
+
+    if (!aesni_available()) {
+        fprintf(stderr, "AES-NI not available, skipped\n");
+        return 0;
+    }
+
+    for (i = 0; i < 32; i++)
+        key[i] = i * 13 + 1;
+    for (i = 0; i < (int) sizeof(plain); i++)
+        plain[i] = i * 7 + 3;
+
+    AES256_init(&ctx, key);
+    AESNI256_init(&nctx, key);
+    for (n = 1; n <= 11; n++) {
+        AES256_encrypt(&ctx, n, sw, plain);
+        AESNI256_encrypt(&nctx, n, hw, plain);
+        AESNI256_decrypt(&nctx, n, back, hw);
+        if (memcmp(sw, hw, 16 * n) || memcmp(back, plain, 16 * n)) {
+            fprintf(stderr, "AES-NI differs on %d blocks\n", n);
+            fail++;
+        }
+    }
+    return fail;
+}
+
 int main(void) {
     int i;
     int fail = 0;
@@ -89,6 +121,19 @@ int main(void) {
                 AES256_init(&ctx, key);
                 AES256_encrypt(&ctx, 1, ciphered, plain);
                 AES256_decrypt(&ctx, 1, deciphered, cipher);
+
+                /* the AES-NI backend agrees, where it runs */
+                if (aesni_available()) {
+                    AESNI256_ctx nctx;
+                    unsigned char nciphered[16], ndeciphered[16];
+                    AESNI256_init(&nctx, key);
+                    AESNI256_encrypt(&nctx, 1, nciphered, plain);
+                    AESNI256_decrypt(&nctx, 1, ndeciphered, cipher);
+                    if (memcmp(cipher, nciphered, 16) || memcmp(plain, ndeciphered, 16)) {
+                        fprintf(stderr, "AES-NI(key=\"%s\") differs\n", test->key);
+                        fail++;
+                    }
+                }
                 break;
             }
         }
@@ -101,6 +146,7 @@ int main(void) {
             fail++;
         }
     }
+    fail += test_aesni_blocks();
     if (fail == 0) {
         fprintf(stderr, "All tests succesful\n");
     } else {
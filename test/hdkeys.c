@@ -632,12 +632,88 @@ static void test_vector_2()
 	hd_extended_key_free(&m);
 }
 
+static void test_derive_range()
+{
+	printf("TEST: test_derive_range\n");
+
+	const char seed[] = "libbitc test seed";
+	enum { N_RANGE = 8, FIRST = 5 };
+
+	struct hd_extended_key m;
+	hd_extended_key_init(&m);
+	assert(hd_extended_key_generate_master(&m, seed, sizeof(seed)));
+
+	// Same keys as deriving one child at a time, private and hardened
+
+	struct hd_extended_key range[N_RANGE];
+	uint32_t starts[2] = { FIRST, 0x80000000 | FIRST };
+	unsigned int s, i;
+	for (s = 0; s < 2; s++) {
+		assert(hd_derive_range(range, &m, starts[s], N_RANGE));
+
+		for (i = 0; i < N_RANGE; i++) {
+			struct hd_extended_key child;
+			struct hd_extended_key_serialized a, b;
+
+			hd_extended_key_init(&child);
+			assert(hd_extended_key_generate_child(&m, starts[s] + i,
+							      &child));
+			assert(write_ek_ser_prv(&a, &child));
+			assert(write_ek_ser_prv(&b, &range[i]));
+			assert(0 == memcmp(a.data, b.data, sizeof(a.data)));
+
+			hd_extended_key_free(&child);
+			hd_extended_key_free(&range[i]);
+		}
+	}
+
+	// From a public-only parent, the public halves match
+
+	struct hd_extended_key_serialized m_xpub;
+	assert(write_ek_ser_pub(&m_xpub, &m));
+
+	struct hd_extended_key m_pub;
+	hd_extended_key_init(&m_pub);
+	assert(hd_extended_key_deser(&m_pub, m_xpub.data,
+				     sizeof(m_xpub.data)));
+
+	struct hd_extended_key pub_range[N_RANGE];
+	assert(hd_derive_range(range, &m, FIRST, N_RANGE));
+	assert(hd_derive_range(pub_range, &m_pub, FIRST, N_RANGE));
+	for (i = 0; i < N_RANGE; i++) {
+		struct hd_extended_key_serialized a, b;
+
+		assert(write_ek_ser_pub(&a, &range[i]));
+		assert(write_ek_ser_pub(&b, &pub_range[i]));
+		assert(0 == memcmp(a.data, b.data, sizeof(a.data)));
+
+		hd_extended_key_free(&pub_range[i]);
+		hd_extended_key_free(&range[i]);
+	}
+
+	// ... but cannot give hardened children
+
+	assert(!hd_derive_range(pub_range, &m_pub, 0x80000000, 1));
+	hd_extended_key_free(&pub_range[0]);
+
+	// Empty ranges, and ranges running past the last index
+
+	assert(hd_derive_range(range, &m, 0xffffffff, 0));
+	assert(hd_derive_range(range, &m, 0xffffffff, 1));
+	hd_extended_key_free(&range[0]);
+	assert(!hd_derive_range(range, &m, 0xffffffff, 2));
+
+	hd_extended_key_free(&m_pub);
+	hd_extended_key_free(&m);
+}
+
 int main(int argc, char **argv)
 {
 	test_extended_key();
 	test_serialize();
 	test_vector_1();
 	test_vector_2();
+	test_derive_range();
 
 	// Keep valgrind happy
 	bitc_key_static_shutdown();
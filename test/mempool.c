@@ -0,0 +1,548 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/cmpctblock.h>            // for cmpct_partial_init, etc
+#include <bitc/core.h>                  // for bitc_tx, bitc_utxo_set, etc
+#include <bitc/cstr.h>                  // for cstr_new_buf
+#include <bitc/mempool.h>               // for bitc_mempool_add, etc
+#include <bitc/parr.h>                  // for parr_idx, parr_add, etc
+#include <bitc/script.h>                // for SCRIPT_VERIFY_P2SH
+#include <bitc/util.h>                  // for ARRAY_SIZE
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, false
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+
+enum {
+	FUND_OUTPUTS	= 40,
+	FUND_VALUE	= 100000,
+	TIP_HEIGHT	= 1000,
+};
+
+static struct bitc_utxo_set uset;
+static bu256_t fund_txid, coinbase_txid;
+
+static void tx_add_in(struct bitc_tx *tx, const bu256_t *hash, uint32_t n)
+{
+	struct bitc_txin *txin = calloc(1, sizeof(*txin));
+	bitc_txin_init(txin);
+	bu256_copy(&txin->prevout.hash, hash);
+	txin->prevout.n = n;
+	txin->scriptSig = cstr_new_sz(0);
+	txin->nSequence = SEQUENCE_FINAL;
+	parr_add(tx->vin, txin);
+}
+
+/* OP_TRUE outputs, or OP_FALSE if !spendable */
+static void tx_add_out(struct bitc_tx *tx, int64_t value, bool spendable)
+{
+	struct bitc_txout *txout = calloc(1, sizeof(*txout));
+	bitc_txout_init(txout);
+	txout->nValue = value;
+	txout->scriptPubKey = cstr_new_buf(spendable ? "\x51" : "\x00", 1);
+	parr_add(tx->vout, txout);
+}
+
+static struct bitc_tx *tx_new(void)
+{
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+	bitc_tx_init(tx);
+	tx->nVersion = 1;
+	tx->vin = parr_new(1, bitc_txin_freep);
+	tx->vout = parr_new(1, bitc_txout_freep);
+	return tx;
+}
+
+/* one input, one output paying value */
+static struct bitc_tx *tx_spend(const bu256_t *hash, uint32_t n, int64_t value)
+{
+	struct bitc_tx *tx = tx_new();
+	tx_add_in(tx, hash, n);
+	tx_add_out(tx, value, true);
+	bitc_tx_calc_sha256(tx);
+	return tx;
+}
+
+static void add_coin(bu256_t *txid, unsigned int n_out, bool is_coinbase,
+		     unsigned int height)
+{
+	struct bitc_tx *tx = tx_new();
+	bu256_t prev;
+
+	bu256_set_u64(&prev, height + 1);
+	tx_add_in(tx, &prev, 0);
+
+	unsigned int i;
+	for (i = 0; i < n_out; i++)
+		tx_add_out(tx, FUND_VALUE, i != (n_out - 1));
+	bitc_tx_calc_sha256(tx);
+
+	struct bitc_utxo *coin = calloc(1, sizeof(*coin));
+	bitc_utxo_init(coin);
+	assert(bitc_utxo_from_tx(coin, tx, is_coinbase, height));
+	bitc_utxo_set_add(&uset, coin);
+
+	bu256_copy(txid, &tx->sha256);
+	bitc_tx_freep(tx);
+}
+
+static enum mempool_result pool_add(struct bitc_mempool *mp,
+				    struct bitc_tx *tx)
+{
+	return bitc_mempool_add(mp, &uset, tx, TIP_HEIGHT,
+				SCRIPT_VERIFY_P2SH |
+				SCRIPT_VERIFY_CHECKSEQUENCEVERIFY);
+}
+
+/* ten minutes a block */
+static int64_t test_median_time(unsigned int height)
+{
+	return 1480000000 + (int64_t) height * 600;
+}
+
+/* tx spending fund output n, with the given locks */
+static struct bitc_tx *tx_locked(uint32_t n, uint32_t lock_time,
+				 int32_t version, uint32_t seq)
+{
+	struct bitc_tx *tx = tx_spend(&fund_txid, n, FUND_VALUE - 1000);
+	struct bitc_txin *txin = parr_idx(tx->vin, 0);
+
+	tx->nVersion = version;
+	tx->nLockTime = lock_time;
+	txin->nSequence = seq;
+	bitc_tx_calc_sha256(tx);
+	return tx;
+}
+
+static void test_final(void)
+{
+	struct bitc_mempool mp;
+	assert(bitc_mempool_init(&mp, MEMPOOL_DEF_MAX_BYTES));
+	mp.median_time = test_median_time;
+
+	int64_t mtp = test_median_time(TIP_HEIGHT - 1);
+	static const struct {
+		uint32_t	lock_time;
+		int32_t		version;
+		uint32_t	seq;
+		bool		final;
+	} cases[] = {
+		/* nLockTime, by height and by median time past */
+		{ TIP_HEIGHT - 1, 1, 0, true },
+		{ TIP_HEIGHT, 1, 0, false },
+		{ TIP_HEIGHT, 1, SEQUENCE_FINAL, true },
+		{ 0, 1, 0, true },
+
+		/* BIP 68, on a coin from height 1 */
+		{ 0, 2, TIP_HEIGHT - 1, true },
+		{ 0, 2, TIP_HEIGHT, false },
+		{ 0, 1, TIP_HEIGHT, true },
+		{ 0, 2, SEQUENCE_LOCKTIME_DISABLE_FLAG | TIP_HEIGHT, true },
+		{ 0, 2, SEQUENCE_LOCKTIME_TYPE_FLAG | 1170, true },
+		{ 0, 2, SEQUENCE_LOCKTIME_TYPE_FLAG | 1171, false },
+	};
+
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		struct bitc_tx *tx = tx_locked(22 + (i % 2), cases[i].lock_time,
+					       cases[i].version, cases[i].seq);
+		enum mempool_result res = pool_add(&mp, tx);
+
+		assert(res == (cases[i].final ? MP_OK : MP_NON_FINAL));
+		if (res == MP_OK)
+			assert(bitc_mempool_remove(&mp, &tx->sha256));
+		bitc_tx_freep(tx);
+	}
+
+	/* time locks, against the median time past */
+	struct bitc_tx *tx = tx_locked(22, mtp - 1, 1, 0);
+	assert(pool_add(&mp, tx) == MP_OK);
+	bitc_tx_freep(tx);
+	tx = tx_locked(23, mtp, 1, 0);
+	assert(pool_add(&mp, tx) == MP_NON_FINAL);
+	bitc_tx_freep(tx);
+
+	/* no chain times: relative time locks cannot be met */
+	mp.median_time = NULL;
+	tx = tx_locked(23, 0, 2, SEQUENCE_LOCKTIME_TYPE_FLAG | 1);
+	assert(pool_add(&mp, tx) == MP_NON_FINAL);
+	bitc_tx_freep(tx);
+
+	bitc_mempool_free(&mp);
+}
+
+static void test_accept(void)
+{
+	struct bitc_mempool mp;
+	assert(bitc_mempool_init(&mp, MEMPOOL_DEF_MAX_BYTES));
+
+	/* fee 10000 */
+	struct bitc_tx *tx1 = tx_spend(&fund_txid, 0, FUND_VALUE - 10000);
+	assert(pool_add(&mp, tx1) == MP_OK);
+	assert(pool_add(&mp, tx1) == MP_DUPLICATE);
+	assert(bitc_mempool_size(&mp) == 1);
+
+	struct mempool_entry *e1 = bitc_mempool_lookup(&mp, &tx1->sha256);
+	assert(e1 != NULL);
+	assert(e1->fee == 10000);
+	assert(e1->n_anc == 1);
+	assert(mp.bytes == e1->size);
+
+	/* double spend of the same outpoint */
+	struct bitc_tx *tx2 = tx_spend(&fund_txid, 0, FUND_VALUE - 20000);
+	assert(pool_add(&mp, tx2) == MP_CONFLICT);
+	assert(bitc_mempool_spender(&mp, &((struct bitc_txin *)
+		parr_idx(tx1->vin, 0))->prevout) == e1);
+
+	/* unknown, spent-past-end and unspendable inputs */
+	bu256_t unknown;
+	bu256_set_u64(&unknown, 0xdeadbeef);
+	struct bitc_tx *tx3 = tx_spend(&unknown, 0, 1000);
+	assert(pool_add(&mp, tx3) == MP_MISSING_INPUTS);
+
+	struct bitc_tx *tx4 = tx_spend(&fund_txid, FUND_OUTPUTS, 1000);
+	assert(pool_add(&mp, tx4) == MP_MISSING_INPUTS);
+
+	struct bitc_tx *tx5 = tx_spend(&fund_txid, FUND_OUTPUTS - 1, 1000);
+	assert(pool_add(&mp, tx5) == MP_BAD_SCRIPT);
+
+	/* outputs exceed inputs */
+	struct bitc_tx *tx6 = tx_spend(&fund_txid, 1, FUND_VALUE + 1);
+	assert(pool_add(&mp, tx6) == MP_BAD_FEE);
+
+	/* coinbase maturity */
+	struct bitc_tx *tx7 = tx_spend(&coinbase_txid, 0, 1000);
+	assert(bitc_mempool_add(&mp, &uset, tx7, TIP_HEIGHT - 50,
+				SCRIPT_VERIFY_P2SH) == MP_IMMATURE);
+	assert(pool_add(&mp, tx7) == MP_OK);
+
+	/* coinbase txs never enter the pool */
+	bu256_t null_hash;
+	bu256_zero(&null_hash);
+	struct bitc_tx *tx8 = tx_spend(&null_hash, 0xffffffff, 1000);
+	assert(pool_add(&mp, tx8) == MP_INVALID);
+
+	assert(bitc_mempool_size(&mp) == 2);
+	assert(bitc_mempool_remove(&mp, &tx7->sha256));
+	assert(!bitc_mempool_remove(&mp, &tx7->sha256));
+	assert(bitc_mempool_size(&mp) == 1);
+
+	bitc_tx_freep(tx1);
+	bitc_tx_freep(tx2);
+	bitc_tx_freep(tx3);
+	bitc_tx_freep(tx4);
+	bitc_tx_freep(tx5);
+	bitc_tx_freep(tx6);
+	bitc_tx_freep(tx7);
+	bitc_tx_freep(tx8);
+	bitc_mempool_free(&mp);
+}
+
+static void test_ancestors(void)
+{
+	struct bitc_mempool mp;
+	assert(bitc_mempool_init(&mp, MEMPOOL_DEF_MAX_BYTES));
+
+	/* low fee parent, high fee child: child pays for parent */
+	struct bitc_tx *parent = tx_spend(&fund_txid, 2, FUND_VALUE - 100);
+	struct bitc_tx *child = tx_spend(&parent->sha256, 0,
+					 FUND_VALUE - 100 - 50000);
+	assert(pool_add(&mp, child) == MP_MISSING_INPUTS);
+	assert(pool_add(&mp, parent) == MP_OK);
+	assert(pool_add(&mp, child) == MP_OK);
+
+	struct mempool_entry *pe = bitc_mempool_lookup(&mp, &parent->sha256);
+	struct mempool_entry *ce = bitc_mempool_lookup(&mp, &child->sha256);
+	assert(ce->n_anc == 2);
+	assert(ce->anc_fee == 50100);
+	assert(ce->anc_size == pe->size + ce->size);
+	assert(ce->anc_feerate > pe->anc_feerate);
+	assert(pe->children->len == 1 && ce->parents->len == 1);
+	assert(bitc_mempool_min(&mp) == pe);
+
+	/* the child lifts the parent's descendant score */
+	assert(pe->n_desc == 2 && pe->desc_fee == 50100);
+	assert(pe->desc_score > (pe->fee * 1000) / (int64_t) pe->size);
+	assert(bitc_mempool_worst(&mp) == pe);
+
+	/* removing the parent takes the child along */
+	assert(bitc_mempool_remove(&mp, &parent->sha256));
+	assert(bitc_mempool_size(&mp) == 0);
+	assert(mp.bytes == 0);
+
+	/* ancestor chain limit */
+	struct bitc_tx *prev = tx_spend(&fund_txid, 3, FUND_VALUE - 100);
+	assert(pool_add(&mp, prev) == MP_OK);
+
+	unsigned int i;
+	for (i = 1; i <= MEMPOOL_MAX_ANCESTORS; i++) {
+		struct bitc_tx *tx = tx_spend(&prev->sha256, 0,
+					      FUND_VALUE - (100 * (i + 1)));
+		enum mempool_result res = pool_add(&mp, tx);
+
+		if (i < MEMPOOL_MAX_ANCESTORS)
+			assert(res == MP_OK);
+		else
+			assert(res == MP_TOO_LONG);
+
+		bitc_tx_freep(prev);
+		prev = tx;
+	}
+	assert(bitc_mempool_size(&mp) == MEMPOOL_MAX_ANCESTORS);
+
+	bitc_tx_freep(prev);
+	bitc_tx_freep(parent);
+	bitc_tx_freep(child);
+	bitc_mempool_free(&mp);
+}
+
+static void test_descendants(void)
+{
+	struct bitc_mempool mp;
+	struct bitc_tx *kid[MEMPOOL_MAX_DESCENDANTS];
+	unsigned int i;
+
+	assert(bitc_mempool_init(&mp, MEMPOOL_DEF_MAX_BYTES));
+
+	/* one parent, fanned out to as many children as it may have */
+	struct bitc_tx *fan = tx_new();
+	tx_add_in(fan, &fund_txid, 5);
+	for (i = 0; i < MEMPOOL_MAX_DESCENDANTS; i++)
+		tx_add_out(fan, 1000, true);
+	bitc_tx_calc_sha256(fan);
+	assert(pool_add(&mp, fan) == MP_OK);
+
+	for (i = 0; i < MEMPOOL_MAX_DESCENDANTS; i++) {
+		kid[i] = tx_spend(&fan->sha256, i, 900);
+		enum mempool_result res = pool_add(&mp, kid[i]);
+
+		if (i < MEMPOOL_MAX_DESCENDANTS - 1)
+			assert(res == MP_OK);
+		else
+			assert(res == MP_TOO_LONG);
+	}
+
+	struct mempool_entry *fe = bitc_mempool_lookup(&mp, &fan->sha256);
+	struct mempool_entry *ke = bitc_mempool_lookup(&mp, &kid[0]->sha256);
+	assert(fe->n_desc == MEMPOOL_MAX_DESCENDANTS);
+	assert(fe->desc_size == fe->size + (MEMPOOL_MAX_DESCENDANTS - 1) *
+	       ke->size);
+	assert(fe->desc_fee == fe->fee + (MEMPOOL_MAX_DESCENDANTS - 1) * 100);
+	assert(ke->n_desc == 1);
+
+	/* a child leaving makes room for another */
+	assert(bitc_mempool_remove(&mp, &kid[0]->sha256));
+	assert(fe->n_desc == MEMPOOL_MAX_DESCENDANTS - 1);
+	assert(pool_add(&mp, kid[MEMPOOL_MAX_DESCENDANTS - 1]) == MP_OK);
+	assert(fe->n_desc == MEMPOOL_MAX_DESCENDANTS);
+
+	/* removing the parent takes all of them */
+	assert(bitc_mempool_remove(&mp, &fan->sha256));
+	assert(bitc_mempool_size(&mp) == 0);
+	assert(mp.bytes == 0);
+
+	for (i = 0; i < MEMPOOL_MAX_DESCENDANTS; i++)
+		bitc_tx_freep(kid[i]);
+	bitc_tx_freep(fan);
+	bitc_mempool_free(&mp);
+}
+
+static void test_eviction(void)
+{
+	struct bitc_mempool mp;
+	struct bitc_tx *tx[8];
+	unsigned int i;
+
+	/* room for about four txs */
+	struct bitc_tx *probe = tx_spend(&fund_txid, 0, 1);
+	size_t tx_size = bitc_tx_ser_size(probe);
+	bitc_tx_freep(probe);
+
+	assert(bitc_mempool_init(&mp, (tx_size * 4) + (tx_size / 2)));
+
+	/* fee rates 1000 .. 8000, added in scrambled order */
+	static const unsigned int order[8] = { 3, 0, 6, 1, 7, 2, 5, 4 };
+	for (i = 0; i < 8; i++) {
+		unsigned int n = order[i];
+		tx[n] = tx_spend(&fund_txid, 10 + n,
+				 FUND_VALUE - (1000 * (n + 1)));
+		enum mempool_result res = pool_add(&mp, tx[n]);
+		assert((res == MP_OK) || (res == MP_FULL));
+		assert(mp.bytes <= mp.max_bytes);
+	}
+
+	/* the four best paying txs survive */
+	assert(bitc_mempool_size(&mp) == 4);
+	for (i = 0; i < 8; i++)
+		assert((bitc_mempool_lookup(&mp, &tx[i]->sha256) != NULL) ==
+		       (i >= 4));
+	assert(mp.n_evicted > 0);
+
+	/* a low fee rate tx is turned away at the door */
+	struct bitc_tx *cheap = tx_spend(&fund_txid, 20, FUND_VALUE - 10);
+	assert(pool_add(&mp, cheap) == MP_FULL);
+
+	/* evicting a parent evicts its children */
+	struct bitc_tx *kid = tx_spend(&tx[4]->sha256, 0,
+				       FUND_VALUE - 5000 - 100);
+	struct bitc_tx *rich = tx_spend(&fund_txid, 21, FUND_VALUE - 90000);
+	assert(pool_add(&mp, kid) == MP_FULL);
+	assert(pool_add(&mp, rich) == MP_OK);
+	assert(!bitc_mempool_lookup(&mp, &tx[4]->sha256));
+
+	for (i = 0; i < 8; i++)
+		bitc_tx_freep(tx[i]);
+	bitc_tx_freep(cheap);
+	bitc_tx_freep(kid);
+	bitc_tx_freep(rich);
+	bitc_mempool_free(&mp);
+}
+
+static void test_eviction_cpfp(void)
+{
+	struct bitc_mempool mp;
+
+	struct bitc_tx *probe = tx_spend(&fund_txid, 0, 1);
+	size_t tx_size = bitc_tx_ser_size(probe);
+	bitc_tx_freep(probe);
+
+	assert(bitc_mempool_init(&mp, (tx_size * 4) + (tx_size / 2)));
+
+	/* low fee parent, paid for by its child */
+	struct bitc_tx *parent = tx_spend(&fund_txid, 32, FUND_VALUE - 100);
+	struct bitc_tx *child = tx_spend(&parent->sha256, 0,
+					 FUND_VALUE - 100 - 50000);
+	struct bitc_tx *m1 = tx_spend(&fund_txid, 33, FUND_VALUE - 2000);
+	struct bitc_tx *m2 = tx_spend(&fund_txid, 34, FUND_VALUE - 3000);
+	struct bitc_tx *m3 = tx_spend(&fund_txid, 35, FUND_VALUE - 4000);
+
+	assert(pool_add(&mp, parent) == MP_OK);
+	assert(pool_add(&mp, child) == MP_OK);
+	assert(pool_add(&mp, m1) == MP_OK);
+	assert(pool_add(&mp, m2) == MP_OK);
+	assert(bitc_mempool_min(&mp) ==
+	       bitc_mempool_lookup(&mp, &parent->sha256));
+	assert(bitc_mempool_worst(&mp) ==
+	       bitc_mempool_lookup(&mp, &m1->sha256));
+
+	/* the package outbids m1, so m1 goes rather than the package */
+	assert(pool_add(&mp, m3) == MP_OK);
+	assert(bitc_mempool_size(&mp) == 4);
+	assert(!bitc_mempool_lookup(&mp, &m1->sha256));
+	assert(bitc_mempool_lookup(&mp, &parent->sha256));
+	assert(bitc_mempool_lookup(&mp, &child->sha256));
+
+	bitc_tx_freep(parent);
+	bitc_tx_freep(child);
+	bitc_tx_freep(m1);
+	bitc_tx_freep(m2);
+	bitc_tx_freep(m3);
+	bitc_mempool_free(&mp);
+}
+
+static void block_init(struct bitc_block *block)
+{
+	bitc_block_init(block);
+	block->nVersion = 4;
+	block->nTime = 1480000000;
+	block->vtx = parr_new(4, bitc_tx_freep);
+
+	bu256_t null_hash;
+	bu256_zero(&null_hash);
+
+	struct bitc_tx *cb = tx_new();
+	tx_add_in(cb, &null_hash, 0xffffffff);
+	cstr_append_buf(((struct bitc_txin *) parr_idx(cb->vin, 0))->scriptSig,
+			"\x01\x02", 2);
+	tx_add_out(cb, 5000000000LL, true);
+	parr_add(block->vtx, cb);
+}
+
+static void block_add(struct bitc_block *block, const struct bitc_tx *tx)
+{
+	struct bitc_tx *copy = calloc(1, sizeof(*copy));
+	bitc_tx_init(copy);
+	bitc_tx_copy(copy, tx);
+	parr_add(block->vtx, copy);
+}
+
+static void test_block(void)
+{
+	struct bitc_mempool mp;
+	assert(bitc_mempool_init(&mp, MEMPOOL_DEF_MAX_BYTES));
+
+	struct bitc_tx *a = tx_spend(&fund_txid, 30, FUND_VALUE - 1000);
+	struct bitc_tx *b = tx_spend(&a->sha256, 0, FUND_VALUE - 11000);
+	struct bitc_tx *c = tx_spend(&fund_txid, 31, FUND_VALUE - 1000);
+	struct bitc_tx *d = tx_spend(&c->sha256, 0, FUND_VALUE - 2000);
+	struct bitc_tx *c2 = tx_spend(&fund_txid, 31, FUND_VALUE - 3000);
+
+	assert(pool_add(&mp, a) == MP_OK);
+	assert(pool_add(&mp, b) == MP_OK);
+	assert(pool_add(&mp, c) == MP_OK);
+	assert(pool_add(&mp, d) == MP_OK);
+
+	/* pooled txs reassemble a compact block with nothing missing */
+	struct bitc_block block;
+	block_init(&block);
+	block_add(&block, a);
+	block_add(&block, b);
+	bitc_block_merkle(&block.hashMerkleRoot, &block);
+	bitc_block_calc_sha256(&block);
+
+	struct msg_cmpctblock mcb;
+	struct cmpct_partial pb;
+	msg_cmpctblock_init(&mcb);
+	cmpct_block_build(&mcb, &block, 42);
+	assert(cmpct_partial_init(&pb, &mcb, NULL, &mp));
+	assert(pb.n_missing == 0);
+	assert(pb.n_cached == 2);
+	cmpct_partial_free(&pb);
+	msg_cmpctblock_free(&mcb);
+
+	bitc_block_free(&block);
+
+	/* a confirmed; c2 conflicts with c, evicting c and d */
+	block_init(&block);
+	block_add(&block, a);
+	block_add(&block, c2);
+	bitc_mempool_remove_block(&mp, &block);
+
+	assert(bitc_mempool_size(&mp) == 1);
+	struct mempool_entry *be = bitc_mempool_lookup(&mp, &b->sha256);
+	assert(be != NULL);
+	assert(be->n_anc == 1);
+	assert(be->anc_fee == be->fee);
+	assert(be->parents->len == 0);
+	assert(be->n_desc == 1);
+	assert(mp.n_confirmed == 1);
+
+	bitc_block_free(&block);
+	bitc_tx_freep(a);
+	bitc_tx_freep(b);
+	bitc_tx_freep(c);
+	bitc_tx_freep(d);
+	bitc_tx_freep(c2);
+	bitc_mempool_free(&mp);
+}
+
+int main (int argc, char *argv[])
+{
+	bitc_utxo_set_init(&uset);
+	add_coin(&fund_txid, FUND_OUTPUTS, false, 1);
+	add_coin(&coinbase_txid, 2, true, TIP_HEIGHT - 100);
+
+	test_accept();
+	test_ancestors();
+	test_descendants();
+	test_eviction();
+	test_eviction_cpfp();
+	test_final();
+	test_block();
+
+	bitc_utxo_set_free(&uset);
+	return 0;
+}
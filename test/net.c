@@ -7,9 +7,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <bitc/net/capture.h>
+#include <bitc/net/dns.h>
+#include <bitc/net/msgbuf.h>
+#include <bitc/net/net.h>
 #include <bitc/net/netbase.h>
+#include <bitc/net/peerman.h>
+#include <bitc/coredefs.h>
+#include <bitc/cstr.h>
+#include <bitc/hashtab.h>
+#include <bitc/log.h>
+#include <bitc/message.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
 #include "libtest.h"
 
+struct logging *log_state;
+
 static void test_addr_str(void)
 {
 	static const unsigned char v6addr[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1};
@@ -23,8 +39,443 @@ static void test_addr_str(void)
 	assert(strcmp(host, "1.2.3.4") == 0);
 }
 
+static void test_peer_ser(void)
+{
+	struct peer a, b;
+	peer_init(&a);
+	peer_init(&b);
+
+	a.addr.ip[15] = 7;
+	a.last_ok = 1500000000;
+	a.n_ok = 3;
+	a.ping_ms = 80;
+	a.handshake_ms = 250;
+	a.rx_rate = 2000000;
+	a.n_stalls = 1;
+
+	cstring *s = cstr_new(NULL);
+	ser_peer(s, CADDR_TIME_VERSION, &a);
+
+	struct const_buffer buf = { s->str, s->len };
+	assert(deser_peer(CADDR_TIME_VERSION, &b, &buf));
+	assert(b.last_ok == a.last_ok && b.n_ok == a.n_ok);
+	assert(b.ping_ms == 80 && b.handshake_ms == 250);
+	assert(b.rx_rate == 2000000 && b.n_stalls == 1);
+
+	/* records from older peer files carry no stats */
+	peer_init(&b);
+	struct const_buffer old = { s->str, s->len - 16 };
+	assert(deser_peer(CADDR_TIME_VERSION, &b, &old));
+	assert(b.n_ok == 3 && b.ping_ms == 0 && b.n_stalls == 0);
+
+	cstr_free(s, true);
+	peer_free(&a);
+	peer_free(&b);
+}
+
+static void test_peer_pop(void)
+{
+	struct peer_manager *peers = peerman_seed(false);
+	int64_t now = time(NULL);
+	struct peer p;
+
+	/* fixed key, so slots are reproducible */
+	peers->key[0] = 1;
+	peers->key[1] = 2;
+
+	/* never connected, fast, stalling, proven and quick */
+	unsigned int i;
+	for (i = 0; i < 4; i++) {
+		peer_init(&p);
+		p.addr.ip[10] = p.addr.ip[11] = 0xff;
+		p.addr.ip[12] = 1;
+		p.addr.ip[13] = i + 1;
+		p.addr.ip[15] = i + 1;
+		p.addr.nTime = (uint32_t) now;
+		if (i > 0) {
+			p.n_ok = 1;
+			p.last_ok = now - 60;
+		}
+		p.ping_ms = (i == 3) ? 20 : 300;
+		p.n_stalls = (i == 2) ? 5 : 0;
+		peerman_add(peers, &p, false);
+	}
+
+	assert(peerman_lookup(peers, p.addr.ip) != NULL);
+
+	static const unsigned char order[] = { 4, 2, 3, 1 };
+	for (i = 0; i < 4; i++) {
+		struct peer *got = peerman_pop(peers);
+		assert(got && got->addr.ip[15] == order[i]);
+		peer_free(got);
+		free(got);
+	}
+	assert(peerman_pop(peers) == NULL);
+
+	peerman_free(peers);
+}
+
+static void test_peer_buckets(void)
+{
+	struct peer_manager *peers = peerman_seed(false);
+	struct bitc_address addr;
+	unsigned int i;
+
+	bitc_addr_init(&addr);
+	addr.ip[10] = addr.ip[11] = 0xff;
+	addr.nTime = 1000;
+
+	/* one /16 is confined to a few buckets */
+	addr.ip[12] = 80;
+	addr.ip[13] = 1;
+	for (i = 0; i < 20000; i++) {
+		addr.ip[14] = i >> 8;
+		addr.ip[15] = i & 0xff;
+		peerman_add_addr(peers, &addr, false);
+	}
+	assert(peerman_size(peers) > PEERMAN_BUCKET_SIZE);
+	assert(peerman_size(peers) <=
+	       PEERMAN_NEW_PER_GROUP * PEERMAN_BUCKET_SIZE);
+	assert(bitc_hashtab_size(peers->map_addr) == peerman_size(peers));
+
+	/* many groups spread out */
+	size_t n_one_group = peerman_size(peers);
+	for (i = 0; i < 2000; i++) {
+		addr.ip[12] = 81 + (i % 100);
+		addr.ip[13] = i / 100;
+		addr.ip[14] = 0;
+		addr.ip[15] = 1;
+		peerman_add_addr(peers, &addr, false);
+	}
+	assert(peerman_size(peers) > n_one_group + 1900);
+
+	/* a working peer moves to "tried" */
+	struct peer *peer = peerman_pop(peers);
+	assert(peer && !peer->tried);
+	peerman_add(peers, peer, true);
+	assert(peers->tried_tab.ids->len == 1);
+	assert(peerman_lookup(peers, peer->addr.ip)->tried);
+	peer_free(peer);
+	free(peer);
+
+	/* pop drains both tables */
+	size_t n = peerman_size(peers);
+	for (i = 0; i < n; i++) {
+		peer = peerman_pop(peers);
+		assert(peer != NULL);
+		peer_free(peer);
+		free(peer);
+	}
+	assert(peerman_size(peers) == 0);
+	assert(bitc_hashtab_size(peers->map_addr) == 0);
+	assert(peerman_pop(peers) == NULL);
+
+	peerman_free(peers);
+}
+
+/* stub resolver: "<id>:<delay ms>" yields 10.<id>.0.1-3, "fail" nothing */
+static int n_stub_started, n_stub_done;
+
+static clist *stub_lookup(clist *l, const char *name, unsigned int port)
+{
+	unsigned int id, delay_ms;
+
+	__atomic_add_fetch(&n_stub_started, 1, __ATOMIC_SEQ_CST);
+
+	if (sscanf(name, "%u:%u", &id, &delay_ms) == 2) {
+		usleep(delay_ms * 1000);
+
+		unsigned int i;
+		for (i = 1; i <= 3; i++) {
+			struct bitc_address *addr = calloc(1, sizeof(*addr));
+			addr->ip[10] = addr->ip[11] = 0xff;
+			addr->ip[12] = 10;
+			addr->ip[13] = id;
+			addr->ip[15] = i;
+			addr->port = port;
+			l = clist_append(l, addr);
+		}
+	}
+
+	__atomic_add_fetch(&n_stub_done, 1, __ATOMIC_SEQ_CST);
+	return l;
+}
+
+static clist *seeder_wait(struct bu_dns_seeder *ds, bool *done)
+{
+	struct pollfd pfd = { bu_dns_seeder_fd(ds), POLLIN };
+
+	assert(poll(&pfd, 1, 5000) == 1);
+	return bu_dns_seeder_take(ds, done);
+}
+
+static void test_dns_seeder(void)
+{
+	/* fast seeds are available before the slow one answers */
+	const char *names[] = { "1:0", "2:500", "fail", "3:0" };
+	struct bu_dns_seeder *ds = bu_dns_seeder_new(names, 4, 8333,
+						     stub_lookup);
+	struct peer_manager *peers = peerman_seed(false);
+	bool done = false;
+
+	/* fixed key: slots are deterministic, and these do not collide */
+	peers->key[0] = 1;
+	peers->key[1] = 2;
+
+	assert(ds != NULL);
+	while (peerman_size(peers) < 6) {
+		peerman_add_seeds(peers, seeder_wait(ds, &done));
+		assert(!done);
+	}
+	assert(peerman_size(peers) == 6);
+
+	while (!done)
+		peerman_add_seeds(peers, seeder_wait(ds, &done));
+	assert(peerman_size(peers) == 9);
+
+	struct peer *peer = peerman_pop(peers);
+	assert(peer->addr.ip[12] == 10 && peer->addr.port == 8333);
+	peer_free(peer);
+	free(peer);
+
+	bu_dns_seeder_free(ds);
+	peerman_free(peers);
+
+	/* more names than threads */
+	char buf[32][16];
+	const char *many[32];
+	unsigned int i;
+	for (i = 0; i < 32; i++) {
+		snprintf(buf[i], sizeof(buf[i]), "%u:%u", 100 + i, i % 3);
+		many[i] = buf[i];
+	}
+
+	ds = bu_dns_seeder_new(many, 32, 18333, stub_lookup);
+	clist *l = NULL;
+	done = false;
+	while (!done) {
+		clist *more = seeder_wait(ds, &done);
+		while (more) {
+			l = clist_prepend(l, more->data);
+			more = clist_delete(more, more);
+		}
+	}
+	assert(clist_length(l) == 32 * 3);
+	clist_free_ext(l, free);
+	bu_dns_seeder_free(ds);
+
+	/* freed mid-lookup: the thread cleans up after itself */
+	const char *slow[] = { "7:200" };
+	n_stub_started = n_stub_done = 0;
+	ds = bu_dns_seeder_new(slow, 1, 8333, stub_lookup);
+	while (__atomic_load_n(&n_stub_started, __ATOMIC_SEQ_CST) == 0)
+		usleep(1000);
+	bu_dns_seeder_free(ds);
+	while (__atomic_load_n(&n_stub_done, __ATOMIC_SEQ_CST) == 0)
+		usleep(10000);
+	usleep(50000);
+
+	/* nothing to resolve */
+	ds = bu_dns_seeder_new(NULL, 0, 8333, stub_lookup);
+	assert(ds != NULL);
+	assert(bu_dns_seeder_take(ds, &done) == NULL && done);
+	bu_dns_seeder_free(ds);
+}
+
+static void test_capture(void)
+{
+	static const char filename[] = "net_capture.dat";
+	const struct chain_info *chain = chain_find("bitcoin");
+	unsigned char ip[16] = { [10] = 0xff, [11] = 0xff, 10, 0, 0, 1 };
+	uint64_t nonce = 42;
+
+	cstring *ping = message_str(chain->netmagic, "ping", &nonce, 8);
+	cstring *verack = message_str(chain->netmagic, "verack", NULL, 0);
+
+	struct nc_capture *cap = nc_capture_open(filename);
+	assert(cap != NULL);
+	assert(nc_capture_write(cap, 1, ip, 8333, (unsigned char *) verack->str,
+				NULL, 0));
+	ip[15] = 2;
+	assert(nc_capture_write(cap, 2, ip, 18333, (unsigned char *) ping->str,
+				ping->str + P2P_HDR_SZ, 8));
+	assert(nc_capture_write(cap, 1, ip, 8333, (unsigned char *) ping->str,
+				ping->str + P2P_HDR_SZ, 8));
+	nc_capture_close(cap);
+
+	FILE *f = fopen(filename, "rb");
+	struct nc_capture_rec rec = {};
+	int64_t t_prev = 0;
+
+	assert(f && nc_capture_read_magic(f));
+
+	assert(nc_capture_read(f, &rec, true));
+	assert(rec.conn_id == 1 && rec.port == 8333 && rec.data_len == 0);
+	assert(!memcmp(rec.hdr, verack->str, P2P_HDR_SZ));
+	t_prev = rec.t_us;
+
+	assert(nc_capture_read(f, &rec, true));
+	assert(rec.conn_id == 2 && rec.port == 18333 && rec.ip[15] == 2);
+	assert(rec.data_len == 8 && !memcmp(rec.data, &nonce, 8));
+	assert(rec.t_us >= t_prev);
+
+	/* payload skipped */
+	assert(nc_capture_read(f, &rec, false));
+	assert(rec.conn_id == 1 && rec.data_len == 8);
+	assert(!nc_capture_read(f, &rec, true));
+
+	nc_capture_rec_free(&rec);
+	fclose(f);
+
+	/* not a capture file */
+	f = fopen(filename, "wb");
+	fwrite(ping->str, ping->len, 1, f);
+	fclose(f);
+	f = fopen(filename, "rb");
+	assert(!nc_capture_read_magic(f));
+	fclose(f);
+
+	assert(unlink(filename) == 0);
+	cstr_free(ping, true);
+	cstr_free(verack, true);
+}
+
+static void test_msgtype(void)
+{
+	assert(nc_msgtype_find("block") == NC_MSG_BLOCK);
+	assert(nc_msgtype_find("getblocktxn") == NC_MSG_GETBLOCKTXN);
+	assert(nc_msgtype_find("blocktxn") == NC_MSG_BLOCKTXN);
+	assert(nc_msgtype_find("alert") == NC_MSG_OTHER);
+	assert(nc_msgtype_find("") == NC_MSG_OTHER);
+
+	unsigned int i;
+	for (i = 0; i < NC_MSG_MAX; i++) {
+		const char *name = nc_msgtype_str(i);
+		assert(name != NULL);
+		assert(nc_msgtype_find(name) == i);
+	}
+	assert(nc_msgtype_str(NC_MSG_MAX) == NULL);
+}
+
+static void test_msgbuf(void)
+{
+	const struct chain_info *chain = chain_find("bitcoin");
+	unsigned char payload[2000];
+	struct nc_msgbuf_stats st0, st;
+
+	memset(payload, 0x5a, sizeof(payload));
+	nc_msgbuf_pool_trim();
+	nc_msgbuf_pool_stats(&st0);
+
+	/* same bytes as message_str() */
+	cstring *s = message_str(chain->netmagic, "inv", payload, 1000);
+	struct nc_msgbuf *mb = nc_msgbuf_new(chain->netmagic, "inv", payload,
+					     1000);
+	assert(mb && mb->len == s->len);
+	assert(!memcmp(mb->data, s->str, s->len));
+	assert(!strcmp(nc_msgbuf_command(mb), "inv"));
+	cstr_free(s, true);
+
+	/* shared: the last reference returns it to the pool */
+	assert(nc_msgbuf_ref(mb) == mb);
+	assert(mb->refs == 2);
+	nc_msgbuf_unref(mb);
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_free[mb->size_class] == st0.n_free[mb->size_class]);
+	nc_msgbuf_unref(mb);
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_free[1] == st0.n_free[1] + 1);
+
+	/* same size class: reused */
+	mb = nc_msgbuf_new(chain->netmagic, "verack", payload,
+			   sizeof(payload));
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_reused == st0.n_reused + 1);
+	assert(st.n_free[1] == st0.n_free[1]);
+	nc_msgbuf_unref(mb);
+
+	/* empty payload, smallest class */
+	mb = nc_msgbuf_new(chain->netmagic, "verack", NULL, 0);
+	assert(mb->len == P2P_HDR_SZ && mb->size_class == 0);
+	nc_msgbuf_unref(mb);
+
+	/* larger than any class: not pooled */
+	size_t big_len = 2 * 1024 * 1024;
+	unsigned char *big = calloc(1, big_len);
+	mb = nc_msgbuf_new(chain->netmagic, "block", big, big_len);
+	assert(mb->size_class == NC_MSGBUF_CLASSES);
+	assert(mb->len == P2P_HDR_SZ + big_len);
+	nc_msgbuf_unref(mb);
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_unpooled == st0.n_unpooled + 1);
+
+	/* spares of the 1M class are capped in bytes, not count */
+	struct nc_msgbuf *mbs[NC_MSGBUF_POOL_MAX];
+	unsigned int i;
+	for (i = 0; i < NC_MSGBUF_POOL_MAX; i++) {
+		mbs[i] = nc_msgbuf_new(chain->netmagic, "block", big,
+				       512 * 1024);
+		assert(mbs[i]->size_class == 3);
+	}
+	for (i = 0; i < NC_MSGBUF_POOL_MAX; i++)
+		nc_msgbuf_unref(mbs[i]);
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_free[3] == NC_MSGBUF_POOL_BYTES / (1024 * 1024));
+	free(big);
+
+	nc_msgbuf_pool_trim();
+	nc_msgbuf_pool_stats(&st);
+	assert(st.n_free[0] == 0 && st.n_free[1] == 0 && st.n_free[3] == 0);
+}
+
+static void test_ratelimit(void)
+{
+	struct nc_ratelimit *rl = nc_ratelimit_new(10000);
+	unsigned int wait_ms = 0;
+
+	/* starts with one second's worth */
+	assert(nc_ratelimit_take(rl, 4000, &wait_ms) == 4000);
+	assert(nc_ratelimit_take(rl, 100000, &wait_ms) == 6000);
+	assert(wait_ms == 0);
+
+	/* empty: told how long to wait */
+	assert(nc_ratelimit_take(rl, 500, &wait_ms) == 0);
+	assert(wait_ms > 0 && wait_ms <= 100);
+	assert(rl->n_throttled == 1);
+
+	/* unspent tokens come back, up to the bucket size */
+	nc_ratelimit_give(rl, 300);
+	assert(nc_ratelimit_take(rl, 300, &wait_ms) == 300);
+	nc_ratelimit_give(rl, 1000000);
+	assert(rl->tokens == rl->rate);
+
+	/* refilled at rate */
+	assert(nc_ratelimit_take(rl, 10000, &wait_ms) == 10000);
+	struct timespec ts = { 0, 50 * 1000 * 1000 };
+	nanosleep(&ts, NULL);
+	size_t n = nc_ratelimit_take(rl, 10000, &wait_ms);
+	assert(n >= 400 && n <= 10000);
+
+	nc_ratelimit_free(rl);
+}
+
 int main (int argc, char *argv[])
 {
+	log_state = calloc(1, sizeof(struct logging));
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+	log_state->debug = false;
+
 	test_addr_str();
+	test_peer_ser();
+	test_peer_pop();
+	test_peer_buckets();
+	test_dns_seeder();
+	test_capture();
+	test_msgtype();
+	test_msgbuf();
+	test_ratelimit();
+
+	free(log_state);
 	return 0;
 }
@@ -0,0 +1,866 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include "peersim.h"
+#include <bitc/buffer.h>               // for const_buffer
+#include <bitc/buint.h>                // for bu256_t, bu256_hash, etc
+#include <bitc/core.h>                 // for bitc_inv, NODE_NETWORK
+#include <bitc/hashtab.h>              // for bitc_hashtab_get, etc
+#include <bitc/hexcode.h>              // for hex_bu256
+#include <bitc/mbr.h>                  // for fread_block
+#include <bitc/message.h>              // for message_str, msg_vinv, etc
+#include <bitc/serialize.h>            // for ser_varlen, ser_bytes
+#include <bitc/util.h>                 // for bu_Hash, file_seq_open, MIN
+
+#include <arpa/inet.h>                  // for htonl, htons, ntohs
+#include <errno.h>                      // for errno, EAGAIN, EINTR
+#include <fcntl.h>                      // for fcntl, O_NONBLOCK
+#include <netinet/in.h>                 // for sockaddr_in
+#include <poll.h>                       // for poll, pollfd, POLLIN
+#include <pthread.h>                    // for pthread_create, etc
+#include <stdio.h>                      // for snprintf
+#include <stdlib.h>                     // for calloc, free, realloc
+#include <sys/socket.h>                 // for socket, bind, accept, etc
+#include <time.h>                       // for clock_gettime
+#include <unistd.h>                     // for close, pread, read, pipe
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+enum {
+	PS_PROTO_VERSION	= 70014,
+	PS_MAX_INV		= 500,		/* per getblocks reply */
+	PS_MAX_HEADERS		= 2000,
+	PS_MAX_MSG		= 32 * 1024 * 1024,
+	PS_MAX_PEERS		= 250,
+	PS_WRITE_CHUNK		= 64 * 1024,
+	PS_POLL_MS		= 100,
+};
+
+struct ps_blk {
+	bu256_t			hash;
+	bu256_t			prev;
+	off_t			off;		/* of block data in file */
+	uint32_t		len;
+	unsigned int		height;
+};
+
+/* reply, held back until due */
+struct ps_out {
+	struct ps_out		*next;
+	int64_t			due_us;
+	cstring			*s;
+	size_t			off;
+};
+
+struct ps_conn {
+	struct ps_conn		*next;
+	int			fd;
+	unsigned int		peer;		/* listener index */
+	bool			bad;		/* misbehaves, eventually */
+	bool			dead;
+
+	cstring			*rx;
+	struct ps_out		*out_head;
+	struct ps_out		*out_tail;
+
+	/* upload token bucket, in bytes */
+	uint64_t		tokens;
+	int64_t			t_fill_us;
+
+	unsigned int		n_served;	/* blocks */
+	unsigned int		cont;		/* last height announced */
+};
+
+struct peersim {
+	struct peersim_opts	opts;
+	const struct chain_info	*chain;
+
+	int			blk_fd;
+	struct ps_blk		*blks;		/* best chain, by height */
+	unsigned int		n_blks;
+	struct bitc_hashtab	*by_hash;	/* hash -> ps_blk */
+
+	int			*listen_fds;
+	uint16_t		port;
+
+	pthread_t		thread;
+	bool			started;
+	bool			stop;
+	int			wake_fd[2];
+
+	struct ps_conn		*conns;
+
+	/* updated by the peer thread */
+	struct peersim_stats	stats;
+};
+
+static int64_t ps_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ps_stat_add(uint64_t *v, uint64_t n)
+{
+	__atomic_add_fetch(v, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Chain
+ */
+
+/* index every block in the file, then keep the best chain only */
+static bool ps_load(struct peersim *ps, const char *blocks_fn)
+{
+	struct ps_blk *all = NULL;
+	unsigned int n_all = 0, alloc = 0;
+	struct bitc_hashtab *by_prev = NULL;
+	bool rc = false;
+
+	int fd = file_seq_open(blocks_fn);
+	if (fd < 0) {
+		perror(blocks_fn);
+		return false;
+	}
+
+	struct p2p_message msg = {};
+	bool read_ok = false;
+	off_t fpos = 0;
+
+	while (fread_block(fd, &msg, &read_ok)) {
+		fpos += sizeof(struct p2p_blockfile_hdr);
+
+		if (!ps->chain)
+			ps->chain = chain_find_by_netmagic(msg.hdr.netmagic);
+		if (!ps->chain ||
+		    memcmp(msg.hdr.netmagic, ps->chain->netmagic, 4) ||
+		    (msg.hdr.data_len < 80))
+			goto out;
+
+		if (n_all == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			struct ps_blk *tmp = realloc(all, alloc * sizeof(*all));
+			if (!tmp)
+				goto out;
+			all = tmp;
+		}
+
+		struct ps_blk *blk = &all[n_all++];
+		bu_Hash((unsigned char *) &blk->hash, msg.data, 80);
+		memcpy(&blk->prev, (unsigned char *) msg.data + 4,
+		       sizeof(blk->prev));
+		blk->off = fpos;
+		blk->len = msg.hdr.data_len;
+
+		fpos += msg.hdr.data_len;
+	}
+
+	if (!read_ok || !ps->chain)
+		goto out;
+
+	/* files from bitcoind hold blocks out of order; follow the links */
+	by_prev = bitc_hashtab_new_ext(bu256_hash, bu256_equal_, NULL, NULL);
+
+	unsigned int i;
+	for (i = 0; i < n_all; i++)
+		if (!bitc_hashtab_get(by_prev, &all[i].prev))
+			bitc_hashtab_put(by_prev, &all[i].prev, &all[i]);
+
+	bu256_t genesis;
+	if (!hex_bu256(&genesis, ps->chain->genesis_hash))
+		goto out;
+
+	struct ps_blk *cur = NULL;
+	for (i = 0; i < n_all; i++)
+		if (bu256_equal(&all[i].hash, &genesis))
+			cur = &all[i];
+
+	ps->blks = calloc(n_all ? n_all : 1, sizeof(*ps->blks));
+	if (!ps->blks)
+		goto out;
+
+	while (cur && ps->n_blks < n_all) {
+		struct ps_blk *blk = &ps->blks[ps->n_blks];
+
+		*blk = *cur;
+		blk->height = ps->n_blks++;
+
+		cur = bitc_hashtab_get(by_prev, &blk->hash);
+	}
+
+	if (!ps->n_blks)
+		goto out;
+
+	ps->by_hash = bitc_hashtab_new_ext(bu256_hash, bu256_equal_,
+					   NULL, NULL);
+	for (i = 0; i < ps->n_blks; i++)
+		bitc_hashtab_put(ps->by_hash, &ps->blks[i].hash, &ps->blks[i]);
+
+	ps->blk_fd = fd;
+	fd = -1;
+	rc = true;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(msg.data);
+	free(all);
+	if (by_prev)
+		bitc_hashtab_unref(by_prev);
+	return rc;
+}
+
+cstring *peersim_block(struct peersim *ps, unsigned int height)
+{
+	if (height >= ps->n_blks)
+		return NULL;
+
+	const struct ps_blk *blk = &ps->blks[height];
+	cstring *s = cstr_new_sz(blk->len);
+
+	if (!cstr_resize(s, blk->len) ||
+	    (pread(ps->blk_fd, s->str, blk->len, blk->off) != blk->len)) {
+		cstr_free(s, true);
+		return NULL;
+	}
+
+	return s;
+}
+
+/* first locator hash we know, or genesis */
+static unsigned int ps_locate(struct peersim *ps,
+			      const struct bitc_locator *locator)
+{
+	unsigned int i;
+	for (i = 0; locator->vHave && (i < locator->vHave->len); i++) {
+		const struct ps_blk *blk;
+		blk = bitc_hashtab_get(ps->by_hash,
+				       parr_idx(locator->vHave, i));
+		if (blk)
+			return blk->height;
+	}
+
+	return 0;
+}
+
+/*
+ * Connections
+ */
+
+static void ps_conn_free(struct ps_conn *conn)
+{
+	while (conn->out_head) {
+		struct ps_out *out = conn->out_head;
+		conn->out_head = out->next;
+		cstr_free(out->s, true);
+		free(out);
+	}
+
+	if (conn->fd >= 0)
+		close(conn->fd);
+	cstr_free(conn->rx, true);
+	free(conn);
+}
+
+static void ps_queue(struct peersim *ps, struct ps_conn *conn, cstring *s)
+{
+	struct ps_out *out = calloc(1, sizeof(*out));
+
+	out->s = s;
+	out->due_us = ps_now_us() + (int64_t) ps->opts.latency_ms * 1000;
+
+	if (conn->out_tail)
+		conn->out_tail->next = out;
+	else
+		conn->out_head = out;
+	conn->out_tail = out;
+}
+
+static void ps_send(struct peersim *ps, struct ps_conn *conn,
+		    const char *command, const void *data, size_t len)
+{
+	ps_queue(ps, conn, message_str(ps->chain->netmagic, command,
+				       data, len));
+}
+
+static uint64_t ps_burst(const struct peersim *ps)
+{
+	uint64_t burst = ps->opts.bandwidth / 10;
+
+	return (burst < 4096) ? 4096 : burst;
+}
+
+static void ps_refill(struct peersim *ps, struct ps_conn *conn, int64_t now)
+{
+	uint64_t add = (uint64_t) (now - conn->t_fill_us) *
+		       ps->opts.bandwidth / 1000000;
+
+	/* sub-byte credit accrues until it is worth a byte */
+	if (!add)
+		return;
+
+	conn->tokens = MIN(conn->tokens + add, ps_burst(ps));
+	conn->t_fill_us = now;
+}
+
+static void ps_flush(struct peersim *ps, struct ps_conn *conn)
+{
+	int64_t now = ps_now_us();
+
+	while (conn->out_head && (conn->out_head->due_us <= now)) {
+		struct ps_out *out = conn->out_head;
+		size_t len = MIN(out->s->len - out->off, PS_WRITE_CHUNK);
+
+		if (ps->opts.bandwidth) {
+			ps_refill(ps, conn, now);
+			len = MIN(len, conn->tokens);
+			if (!len)
+				return;
+		}
+
+		ssize_t wrc = send(conn->fd, out->s->str + out->off, len,
+				   MSG_NOSIGNAL);
+		if (wrc < 0) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				conn->dead = true;
+			return;
+		}
+
+		if (ps->opts.bandwidth)
+			conn->tokens -= wrc;
+		ps_stat_add(&ps->stats.n_bytes, wrc);
+
+		out->off += wrc;
+		if (out->off < out->s->len)
+			continue;
+
+		conn->out_head = out->next;
+		if (!conn->out_head)
+			conn->out_tail = NULL;
+		cstr_free(out->s, true);
+		free(out);
+	}
+}
+
+/* ms until conn can write again, or -1 if it waits on the socket */
+static int ps_wait_ms(struct peersim *ps, struct ps_conn *conn, int64_t now)
+{
+	const struct ps_out *out = conn->out_head;
+
+	if (!out)
+		return PS_POLL_MS;
+	if (out->due_us > now)
+		return (int) ((out->due_us - now + 999) / 1000);
+
+	if (ps->opts.bandwidth) {
+		ps_refill(ps, conn, now);
+		if (!conn->tokens)
+			return (int) (1 + 1000 * 1460 / ps->opts.bandwidth);
+	}
+
+	return -1;
+}
+
+/*
+ * Messages
+ */
+
+static void ps_msg_version(struct peersim *ps, struct ps_conn *conn)
+{
+	struct msg_version mv;
+
+	msg_version_init(&mv);
+	mv.nVersion = PS_PROTO_VERSION;
+	mv.nServices = NODE_NETWORK;
+	mv.nTime = (int64_t) time(NULL);
+	mv.nonce = 0x7065657273696d00ULL | conn->peer;	/* not the node's */
+	snprintf(mv.strSubVer, sizeof(mv.strSubVer), "/peersim:%u/",
+		 conn->peer);
+	mv.nStartingHeight = ps->n_blks - 1;
+
+	cstring *s = ser_msg_version(&mv);
+	ps_send(ps, conn, "version", s->str, s->len);
+	cstr_free(s, true);
+
+	ps_send(ps, conn, "verack", NULL, 0);
+}
+
+/* announce up to PS_MAX_INV blocks after height */
+static void ps_inv_from(struct peersim *ps, struct ps_conn *conn,
+			unsigned int height, const bu256_t *hash_stop)
+{
+	struct msg_vinv mv;
+	msg_vinv_init(&mv);
+
+	unsigned int h;
+	for (h = height + 1; (h < ps->n_blks) && (h <= height + PS_MAX_INV);
+	     h++) {
+		msg_vinv_push(&mv, MSG_BLOCK, &ps->blks[h].hash);
+		conn->cont = h;
+		if (hash_stop && bu256_equal(hash_stop, &ps->blks[h].hash))
+			break;
+	}
+
+	if (mv.invs && mv.invs->len) {
+		cstring *s = ser_msg_vinv(&mv);
+		ps_send(ps, conn, "inv", s->str, s->len);
+		cstr_free(s, true);
+	}
+
+	msg_vinv_free(&mv);
+}
+
+static bool ps_msg_getblocks(struct peersim *ps, struct ps_conn *conn,
+			     struct const_buffer *buf)
+{
+	struct msg_getblocks gb;
+	msg_getblocks_init(&gb);
+
+	bool rc = deser_msg_getblocks(&gb, buf);
+	if (rc)
+		ps_inv_from(ps, conn, ps_locate(ps, &gb.locator),
+			    &gb.hash_stop);
+
+	msg_getblocks_free(&gb);
+	return rc;
+}
+
+static bool ps_msg_getheaders(struct peersim *ps, struct ps_conn *conn,
+			      struct const_buffer *buf)
+{
+	struct msg_getblocks gh;
+	msg_getblocks_init(&gh);
+
+	if (!deser_msg_getblocks(&gh, buf)) {
+		msg_getblocks_free(&gh);
+		return false;
+	}
+
+	unsigned int start = ps_locate(ps, &gh.locator) + 1;
+	unsigned int end = MIN(ps->n_blks, start + PS_MAX_HEADERS);
+	unsigned char hdr[80];
+	cstring *s = cstr_new_sz(3 + (end - start) * sizeof(hdr) + 1);
+
+	/* count is fixed up below, should hash_stop cut it short */
+	unsigned int h;
+	for (h = start; h < end; h++) {
+		const struct ps_blk *blk = &ps->blks[h];
+		if (pread(ps->blk_fd, hdr, sizeof(hdr), blk->off) !=
+		    sizeof(hdr))
+			break;
+		ser_bytes(s, hdr, sizeof(hdr));
+		ser_varlen(s, 0);
+		if (bu256_equal(&gh.hash_stop, &blk->hash)) {
+			h++;
+			break;
+		}
+	}
+
+	cstring *msg = cstr_new_sz(s->len + 9);
+	ser_varlen(msg, (h > start) ? h - start : 0);
+	cstr_append_buf(msg, s->str, s->len);
+	ps_send(ps, conn, "headers", msg->str, msg->len);
+
+	cstr_free(msg, true);
+	cstr_free(s, true);
+	msg_getblocks_free(&gh);
+	return true;
+}
+
+static void ps_serve_block(struct peersim *ps, struct ps_conn *conn,
+			   const struct ps_blk *blk)
+{
+	enum peersim_misbehave mb = PSM_NONE;
+
+	if (conn->bad && (conn->n_served >= ps->opts.misbehave_after))
+		mb = ps->opts.misbehave;
+
+	if (mb == PSM_STALL)
+		return;
+	if (mb == PSM_DISCONNECT) {
+		conn->dead = true;
+		return;
+	}
+
+	cstring *data = peersim_block(ps, blk->height);
+	if (!data) {
+		conn->dead = true;
+		return;
+	}
+
+	/* a flipped merkle root bit still deserializes, but fails checks */
+	if (mb == PSM_CORRUPT)
+		data->str[36] ^= 0x01;
+
+	cstring *s = message_str(ps->chain->netmagic, "block",
+				 data->str, data->len);
+	if (mb == PSM_GARBAGE)
+		s->str[20] ^= 0xff;		/* checksum */
+
+	ps_queue(ps, conn, s);
+	cstr_free(data, true);
+
+	conn->n_served++;
+	ps_stat_add(&ps->stats.n_blocks, 1);
+
+	/* served the last one announced: announce the next batch */
+	if ((blk->height == conn->cont) && (conn->cont + 1 < ps->n_blks))
+		ps_inv_from(ps, conn, conn->cont, NULL);
+}
+
+static bool ps_msg_getdata(struct peersim *ps, struct ps_conn *conn,
+			   struct const_buffer *buf)
+{
+	struct msg_vinv mv, mv_nf;
+	msg_vinv_init(&mv);
+	msg_vinv_init(&mv_nf);
+
+	bool rc = deser_msg_vinv(&mv, buf);
+
+	unsigned int i;
+	for (i = 0; rc && mv.invs && (i < mv.invs->len) && !conn->dead; i++) {
+		struct bitc_inv *inv = parr_idx(mv.invs, i);
+		const struct ps_blk *blk = NULL;
+
+		/* compact blocks are never offered; witness flag ignored */
+		if ((inv->type & 0xffff) == MSG_BLOCK)
+			blk = bitc_hashtab_get(ps->by_hash, &inv->hash);
+
+		if (blk)
+			ps_serve_block(ps, conn, blk);
+		else
+			msg_vinv_push(&mv_nf, inv->type, &inv->hash);
+	}
+
+	if (mv_nf.invs && mv_nf.invs->len) {
+		cstring *s = ser_msg_vinv(&mv_nf);
+		ps_send(ps, conn, "notfound", s->str, s->len);
+		cstr_free(s, true);
+	}
+
+	msg_vinv_free(&mv);
+	msg_vinv_free(&mv_nf);
+	return rc;
+}
+
+static bool ps_msg(struct peersim *ps, struct ps_conn *conn,
+		   const struct p2p_message *msg)
+{
+	struct const_buffer buf = { msg->data, msg->hdr.data_len };
+	const char *command = msg->hdr.command;
+
+	if (!strncmp(command, "version", 12))
+		ps_msg_version(ps, conn);
+	else if (!strncmp(command, "getblocks", 12))
+		return ps_msg_getblocks(ps, conn, &buf);
+	else if (!strncmp(command, "getheaders", 12))
+		return ps_msg_getheaders(ps, conn, &buf);
+	else if (!strncmp(command, "getdata", 12))
+		return ps_msg_getdata(ps, conn, &buf);
+	else if (!strncmp(command, "ping", 12))
+		ps_send(ps, conn, "pong", msg->data, msg->hdr.data_len);
+
+	/* everything else is of no interest */
+	return true;
+}
+
+static void ps_read(struct peersim *ps, struct ps_conn *conn)
+{
+	unsigned char buf[64 * 1024];
+
+	ssize_t rrc = read(conn->fd, buf, sizeof(buf));
+	if (rrc <= 0) {
+		if ((rrc == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			conn->dead = true;
+		return;
+	}
+
+	cstr_append_buf(conn->rx, buf, rrc);
+
+	while (!conn->dead && (conn->rx->len >= P2P_HDR_SZ)) {
+		struct p2p_message msg;
+		parse_message_hdr(&msg.hdr, (unsigned char *) conn->rx->str);
+
+		if (memcmp(msg.hdr.netmagic, ps->chain->netmagic, 4) ||
+		    (msg.hdr.data_len > PS_MAX_MSG)) {
+			conn->dead = true;
+			return;
+		}
+
+		size_t msg_len = P2P_HDR_SZ + msg.hdr.data_len;
+		if (conn->rx->len < msg_len)
+			return;
+
+		msg.data = conn->rx->str + P2P_HDR_SZ;
+		if (!ps_msg(ps, conn, &msg))
+			conn->dead = true;
+
+		cstr_erase(conn->rx, 0, msg_len);
+	}
+}
+
+static void ps_accept(struct peersim *ps, unsigned int peer)
+{
+	int fd = accept(ps->listen_fds[peer], NULL, NULL);
+	if (fd < 0)
+		return;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	struct ps_conn *conn = calloc(1, sizeof(*conn));
+	conn->fd = fd;
+	conn->peer = peer;
+	conn->rx = cstr_new_sz(P2P_HDR_SZ);
+	conn->t_fill_us = ps_now_us();
+	conn->tokens = ps_burst(ps);
+	conn->bad = (ps->opts.misbehave != PSM_NONE) &&
+		    ps->opts.misbehave_every &&
+		    ((peer % ps->opts.misbehave_every) == 0);
+
+	conn->next = ps->conns;
+	ps->conns = conn;
+
+	ps_stat_add(&ps->stats.n_conns, 1);
+}
+
+static void ps_reap(struct peersim *ps)
+{
+	struct ps_conn **pp = &ps->conns;
+
+	while (*pp) {
+		struct ps_conn *conn = *pp;
+		if (conn->dead) {
+			*pp = conn->next;
+			ps_conn_free(conn);
+		} else
+			pp = &conn->next;
+	}
+}
+
+static void *ps_main(void *priv)
+{
+	struct peersim *ps = priv;
+	unsigned int n_peers = ps->opts.n_peers;
+
+	while (!__atomic_load_n(&ps->stop, __ATOMIC_ACQUIRE)) {
+		unsigned int n_conns = 0;
+		struct ps_conn *conn;
+		for (conn = ps->conns; conn; conn = conn->next)
+			n_conns++;
+
+		struct pollfd pfd[1 + n_peers + n_conns];
+		struct ps_conn *pconn[n_conns ? n_conns : 1];
+		int64_t now = ps_now_us();
+		int timeout = PS_POLL_MS;
+		unsigned int i, n = 0;
+
+		pfd[n].fd = ps->wake_fd[0];
+		pfd[n++].events = POLLIN;
+		for (i = 0; i < n_peers; i++) {
+			pfd[n].fd = ps->listen_fds[i];
+			pfd[n++].events = POLLIN;
+		}
+		for (conn = ps->conns, i = 0; conn; conn = conn->next, i++) {
+			int wait_ms = ps_wait_ms(ps, conn, now);
+
+			pconn[i] = conn;
+			pfd[n].fd = conn->fd;
+			pfd[n].events = POLLIN | ((wait_ms < 0) ? POLLOUT : 0);
+			n++;
+
+			if ((wait_ms >= 0) && (wait_ms < timeout))
+				timeout = wait_ms;
+		}
+
+		if ((poll(pfd, n, timeout) < 0) && (errno != EINTR))
+			break;
+
+		for (i = 0; i < n_peers; i++)
+			if (pfd[1 + i].revents & POLLIN)
+				ps_accept(ps, i);
+
+		for (i = 0; i < n_conns; i++) {
+			conn = pconn[i];
+			if (pfd[1 + n_peers + i].revents & (POLLIN | POLLHUP))
+				ps_read(ps, conn);
+			if (!conn->dead)
+				ps_flush(ps, conn);
+		}
+
+		ps_reap(ps);
+	}
+
+	return NULL;
+}
+
+/*
+ * Setup
+ */
+
+static int ps_listen(unsigned int peer, uint16_t *port)
+{
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(0x7f000001 | ((peer + 1) << 16));
+	sa.sin_port = htons(*port);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	socklen_t sl = sizeof(sa);
+	if ((bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) ||
+	    (listen(fd, 16) < 0) ||
+	    (getsockname(fd, (struct sockaddr *) &sa, &sl) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	/* all peers share the port picked for the first */
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+struct peersim *peersim_new(const char *blocks_fn,
+			    const struct peersim_opts *opts)
+{
+	if (!opts->n_peers || (opts->n_peers > PS_MAX_PEERS))
+		return NULL;
+
+	struct peersim *ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return NULL;
+
+	ps->opts = *opts;
+	ps->blk_fd = -1;
+	ps->wake_fd[0] = ps->wake_fd[1] = -1;
+
+	if (!ps_load(ps, blocks_fn))
+		goto err_out;
+
+	ps->listen_fds = calloc(opts->n_peers, sizeof(int));
+	if (!ps->listen_fds)
+		goto err_out;
+
+	unsigned int i;
+	for (i = 0; i < opts->n_peers; i++)
+		ps->listen_fds[i] = -1;
+	for (i = 0; i < opts->n_peers; i++) {
+		ps->listen_fds[i] = ps_listen(i, &ps->port);
+		if (ps->listen_fds[i] < 0)
+			goto err_out;
+	}
+
+	if (pipe(ps->wake_fd) < 0)
+		goto err_out;
+
+	return ps;
+
+err_out:
+	peersim_free(ps);
+	return NULL;
+}
+
+bool peersim_start(struct peersim *ps)
+{
+	if (pthread_create(&ps->thread, NULL, ps_main, ps))
+		return false;
+
+	ps->started = true;
+	return true;
+}
+
+void peersim_free(struct peersim *ps)
+{
+	if (!ps)
+		return;
+
+	if (ps->started) {
+		__atomic_store_n(&ps->stop, true, __ATOMIC_RELEASE);
+		if (write(ps->wake_fd[1], "", 1) < 0) {
+			/* poll times out anyway */
+		}
+		pthread_join(ps->thread, NULL);
+	}
+
+	while (ps->conns) {
+		struct ps_conn *conn = ps->conns;
+		ps->conns = conn->next;
+		ps_conn_free(conn);
+	}
+
+	unsigned int i;
+	for (i = 0; ps->listen_fds && (i < ps->opts.n_peers); i++)
+		if (ps->listen_fds[i] >= 0)
+			close(ps->listen_fds[i]);
+	free(ps->listen_fds);
+
+	if (ps->wake_fd[0] >= 0) {
+		close(ps->wake_fd[0]);
+		close(ps->wake_fd[1]);
+	}
+
+	if (ps->by_hash)
+		bitc_hashtab_unref(ps->by_hash);
+	free(ps->blks);
+	if (ps->blk_fd >= 0)
+		close(ps->blk_fd);
+	free(ps);
+}
+
+const struct chain_info *peersim_chain(const struct peersim *ps)
+{
+	return ps->chain;
+}
+
+unsigned int peersim_height(const struct peersim *ps)
+{
+	return ps->n_blks - 1;
+}
+
+/* "address SPACE port", as peerman_addstr() takes it */
+void peersim_addr_str(const struct peersim *ps, unsigned int idx,
+		      char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "127.%u.0.1 %u", idx + 1, ps->port);
+}
+
+void peersim_stats(const struct peersim *ps, struct peersim_stats *st)
+{
+	st->n_conns = __atomic_load_n(&ps->stats.n_conns, __ATOMIC_RELAXED);
+	st->n_blocks = __atomic_load_n(&ps->stats.n_blocks, __ATOMIC_RELAXED);
+	st->n_bytes = __atomic_load_n(&ps->stats.n_bytes, __ATOMIC_RELAXED);
+}
+
+bool peersim_misbehave_parse(const char *s, enum peersim_misbehave *mb)
+{
+	static const char *names[] = {
+		[PSM_NONE]		= "none",
+		[PSM_STALL]		= "stall",
+		[PSM_CORRUPT]		= "corrupt",
+		[PSM_GARBAGE]		= "garbage",
+		[PSM_DISCONNECT]	= "disconnect",
+	};
+
+	unsigned int i;
+	for (i = 0; i < ARRAY_SIZE(names); i++)
+		if (!strcmp(s, names[i])) {
+			*mb = i;
+			return true;
+		}
+
+	return false;
+}
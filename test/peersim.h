@@ -0,0 +1,77 @@
+#ifndef __LIBTEST_PEERSIM_H__
+#define __LIBTEST_PEERSIM_H__
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#include <bitc/coredefs.h>              // for chain_info
+#include <bitc/cstr.h>                  // for cstring
+
+#include <stdbool.h>                    // for bool
+#include <stdint.h>                     // for uint64_t
+#include <string.h>                     // for memset
+
+/*
+ * Local synthetic peers, serving a chain read from a blocks.dat-style
+ * file (netmagic, length, block; as written by mkbootstrap or bitcoind)
+ * to a node under test.  Each simulated peer listens on its own
+ * loopback address, 127.N.0.1, so the node's peer manager keeps them
+ * apart.  All peers are driven by one thread.
+ *
+ * The message set is what lib/net/net.c speaks: version/verack,
+ * getblocks/inv, getheaders/headers, getdata/block, ping/pong.  When
+ * the last block of an inv batch is served, the next batch is
+ * announced unprompted, standing in for the getblocks round trip.
+ */
+
+enum peersim_misbehave {
+	PSM_NONE,
+	PSM_STALL,		/* take getdata, never deliver */
+	PSM_CORRUPT,		/* deliver blocks that fail validation */
+	PSM_GARBAGE,		/* send a message with a bad checksum */
+	PSM_DISCONNECT,		/* hang up */
+};
+
+struct peersim_opts {
+	unsigned int		n_peers;
+	uint64_t		bandwidth;	/* bytes/sec per conn; 0: no limit */
+	unsigned int		latency_ms;	/* added to every reply */
+
+	/* one peer in every misbehave_every (from the first) turns bad
+	 * once it has served misbehave_after blocks
+	 */
+	enum peersim_misbehave	misbehave;
+	unsigned int		misbehave_every;
+	unsigned int		misbehave_after;
+};
+
+static inline void peersim_opts_init(struct peersim_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->n_peers = 1;
+}
+
+struct peersim_stats {
+	uint64_t		n_conns;
+	uint64_t		n_blocks;	/* served */
+	uint64_t		n_bytes;	/* sent, all messages */
+};
+
+struct peersim;
+
+extern struct peersim *peersim_new(const char *blocks_fn,
+				   const struct peersim_opts *opts);
+extern bool peersim_start(struct peersim *ps);
+extern void peersim_free(struct peersim *ps);
+
+extern const struct chain_info *peersim_chain(const struct peersim *ps);
+extern unsigned int peersim_height(const struct peersim *ps);
+extern cstring *peersim_block(struct peersim *ps, unsigned int height);
+extern void peersim_addr_str(const struct peersim *ps, unsigned int idx,
+			     char *buf, size_t buflen);
+extern void peersim_stats(const struct peersim *ps, struct peersim_stats *st);
+extern bool peersim_misbehave_parse(const char *s,
+				    enum peersim_misbehave *mb);
+
+#endif /* __LIBTEST_PEERSIM_H__ */
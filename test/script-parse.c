@@ -67,6 +67,134 @@ static void test_txout(const struct bitc_txout *txout)
 	assert(cstr_equal(s, txout->scriptPubKey));
 
 	cstr_free(s, true);
+
+	/* template matcher agrees with the parse-then-classify path */
+	parr *all = bsp_parse_all(buf.p, buf.len);
+	struct bscript_tmpl tmpl;
+	assert(all != NULL);
+	assert(bsp_tmpl_match(&tmpl, buf.p, buf.len));
+	assert(tmpl.txtype == bsp_classify(all));
+	if (tmpl.txtype == TX_PUBKEYHASH) {
+		struct bscript_op *op_p = parr_idx(all, 2);
+		assert(tmpl.n_data == 1);
+		assert(tmpl.data[0].p == op_p->data.p);
+		assert(tmpl.data[0].len == 20);
+	}
+	parr_free(all, true);
+}
+
+static void check_tmpl(const cstring *s, enum txnouttype txtype,
+		       unsigned int n_data)
+{
+	struct bscript_tmpl tmpl;
+
+	assert(bsp_tmpl_match(&tmpl, s->str, s->len));
+	assert(tmpl.txtype == txtype);
+	assert(tmpl.n_data == n_data);
+
+	unsigned int i;
+	for (i = 0; i < n_data; i++) {
+		const char *p = tmpl.data[i].p;
+		assert(p > s->str && p + tmpl.data[i].len <= s->str + s->len);
+	}
+
+	/* legacy types, as bsp_classify sees them */
+	parr *all = bsp_parse_all(s->str, s->len);
+	assert(all != NULL);
+	if (txtype <= TX_MULTISIG)
+		assert(bsp_classify(all) == txtype);
+	else
+		assert(bsp_classify(all) == TX_NONSTANDARD);
+	parr_free(all, true);
+}
+
+static void test_templates(void)
+{
+	unsigned char key[65], hash[32];
+	struct bscript_tmpl tmpl;
+	cstring *s;
+
+	memset(key, 0x02, sizeof(key));
+	memset(hash, 0xab, sizeof(hash));
+
+	/* P2PKH, with the hash pushed the long way */
+	s = cstr_new_sz(32);
+	bsp_push_op(s, OP_DUP);
+	bsp_push_op(s, OP_HASH160);
+	bsp_push_op(s, OP_PUSHDATA1);
+	cstr_append_c(s, 20);
+	cstr_append_buf(s, hash, 20);
+	bsp_push_op(s, OP_EQUALVERIFY);
+	bsp_push_op(s, OP_CHECKSIG);
+	check_tmpl(s, TX_PUBKEYHASH, 1);
+	cstr_free(s, true);
+
+	cstring *h = cstr_new_buf(hash, 20);
+	s = bsp_make_scripthash(h);
+	check_tmpl(s, TX_SCRIPTHASH, 1);
+	cstr_free(s, true);
+	cstr_free(h, true);
+
+	s = cstr_new_sz(80);
+	bsp_push_data(s, key, 65);
+	bsp_push_op(s, OP_CHECKSIG);
+	check_tmpl(s, TX_PUBKEY, 1);
+	cstr_free(s, true);
+
+	/* 2 of 3 */
+	s = cstr_new_sz(128);
+	bsp_push_op(s, OP_2);
+	bsp_push_data(s, key, 33);
+	bsp_push_data(s, key, 33);
+	bsp_push_data(s, key, 65);
+	bsp_push_op(s, OP_3);
+	bsp_push_op(s, OP_CHECKMULTISIG);
+	check_tmpl(s, TX_MULTISIG, 3);
+	assert(bsp_tmpl_match(&tmpl, s->str, s->len));
+	assert(tmpl.n_req == 2);
+	assert(tmpl.data[2].len == 65);
+	cstr_free(s, true);
+
+	/* witness programs */
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_0);
+	bsp_push_data(s, hash, 20);
+	check_tmpl(s, TX_WITNESS_V0_KEYHASH, 1);
+	cstr_free(s, true);
+
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_0);
+	bsp_push_data(s, hash, 32);
+	check_tmpl(s, TX_WITNESS_V0_SCRIPTHASH, 1);
+	cstr_free(s, true);
+
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_1);
+	bsp_push_data(s, hash, 32);
+	check_tmpl(s, TX_WITNESS_UNKNOWN, 1);
+	assert(bsp_tmpl_match(&tmpl, s->str, s->len));
+	assert(tmpl.version == 1);
+	cstr_free(s, true);
+
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_0);
+	bsp_push_data(s, hash, 24);
+	check_tmpl(s, TX_NONSTANDARD, 0);
+	cstr_free(s, true);
+
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_RETURN);
+	bsp_push_data(s, hash, 32);
+	check_tmpl(s, TX_NONSTANDARD, 0);
+	cstr_free(s, true);
+
+	/* a push running off the end */
+	s = cstr_new_sz(64);
+	bsp_push_op(s, OP_DUP);
+	cstr_append_c(s, 20);
+	cstr_append_buf(s, hash, 10);
+	assert(!bsp_tmpl_match(&tmpl, s->str, s->len));
+	cstr_free(s, true);
 }
 
 static void runtest(const char *ser_fn_base)
@@ -121,6 +249,7 @@ int main (int argc, char *argv[])
 	assert(!strcmp(opn, "<unknown>"));
 
 	runtest("data/blk120383.ser");
+	test_templates();
 
 	bitc_key_static_shutdown();
 	return 0;
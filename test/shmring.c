@@ -0,0 +1,133 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/log.h>
+#include <bitc/net/shmring.h>
+#include "libtest.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct logging *log_state;
+
+static void fill(unsigned char *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char) (seed * 31 + i);
+}
+
+static void test_basic(void)
+{
+	struct shmring ring;
+	unsigned char buf[1000];
+
+	assert(shmring_init(&ring, 4096) == true);
+	assert(ring.size == 4096);
+	assert(shmring_peek(&ring) == NULL);
+
+	/* too large, ever */
+	assert(shmring_put(&ring, SHMR_BLOCK, buf, 4096) == false);
+
+	/* fill until full, then drain */
+	unsigned int n = 0;
+	fill(buf, sizeof(buf), 0);
+	while (shmring_put(&ring, SHMR_BLOCK, buf, sizeof(buf)))
+		n++;
+	assert(n == 4);
+
+	const struct shmring_rec *rec;
+	unsigned int got = 0;
+	while ((rec = shmring_peek(&ring)) != NULL) {
+		assert(rec->type == SHMR_BLOCK);
+		assert(rec->len == sizeof(buf));
+		assert(memcmp(rec->data, buf, sizeof(buf)) == 0);
+		shmring_release(&ring);
+		got++;
+	}
+	assert(got == n);
+
+	/* next record wraps: padding is skipped by the reader */
+	fill(buf, sizeof(buf), 1);
+	assert(shmring_put(&ring, SHMR_HEADER, buf, 80) == true);
+	assert(shmring_put(&ring, SHMR_BLOCK, buf, sizeof(buf)) == true);
+
+	rec = shmring_peek(&ring);
+	assert(rec && rec->type == SHMR_HEADER && rec->len == 80);
+	shmring_release(&ring);
+	rec = shmring_peek(&ring);
+	assert(rec && rec->type == SHMR_BLOCK);
+	assert(memcmp(rec->data, buf, sizeof(buf)) == 0);
+	shmring_release(&ring);
+	assert(shmring_wait(&ring, 0) == false);
+
+	shmring_free(&ring);
+}
+
+/* child produces records of varying sizes; parent checks them in place */
+static void test_fork(void)
+{
+	const unsigned int n_recs = 2000;
+	struct shmring ring;
+
+	assert(shmring_init(&ring, 64 * 1024) == true);
+
+	pid_t child = fork();
+	assert(child >= 0);
+
+	if (child == 0) {
+		unsigned char buf[20000];
+		unsigned int i;
+
+		for (i = 0; i < n_recs; i++) {
+			size_t len = (i * 7919) % sizeof(buf);
+			fill(buf, len, i);
+			if (!shmring_put_wait(&ring, SHMR_BLOCK, buf, len, 5000))
+				_exit(1);
+		}
+		_exit(0);
+	}
+
+	unsigned char buf[20000];
+	unsigned int i;
+	for (i = 0; i < n_recs; i++) {
+		assert(shmring_wait(&ring, 5000) == true);
+
+		const struct shmring_rec *rec = shmring_peek(&ring);
+		size_t len = (i * 7919) % sizeof(buf);
+		fill(buf, len, i);
+
+		assert(rec->type == SHMR_BLOCK);
+		assert(rec->len == len);
+		assert(memcmp(rec->data, buf, len) == 0);
+
+		shmring_release(&ring);
+	}
+
+	int status;
+	assert(waitpid(child, &status, 0) == child);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	shmring_free(&ring);
+}
+
+int main (int argc, char *argv[])
+{
+	log_state = calloc(1, sizeof(struct logging));
+
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+	log_state->debug = true;
+
+	test_basic();
+	test_fork();
+
+	free(log_state);
+	return 0;
+}
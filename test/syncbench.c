@@ -0,0 +1,471 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+/*
+ * End-to-end sync through the net engine, from local simulated peers
+ * into chaindb and the LMDB block store.  With --blocks, a benchmark
+ * reporting blocks/sec and MB/sec; without, a self-test on blks10.ser.
+ */
+
+#include <bitc/db/chaindb.h>           // for chaindb, chaindb_add, etc
+#include <bitc/db/db.h>                // for metadb_init, blockdb_add, etc
+#include <bitc/buint.h>                // for bu256_t, bu256_hash, etc
+#include <bitc/core.h>                 // for bitc_block, deser_bitc_block
+#include <bitc/cstr.h>                 // for cstring, cstr_free
+#include <bitc/hashtab.h>              // for bitc_hashtab_get, etc
+#include <bitc/hexcode.h>              // for hex_bu256
+#include <bitc/log.h>                  // for logging
+#include <bitc/net/net.h>              // for net_child_info, etc
+#include <bitc/net/peerman.h>          // for peerman_seed, peerman_addstr
+#include <bitc/parr.h>                 // for parr_new, parr_free
+#include "libtest.h"
+#include "peersim.h"
+
+#include <event.h>                     // for event_base_dispatch, etc
+
+#include <argp.h>                       // for argp_parse, etc
+#include <assert.h>                     // for assert
+#include <signal.h>                     // for signal, SIGPIPE, SIG_IGN
+#include <stdio.h>                      // for printf, fprintf
+#include <stdlib.h>                     // for strtoul, mkdtemp, free
+#include <string.h>                     // for strcmp, memset
+#include <time.h>                       // for clock_gettime
+#include <unistd.h>                     // for chdir, rmdir, unlink
+
+struct logging *log_state;
+
+const char *argp_program_version = PACKAGE_VERSION;
+
+static struct argp_option options[] = {
+	{ "blocks", 'b', "FILE", 0,
+	  "Serve blockchain data from mkbootstrap-produced FILE, and benchmark.  Without it, self-test on data/blks10.ser." },
+	{ "peers", 'p', "N", 0,
+	  "Number of simulated peers.  Default 4." },
+	{ "bandwidth", 'w', "BYTES", 0,
+	  "Upload limit of each peer, in bytes/sec.  Default none." },
+	{ "latency", 'l', "MS", 0,
+	  "Delay added to each peer reply, in milliseconds." },
+	{ "misbehave", 'm', "MODE", 0,
+	  "Peer misbehavior: none, stall, corrupt, garbage, disconnect." },
+	{ "misbehave-every", 'e', "N", 0,
+	  "One peer in every N misbehaves.  Default 2." },
+	{ "misbehave-after", 'a', "N", 0,
+	  "Blocks a bad peer serves before misbehaving." },
+	{ "threads", 't', "N", 0,
+	  "Net I/O threads in the node under test.  Default none." },
+	{ "timeout", 'T', "SECS", 0,
+	  "Give up after SECS seconds.  Default 600." },
+	{ "debug", 'd', NULL, 0,
+	  "Enable debug output." },
+	{ "quiet", 'q', NULL, 0,
+	  "Silence informational messages" },
+
+	{ }
+};
+
+static const char doc[] =
+"syncbench - sync a node from local simulated peers, and measure it";
+
+static char *blocks_fn = NULL;
+static struct peersim_opts sim_opts = { .n_peers = 4, .misbehave_every = 2 };
+static unsigned int opt_threads = 0;
+static unsigned int opt_timeout = 600;
+static bool opt_debug = false;
+static bool opt_quiet = false;
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state);
+
+static const struct argp argp = { options, parse_opt, NULL, doc };
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state)
+{
+	switch(key) {
+
+	case 'b':
+		blocks_fn = arg;
+		break;
+	case 'p':
+		sim_opts.n_peers = strtoul(arg, NULL, 10);
+		break;
+	case 'w':
+		sim_opts.bandwidth = strtoull(arg, NULL, 10);
+		break;
+	case 'l':
+		sim_opts.latency_ms = strtoul(arg, NULL, 10);
+		break;
+	case 'm':
+		if (!peersim_misbehave_parse(arg, &sim_opts.misbehave))
+			argp_error(state, "unknown misbehavior '%s'", arg);
+		break;
+	case 'e':
+		sim_opts.misbehave_every = strtoul(arg, NULL, 10);
+		break;
+	case 'a':
+		sim_opts.misbehave_after = strtoul(arg, NULL, 10);
+		break;
+	case 't':
+		opt_threads = strtoul(arg, NULL, 10);
+		break;
+	case 'T':
+		opt_timeout = strtoul(arg, NULL, 10);
+		break;
+	case 'd':
+		opt_debug = true;
+		break;
+	case 'q':
+		opt_quiet = true;
+		break;
+
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+/*
+ * Node under test: chaindb plus LMDB block store, as in brd, minus
+ * script and UTXO work.  Orphans wait, by parent hash, for their parent.
+ */
+
+static struct chaindb db;
+static struct net_child_info nci;
+static struct bitc_hashtab *orphans;	/* of prev hash -> cstring */
+static uint64_t instance_nonce = 0x73796e6362656e63ULL;
+static unsigned int target_height;
+static double deadline;
+
+static struct sync_stats {
+	unsigned int		n_blocks;	/* connected, past genesis */
+	uint64_t		n_bytes;
+} stats;
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_stop(void)
+{
+	nci.running = false;
+	event_base_loopbreak(nci.eb);
+}
+
+static bool node_connect(const struct bitc_block *block,
+			 struct const_buffer *buf)
+{
+	struct blkinfo *bi = bi_new();
+	bu256_copy(&bi->hash, &block->sha256);
+	bitc_block_copy_hdr(&bi->hdr, block);
+
+	struct chaindb_reorg reorg;
+	if (!chaindb_add(&db, bi, &reorg)) {
+		bi_free(bi);
+		return false;
+	}
+
+	blockdb_add(&bi->hash, buf);
+
+	stats.n_blocks++;
+	stats.n_bytes += buf->len;
+
+	if (db.best_chain->height >= target_height)
+		node_stop();
+
+	return true;
+}
+
+/* the orphan map owns its values until they are taken out */
+static cstring *orphan_take(const bu256_t *parent)
+{
+	cstring *s = bitc_hashtab_get(orphans, parent);
+	if (s)
+		bitc_hashtab_del(orphans, parent);
+	return s;
+}
+
+static void node_connect_orphans(const bu256_t *parent)
+{
+	bu256_t hash;
+	cstring *s;
+
+	bu256_copy(&hash, parent);
+
+	while ((s = orphan_take(&hash)) != NULL) {
+		struct bitc_block block;
+		bitc_block_init(&block);
+
+		struct const_buffer buf = { s->str, s->len };
+		bool ok = deser_bitc_block(&block, &buf);
+		if (ok) {
+			bitc_block_calc_sha256(&block);
+
+			struct const_buffer blk_buf = { s->str, s->len };
+			ok = node_connect(&block, &blk_buf);
+			bu256_copy(&hash, &block.sha256);
+		}
+
+		bitc_block_free(&block);
+		cstr_free(s, true);
+
+		if (!ok)
+			break;
+	}
+}
+
+static bool node_block_process(struct bitc_block *block,
+			       struct const_buffer *buf)
+{
+	if (chaindb_lookup(&db, &block->sha256))
+		return true;
+
+	if (!chaindb_lookup(&db, &block->hashPrevBlock)) {
+		if (!bitc_hashtab_get(orphans, &block->hashPrevBlock))
+			bitc_hashtab_put(orphans,
+					 bu256_new(&block->hashPrevBlock),
+					 cstr_new_buf(buf->p, buf->len));
+		return true;
+	}
+
+	if (!node_connect(block, buf))
+		return false;
+
+	node_connect_orphans(&block->sha256);
+	return true;
+}
+
+static bool node_inv_block(bu256_t *hash)
+{
+	return !chaindb_lookup(&db, hash);
+}
+
+static void orphan_free(void *key, void *value, void *priv)
+{
+	cstr_free(value, true);
+}
+
+static void deadline_evt(int fd, short events, void *priv)
+{
+	if (now_secs() > deadline) {
+		fprintf(stderr, "syncbench: timeout at height %d\n",
+			db.best_chain ? (int) db.best_chain->height : -1);
+		node_stop();
+	}
+}
+
+/* genesis comes from the file, not the wire */
+static void node_init(struct peersim *ps)
+{
+	const struct chain_info *chain = peersim_chain(ps);
+	bu256_t genesis;
+
+	assert(hex_bu256(&genesis, chain->genesis_hash));
+	assert(chaindb_init(&db, chain->netmagic, &genesis));
+	assert(metadb_init(chain->netmagic, &genesis));
+	assert(blockdb_init());
+	assert(blockheightdb_init());
+
+	orphans = bitc_hashtab_new_ext(bu256_hash, bu256_equal_,
+				       bu256_freep, NULL);
+
+	cstring *s = peersim_block(ps, 0);
+	assert(s != NULL);
+
+	struct bitc_block block;
+	bitc_block_init(&block);
+	struct const_buffer buf = { s->str, s->len };
+	assert(deser_bitc_block(&block, &buf));
+	bitc_block_calc_sha256(&block);
+
+	struct const_buffer blk_buf = { s->str, s->len };
+	assert(node_connect(&block, &blk_buf));
+
+	bitc_block_free(&block);
+	cstr_free(s, true);
+
+	memset(&stats, 0, sizeof(stats));
+
+	memset(&nci, 0, sizeof(nci));
+	nci.read_fd = -1;
+	nci.write_fd = -1;
+	nci.peers = peerman_seed(false);
+	nci.db = &db;
+	nci.conns = parr_new(NC_MAX_CONN, NULL);
+	nci.eb = event_base_new();
+	nci.inv_block_process = node_inv_block;
+	nci.block_process = node_block_process;
+	nci.net_conn_timeout = 11;
+	nci.chain = chain;
+	nci.instance_nonce = &instance_nonce;
+	nci.running = true;
+	nci.max_conns = sim_opts.n_peers;
+
+	unsigned int i;
+	for (i = 0; i < sim_opts.n_peers; i++) {
+		char addr_str[64];
+		peersim_addr_str(ps, i, addr_str, sizeof(addr_str));
+		peerman_addstr(nci.peers, addr_str);
+	}
+
+	if (opt_threads)
+		assert(nc_shards_start(&nci, opt_threads));
+}
+
+static void node_free(void)
+{
+	nc_shards_stop(&nci);
+	nc_conns_gc(&nci, true);
+	parr_free(nci.conns, true);
+	event_base_free(nci.eb);
+	peerman_free(nci.peers);
+
+	bitc_hashtab_iter(orphans, orphan_free, NULL);
+	bitc_hashtab_unref(orphans);
+	chaindb_free(&db);
+	db_close();
+}
+
+/* sync everything ps has; true if the node got to its tip */
+static bool run_sync(struct peersim *ps)
+{
+	char tmpdir[] = "syncbench.XXXXXX";
+	char cwd[4096];
+
+	/* a scratch database, whatever is in the current directory */
+	assert(getcwd(cwd, sizeof(cwd)) != NULL);
+	assert(mkdtemp(tmpdir) != NULL);
+	assert(chdir(tmpdir) == 0);
+
+	target_height = peersim_height(ps);
+	node_init(ps);
+
+	struct event *ev = event_new(nci.eb, -1, EV_PERSIST, deadline_evt, NULL);
+	struct timeval tv = { 1, 0 };
+	event_add(ev, &tv);
+
+	double t_start = now_secs();
+	deadline = t_start + opt_timeout;
+
+	assert(peersim_start(ps));
+
+	while (nci.running) {
+		nc_conns_process(&nci);
+		event_base_dispatch(nci.eb);
+	}
+
+	double secs = now_secs() - t_start;
+	unsigned int height = db.best_chain->height;
+	struct peersim_stats st;
+	peersim_stats(ps, &st);
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("syncbench: %u blocks, %.2f MB in %.3f sec: "
+	       "%.1f blocks/sec, %.2f MB/sec\n",
+	       stats.n_blocks, stats.n_bytes / 1e6, secs,
+	       stats.n_blocks / secs, stats.n_bytes / 1e6 / secs);
+	printf("syncbench: height %u/%u; peers served %llu blocks, "
+	       "%.2f MB over %llu connections\n",
+	       height, target_height,
+	       (unsigned long long) st.n_blocks, st.n_bytes / 1e6,
+	       (unsigned long long) st.n_conns);
+
+	event_del(ev);
+	event_free(ev);
+	node_free();
+
+	const struct chain_info *chain = peersim_chain(ps);
+	char db_fn[64];
+	snprintf(db_fn, sizeof(db_fn), "%s.mdb", chain->name);
+	unlink(db_fn);
+	snprintf(db_fn, sizeof(db_fn), "%s.mdb-lock", chain->name);
+	unlink(db_fn);
+	assert(chdir(cwd) == 0);
+	rmdir(tmpdir);
+
+	return height == target_height;
+}
+
+static void runtest(const char *ser_fn, enum peersim_misbehave mb,
+		    unsigned int threads)
+{
+	struct peersim_opts opts;
+	peersim_opts_init(&opts);
+	opts.n_peers = 4;
+	opts.misbehave = mb;
+	opts.misbehave_every = 2;
+	opts.misbehave_after = 2;
+
+	struct peersim *ps = peersim_new(ser_fn, &opts);
+	assert(ps != NULL);
+	assert(peersim_height(ps) == 10);
+
+	sim_opts = opts;
+	opt_threads = threads;
+	opt_timeout = 60;
+
+	assert(run_sync(ps) == true);
+
+	peersim_free(ps);
+}
+
+int main (int argc, char *argv[])
+{
+	log_state = calloc(1, sizeof(struct logging));
+
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+
+	error_t aprc = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (aprc) {
+		fprintf(stderr, "argp_parse failed: %s\n", strerror(aprc));
+		return 1;
+	}
+
+	log_state->debug = opt_debug;
+	if (opt_quiet && !opt_debug) {
+		log_state->stream = fopen("/dev/null", "w");
+		if (!log_state->stream)
+			log_state->stream = stderr;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	int rc = 0;
+
+	if (blocks_fn) {
+		if (!sim_opts.misbehave_every)
+			sim_opts.misbehave = PSM_NONE;
+
+		struct peersim *ps = peersim_new(blocks_fn, &sim_opts);
+		if (!ps) {
+			fprintf(stderr, "syncbench: cannot serve %s\n",
+				blocks_fn);
+			return 1;
+		}
+
+		rc = run_sync(ps) ? 0 : 1;
+		peersim_free(ps);
+	} else {
+		char *ser_fn = test_filename("data/blks10.ser");
+
+		runtest(ser_fn, PSM_NONE, 0);
+		runtest(ser_fn, PSM_NONE, 2);
+		runtest(ser_fn, PSM_CORRUPT, 0);
+		runtest(ser_fn, PSM_GARBAGE, 2);
+		runtest(ser_fn, PSM_DISCONNECT, 0);
+
+		free(ser_fn);
+	}
+
+	if (log_state->stream != stderr)
+		fclose(log_state->stream);
+	free(log_state);
+	return rc;
+}
@@ -0,0 +1,212 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/buint.h>                 // for bu256_t, bu256_copy, etc
+#include <bitc/core.h>                  // for bitc_block, bitc_tx, etc
+#include <bitc/db/txindex.h>            // for txindex, txindex_pos, etc
+#include <bitc/key.h>                   // for bitc_key_static_shutdown
+#include <bitc/log.h>                   // for logging
+#include <bitc/mbr.h>                   // for blkfile, blkfile_next, etc
+#include <bitc/parr.h>                  // for parr_idx
+#include "libtest.h"                    // for test_filename
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, bool
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+#include <unistd.h>                     // for unlink
+
+struct logging *log_state;
+
+static const char *idx_fn = "txindex-test.mdb";
+
+/* every tx in the file, looked up and fetched through the index */
+static unsigned int check_all(struct txindex *ti, const char *ser_fn)
+{
+	struct blkfile bf;
+	struct const_buffer buf;
+	uint64_t fpos;
+	unsigned int n_txs = 0;
+
+	assert(blkfile_open(&bf, ser_fn));
+	while (blkfile_next(&bf, &buf, &fpos)) {
+		struct bitc_block block;
+		bitc_block_init(&block);
+		assert(deser_bitc_block(&block, &buf));
+
+		unsigned int i;
+		for (i = 0; i < block.vtx->len; i++) {
+			struct bitc_tx *tx = parr_idx(block.vtx, i);
+			struct txindex_pos pos;
+			struct const_buffer blk;
+			struct bitc_tx tx2;
+
+			bitc_tx_calc_sha256(tx);
+			assert(txindex_get(ti, &tx->sha256, &pos));
+			assert(pos.block_pos == fpos);
+
+			assert(blkfile_at(&bf, pos.block_pos, &blk));
+			bitc_tx_init(&tx2);
+			assert(txindex_fetch(&tx2, &tx->sha256, &blk, &pos));
+			assert(tx2.vin->len == tx->vin->len);
+			assert(tx2.vout->len == tx->vout->len);
+			bitc_tx_free(&tx2);
+
+			n_txs++;
+		}
+
+		bitc_block_free(&block);
+	}
+
+	assert(!bf.error);
+	blkfile_close(&bf);
+	return n_txs;
+}
+
+static void runtest(const char *ser_fn_base)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	struct blkfile bf;
+	struct txindex ti;
+	struct const_buffer buf;
+	uint64_t fpos, fpos_list[11];
+	unsigned int n_blocks = 0;
+
+	unlink(idx_fn);
+	assert(blkfile_open(&bf, ser_fn));
+
+	/* first half, then close: progress is kept */
+	assert(txindex_open(&ti, idx_fn, false));
+	assert(ti.next_pos == 0);
+	assert(ti.ident_len == 0);
+	assert(txindex_set_ident(&ti, "blks10", 6, false));
+
+	while (blkfile_next(&bf, &buf, &fpos)) {
+		fpos_list[n_blocks++] = fpos;
+		if (n_blocks <= 5)
+			assert(txindex_add_block(&ti, fpos, bf.pos, &buf));
+	}
+	assert(!bf.error);
+	assert(n_blocks == 11);
+	assert(ti.next_pos == fpos_list[5]);
+	txindex_close(&ti);
+
+	/* the rest, on reopening; already indexed blocks are skipped */
+	assert(txindex_open(&ti, idx_fn, false));
+	assert(ti.next_pos == fpos_list[5]);
+	assert((ti.ident_len == 6) && !memcmp(ti.ident, "blks10", 6));
+
+	blkfile_close(&bf);
+	assert(blkfile_open(&bf, ser_fn));
+	while (blkfile_next(&bf, &buf, &fpos))
+		assert(txindex_add_block(&ti, fpos, bf.pos, &buf));
+	assert(ti.next_pos == bf.len);
+
+	/* lookups see the uncommitted batch */
+	assert(ti.txn != NULL);
+	assert(check_all(&ti, ser_fn) >= n_blocks);
+	assert(txindex_sync(&ti));
+	assert(ti.txn == NULL);
+	assert(check_all(&ti, ser_fn) >= n_blocks);
+
+	bu256_t unknown;
+	memset(&unknown, 0x5a, sizeof(unknown));
+	struct txindex_pos pos;
+	assert(!txindex_get(&ti, &unknown, &pos));
+	txindex_close(&ti);
+
+	/* read-only: lookups only */
+	assert(txindex_open(&ti, idx_fn, true));
+	assert(ti.next_pos == bf.len);
+	assert(check_all(&ti, ser_fn) >= n_blocks);
+
+	struct bitc_block block;
+	struct txindex_pos *tpos;
+	bitc_block_init(&block);
+	assert(blkfile_at(&bf, fpos_list[1], &buf));
+	assert(txindex_deser_block(&block, &buf, fpos_list[1], &tpos));
+	assert(block.vtx->len >= 1);
+
+	struct bitc_tx *tx = parr_idx(block.vtx, 0);
+	bitc_tx_calc_sha256(tx);
+	assert(tpos[0].offset > 80);
+	assert(tpos[0].offset + tpos[0].len <= buf.len);
+
+	/* wrong tx, or a position off the end, is refused */
+	struct bitc_tx tx2;
+	bitc_tx_init(&tx2);
+	assert(!txindex_fetch(&tx2, &unknown, &buf, &tpos[0]));
+	pos = tpos[0];
+	pos.offset = buf.len;
+	assert(!txindex_fetch(&tx2, &tx->sha256, &buf, &pos));
+	bitc_tx_free(&tx2);
+
+	assert(!txindex_add(&ti, &tx->sha256, tpos, 1, bf.len + 1));
+
+	assert(!txindex_set_ident(&ti, "other", 5, true));
+
+	bu256_t txid;
+	bu256_copy(&txid, &tx->sha256);
+	free(tpos);
+	bitc_block_free(&block);
+	txindex_close(&ti);
+
+	/* another source: emptied */
+	assert(txindex_open(&ti, idx_fn, false));
+	assert(txindex_set_ident(&ti, "other", 5, true));
+	assert(ti.next_pos == 0);
+	assert(!txindex_get(&ti, &txid, &pos));
+	txindex_close(&ti);
+
+	assert(txindex_open(&ti, idx_fn, false));
+	assert(ti.next_pos == 0);
+	assert((ti.ident_len == 5) && !memcmp(ti.ident, "other", 5));
+	txindex_close(&ti);
+
+	blkfile_close(&bf);
+	unlink(idx_fn);
+	free(ser_fn);
+}
+
+/* a temporary index works the same, and leaves nothing behind */
+static void runtest_temp(const char *ser_fn_base)
+{
+	char *ser_fn = test_filename(ser_fn_base);
+	struct blkfile bf;
+	struct txindex ti;
+	struct const_buffer buf;
+	uint64_t fpos;
+
+	assert(txindex_open_temp(&ti));
+	assert((ti.next_pos == 0) && (ti.ident_len == 0));
+
+	assert(blkfile_open(&bf, ser_fn));
+	while (blkfile_next(&bf, &buf, &fpos))
+		assert(txindex_add_block(&ti, fpos, bf.pos, &buf));
+	assert(!bf.error);
+	blkfile_close(&bf);
+
+	assert(check_all(&ti, ser_fn) >= 11);
+	txindex_close(&ti);
+	free(ser_fn);
+}
+
+int main (int argc, char *argv[])
+{
+	log_state = calloc(1, sizeof(struct logging));
+
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+	log_state->debug = true;
+
+	runtest("data/blks10.ser");
+	runtest_temp("data/blks10.ser");
+
+	bitc_key_static_shutdown();
+	free(log_state);
+	return 0;
+}
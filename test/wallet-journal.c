@@ -0,0 +1,295 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/coredefs.h>              // for chain_metadata, etc
+#include <bitc/crypto/aes_util.h>       // for write_aes_file
+#include <bitc/cstr.h>                  // for cstring, cstr_free, etc
+#include <bitc/key.h>                   // for bitc_key_static_shutdown
+#include <bitc/parr.h>                  // for parr, parr_idx, etc
+#include <bitc/util.h>                  // for bu_read_file, bu_write_file
+#include <bitc/wallet/journal.h>        // for wallet_journal, etc
+#include <bitc/wallet/wallet.h>         // for wallet, wallet_records, etc
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, bool
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memcmp, memset, strlen
+#include <unistd.h>                     // for access, unlink
+
+static const char *jrnl_fn = "wallet-journal-test.dat";
+static const char *pass = "correct horse battery staple";
+
+enum {
+	BIG_LEN		= 100 * 1024,
+};
+
+static const uint8_t test_seed[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static bool collect_rec(void *priv, const void *data, size_t len)
+{
+	parr *recs = priv;
+
+	return parr_add(recs, cstr_new_buf(data, len));
+}
+
+static void free_recs(parr *recs)
+{
+	unsigned int i;
+
+	for (i = 0; i < recs->len; i++)
+		cstr_free(parr_idx(recs, i), true);
+	parr_free(recs, true);
+}
+
+static void check_rec(parr *recs, unsigned int idx, const void *data,
+		      size_t len)
+{
+	cstring *s = parr_idx(recs, idx);
+
+	assert(s->len == len);
+	assert(!memcmp(s->str, data, len));
+}
+
+static parr *open_recs(struct wallet_journal *wj)
+{
+	parr *recs = parr_new(8, NULL);
+
+	if (!wallet_journal_open(wj, jrnl_fn, pass, strlen(pass),
+				 collect_rec, recs)) {
+		free_recs(recs);
+		return NULL;
+	}
+
+	return recs;
+}
+
+/* a copy of the journal, altered, in place of it */
+static void rewrite(const void *data, size_t len, size_t flip)
+{
+	uint8_t *copy = malloc(len);
+	memcpy(copy, data, len);
+	if (flip < len)
+		copy[flip] ^= 0x40;
+
+	assert(bu_write_file(jrnl_fn, copy, len));
+	free(copy);
+}
+
+static void test_journal(void)
+{
+	struct wallet_journal wj;
+	parr *recs;
+
+	uint8_t *big = malloc(BIG_LEN);
+	unsigned int i;
+	for (i = 0; i < BIG_LEN; i++)
+		big[i] = i * 7;
+
+	unlink(jrnl_fn);
+	assert(!wallet_journal_detect(jrnl_fn));
+
+	/* nothing there until committed */
+	assert(wallet_journal_create(&wj, jrnl_fn, pass, strlen(pass)));
+	assert(wallet_journal_append(&wj, "one", 3));
+	assert(wallet_journal_append(&wj, "two", 3));
+	assert(wallet_journal_append(&wj, big, BIG_LEN));
+	assert(access(jrnl_fn, F_OK) != 0);
+	assert(wallet_journal_commit(&wj));
+	assert(access(jrnl_fn, F_OK) == 0);
+
+	/* then appended to in place */
+	assert(wallet_journal_append(&wj, "four", 4));
+	assert(wj.n_records == 4);
+	wallet_journal_free(&wj);
+
+	assert(wallet_journal_detect(jrnl_fn));
+	recs = open_recs(&wj);
+	assert(recs && (recs->len == 4));
+	check_rec(recs, 0, "one", 3);
+	check_rec(recs, 1, "two", 3);
+	check_rec(recs, 2, big, BIG_LEN);
+	check_rec(recs, 3, "four", 4);
+	assert(wj.n_records == 4);
+	assert(!wj.torn);
+	free_recs(recs);
+	wallet_journal_free(&wj);
+
+	/* not with another passphrase */
+	assert(!wallet_journal_open(&wj, jrnl_fn, "wrong", 5, collect_rec,
+				    NULL));
+
+	void *data;
+	size_t len;
+	assert(bu_read_file(jrnl_fn, &data, &len, 100 * 1024 * 1024));
+
+	/* the last append cut short: dropped, then overwritten */
+	rewrite(data, len - 10, len);
+	recs = open_recs(&wj);
+	assert(recs && (recs->len == 3));
+	assert(wj.torn);
+	free_recs(recs);
+	assert(wallet_journal_append(&wj, "five", 4));
+	wallet_journal_free(&wj);
+
+	recs = open_recs(&wj);
+	assert(recs && (recs->len == 4));
+	check_rec(recs, 2, big, BIG_LEN);
+	check_rec(recs, 3, "five", 4);
+	assert(!wj.torn);
+	free_recs(recs);
+	wallet_journal_free(&wj);
+
+	/* the last record damaged in full: the same */
+	rewrite(data, len, len - 1);
+	recs = open_recs(&wj);
+	assert(recs && (recs->len == 3));
+	free_recs(recs);
+	wallet_journal_free(&wj);
+
+	/* any other damaged: refused */
+	size_t hdr_len = 64, rec1 = hdr_len + 20 + 3 + 32;
+	rewrite(data, len, rec1 + 20 + 1);		/* "two" data */
+	assert(open_recs(&wj) == NULL);
+	rewrite(data, len, rec1 + 4);			/* "two" iv */
+	assert(open_recs(&wj) == NULL);
+	rewrite(data, len, 20);				/* salt */
+	assert(open_recs(&wj) == NULL);
+
+	/* or dropped */
+	uint8_t *cut = malloc(len);
+	memcpy(cut, data, rec1);
+	memcpy(cut + rec1, (uint8_t *) data + rec1 + (rec1 - hdr_len),
+	       len - rec1 - (rec1 - hdr_len));
+	rewrite(cut, len - (rec1 - hdr_len), len);
+	assert(open_recs(&wj) == NULL);
+	free(cut);
+
+	/* a wallet file from before journals is not one */
+	assert(write_aes_file(jrnl_fn, (void *) pass, strlen(pass), "old", 3));
+	assert(!wallet_journal_detect(jrnl_fn));
+
+	free(data);
+	free(big);
+	unlink(jrnl_fn);
+}
+
+static bool journal_rec(void *priv, const cstring *rec)
+{
+	return wallet_journal_append(priv, rec->str, rec->len);
+}
+
+static bool load_rec(void *priv, const void *data, size_t len)
+{
+	struct const_buffer buf = { data, len };
+
+	return deser_wallet(priv, &buf);
+}
+
+static void append_rec(struct wallet_journal *wj, cstring *rec)
+{
+	assert(rec != NULL);
+	assert(wallet_journal_append(wj, rec->str, rec->len));
+	cstr_free(rec, true);
+}
+
+static void test_wallet(void)
+{
+	struct wallet_journal wj;
+	struct wallet wlt;
+	unsigned int i;
+
+	assert(wallet_init(&wlt, &chain_metadata[CHAIN_BITCOIN]));
+	assert(wallet_create(&wlt, test_seed, sizeof(test_seed)));
+
+	/* a snapshot */
+	unlink(jrnl_fn);
+	assert(wallet_journal_create(&wj, jrnl_fn, pass, strlen(pass)));
+	assert(wallet_records(&wlt, journal_rec, &wj));
+	assert(wallet_journal_commit(&wj));
+	assert(wj.n_records == 3);
+
+	/* then its changes */
+	struct wallet_account *master = parr_idx(wlt.accounts, 0);
+	for (i = 0; i < 5; i++) {
+		cstring *addr = wallet_new_address(&wlt);
+		assert(addr != NULL);
+		cstr_free(addr, true);
+		append_rec(&wj, wallet_record_account(&wlt, master));
+	}
+
+	assert(wallet_createAccount(&wlt, "savings"));
+	struct wallet_account *savings = account_byname(&wlt, "savings");
+	append_rec(&wj, wallet_record_account(&wlt, savings));
+
+	cstr_free(wlt.def_acct, true);
+	wlt.def_acct = cstr_new("savings");
+	append_rec(&wj, wallet_record_root(&wlt));
+
+	struct wallet_coin *coin = calloc(1, sizeof(*coin));
+	memset(&coin->outpt.hash, 0x11, sizeof(coin->outpt.hash));
+	coin->outpt.n = 1;
+	coin->value = 5000;
+	coin->height = 100;
+	coin->key_idx = 3;
+	assert(wallet_add_coin(&wlt, coin));
+	assert(wallet_coin_find(&wlt, &coin->outpt) == coin);
+	append_rec(&wj, wallet_record_coin(&wlt, coin));
+
+	coin->spent = true;
+	memset(&coin->spent_txid, 0x22, sizeof(coin->spent_txid));
+	coin->spent_height = 120;
+	append_rec(&wj, wallet_record_coin(&wlt, coin));
+
+	assert(wj.n_records == 3 + 5 + 1 + 1 + 2);
+	wallet_journal_free(&wj);
+
+	/* read back: the later records win */
+	struct wallet loaded;
+	assert(wallet_init(&loaded, wlt.chain));
+	assert(wallet_journal_open(&wj, jrnl_fn, pass, strlen(pass),
+				   load_rec, &loaded));
+	wallet_journal_free(&wj);
+
+	assert(loaded.accounts->len == 2);
+	assert(((struct wallet_account *)
+		parr_idx(loaded.accounts, 0))->next_key_idx == 5);
+	assert(!strcmp(loaded.def_acct->str, "savings"));
+	assert(loaded.coins->len == 1);
+	struct wallet_coin *lcoin = wallet_coin_find(&loaded, &coin->outpt);
+	assert(lcoin && lcoin->spent && (lcoin->spent_height == 120));
+
+	/* the same wallet as a snapshot */
+	cstring *s1 = ser_wallet(&wlt);
+	cstring *s2 = ser_wallet(&loaded);
+	assert(s1->len == s2->len);
+	assert(!memcmp(s1->str, s2->str, s1->len));
+	cstr_free(s1, true);
+	cstr_free(s2, true);
+
+	/* and it carries on where it left off */
+	cstring *a1 = wallet_new_address(&wlt);
+	cstring *a2 = wallet_new_address(&loaded);
+	assert(!strcmp(a1->str, a2->str));
+	cstr_free(a1, true);
+	cstr_free(a2, true);
+
+	wallet_free(&loaded);
+	wallet_free(&wlt);
+	unlink(jrnl_fn);
+}
+
+int main(int argc, char *argv[])
+{
+	test_journal();
+	test_wallet();
+
+	bitc_key_static_shutdown();
+	return 0;
+}
@@ -0,0 +1,338 @@
+/* Copyright 2012 exMULTI, Inc.
+ * Distributed under the MIT/X11 software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+#include "libbitc-config.h"
+
+#include <bitc/buffer.h>                // for const_buffer
+#include <bitc/core.h>                  // for bitc_block, bitc_tx, etc
+#include <bitc/coredefs.h>              // for chain_metadata, etc
+#include <bitc/cstr.h>                  // for cstring, cstr_free, etc
+#include <bitc/hdkeys.h>                // for hd_extended_key, etc
+#include <bitc/key.h>                   // for bitc_pubkey_ser, etc
+#include <bitc/log.h>                   // for logging
+#include <bitc/parr.h>                  // for parr, parr_idx, etc
+#include <bitc/script.h>                // for bsp_make_pubkeyhash, etc
+#include <bitc/util.h>                  // for bu_Hash160
+#include <bitc/wallet/rescan.h>         // for wallet_rescan_new, etc
+#include <bitc/wallet/wallet.h>         // for wallet, wallet_coin, etc
+
+#include <assert.h>                     // for assert
+#include <stdbool.h>                    // for true, bool
+#include <stdlib.h>                     // for calloc, free
+#include <string.h>                     // for memset
+
+struct logging *log_state;
+
+enum {
+	GAP		= 5,
+	N_BLOCKS	= 3 * RESCAN_BATCH + 5,
+};
+
+static const uint8_t test_seed[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+/* a payment to key m/44'/0'/acct'/change/key_idx, at a height */
+struct payment {
+	uint32_t	height;
+	uint32_t	acct;
+	bool		change;
+	uint32_t	key_idx;
+	bool		p2pk;
+	int32_t		spent_height;	/* or -1 */
+	bool		found;
+};
+
+static struct payment payments[] = {
+	{ 10, 0, false, 0, false, 70, true },
+	{ 20, 0, false, 1, true, -1, true },
+	{ 30, 0, false, 4, false, -1, true },	/* last in the window */
+	{ 31, 0, false, 9, false, 31, true },	/* spent in the same block */
+	{ 40, 0, true, 3, false, -1, true },
+	{ 50, 1, false, 0, false, -1, true },
+	{ 64, 0, false, 14, false, 65, true },
+	{ 130, 0, false, 19, false, -1, true },
+	{ 150, 0, false, 30, false, -1, false },	/* past the gap */
+};
+
+static void make_wallet(struct wallet *wlt)
+{
+	assert(wallet_init(wlt, &chain_metadata[CHAIN_BITCOIN]));
+	assert(wallet_create(wlt, test_seed, sizeof(test_seed)));
+	assert(wallet_createAccount(wlt, "savings"));
+}
+
+static cstring *payment_script(struct wallet *wlt, const struct payment *pay)
+{
+	struct wallet_account *acct = parr_idx(wlt->accounts, pay->acct);
+	struct hd_extended_key ek;
+	uint8_t pubkey[33];
+
+	assert(wallet_account_keys(wlt, acct, pay->change, pay->key_idx, 1,
+				   &ek));
+	assert(bitc_pubkey_ser(&ek.key, pubkey));
+	hd_extended_key_free(&ek);
+
+	if (pay->p2pk) {
+		cstring *script = cstr_new_sz(64);
+		bsp_push_data(script, pubkey, sizeof(pubkey));
+		bsp_push_op(script, OP_CHECKSIG);
+		return script;
+	}
+
+	uint8_t md160[20];
+	bu_Hash160(md160, pubkey, sizeof(pubkey));
+
+	cstring *hash = cstr_new_buf(md160, sizeof(md160));
+	cstring *script = bsp_make_pubkeyhash(hash);
+	cstr_free(hash, true);
+	return script;
+}
+
+static struct bitc_tx *make_tx(const struct bitc_outpt *prevout,
+			       uint32_t tag, int64_t value, cstring *script)
+{
+	struct bitc_tx *tx = calloc(1, sizeof(*tx));
+	bitc_tx_init(tx);
+	tx->vin = parr_new(1, bitc_txin_freep);
+	tx->vout = parr_new(2, bitc_txout_freep);
+
+	struct bitc_txin *txin = calloc(1, sizeof(*txin));
+	bitc_txin_init(txin);
+	if (prevout)
+		bitc_outpt_copy(&txin->prevout, prevout);
+	else {
+		memset(&txin->prevout.hash, 0, sizeof(txin->prevout.hash));
+		txin->prevout.n = 0xffffffffU;
+	}
+	txin->scriptSig = cstr_new_sz(8);
+	bsp_push_int64(txin->scriptSig, tag);
+	txin->nSequence = 0xffffffffU;
+	parr_add(tx->vin, txin);
+
+	/* unrelated, first: ours is output 1 */
+	uint8_t junk[20];
+	memset(junk, (uint8_t) tag, sizeof(junk));
+	cstring *junk_hash = cstr_new_buf(junk, sizeof(junk));
+
+	struct bitc_txout *txout = calloc(1, sizeof(*txout));
+	bitc_txout_init(txout);
+	txout->nValue = 1;
+	txout->scriptPubKey = bsp_make_pubkeyhash(junk_hash);
+	parr_add(tx->vout, txout);
+	cstr_free(junk_hash, true);
+
+	if (script) {
+		txout = calloc(1, sizeof(*txout));
+		bitc_txout_init(txout);
+		txout->nValue = value;
+		txout->scriptPubKey = script;
+		parr_add(tx->vout, txout);
+	}
+
+	bitc_tx_calc_sha256(tx);
+	return tx;
+}
+
+/* serialized blocks: a coinbase each, plus the payments and spends */
+static parr *make_blocks(struct wallet *wlt, const struct payment *pays,
+			 unsigned int n_pays, uint32_t n_blocks)
+{
+	parr *blocks = parr_new(n_blocks, NULL);
+	struct bitc_outpt outpts[n_pays];
+	uint32_t height;
+	unsigned int i;
+
+	for (height = 0; height < n_blocks; height++) {
+		struct bitc_block block;
+		bitc_block_init(&block);
+		block.nNonce = height;
+		block.vtx = parr_new(4, bitc_tx_freep);
+
+		parr_add(block.vtx, make_tx(NULL, height, 0, NULL));
+
+		for (i = 0; i < n_pays; i++) {
+			const struct payment *pay = &pays[i];
+
+			if (pay->height == height) {
+				struct bitc_tx *tx;
+				tx = make_tx(NULL, 1000 + i, 5000 + i,
+					     payment_script(wlt, pay));
+				bu256_copy(&outpts[i].hash, &tx->sha256);
+				outpts[i].n = 1;
+				parr_add(block.vtx, tx);
+			}
+			if (pay->spent_height == (int32_t) height)
+				parr_add(block.vtx,
+					 make_tx(&outpts[i], 2000 + i, 0, NULL));
+		}
+
+		cstring *s = cstr_new_sz(1024);
+		ser_bitc_block(s, &block);
+		parr_add(blocks, s);
+		bitc_block_free(&block);
+	}
+
+	return blocks;
+}
+
+static void rescan(struct wallet *wlt, parr *blocks, unsigned int gap,
+		   unsigned int n_threads, struct wallet_rescan_stats *stats)
+{
+	struct wallet_rescan *rs = wallet_rescan_new(wlt, gap, n_threads);
+	assert(rs != NULL);
+
+	uint32_t height;
+	for (height = 0; height < blocks->len; height++) {
+		cstring *s = parr_idx(blocks, height);
+		struct const_buffer buf = { s->str, s->len };
+		assert(wallet_rescan_push(rs, height, &buf));
+	}
+
+	assert(wallet_rescan_finish(rs, stats));
+}
+
+static void check_coins(const struct wallet *wlt)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(payments); i++) {
+		const struct payment *pay = &payments[i];
+		if (!pay->found)
+			continue;
+
+		/* in the order found */
+		assert(n < wlt->coins->len);
+		const struct wallet_coin *coin = parr_idx(wlt->coins, n++);
+
+		assert(coin->height == pay->height);
+		assert(coin->acct_idx == pay->acct);
+		assert(coin->change == pay->change);
+		assert(coin->key_idx == pay->key_idx);
+		assert(coin->outpt.n == 1);
+		assert(coin->value == 5000 + i);
+		assert(coin->spent == (pay->spent_height >= 0));
+		if (coin->spent)
+			assert(coin->spent_height == pay->spent_height);
+	}
+	assert(n == wlt->coins->len);
+
+	/* used receive keys are not handed out again */
+	struct wallet_account *acct0 = parr_idx(wlt->accounts, 0);
+	struct wallet_account *acct1 = parr_idx(wlt->accounts, 1);
+	assert(acct0->next_key_idx == 20);
+	assert(acct1->next_key_idx == 1);
+}
+
+static void runtest(void)
+{
+	struct wallet wlt;
+	make_wallet(&wlt);
+	parr *blocks = make_blocks(&wlt, payments, ARRAY_SIZE(payments),
+				   N_BLOCKS);
+
+	struct wallet_rescan_stats stats;
+	rescan(&wlt, blocks, GAP, 4, &stats);
+	assert(stats.n_blocks == N_BLOCKS);
+	assert(stats.n_txs > N_BLOCKS);
+	assert(stats.n_coins == 8);
+	assert(stats.n_spends == 3);
+	check_coins(&wlt);
+
+	/* again: nothing new */
+	rescan(&wlt, blocks, GAP, 4, &stats);
+	assert(stats.n_coins == 0);
+	assert(stats.n_spends == 0);
+	check_coins(&wlt);
+
+	/* coins are saved with the wallet */
+	cstring *ser = ser_wallet(&wlt);
+	struct wallet deser;
+	assert(wallet_init(&deser, wlt.chain));
+	struct const_buffer buf = { ser->str, ser->len };
+	assert(deser_wallet(&deser, &buf));
+	check_coins(&deser);
+	wallet_free(&deser);
+	cstr_free(ser, true);
+	wallet_free(&wlt);
+
+	/* on one thread, the same */
+	make_wallet(&wlt);
+	rescan(&wlt, blocks, GAP, 1, &stats);
+	assert(stats.n_coins == 8);
+	check_coins(&wlt);
+	wallet_free(&wlt);
+
+	/* a short run, in one partial batch */
+	make_wallet(&wlt);
+	parr *few = parr_new(32, NULL);
+	unsigned int i;
+	for (i = 0; i < 32; i++)
+		parr_add(few, parr_idx(blocks, i));
+	rescan(&wlt, few, GAP, 2, &stats);
+	assert(stats.n_blocks == 32);
+	assert(stats.n_coins == 4);
+	assert(stats.n_spends == 1);
+	parr_free(few, true);
+	wallet_free(&wlt);
+
+	for (i = 0; i < blocks->len; i++)
+		cstr_free(parr_idx(blocks, i), true);
+	parr_free(blocks, true);
+}
+
+/* keys a batch's snapshot lacks, derived on a hit in that batch */
+static void test_lookahead(void)
+{
+	static const struct payment pays[] = {
+		{ RESCAN_BATCH - 1, 0, false, 99, false, -1, true },
+		{ RESCAN_BATCH, 0, false, 199, false, -1, true },
+		{ RESCAN_BATCH + 1, 0, false, 299, false, RESCAN_BATCH + 2,
+		  true },
+	};
+	struct wallet wlt;
+	make_wallet(&wlt);
+	parr *blocks = make_blocks(&wlt, pays, ARRAY_SIZE(pays),
+				   2 * RESCAN_BATCH);
+
+	struct wallet_rescan_stats stats;
+	rescan(&wlt, blocks, RESCAN_LOOKAHEAD, 2, &stats);
+	assert(stats.n_coins == 3);
+	assert(stats.n_spends == 1);
+
+	struct wallet_account *acct0 = parr_idx(wlt.accounts, 0);
+	assert(acct0->next_key_idx == 300);
+
+	/* heights may skip, but not go back */
+	struct wallet_rescan *rs = wallet_rescan_new(&wlt, GAP, 1);
+	cstring *s = parr_idx(blocks, 0);
+	struct const_buffer buf = { s->str, s->len };
+	assert(wallet_rescan_push(rs, 5, &buf));
+	assert(wallet_rescan_push(rs, 7, &buf));
+	assert(!wallet_rescan_push(rs, 7, &buf));
+	assert(!wallet_rescan_finish(rs, NULL));
+
+	unsigned int i;
+	for (i = 0; i < blocks->len; i++)
+		cstr_free(parr_idx(blocks, i), true);
+	parr_free(blocks, true);
+	wallet_free(&wlt);
+}
+
+int main (int argc, char *argv[])
+{
+	log_state = calloc(1, sizeof(struct logging));
+
+	log_state->stream = stderr;
+	log_state->logtofile = false;
+	log_state->debug = false;
+
+	runtest();
+	test_lookahead();
+
+	bitc_key_static_shutdown();
+	free(log_state);
+	return 0;
+}